@@ -0,0 +1,1711 @@
+#ifndef RENDERER_H
+#define RENDERER_H
+
+#include <dlfcn.h>
+#include <stdio.h>
+#include <map>
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <chrono>
+#include <stdexcept>
+#include <cstdlib>
+#include <memory>
+#include <functional>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <future>
+#include <condition_variable>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#define VK_NO_PROTOTYPES
+#ifdef USE_GLFW
+	#define VK_USE_PLATFORM_XLIB_KHR
+	#define GLFW_INCLUDE_VULKAN
+	#define GLFW_EXPOSE_NATIVE_X11
+	#include <GLFW/glfw3.h>
+	#include <GLFW/glfw3native.h>
+#elif defined(USE_XCB)
+	#define VK_USE_PLATFORM_XCB_KHR
+	#include <xcb/xcb.h>
+#elif defined(USE_XLIB)
+	#define VK_USE_PLATFORM_XLIB_KHR
+	#include <X11/Xlib.h>
+#endif
+
+#include <vulkan/vulkan.h>
+#include "VulkanFunctions.h"
+
+extern void* VULKAN_LIBRARY;
+#if defined(VK_USE_PLATFORM_WIN32_KHR)
+    #define LoadProcAddress GetProcAddress
+#elif defined(VK_USE_PLATFORM_XCB_KHR) || defined(VK_USE_PLATFORM_XLIB_KHR)
+    #define LoadProcAddress dlsym
+#endif
+
+#define VK_EXPORTED_FUNCTION( fun )                                     \
+    if( !(fun = (PFN_##fun)LoadProcAddress( VULKAN_LIBRARY, #fun )) ) { \
+      printf("Could not load exported function: %s!\n", #fun);          \
+      return false;                                                     \
+    }
+
+//use only AFTER VK_EXPORTED_FUNCTION( vkGetInstanceProcAddr )
+#define VK_LOAD_INSTANCE_FUNCTION( source, fun ) \
+	if (!(fun = (PFN_##fun)vkGetInstanceProcAddr( source, #fun ))) {  \
+		printf("Could not load function: %s!\n", #fun);               \
+		throw VulkanException("Loading func error");		          \
+	}
+
+//use only AFTER VK_LOAD_INSTANCE_FUNCTION( vkGetDeviceProcAddr )
+#define VK_LOAD_DEVICE_FUNCTION( source, fun ) \
+	if (!(fun = (PFN_##fun)vkGetDeviceProcAddr( source, #fun ))) {	 \
+		printf("Could not load function: %s!\n", #fun);              \
+		throw VulkanException("Loading func error");			     \
+	}
+
+#define VK_DESTROY_INSTANCE_FUNCTION ( source, obj, fun ) \
+    if ( obj != VK_NULL_HANDLE) {                         \
+        VK_LOAD_INSTANCE_FUNCTION(instance , fun);        \
+        fun(source, obj, nullptr);                        \
+    }
+
+#define VK_DESTROY_DEVICE_FUNCTION ( source, obj, fun ) \
+    if ( obj != VK_NULL_HANDLE) {                       \
+        VK_LOAD_DEVICE_FUNCTION(instance , fun);        \
+        fun(source, obj, nullptr);                      \
+    }
+
+void create_window();
+
+void destroy_window();
+
+#ifdef USE_GLFW
+typedef GLFWwindow* NativeWindow;
+#elif defined(USE_XCB)
+typedef xcb_window_t NativeWindow;
+#elif defined(USE_XLIB)
+typedef Window NativeWindow;
+#endif
+
+// Further windows next to the one made by create_window, which has to exist first
+NativeWindow create_output_window(const char* title, uint32_t width, uint32_t height);
+
+void destroy_output_window(NativeWindow window);
+
+#if defined(__GNUC__) || defined(__clang__)
+	#define VK_LIKELY(x) __builtin_expect(!!(x), 1)
+	#define VK_COLD __attribute__((cold, noinline))
+#else
+	#define VK_LIKELY(x) (x)
+	#define VK_COLD
+#endif
+
+class VulkanException : public std::runtime_error
+{
+public:
+	explicit VulkanException(const std::string& message, VkResult result = VK_RESULT_MAX_ENUM)
+		: std::runtime_error(message), code(result)
+	{}
+
+	// VK_RESULT_MAX_ENUM when the error didn't come from a Vulkan call
+	VkResult result() const
+	{
+		return code;
+	}
+
+private:
+	VkResult code;
+};
+
+// Every code of the headers in use, extension codes only when the headers declare them
+constexpr const char* vk_result_string(VkResult result)
+{
+    switch (result) {
+    case VK_SUCCESS: return "VK_SUCCESS";
+    case VK_NOT_READY: return "VK_NOT_READY";
+    case VK_TIMEOUT: return "VK_TIMEOUT";
+    case VK_EVENT_SET: return "VK_EVENT_SET";
+    case VK_EVENT_RESET: return "VK_EVENT_RESET";
+    case VK_INCOMPLETE: return "VK_INCOMPLETE";
+    case VK_ERROR_OUT_OF_HOST_MEMORY: return "VK_ERROR_OUT_OF_HOST_MEMORY";
+    case VK_ERROR_OUT_OF_DEVICE_MEMORY: return "VK_ERROR_OUT_OF_DEVICE_MEMORY";
+    case VK_ERROR_INITIALIZATION_FAILED: return "VK_ERROR_INITIALIZATION_FAILED";
+    case VK_ERROR_DEVICE_LOST: return "VK_ERROR_DEVICE_LOST";
+    case VK_ERROR_MEMORY_MAP_FAILED: return "VK_ERROR_MEMORY_MAP_FAILED";
+    case VK_ERROR_LAYER_NOT_PRESENT: return "VK_ERROR_LAYER_NOT_PRESENT";
+    case VK_ERROR_EXTENSION_NOT_PRESENT: return "VK_ERROR_EXTENSION_NOT_PRESENT";
+    case VK_ERROR_FEATURE_NOT_PRESENT: return "VK_ERROR_FEATURE_NOT_PRESENT";
+    case VK_ERROR_INCOMPATIBLE_DRIVER: return "VK_ERROR_INCOMPATIBLE_DRIVER";
+    case VK_ERROR_TOO_MANY_OBJECTS: return "VK_ERROR_TOO_MANY_OBJECTS";
+    case VK_ERROR_FORMAT_NOT_SUPPORTED: return "VK_ERROR_FORMAT_NOT_SUPPORTED";
+    case VK_ERROR_FRAGMENTED_POOL: return "VK_ERROR_FRAGMENTED_POOL";
+#ifdef VK_VERSION_1_2
+    case VK_ERROR_UNKNOWN: return "VK_ERROR_UNKNOWN";
+#endif
+    case VK_ERROR_SURFACE_LOST_KHR: return "VK_ERROR_SURFACE_LOST_KHR";
+    case VK_ERROR_NATIVE_WINDOW_IN_USE_KHR: return "VK_ERROR_NATIVE_WINDOW_IN_USE_KHR";
+    case VK_SUBOPTIMAL_KHR: return "VK_SUBOPTIMAL_KHR";
+    case VK_ERROR_OUT_OF_DATE_KHR: return "VK_ERROR_OUT_OF_DATE_KHR";
+#ifdef VK_KHR_display_swapchain
+    case VK_ERROR_INCOMPATIBLE_DISPLAY_KHR: return "VK_ERROR_INCOMPATIBLE_DISPLAY_KHR";
+#endif
+#ifdef VK_EXT_debug_report
+    case VK_ERROR_VALIDATION_FAILED_EXT: return "VK_ERROR_VALIDATION_FAILED_EXT";
+#endif
+#ifdef VK_NV_glsl_shader
+    case VK_ERROR_INVALID_SHADER_NV: return "VK_ERROR_INVALID_SHADER_NV";
+#endif
+    // Promoted codes are matched through their extension alias, which newer headers keep
+#ifdef VK_KHR_maintenance1
+    case VK_ERROR_OUT_OF_POOL_MEMORY_KHR: return "VK_ERROR_OUT_OF_POOL_MEMORY";
+#endif
+#ifdef VK_KHR_external_memory
+    case VK_ERROR_INVALID_EXTERNAL_HANDLE_KHR: return "VK_ERROR_INVALID_EXTERNAL_HANDLE";
+#endif
+#ifdef VK_EXT_descriptor_indexing
+    case VK_ERROR_FRAGMENTATION_EXT: return "VK_ERROR_FRAGMENTATION";
+#endif
+#ifdef VK_EXT_buffer_device_address
+    case VK_ERROR_INVALID_DEVICE_ADDRESS_EXT: return "VK_ERROR_INVALID_OPAQUE_CAPTURE_ADDRESS";
+#endif
+#ifdef VK_EXT_global_priority
+    case VK_ERROR_NOT_PERMITTED_EXT: return "VK_ERROR_NOT_PERMITTED";
+#endif
+#ifdef VK_EXT_full_screen_exclusive
+    case VK_ERROR_FULL_SCREEN_EXCLUSIVE_MODE_LOST_EXT: return "VK_ERROR_FULL_SCREEN_EXCLUSIVE_MODE_LOST_EXT";
+#endif
+#ifdef VK_EXT_pipeline_creation_cache_control
+    case VK_PIPELINE_COMPILE_REQUIRED_EXT: return "VK_PIPELINE_COMPILE_REQUIRED";
+#endif
+#ifdef VK_KHR_deferred_host_operations
+    case VK_THREAD_IDLE_KHR: return "VK_THREAD_IDLE_KHR";
+    case VK_THREAD_DONE_KHR: return "VK_THREAD_DONE_KHR";
+    case VK_OPERATION_DEFERRED_KHR: return "VK_OPERATION_DEFERRED_KHR";
+    case VK_OPERATION_NOT_DEFERRED_KHR: return "VK_OPERATION_NOT_DEFERRED_KHR";
+#endif
+#ifdef VK_EXT_image_drm_format_modifier
+    case VK_ERROR_INVALID_DRM_FORMAT_MODIFIER_PLANE_LAYOUT_EXT: return "VK_ERROR_INVALID_DRM_FORMAT_MODIFIER_PLANE_LAYOUT_EXT";
+#endif
+#ifdef VK_KHR_video_queue
+    case VK_ERROR_IMAGE_USAGE_NOT_SUPPORTED_KHR: return "VK_ERROR_IMAGE_USAGE_NOT_SUPPORTED_KHR";
+    case VK_ERROR_VIDEO_PICTURE_LAYOUT_NOT_SUPPORTED_KHR: return "VK_ERROR_VIDEO_PICTURE_LAYOUT_NOT_SUPPORTED_KHR";
+    case VK_ERROR_VIDEO_PROFILE_OPERATION_NOT_SUPPORTED_KHR: return "VK_ERROR_VIDEO_PROFILE_OPERATION_NOT_SUPPORTED_KHR";
+    case VK_ERROR_VIDEO_PROFILE_FORMAT_NOT_SUPPORTED_KHR: return "VK_ERROR_VIDEO_PROFILE_FORMAT_NOT_SUPPORTED_KHR";
+    case VK_ERROR_VIDEO_PROFILE_CODEC_NOT_SUPPORTED_KHR: return "VK_ERROR_VIDEO_PROFILE_CODEC_NOT_SUPPORTED_KHR";
+    case VK_ERROR_VIDEO_STD_VERSION_NOT_SUPPORTED_KHR: return "VK_ERROR_VIDEO_STD_VERSION_NOT_SUPPORTED_KHR";
+#endif
+#ifdef VK_KHR_video_encode_queue
+    case VK_ERROR_INVALID_VIDEO_STD_PARAMETERS_KHR: return "VK_ERROR_INVALID_VIDEO_STD_PARAMETERS_KHR";
+#endif
+#ifdef VK_EXT_image_compression_control
+    case VK_ERROR_COMPRESSION_EXHAUSTED_EXT: return "VK_ERROR_COMPRESSION_EXHAUSTED_EXT";
+#endif
+#ifdef VK_EXT_shader_object
+    // Renamed without ERROR_ after its first release, the old name stays as an alias
+    case VK_ERROR_INCOMPATIBLE_SHADER_BINARY_EXT: return "VK_INCOMPATIBLE_SHADER_BINARY_EXT";
+#endif
+#ifdef VK_KHR_pipeline_binary
+    case VK_PIPELINE_BINARY_MISSING_KHR: return "VK_PIPELINE_BINARY_MISSING_KHR";
+    case VK_ERROR_NOT_ENOUGH_SPACE_KHR: return "VK_ERROR_NOT_ENOUGH_SPACE_KHR";
+#endif
+    default: return "VK_RESULT_UNKNOWN";
+    }
+}
+
+// What the caller of a frame loop call can do about a result
+enum ResultAction
+{
+    RESULT_CONTINUE,           // Success, VK_SUBOPTIMAL_KHR included: the image was still acquired or presented
+    RESULT_RETRY,              // VK_TIMEOUT or VK_NOT_READY, nothing happened
+    RESULT_RECREATE_SWAPCHAIN, // VK_ERROR_OUT_OF_DATE_KHR
+    RESULT_DEVICE_LOST,        // Everything created from the device has to go
+    RESULT_FATAL
+};
+
+constexpr ResultAction classify_result(VkResult result)
+{
+    switch (result) {
+    case VK_SUCCESS:
+    case VK_SUBOPTIMAL_KHR:
+        return RESULT_CONTINUE;
+    case VK_TIMEOUT:
+    case VK_NOT_READY:
+        return RESULT_RETRY;
+    case VK_ERROR_OUT_OF_DATE_KHR:
+        return RESULT_RECREATE_SWAPCHAIN;
+    case VK_ERROR_DEVICE_LOST:
+        return RESULT_DEVICE_LOST;
+    default:
+        return result > VK_SUCCESS ? RESULT_CONTINUE : RESULT_FATAL;
+    }
+}
+
+// Out of line so the inlined checks stay a compare and a never-taken branch
+[[noreturn]] VK_COLD void vkThrowResult(VkResult result);
+
+// Any code but VK_SUCCESS throws
+inline void vkCheckResult(VkResult result)
+{
+    if (VK_LIKELY(result == VK_SUCCESS)) {
+        return;
+    }
+    vkThrowResult(result);
+}
+
+// Classifies instead of throwing for the codes a frame loop recovers from, fatal codes still throw
+inline ResultAction vkCheckRecoverable(VkResult result)
+{
+    if (VK_LIKELY(result == VK_SUCCESS)) {
+        return RESULT_CONTINUE;
+    }
+    const ResultAction action = classify_result(result);
+    if (action == RESULT_FATAL) {
+        vkThrowResult(result);
+    }
+    return action;
+}
+
+VkShaderModule create_shader_module(PFN_vkCreateShaderModule vkCreateShaderModule, VkDevice& logical_device, const std::vector<char>& shader);
+
+/*Specialization constants of one shader stage. Every pipeline built from the
+same VkShaderModule may carry its own ShaderVariant, so the driver folds the
+constants instead of branching at runtime*/
+struct ShaderVariant
+{
+    std::vector<VkSpecializationMapEntry> entries;
+    std::vector<char> data;
+    VkSpecializationInfo info;
+};
+
+template <typename T>
+void set_specialization_constant(ShaderVariant& variant, uint32_t constantID, const T value)
+{
+    VkSpecializationMapEntry entry = {};
+    entry.constantID = constantID;
+    entry.offset = static_cast<uint32_t>(variant.data.size());
+    entry.size = sizeof(T);
+    variant.data.resize(entry.offset + sizeof(T));
+    memcpy(variant.data.data() + entry.offset, &value, sizeof(T));
+    variant.entries.push_back(entry);
+}
+
+// SPIR-V booleans are 32-bit wide
+void set_specialization_constant(ShaderVariant& variant, uint32_t constantID, const bool value);
+
+VkPipelineShaderStageCreateInfo create_shader_stage(VkShaderStageFlagBits stage, VkShaderModule module, ShaderVariant& variant);
+
+std::vector<char> load_shader(const std::string& filename);
+
+// Returns the listing instead of printing it, so it can run next to startup tasks that print
+std::string available_layers_and_extensions();
+
+VkInstance init_vulkan_instance(const std::vector<const char *> enabledLayerNames);
+
+// Instance extensions init_vulkan_instance enabled besides the surface ones
+bool has_instance_extension(const char* name);
+
+VkPhysicalDevice find_phisical_device(VkInstance& instance);
+
+const std::vector<uint32_t> find_queue_families(VkInstance& instance, VkPhysicalDevice& gpuDevice, VkSurfaceKHR& surface);
+
+uint32_t find_graphics_queue_family(VkPhysicalDevice& gpuDevice);
+
+uint32_t find_compute_queue_family(VkPhysicalDevice& gpuDevice);
+
+/*Extensions and features subsystems ask for before the device is created.
+Required ones fail device creation when missing, optional ones are enabled
+only if supported and can be looked up in the resulting DeviceCapabilities*/
+struct DeviceRequirements
+{
+    std::vector<const char*> requiredExtensions;
+    std::vector<const char*> optionalExtensions;
+    VkPhysicalDeviceFeatures requiredFeatures;
+    VkPhysicalDeviceFeatures optionalFeatures;
+};
+
+// What the device was actually created with
+struct DeviceCapabilities
+{
+    std::vector<std::string> extensions;
+    VkPhysicalDeviceFeatures features;
+    double creationTime; // ms spent in vkCreateDevice
+};
+
+void require_device_extension(DeviceRequirements& requirements, const char* name, bool optional);
+
+// e.g. require_device_feature(requirements, &VkPhysicalDeviceFeatures::samplerAnisotropy, true)
+void require_device_feature(DeviceRequirements& requirements, VkBool32 VkPhysicalDeviceFeatures::* feature, bool optional);
+
+bool has_device_extension(const DeviceCapabilities& capabilities, const char* name);
+
+VkDevice create_logical_device(VkInstance& instance, 
+    VkPhysicalDevice& gpuDevice, 
+    const std::vector<uint32_t>& neccessary_queues,
+    const std::vector<const char*> enabled_layers,
+    const DeviceRequirements& requirements,
+    DeviceCapabilities& capabilities);
+
+// --device-baseline
+bool parse_device_baseline_option(int argc, char* argv[]);
+
+/*Creates and destroys a device with every available extension enabled, the
+way devices were created before requirements were negotiated, and returns
+the milliseconds vkCreateDevice took, negative when the driver refused*/
+double time_device_creation_baseline(VkInstance& instance,
+VkPhysicalDevice& gpuDevice,
+const std::vector<const char*>& enabled_layers);
+
+/*Every submission made through the scheduler signals the next value of its
+queue's timeline, so CPU code waits for exact values instead of idling
+queues and submissions on one queue can wait for values of another.
+Without VK_KHR_timeline_semaphore each value is backed by a fence and
+cross-queue waits are resolved on the CPU before submitting*/
+enum SchedulerQueue
+{
+    SCHEDULER_GRAPHICS,
+    SCHEDULER_TRANSFER,
+    SCHEDULER_COMPUTE,
+    SCHEDULER_QUEUE_COUNT
+};
+
+struct SchedulerTimeline
+{
+    VkQueue queue;
+    uint32_t owner;        // Timeline tracking this VkQueue when roles share it
+    VkSemaphore semaphore; // VK_NULL_HANDLE on the fallback
+    uint64_t submitted;
+    uint64_t completed;    // Last value known to be finished
+    std::deque<std::pair<uint64_t, VkFence>> pendingFences; // Fallback only, in submission order
+    std::vector<VkFence> freeFences;
+};
+
+struct FrameScheduler
+{
+    VkDevice device;
+    bool timeline;
+    SchedulerTimeline timelines[SCHEDULER_QUEUE_COUNT];
+};
+
+struct ScheduledWait
+{
+    SchedulerQueue queue;
+    uint64_t value;
+    VkPipelineStageFlags stage;
+};
+
+struct ScheduledSubmit
+{
+    std::vector<VkCommandBuffer> commandBuffers;
+    std::vector<ScheduledWait> waits;
+    std::vector<VkSemaphore> binaryWaits; // Swapchain acquire and the like
+    std::vector<VkPipelineStageFlags> binaryWaitStages;
+    std::vector<VkSemaphore> binarySignals;
+};
+
+void register_scheduler_requirements(DeviceRequirements& requirements);
+
+// Roles without a dedicated queue pass the graphics queue again
+FrameScheduler create_frame_scheduler(VkDevice& logical_device,
+const DeviceCapabilities& capabilities,
+VkQueue graphicsQueue,
+VkQueue transferQueue,
+VkQueue computeQueue);
+
+// Returns the value signalled once the submission finishes
+uint64_t scheduler_submit(FrameScheduler& scheduler, SchedulerQueue queue, const ScheduledSubmit& submit);
+
+uint64_t scheduler_completed(FrameScheduler& scheduler, SchedulerQueue queue);
+
+bool scheduler_is_complete(FrameScheduler& scheduler, SchedulerQueue queue, uint64_t value);
+
+void scheduler_wait(FrameScheduler& scheduler, SchedulerQueue queue, uint64_t value);
+
+// Value of the latest submission, what a resource used by it has to wait for
+uint64_t scheduler_submitted(FrameScheduler& scheduler, SchedulerQueue queue);
+
+void scheduler_wait_idle(FrameScheduler& scheduler);
+
+void destroy_frame_scheduler(FrameScheduler& scheduler);
+
+/*A device with a single queue that every scheduler role shares, for the
+runners that work without a surface*/
+struct OffscreenContext
+{
+    VkDevice device;
+    uint32_t queueFamily;
+    VkQueue queue;
+    DeviceCapabilities capabilities;
+    FrameScheduler scheduler;
+};
+
+// The queue family is a compute one with compute set, a graphics one otherwise
+OffscreenContext create_offscreen_context(VkInstance& instance,
+VkPhysicalDevice& gpuDevice,
+const std::vector<const char*>& enabledLayerNames,
+bool compute = false);
+
+// Waits for the scheduler, then destroys it and the device
+void destroy_offscreen_context(OffscreenContext& context);
+
+VkSurfaceKHR create_window_surface(VkInstance& instance, NativeWindow window);
+
+// Surface of the window made by create_window
+VkSurfaceKHR create_swapchain_surface(VkInstance& instance);
+
+struct VkSwapchain
+{
+    VkSwapchainKHR swapchain;
+    uint32_t imageCount;
+    VkExtent2D extent;
+    VkSurfaceFormatKHR format;
+};
+
+void register_swapchain_requirements(DeviceRequirements& requirements);
+
+// B8G8R8A8_UNORM with sRGB nonlinear when offered, the first supported format otherwise
+VkSurfaceFormatKHR find_surface_format(VkInstance& instance, VkPhysicalDevice& gpuDevice, VkSurfaceKHR& surface);
+
+// oldSwapchain is only handed to the driver, the caller destroys it once the new swapchain exists
+VkSwapchain create_swapchain(VkInstance& instance, 
+VkPhysicalDevice& gpuDevice,
+VkDevice& logical_device, 
+VkSurfaceKHR& surface,
+VkSwapchainKHR oldSwapchain = VK_NULL_HANDLE);
+
+std::vector<VkImageView> create_image_views(VkDevice& logical_device, VkSwapchain& swapChain);
+
+int32_t find_memory_type_index(VkPhysicalDevice& gpuDevice, uint32_t typeFilter, VkMemoryPropertyFlags properties);
+
+uint32_t find_memory_type(VkPhysicalDevice& gpuDevice, uint32_t typeFilter, VkMemoryPropertyFlags properties);
+
+struct AllocatedImage
+{
+    VkImage image;
+    VkDeviceMemory memory;
+    VkImageView view;
+    VkExtent2D extent;
+    VkFormat format;
+    uint32_t mipLevels;
+};
+
+struct AllocatedBuffer
+{
+    VkBuffer buffer;
+    VkDeviceMemory memory;
+    VkDeviceSize size;
+    VkMemoryPropertyFlags properties; // Of the memory type actually used
+    void* mapped; // Persistently mapped for host visible memory, nullptr otherwise
+};
+
+AllocatedImage create_image(VkPhysicalDevice& gpuDevice,
+VkDevice& logical_device,
+VkExtent2D extent,
+VkFormat format,
+VkImageUsageFlags usage,
+VkImageAspectFlags aspect,
+VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT,
+uint32_t mipLevels = 1);
+
+// VkMemoryRequirements.size of the image create_image would allocate, from a throwaway VkImage
+VkDeviceSize image_memory_size(VkDevice& logical_device,
+VkExtent2D extent,
+VkFormat format,
+VkImageUsageFlags usage,
+VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT,
+uint32_t mipLevels = 1);
+
+AllocatedBuffer create_buffer(VkPhysicalDevice& gpuDevice,
+VkDevice& logical_device,
+VkDeviceSize size,
+VkBufferUsageFlags usage,
+VkMemoryPropertyFlags properties,
+VkMemoryPropertyFlags preferredProperties = 0);
+
+void destroy_image(VkDevice& logical_device, AllocatedImage& image);
+
+void destroy_buffer(VkDevice& logical_device, AllocatedBuffer& buffer);
+
+/*Flush after host writes, invalidate before host reads. Both cover the whole
+mapping and do nothing for coherent memory. vkFlushMappedMemoryRanges and
+vkInvalidateMappedMemoryRanges have to be loaded*/
+void flush_mapped(VkDevice& logical_device, const AllocatedBuffer& buffer);
+
+void invalidate_mapped(VkDevice& logical_device, const AllocatedBuffer& buffer);
+
+/*Resources handed over while the GPU may still use them. Each entry keeps
+the scheduler value of the last submission using it and is destroyed once
+that value completes, so nothing waits for the device to go idle*/
+struct PendingDeletion
+{
+    uint64_t value;
+    std::function<void(VkDevice)> destroy;
+};
+
+struct DeletionQueue
+{
+    FrameScheduler* scheduler;
+    std::deque<PendingDeletion> pending[SCHEDULER_QUEUE_COUNT]; // By owning timeline, sorted by value
+};
+
+DeletionQueue create_deletion_queue(FrameScheduler& scheduler);
+
+void defer_deletion(DeletionQueue& queue, SchedulerQueue role, uint64_t value, std::function<void(VkDevice)> destroy);
+
+void defer_destroy_buffer(DeletionQueue& queue, SchedulerQueue role, uint64_t value, AllocatedBuffer buffer);
+
+void defer_destroy_image(DeletionQueue& queue, SchedulerQueue role, uint64_t value, AllocatedImage image);
+
+void defer_destroy_pipeline(DeletionQueue& queue, SchedulerQueue role, uint64_t value, VkPipeline pipeline);
+
+void defer_destroy_framebuffer(DeletionQueue& queue, SchedulerQueue role, uint64_t value, VkFramebuffer framebuffer);
+
+void defer_destroy_descriptor_pool(DeletionQueue& queue, SchedulerQueue role, uint64_t value, VkDescriptorPool pool);
+
+size_t collect_deletion_queue(DeletionQueue& queue);
+
+// Waits for the last pending value of every timeline, for teardown
+void flush_deletion_queue(DeletionQueue& queue);
+
+struct FramePacingOptions
+{
+    double targetFps;     // 0 leaves pacing to vkAcquireNextImageKHR
+    bool idle;            // Render only after something changed
+    double idleTimeoutMs; // Longest event wait while idle, frame boundary work still runs
+    uint64_t frameLimit;  // 0 runs until the window is closed
+};
+
+// --fps N, --idle and --frames N, all off by default
+void parse_pacing_options(int argc, char* argv[], FramePacingOptions& options);
+
+/*Paces the window loop to a target frame rate. A frame is started as late as
+the measured CPU and GPU times allow, so it completes right at its deadline.
+The wait sleeps first and spins for the last part, the spin window follows
+how much the OS oversleeps*/
+struct FramePacer
+{
+    FramePacingOptions options;
+    std::chrono::steady_clock::duration period;
+    std::chrono::steady_clock::time_point deadline;
+    std::chrono::steady_clock::time_point frameStart;
+    double cpuMs;        // Smoothed CPU work per frame
+    double gpuMs;        // Smoothed wait for the GPU per frame
+    double oversleepMs;  // Smoothed sleep overshoot
+    bool dirty;          // Idle mode: something changed since the last frame
+    uint64_t frames;
+    uint64_t idleSkips;
+    uint64_t missed;     // Frames finished after their deadline
+};
+
+FramePacer create_frame_pacer(const FramePacingOptions& options);
+
+void pacer_mark_dirty(FramePacer& pacer);
+
+// In idle mode false until pacer_mark_dirty, otherwise always true
+bool pacer_should_render(FramePacer& pacer);
+
+// Blocks until the frame should start and starts its CPU timer
+void pacer_begin_frame(FramePacer& pacer);
+
+// gpuWaitMs is the part of the frame spent blocked on the GPU
+void pacer_end_frame(FramePacer& pacer, double gpuWaitMs);
+
+void print_pacing_statistics(const FramePacer& pacer);
+
+/*Callbacks into the owner of the window's resources. Frame boundary work runs
+once per loop iteration, also while idle, and returns true when it changed
+what is drawn. recreateSwapchain runs with the queue idle once the swapchain
+is out of date and has to update the swapchain handle the loop was given*/
+struct WindowLoopHooks
+{
+    std::function<bool()> frameBoundary;
+    std::function<void()> recreateSwapchain;
+};
+
+// Throws VulkanException with VK_ERROR_DEVICE_LOST when the device is lost
+void window_main_loop(VkDevice& logical_device, VkSwapchainKHR& swapChain,
+    FrameScheduler& scheduler,
+    DeletionQueue& deletionQueue,
+    std::vector<VkCommandBuffer>& commandBuffers,
+    VkQueue& presentQueue,
+    FramePacer& pacer,
+    const WindowLoopHooks& hooks);
+
+/*Attachments, subpasses and dependencies of a render pass under construction.
+Transient attachments are never stored, so tile-based and software
+rasterizers keep them in tile memory and their images can be lazily allocated*/
+struct SubpassAttachments
+{
+    std::vector<VkAttachmentReference> colors;
+    std::vector<VkAttachmentReference> resolves;
+    std::vector<VkAttachmentReference> inputs;
+    VkAttachmentReference depth;
+    bool hasDepth;
+};
+
+struct RenderPassBuilder
+{
+    std::vector<VkAttachmentDescription> attachments;
+    std::vector<SubpassAttachments> subpasses;
+    std::vector<VkSubpassDependency> dependencies;
+};
+
+bool has_stencil(VkFormat format);
+
+bool is_depth_format(VkFormat format);
+
+uint32_t add_color_attachment(RenderPassBuilder& builder,
+VkFormat format,
+VkSampleCountFlagBits samples,
+bool transient,
+VkImageLayout finalLayout);
+
+uint32_t add_resolve_attachment(RenderPassBuilder& builder, VkFormat format, VkImageLayout finalLayout);
+
+uint32_t add_depth_attachment(RenderPassBuilder& builder, VkFormat format, VkSampleCountFlagBits samples, bool transient);
+
+uint32_t add_subpass(RenderPassBuilder& builder,
+const std::vector<uint32_t>& colors,
+const std::vector<uint32_t>& resolves,
+const std::vector<uint32_t>& inputs,
+int32_t depth);
+
+VkRenderPass build_render_pass(VkDevice& logical_device, RenderPassBuilder& builder);
+
+/*Color target plus optional MSAA and depth. Framebuffer attachments go in
+the order: [multisampled color], target, [depth]*/
+struct RenderPassConfig
+{
+    VkFormat colorFormat;
+    VkImageLayout finalLayout;
+    VkSampleCountFlagBits samples;
+    VkFormat depthFormat; // VK_FORMAT_UNDEFINED disables depth
+};
+
+VkFormat find_depth_format(VkPhysicalDevice& gpuDevice);
+
+RenderPassConfig make_render_pass_config(VkPhysicalDevice& gpuDevice,
+VkFormat colorFormat,
+VkImageLayout finalLayout,
+uint32_t requestedSamples);
+
+VkRenderPass create_render_pass(VkDevice& logical_device, const RenderPassConfig& config);
+
+std::vector<VkClearValue> make_clear_values(const RenderPassConfig& config);
+
+// Transient images of a RenderPassConfig, shared by every framebuffer of the pass
+struct TransientAttachments
+{
+    bool hasColor;
+    bool hasDepth;
+    AllocatedImage color;
+    AllocatedImage depth;
+};
+
+TransientAttachments create_transient_attachments(VkPhysicalDevice& gpuDevice,
+VkDevice& logical_device,
+const RenderPassConfig& config,
+VkExtent2D extent);
+
+std::vector<VkImageView> make_framebuffer_attachments(const TransientAttachments& transient, VkImageView target);
+
+void destroy_transient_attachments(VkDevice& logical_device, TransientAttachments& transient);
+
+// --subpass-test
+bool parse_subpass_test_option(int argc, char* argv[]);
+
+/*Builds a two subpass render pass where the second reads the transient color
+and depth of the first as input attachments and checks the derived layouts and
+dependencies. Subpass 0 draws pixel coordinates, subpass 1 draws them swapped
+through the input attachment and the target is read back and compared. Returns
+false when a check fails*/
+bool run_subpass_test(VkInstance& instance, VkPhysicalDevice& gpu, const std::vector<const char*>& enabledLayerNames);
+
+/*Render graph: passes declare how they use images and buffers, and
+compile_render_graph derives everything that used to be placed by hand:
+- passes that contribute nothing to an output are culled
+- one vkCmdPipelineBarrier batch per pass with the minimal stage/access
+  masks and layout transitions, reads after reads need no barrier
+- transient images whose lifetimes don't overlap share memory, outputs
+  keep theirs until the graph is done
+Render passes recorded inside the graph should keep their attachments in
+the layout of the declared access, transitions are done by the graph*/
+enum GraphAccess
+{
+    GRAPH_ACCESS_COLOR_ATTACHMENT,
+    GRAPH_ACCESS_DEPTH_ATTACHMENT,
+    GRAPH_ACCESS_SHADER_READ,
+    GRAPH_ACCESS_STORAGE_READ,
+    GRAPH_ACCESS_STORAGE_WRITE,
+    GRAPH_ACCESS_TRANSFER_SRC,
+    GRAPH_ACCESS_TRANSFER_DST,
+    GRAPH_ACCESS_HOST_READ,
+    GRAPH_ACCESS_PRESENT
+};
+
+struct GraphAccessInfo
+{
+    VkPipelineStageFlags stage;
+    VkAccessFlags access;
+    VkImageLayout layout;
+    bool write;
+};
+
+GraphAccessInfo graph_access_info(GraphAccess access);
+
+struct GraphResource
+{
+    std::string name;
+    bool isImage;
+    bool imported;
+    VkImage image;
+    VkImageView view;
+    VkBuffer buffer;
+    VkExtent2D extent;
+    VkFormat format;
+    VkImageUsageFlags usage;
+    VkImageAspectFlags aspect;
+    VkImageLayout initialLayout;
+    bool output;
+    GraphAccess outputAccess;
+    // Filled in by compile_render_graph
+    int32_t firstPass;
+    int32_t lastPass;
+    int32_t aliasOf;
+    uint32_t memoryIndex;       // Into RenderGraph::memory
+    VkDeviceSize memoryOffset;
+};
+
+struct GraphUse
+{
+    uint32_t resource;
+    GraphAccess access;
+};
+
+// Barriers keep resource indices, so imported handles may be rebound between executions
+struct GraphBarrierBatch
+{
+    VkPipelineStageFlags srcStage;
+    VkPipelineStageFlags dstStage;
+    std::vector<VkImageMemoryBarrier> images;
+    std::vector<uint32_t> imageResources;
+    std::vector<VkBufferMemoryBarrier> buffers;
+    std::vector<uint32_t> bufferResources;
+};
+
+struct GraphPass
+{
+    std::string name;
+    std::vector<GraphUse> uses;
+    std::function<void(VkCommandBuffer)> record;
+    bool culled;
+    GraphBarrierBatch barriers;
+};
+
+struct RenderGraph
+{
+    std::vector<GraphResource> resources;
+    std::vector<GraphPass> passes;
+    GraphBarrierBatch finalBarriers;
+    std::vector<VkDeviceMemory> memory; // One allocation per memory type of the transient images
+    VkDeviceSize memorySize;            // Of all allocations
+};
+
+uint32_t graph_import_image(RenderGraph& graph, const std::string& name, VkImageLayout initialLayout, VkImageAspectFlags aspect);
+
+uint32_t graph_import_buffer(RenderGraph& graph, const std::string& name);
+
+uint32_t graph_create_image(RenderGraph& graph,
+const std::string& name,
+VkExtent2D extent,
+VkFormat format,
+VkImageUsageFlags usage,
+VkImageAspectFlags aspect);
+
+void graph_bind_image(RenderGraph& graph, uint32_t resource, VkImage image, VkImageView view);
+
+void graph_bind_buffer(RenderGraph& graph, uint32_t resource, VkBuffer buffer);
+
+uint32_t graph_add_pass(RenderGraph& graph, const std::string& name, std::function<void(VkCommandBuffer)> record);
+
+void graph_use(RenderGraph& graph, uint32_t pass, uint32_t resource, GraphAccess access);
+
+void graph_set_output(RenderGraph& graph, uint32_t resource, GraphAccess finalAccess);
+
+void compile_render_graph(VkPhysicalDevice& gpuDevice, VkDevice& logical_device, RenderGraph& graph);
+
+void execute_render_graph(VkCommandBuffer commandBuffer, RenderGraph& graph);
+
+void destroy_render_graph(VkDevice& logical_device, RenderGraph& graph);
+
+// --graph-test
+bool parse_graph_test_option(int argc, char* argv[]);
+
+/*Compiles a graph of transfer passes with transient images whose lifetimes
+don't overlap, an output image and a pass whose output nobody reads. Checks
+culling, aliasing, the barrier of a second reader and that the executed graph
+kept every image intact. Returns false when a check fails*/
+bool run_render_graph_test(VkInstance& instance, VkPhysicalDevice& gpu, const std::vector<const char*>& enabledLayerNames);
+
+// Push constant block of Shaders/shader.vert
+struct TileTransform
+{
+    float scale[2];
+    float offset[2];
+};
+
+const TileTransform identityTileTransform = {{1.0f, 1.0f}, {0.0f, 0.0f}};
+
+VkPipelineLayout create_pipeline_layout(VkDevice& logical_device);
+
+/*With dynamicViewport the extent is ignored and viewport and scissor are set
+while recording. Threads other than the one loading functions pass their own
+createGraphicsPipelines, the global one is loaded otherwise. renderPassConfig
+describes the attachments of the given subpass*/
+VkPipeline create_pipeline(VkDevice& logical_device, 
+VkPipelineShaderStageCreateInfo shaderStages[], 
+VkExtent2D& swapchainExtent,
+VkRenderPass& renderPass,
+const RenderPassConfig& renderPassConfig,
+VkPipelineLayout& pipelineLayout,
+bool dynamicViewport = false,
+PFN_vkCreateGraphicsPipelines createGraphicsPipelines = nullptr,
+uint32_t subpass = 0
+);
+
+struct PipelineVariant
+{
+    const char* name;
+    ShaderVariant vertex;
+    ShaderVariant fragment;
+};
+
+// Constant ids are declared in Shaders/shader.vert and Shaders/shader.frag
+enum ShaderConstant : uint32_t
+{
+    SHADER_CONSTANT_SCALE = 0,
+    SHADER_CONSTANT_FLIP_Y = 1,
+    SHADER_CONSTANT_GRAYSCALE = 2,
+    SHADER_CONSTANT_POSTERIZE_LEVELS = 3
+};
+
+PipelineVariant make_pipeline_variant(const char* name, float scale, bool flipY, bool grayscale, int32_t posterizeLevels);
+
+std::vector<VkPipeline> create_pipeline_variants(VkDevice& logical_device,
+VkShaderModule vertModule,
+VkShaderModule fragModule,
+std::vector<PipelineVariant>& variants,
+VkExtent2D& swapchainExtent,
+VkRenderPass& renderPass,
+const RenderPassConfig& renderPassConfig,
+VkPipelineLayout& pipelineLayout,
+bool dynamicViewport = false,
+PFN_vkCreateGraphicsPipelines createGraphicsPipelines = nullptr
+);
+
+uint32_t parse_msaa_option(int argc, char* argv[]);
+
+struct TiledRenderOptions
+{
+    uint32_t width;
+    uint32_t height;
+    uint32_t tileSize;
+    uint32_t frames;
+    uint32_t readbackSlots;
+    uint32_t msaa;
+    std::string sink;   // ppm, raw or pipe
+    std::string output; // File name (may contain %u for the frame) or encoder command for pipe
+};
+
+bool parse_tiled_options(int argc, char* argv[], TiledRenderOptions& options);
+
+TileTransform make_tile_transform(const TiledRenderOptions& options, uint32_t x, uint32_t y);
+
+// Finished copy in mapped readback memory, data is valid only inside FrameSink::write
+struct ReadbackFrame
+{
+    uint32_t frame;
+    VkRect2D region;     // Part of the output image held in data
+    const uint8_t* data; // Tightly packed RGBA8
+};
+
+/*Consumer of finished readbacks. Regions arrive in submission order and
+data points straight into the mapped buffer, sinks must not keep it*/
+class FrameSink
+{
+public:
+    virtual ~FrameSink() {}
+    virtual void write(const ReadbackFrame& frame) = 0;
+};
+
+std::unique_ptr<FrameSink> create_frame_sink(const TiledRenderOptions& options);
+
+struct ReadbackSlot
+{
+    AllocatedBuffer buffer;
+    VkFence fence;
+    bool pending;
+    ReadbackFrame frame;
+};
+
+/*Persistently mapped host buffers reused in FIFO order. A slot is handed
+back to the sink once its fence signals, so readbacks stay in flight
+while the GPU renders the next submissions*/
+struct ReadbackRing
+{
+    std::vector<ReadbackSlot> slots;
+    uint32_t next;
+};
+
+ReadbackRing create_readback_ring(VkPhysicalDevice& gpuDevice, VkDevice& logical_device, uint32_t slotCount, VkDeviceSize slotSize);
+
+void retire_readback_slot(VkDevice& logical_device, ReadbackSlot& slot, FrameSink& sink);
+
+uint32_t acquire_readback_slot(VkDevice& logical_device, ReadbackRing& ring, FrameSink& sink);
+
+void drain_readback_ring(VkDevice& logical_device, ReadbackRing& ring, FrameSink& sink);
+
+void destroy_readback_ring(VkDevice& logical_device, ReadbackRing& ring);
+
+void record_readback_copy(VkCommandBuffer commandBuffer, VkImage image, ReadbackSlot& slot);
+
+// Offscreen attachment of one readback slot, the slot fence also guards its reuse
+struct TileTarget
+{
+    AllocatedImage image;
+    VkFramebuffer framebuffer;
+    VkCommandBuffer commandBuffer;
+};
+
+/*Scene and readback passes of one tile. The graph is compiled once, the
+tile being recorded is bound before every execution*/
+struct TileGraph
+{
+    RenderGraph graph;
+    uint32_t tileImage;
+    uint32_t readbackBuffer;
+    TileTarget* target;
+    ReadbackSlot* slot;
+    TileTransform transform;
+};
+
+void build_tile_graph(TileGraph& tile,
+VkRenderPass renderPass,
+std::vector<VkClearValue> clearValues,
+VkPipeline pipeline,
+VkPipelineLayout pipelineLayout);
+
+void render_tiled(VkInstance& instance,
+VkPhysicalDevice& gpu,
+const std::vector<const char*>& enabledLayerNames,
+TiledRenderOptions& options);
+
+struct BenchmarkOptions
+{
+    uint32_t warmupFrames;
+    uint32_t measuredFrames;
+    uint32_t trianglesPerDraw;
+    uint32_t drawCount;
+    float overdraw;      // Average number of triangle layers over the covered area
+    bool offscreen;
+    uint32_t width;      // Offscreen target only
+    uint32_t height;
+    uint32_t msaa;
+    std::string json;
+};
+
+bool parse_benchmark_options(int argc, char* argv[], BenchmarkOptions& options);
+
+// Push constant block of Shaders/bench.vert, same size as TileTransform so the pipeline layout is shared
+struct BenchmarkScene
+{
+    uint32_t trianglesPerDraw;
+    uint32_t drawIndex;
+    uint32_t drawCount;
+    float triangleScale;
+};
+
+struct FrameStats
+{
+    double mean;
+    double median;
+    double p95;
+    double p99;
+    double min;
+    double max;
+};
+
+FrameStats compute_frame_stats(std::vector<double> samples);
+
+// Everything a benchmark run renders into, either one offscreen framebuffer or a swapchain
+struct BenchmarkTarget
+{
+    VkDevice device;
+    VkQueue queue;
+    VkQueue presentQueue;
+    uint32_t queueFamily;
+    VkSwapchainKHR swapchain; // VK_NULL_HANDLE when offscreen
+    std::vector<VkFramebuffer> framebuffers;
+    VkRenderPass renderPass;
+    std::vector<VkClearValue> clearValues;
+    VkExtent2D extent;
+    VkPipeline pipeline;
+    VkPipelineLayout pipelineLayout;
+};
+
+void run_benchmark(VkPhysicalDevice& gpu, BenchmarkTarget& target, const BenchmarkOptions& options);
+
+VkPipeline create_benchmark_pipeline(VkDevice& logical_device,
+VkShaderModule fragModule,
+VkExtent2D extent,
+VkRenderPass& renderPass,
+const RenderPassConfig& renderPassConfig,
+VkPipelineLayout& pipelineLayout);
+
+void run_offscreen_benchmark(VkInstance& instance,
+VkPhysicalDevice& gpu,
+const std::vector<const char*>& enabledLayerNames,
+const BenchmarkOptions& options);
+
+struct ComputePipeline
+{
+    VkDescriptorSetLayout setLayout; // Storage buffers at bindings 0..n-1
+    VkPipelineLayout layout;
+    VkPipeline pipeline;
+    uint32_t localSize; // Workgroup size picked from the device limits
+    uint32_t maxGroups;
+};
+
+// Constant ids declared by compute shaders, see Shaders/batch.comp
+enum ComputeConstant : uint32_t
+{
+    COMPUTE_CONSTANT_LOCAL_SIZE_X = 0
+};
+
+ComputePipeline create_compute_pipeline(VkPhysicalDevice& gpuDevice,
+VkDevice& logical_device,
+VkShaderModule module,
+uint32_t storageBuffers,
+uint32_t pushConstantSize);
+
+uint32_t compute_group_count(const ComputePipeline& pipeline, uint32_t elements);
+
+// Largest element count a single one-dimensional dispatch can cover
+uint32_t max_dispatch_elements(const ComputePipeline& pipeline);
+
+void destroy_compute_pipeline(VkDevice& logical_device, ComputePipeline& pipeline);
+
+struct ComputeBatchOptions
+{
+    uint64_t elements;
+    uint32_t batchElements; // Per dispatch, clamped to the dispatch limits
+    float scale;
+    float bias;
+    bool verify;            // Check every element against the CPU
+};
+
+bool parse_compute_options(int argc, char* argv[], ComputeBatchOptions& options);
+
+// Push constant block of Shaders/batch.comp
+struct BatchConstants
+{
+    uint32_t count;
+    float scale;
+    float bias;
+};
+
+/*One of the two buffers sets a dataset streams through. Staging and
+readback buffers are only created when the storage buffers can't be mapped*/
+struct ComputeBatchSlot
+{
+    AllocatedBuffer input;
+    AllocatedBuffer output;
+    AllocatedBuffer staging;
+    AllocatedBuffer readback;
+    bool hasStaging;
+    bool hasReadback;
+    VkDescriptorSet descriptorSet;
+    VkCommandBuffer commandBuffer;
+    uint64_t submitted; // Scheduler value of the batch in flight
+    uint64_t first;     // Its first element
+    uint32_t count;     // 0 when idle
+};
+
+float batch_input_value(uint64_t index);
+
+// Returns false when --verify found mismatches
+bool run_compute_batch(VkInstance& instance,
+VkPhysicalDevice& gpu,
+const std::vector<const char*>& enabledLayerNames,
+ComputeBatchOptions& options);
+
+// Opens the Vulkan loader and fetches vkGetInstanceProcAddr from it
+bool load_vulkan_library();
+
+void unload_vulkan_library();
+
+// Validation layers only in builds configured with ENABLED_DEBUG
+std::vector<const char*> get_enabled_layers();
+
+/*Initialization steps and the earlier steps they depend on. Worker tasks get
+a thread each and start as soon as their dependencies finished; main thread
+tasks run in order on the caller, window systems want their calls there*/
+struct StartupTask
+{
+    const char* name;
+    std::function<void()> run;
+    std::vector<uint32_t> dependencies; // Indices of earlier tasks
+    bool mainThread;
+    double start;    // ms since process start
+    double duration; // ms
+};
+
+struct StartupGraph
+{
+    std::vector<StartupTask> tasks;
+};
+
+uint32_t add_startup_task(StartupGraph& graph,
+const char* name,
+std::function<void()> run,
+std::vector<uint32_t> dependencies = {},
+bool mainThread = false);
+
+// Returns once every task finished, rethrowing the first failure. Dependents of a failed task don't run
+void run_startup_graph(StartupGraph& graph);
+
+void print_startup_graph(const StartupGraph& graph);
+
+// Time since the renderer library was initialized, which is before main
+double startup_elapsed_ms();
+
+// The per-layer extension listing of available_layers_and_extensions is opt out with --skip-enumeration
+bool parse_skip_enumeration_option(int argc, char* argv[]);
+
+// Builds pipelines on the reloader's thread, which must only call through the given function
+typedef std::function<std::vector<VkPipeline>(const std::vector<VkShaderModule>&, PFN_vkCreateGraphicsPipelines)>
+    ReloadBuilder;
+
+/*Watches a directory of compiled shaders and rebuilds the pipelines using
+them on a background thread. The frame loop picks finished pipelines up at a
+frame boundary, so it never waits for pipeline compilation. The load macros
+write globals the frame loop uses, so the worker only calls the functions
+resolved by start_shader_reloader*/
+struct ShaderReloader
+{
+    VkDevice device;
+    std::string directory;
+    std::vector<std::string> files; // Shader files passed to build, in order
+    ReloadBuilder build;
+    PFN_vkCreateShaderModule createShaderModule;
+    PFN_vkDestroyShaderModule destroyShaderModule;
+    PFN_vkCreateGraphicsPipelines createGraphicsPipelines;
+    PFN_vkDestroyPipeline destroyPipeline;
+    int inotifyFd;
+    std::thread worker;
+    std::atomic<bool> running;
+    std::mutex mutex;                // Guards ready and hasReady
+    std::vector<VkPipeline> ready;
+    bool hasReady;
+    uint32_t generation;             // Rebuilds finished so far
+};
+
+// Returns true with --hot-reload DIR, shaders are then loaded from and watched in DIR
+bool parse_hot_reload_option(int argc, char* argv[], std::string& directory);
+
+std::string shader_path(const std::string& directory, const std::string& file);
+
+bool start_shader_reloader(ShaderReloader& reloader,
+VkDevice device,
+const std::string& directory,
+const std::vector<std::string>& files,
+ReloadBuilder build);
+
+/*Hands over the latest rebuilt pipelines, the caller owns them afterwards.
+Never blocks: returns false while the worker holds the lock*/
+bool take_reloaded_pipelines(ShaderReloader& reloader, std::vector<VkPipeline>& pipelines);
+
+// Joins the worker and destroys pipelines that were never taken
+void stop_shader_reloader(ShaderReloader& reloader);
+
+// --reload-test DIR
+bool parse_reload_test_option(int argc, char* argv[], std::string& directory);
+
+/*Copies the shaders into DIR, starts a reloader on it and rewrites the
+files: invalid SPIR-V has to keep the pipelines, valid replacements have to
+produce new ones. Returns false when a check fails*/
+bool run_hot_reload_test(VkInstance& instance,
+VkPhysicalDevice& gpu,
+const std::vector<const char*>& enabledLayerNames,
+const std::string& directory);
+
+/*Creates the surface, device and swapchain for the window made by
+create_window and runs the interactive loop, or the benchmark when
+benchmark is not null. Everything but the instance is destroyed on return*/
+void run_windowed(VkInstance& instance,
+VkPhysicalDevice& gpu,
+const std::vector<const char*>& enabledLayerNames,
+int argc,
+char* argv[],
+const BenchmarkOptions* benchmark);
+
+uint32_t mip_level_count(VkExtent2D extent);
+
+VkExtent2D mip_extent(VkExtent2D extent, uint32_t level);
+
+// vkCmdBlitImage with VK_FILTER_LINEAR needs both blit directions and linear filtering on optimal tiling
+bool supports_linear_blit(VkPhysicalDevice& gpuDevice, VkFormat format);
+
+void record_image_barrier(VkCommandBuffer commandBuffer,
+VkImage image,
+VkImageLayout oldLayout,
+VkImageLayout newLayout,
+VkAccessFlags srcAccess,
+VkAccessFlags dstAccess,
+VkPipelineStageFlags srcStage,
+VkPipelineStageFlags dstStage,
+uint32_t baseLevel,
+uint32_t levelCount);
+
+/*Fills the levels after baseLevel by halving blits. Every level from
+baseLevel on has to be in TRANSFER_DST_OPTIMAL with baseLevel written, all of
+them end in finalLayout*/
+void record_mip_generation(VkCommandBuffer commandBuffer,
+const AllocatedImage& image,
+uint32_t baseLevel,
+VkImageLayout finalLayout);
+
+/*Full chain texture from level 0 data in a staging buffer. Only records, the
+staging buffer has to live until the command buffer completed*/
+AllocatedImage create_mipmapped_texture(VkPhysicalDevice& gpuDevice,
+VkDevice& logical_device,
+VkCommandBuffer commandBuffer,
+const AllocatedBuffer& staging,
+VkExtent2D extent,
+VkFormat format);
+
+/*Texture container: header, entries, then the level data of every texture,
+finest first, each level 16 byte aligned. Read through a read-only mapping*/
+const uint32_t textureFileMagic = 0x58544B56; // "VKTX"
+const uint32_t textureFileVersion = 1;
+const uint32_t maxTextureLevels = 16;
+
+struct TextureFileHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t textureCount;
+    uint32_t reserved;
+};
+
+struct TextureFileLevel
+{
+    uint64_t offset; // From the start of the file
+    uint64_t size;
+};
+
+struct TextureFileEntry
+{
+    uint32_t width;
+    uint32_t height;
+    uint32_t format; // VkFormat, only the 4 byte RGBA8 and BGRA8 ones are accepted
+    uint32_t levels;
+    TextureFileLevel level[maxTextureLevels];
+};
+
+struct TextureContainer
+{
+    int fd;
+    const uint8_t* data;
+    size_t size;
+    const TextureFileHeader* header;
+    const TextureFileEntry* entries;
+};
+
+// Validates every entry against the file size, false for anything that isn't a container
+bool open_texture_container(const std::string& filename, TextureContainer& container);
+
+void close_texture_container(TextureContainer& container);
+
+// Writes RGBA8 textures with box filtered mip chains
+bool write_texture_container(const std::string& filename,
+const std::vector<VkExtent2D>& extents,
+const std::vector<std::vector<uint8_t>>& pixels);
+
+std::vector<uint8_t> make_test_texture(VkExtent2D extent, uint32_t seed);
+
+struct TextureStreamingOptions
+{
+    VkDeviceSize uploadBudget; // Staged bytes per update
+    VkDeviceSize memoryBudget; // Resident bytes across all textures
+    uint32_t evictAfter;       // Updates without a request before a texture gives up mips
+};
+
+struct StreamedTexture
+{
+    AllocatedImage image;       // Levels residentLevel.. of the chain, VK_NULL_HANDLE while nothing is resident
+    uint32_t residentLevel;     // Equals the entry's level count while nothing is resident
+    uint32_t wantedLevel;
+    uint32_t finestLevel;       // Finest level whose upload fits the budget
+    uint64_t lastRequested;     // Update counter, for LRU eviction
+    bool busy;                  // Part of a batch in flight
+    std::vector<VkDeviceSize> memoryBytes; // VkMemoryRequirements.size with levels i.. resident, 0 past the chain
+};
+
+/*Rebuilds a texture with levels level.. : the levels the old image shares
+are copied from it, a new finer level comes from staging*/
+struct TextureStreamOp
+{
+    uint32_t texture;
+    uint32_t level;
+    uint32_t sourceLevel;       // Resident level when planned
+    VkImage source;             // Old image, VK_NULL_HANDLE while nothing was resident
+    VkDeviceSize stagingOffset;
+    VkDeviceSize stagingBytes;  // 0 when every level is copied from the old image
+    AllocatedImage image;       // Created when the batch is recorded
+};
+
+enum StreamingSlotState
+{
+    STREAMING_SLOT_IDLE,
+    STREAMING_SLOT_LOADING,     // The loader thread copies from the mapping into staging
+    STREAMING_SLOT_READY,
+    STREAMING_SLOT_SUBMITTED
+};
+
+struct StreamingSlot
+{
+    StreamingSlotState state;   // Guarded by the streamer mutex
+    std::vector<TextureStreamOp> ops;
+    VkDeviceSize stagingBase;
+    VkCommandBuffer commandBuffer;
+    uint64_t submitted;
+};
+
+/*Streams mip levels of container textures within an upload and a memory
+budget. Each update plans one batch, moving requested textures a level finer
+and least recently requested ones a level coarser. A texture is rebuilt
+with its new residency rather than patched, so images in use are never
+written: the levels it keeps are copied from the old image on the device and
+only a new finer level is uploaded. Textures whose finest levels exceed the
+upload budget stop at a coarser one. The copies run on the transfer role and
+new images replace the old ones once they completed; consumers have to
+submit to the same VkQueue*/
+struct TextureStreamer
+{
+    VkPhysicalDevice gpu;
+    VkDevice device;
+    FrameScheduler* scheduler;
+    DeletionQueue* deletionQueue;
+    const TextureContainer* container;
+    TextureStreamingOptions options;
+    std::vector<StreamedTexture> textures;
+    AllocatedBuffer staging;    // One upload budget per slot
+    VkCommandPool commandPool;
+    StreamingSlot slots[2];
+    uint64_t updates;
+    VkDeviceSize residentBytes; // VkMemoryRequirements sizes, including the batch in flight
+    std::thread loader;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<uint32_t> loadQueue; // Slots for the loader, guarded by mutex
+    bool running;                   // Guarded by mutex
+    // Statistics
+    VkDeviceSize uploadedBytes;
+    VkDeviceSize largestUpdate;     // Staged bytes submitted by one update
+    VkDeviceSize peakResidentBytes;
+    uint64_t evictions;
+    uint32_t cappedTextures;    // Limited to a coarser level by the upload budget
+};
+
+void create_texture_streamer(TextureStreamer& streamer,
+VkPhysicalDevice& gpuDevice,
+VkDevice& logical_device,
+uint32_t queueFamily,
+FrameScheduler& scheduler,
+DeletionQueue& deletionQueue,
+const TextureContainer& container,
+const TextureStreamingOptions& options);
+
+// Marks the texture as used this update and asks for level and coarser
+void request_texture_level(TextureStreamer& streamer, uint32_t texture, uint32_t level);
+
+// Never blocks, submits at most one batch. Returns how many textures got a new image
+uint32_t update_texture_streamer(TextureStreamer& streamer);
+
+bool texture_streamer_idle(TextureStreamer& streamer);
+
+// Waits for the batches in flight, textures are destroyed right away so the device must be done with them
+void destroy_texture_streamer(TextureStreamer& streamer);
+
+struct TextureStreamingRun
+{
+    std::string container;
+    uint32_t textures;
+    uint32_t size;
+    uint32_t frames;
+    TextureStreamingOptions streaming;
+};
+
+// --texture-stream FILE, with --textures N --texture-size S --upload-budget KB --memory-budget KB --frames F
+bool parse_texture_streaming_options(int argc, char* argv[], TextureStreamingRun& options);
+
+/*Streams a synthetic container (written first when FILE doesn't exist)
+under a moving view, then checks streamed and blit generated levels against
+the container. Returns false on a mismatch or an exceeded budget*/
+bool run_texture_streaming(VkInstance& instance,
+VkPhysicalDevice& gpu,
+const std::vector<const char*>& enabledLayerNames,
+TextureStreamingRun& options);
+
+/*Scene file: header with the section table, then the vertex, index,
+instance and mesh sections, each page aligned. Loading maps the file and
+copies the sections into staging as they are, nothing is parsed*/
+const uint32_t sceneFileMagic = 0x43534B56; // "VKSC"
+const uint32_t sceneFileVersion = 1;
+const uint64_t sceneSectionAlignment = 4096;
+
+enum SceneSection : uint32_t
+{
+    SCENE_SECTION_VERTICES,
+    SCENE_SECTION_INDICES,   // uint32_t
+    SCENE_SECTION_INSTANCES,
+    SCENE_SECTION_MESHES,    // Read on the CPU, not uploaded
+    SCENE_SECTION_COUNT
+};
+
+struct SceneVertex
+{
+    float position[3];
+    float normal[3];
+    float uv[2];
+};
+
+struct SceneInstance
+{
+    float position[3];
+    float scale;
+};
+
+// Arguments of one vkCmdDrawIndexed
+struct SceneMesh
+{
+    uint32_t firstIndex;
+    uint32_t indexCount;
+    int32_t vertexOffset;
+    uint32_t firstInstance;
+    uint32_t instanceCount;
+};
+
+struct SceneFileSection
+{
+    uint64_t offset; // From the start of the file
+    uint64_t size;
+    uint32_t stride;
+    uint32_t reserved;
+};
+
+struct SceneFileHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t fileSize;
+    SceneFileSection sections[SCENE_SECTION_COUNT];
+};
+
+// The file layout is these structs as they are, keep them from changing by accident
+static_assert(sizeof(SceneVertex) == 32, "SceneVertex is part of the scene file format");
+static_assert(sizeof(SceneInstance) == 16, "SceneInstance is part of the scene file format");
+static_assert(sizeof(SceneMesh) == 20, "SceneMesh is part of the scene file format");
+static_assert(sizeof(SceneFileHeader) == 16 + 24 * SCENE_SECTION_COUNT, "SceneFileHeader is part of the scene file format");
+
+uint32_t scene_section_stride(SceneSection section);
+
+// Section table for the given element counts, fileSize included
+SceneFileHeader make_scene_header(const uint64_t counts[SCENE_SECTION_COUNT]);
+
+struct SceneFile
+{
+    int fd;
+    const uint8_t* data;
+    size_t size;
+    const SceneFileHeader* header;
+    const SceneMesh* meshes;
+    uint32_t meshCount;
+};
+
+/*Checks the header, the section table and the mesh ranges against the
+file. Index values aren't checked, that would mean reading the whole file*/
+bool open_scene_file(const std::string& filename, SceneFile& scene);
+
+// Reads every mesh's indices, vertexOffset plus the largest one has to be a vertex of the file
+bool check_scene_indices(const SceneFile& scene);
+
+void close_scene_file(SceneFile& scene);
+
+const uint8_t* scene_section_data(const SceneFile& scene, SceneSection section);
+
+uint64_t scene_section_count(const SceneFile& scene, SceneSection section);
+
+struct SceneData
+{
+    std::vector<SceneVertex> vertices;
+    std::vector<uint32_t> indices;
+    std::vector<SceneInstance> instances;
+    std::vector<SceneMesh> meshes;
+};
+
+bool write_scene_file(const std::string& filename, const SceneData& scene);
+
+// Wavefront OBJ, one mesh per object or group, faces are fanned into triangles
+bool convert_obj_scene(const std::string& filename, SceneData& scene);
+
+// Gives every mesh instanceCount instances laid out on a grid
+void add_grid_instances(SceneData& scene, uint32_t instanceCount);
+
+/*Grid meshes up to about megabytes of vertex and index data, written a mesh
+at a time so scenes larger than memory can be made*/
+bool generate_scene_file(const std::string& filename, uint64_t megabytes);
+
+// Device local buffers of the uploaded sections, VK_NULL_HANDLE for empty ones
+struct GpuScene
+{
+    AllocatedBuffer buffers[SCENE_SECTION_MESHES];
+};
+
+struct SceneLoadStats
+{
+    double openMs;
+    double copyMs;   // memcpy from the mapping, page faults included
+    double waitMs;   // Waiting for staging slots to come back
+    double uploadMs; // From the first copy to the last transfer completed
+    uint64_t bytes;
+    long majorFaults;
+    long minorFaults;
+};
+
+/*Copies the sections through two staging slots of chunkSize, so one is
+filled while the other is transferred. Buffers the host can map are
+written directly from the mapping*/
+GpuScene upload_scene(VkPhysicalDevice& gpuDevice,
+VkDevice& logical_device,
+FrameScheduler& scheduler,
+VkCommandPool commandPool,
+const SceneFile& scene,
+VkDeviceSize chunkSize,
+SceneLoadStats& stats);
+
+void destroy_gpu_scene(VkDevice& logical_device, GpuScene& scene);
+
+struct SceneLoadOptions
+{
+    std::string file;
+    VkDeviceSize chunkSize;
+    bool cold;   // Drops the file from the page cache first
+    bool verify; // Reads back the start and end of every section
+};
+
+// --scene FILE, with --scene-chunk MB --cold --verify
+bool parse_scene_load_options(int argc, char* argv[], SceneLoadOptions& options);
+
+// Load time benchmark, returns false when --verify found a mismatch
+bool run_scene_load(VkInstance& instance,
+VkPhysicalDevice& gpu,
+const std::vector<const char*>& enabledLayerNames,
+const SceneLoadOptions& options);
+
+/*One window the renderer presents to. Everything sized by the window lives
+here, so adding an output costs a surface, a swapchain and its framebuffers
+and command buffers, nothing else*/
+struct OutputSurface
+{
+    NativeWindow window;
+    bool ownsWindow;            // False for the window of create_window
+    bool closed;
+    bool outOfDate;             // Swapchain is recreated at the next frame boundary
+    VkSurfaceKHR surface;
+    VkSwapchain swapchain;
+    std::vector<VkImageView> imageViews;
+    TransientAttachments transient;
+    std::vector<VkFramebuffer> framebuffers;
+    std::vector<VkCommandBuffer> commandBuffers;
+    std::vector<uint64_t> imageSubmitted;    // Graphics value of the last submit per swapchain image
+    std::vector<VkSemaphore> imageAvailable; // One per frame in flight
+};
+
+/*Outputs sharing one device, render pass, pipeline and command pool. The
+pipeline uses a dynamic viewport so windows of any size can share it; all
+surfaces have to offer the render pass format. Only the command pool is
+owned by the manager*/
+struct SurfaceManager
+{
+    VkInstance instance;
+    VkPhysicalDevice gpu;
+    VkDevice device;
+    uint32_t presentFamily;
+    uint32_t framesInFlight;
+    RenderPassConfig renderPassConfig;
+    VkRenderPass renderPass;
+    std::vector<VkClearValue> clearValues;
+    VkPipeline pipeline;
+    VkPipelineLayout pipelineLayout;
+    VkCommandPool commandPool;
+    std::vector<std::unique_ptr<OutputSurface>> outputs;
+};
+
+void init_surface_manager(SurfaceManager& manager,
+VkInstance& instance,
+VkPhysicalDevice& gpuDevice,
+VkDevice& logical_device,
+uint32_t graphicsFamily,
+uint32_t presentFamily,
+const RenderPassConfig& renderPassConfig,
+VkRenderPass renderPass,
+VkPipeline pipeline,
+VkPipelineLayout pipelineLayout);
+
+// Takes over the surface, and the window too when ownsWindow is set. Throws if the present family can't use it
+OutputSurface& add_output_surface(SurfaceManager& manager, NativeWindow window, VkSurfaceKHR surface, bool ownsWindow);
+
+// The GPU has to be done with the output's previous swapchain
+void recreate_output_swapchain(SurfaceManager& manager, OutputSurface& output);
+
+// The GPU has to be done with the output
+void remove_output_surface(SurfaceManager& manager, size_t index);
+
+/*Polls, or waits up to timeoutMs when it is positive, and marks closed
+outputs. True when an event invalidated what the native backends show, GLFW
+doesn't report that*/
+bool poll_output_events(SurfaceManager& manager, double timeoutMs);
+
+// Removes every output and destroys the command pool
+void destroy_surface_manager(SurfaceManager& manager);
+
+// --windows N
+uint32_t parse_window_count_option(int argc, char* argv[]);
+
+/*Renders to the window made by create_window and windowCount - 1 more from
+one device, presenting all swapchains with a single vkQueuePresentKHR. Runs
+until every window is closed*/
+void run_multi_window(VkInstance& instance,
+VkPhysicalDevice& gpu,
+const std::vector<const char*>& enabledLayerNames,
+int argc,
+char* argv[],
+uint32_t windowCount);
+
+#endif
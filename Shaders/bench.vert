@@ -0,0 +1,41 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+out gl_PerVertex {
+    vec4 gl_Position;
+};
+
+layout(location = 0) out vec3 fragColor;
+
+// Synthetic benchmark scene, see BenchmarkScene in vulkan.cpp
+layout(push_constant) uniform BenchmarkScene {
+    uint trianglesPerDraw;
+    uint drawIndex;
+    uint drawCount;
+    float triangleScale;
+} scene;
+
+vec2 corners[3] = vec2[](
+    vec2(0.0, -1.0),
+    vec2(1.0, 1.0),
+    vec2(-1.0, 1.0)
+);
+
+vec3 colors[3] = vec3[](
+    vec3(1.0, 0.0, 0.0),
+    vec3(0.0, 1.0, 0.0),
+    vec3(0.0, 0.0, 1.0)
+);
+
+void main() {
+    uint corner = uint(gl_VertexIndex) % 3u;
+    uint total = scene.trianglesPerDraw * scene.drawCount;
+    uint triangle = scene.drawIndex * scene.trianglesPerDraw + uint(gl_VertexIndex) / 3u;
+    // Triangles are laid out on a square grid, later ones closer so every fragment passes the depth test
+    uint grid = uint(ceil(sqrt(float(total))));
+    vec2 cellSize = vec2(2.0 / float(grid));
+    vec2 center = vec2(-1.0) + (vec2(triangle % grid, triangle / grid) + 0.5) * cellSize;
+    float depth = 1.0 - (float(triangle) + 1.0) / (float(total) + 1.0);
+    gl_Position = vec4(center + corners[corner] * cellSize * 0.5 * scene.triangleScale, depth, 1.0);
+    fragColor = colors[corner];
+}
@@ -0,0 +1,18 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+out gl_PerVertex {
+    vec4 gl_Position;
+};
+
+// One clockwise triangle covering the whole target
+vec2 positions[3] = vec2[](
+    vec2(-1.0, -1.0),
+    vec2(3.0, -1.0),
+    vec2(-1.0, 3.0)
+);
+
+void main() {
+    // In front of a depth buffer cleared to 1.0
+    gl_Position = vec4(positions[gl_VertexIndex], 0.25, 1.0);
+}
@@ -4,6 +4,17 @@
 layout(location = 0) in vec3 fragColor;
 layout(location = 0) out vec4 outColor;
 
+// Specialization constants, see ShaderVariant in vulkan.cpp
+layout(constant_id = 2) const bool GRAYSCALE = false;
+layout(constant_id = 3) const int POSTERIZE_LEVELS = 0;
+
 void main() {
-    outColor = vec4(fragColor, 1.0);
-}
\ No newline at end of file
+    vec3 color = fragColor;
+    if (GRAYSCALE) {
+        color = vec3(dot(color, vec3(0.299, 0.587, 0.114)));
+    }
+    if (POSTERIZE_LEVELS > 0) {
+        color = floor(color * float(POSTERIZE_LEVELS)) / float(POSTERIZE_LEVELS);
+    }
+    outColor = vec4(color, 1.0);
+}
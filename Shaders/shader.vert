@@ -7,6 +7,16 @@ out gl_PerVertex {
 
 layout(location = 0) out vec3 fragColor;
 
+// Specialization constants, see ShaderVariant in vulkan.cpp
+layout(constant_id = 0) const float SCALE = 1.0;
+layout(constant_id = 1) const bool FLIP_Y = false;
+
+// Maps the full image onto the rendered tile, identity for on-screen frames
+layout(push_constant) uniform TileTransform {
+    vec2 scale;
+    vec2 offset;
+} tile;
+
 vec2 positions[3] = vec2[](
     vec2(0.0, -0.5),
     vec2(0.5, 0.5),
@@ -20,6 +30,10 @@ vec3 colors[3] = vec3[](
 );
 
 void main() {
-    gl_Position = vec4(positions[gl_VertexIndex], 0.0, 1.0);
+    vec2 position = positions[gl_VertexIndex] * SCALE;
+    if (FLIP_Y) {
+        position.y = -position.y;
+    }
+    gl_Position = vec4(position * tile.scale + tile.offset, 0.0, 1.0);
     fragColor = colors[gl_VertexIndex];
-}
\ No newline at end of file
+}
@@ -0,0 +1,12 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+layout(input_attachment_index = 0, set = 0, binding = 0) uniform subpassInput gbuffer;
+
+layout(location = 0) out vec4 outColor;
+
+// Red and green swap places, so a target written without the input attachment doesn't match
+void main() {
+    vec4 color = subpassLoad(gbuffer);
+    outColor = vec4(color.g, color.r, 1.0, color.a);
+}
@@ -0,0 +1,9 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+layout(location = 0) out vec4 outColor;
+
+// Pixel coordinates in red and green, exact in an 8 bit UNORM target up to 256x256
+void main() {
+    outColor = vec4(floor(gl_FragCoord.xy) / 255.0, 0.0, 1.0);
+}
@@ -1,4 +1,9 @@
-#define VK_FUNCTION( fun ) PFN_##fun fun;
+// Defined once by the translation unit that sets VK_DEFINE_FUNCTIONS, declared everywhere else
+#ifdef VK_DEFINE_FUNCTIONS
+    #define VK_FUNCTION( fun ) PFN_##fun fun;
+#else
+    #define VK_FUNCTION( fun ) extern PFN_##fun fun;
+#endif
 VK_FUNCTION(vkGetInstanceProcAddr)
 VK_FUNCTION(vkGetDeviceProcAddr)
 VK_FUNCTION(vkEnumerateInstanceLayerProperties)
@@ -30,11 +35,13 @@ VK_FUNCTION(vkCreateImageView)
 VK_FUNCTION(vkCreateShaderModule)
 VK_FUNCTION(vkCreateCommandPool)
 VK_FUNCTION(vkAllocateCommandBuffers)
+VK_FUNCTION(vkFreeCommandBuffers)
 VK_FUNCTION(vkBeginCommandBuffer)
 VK_FUNCTION(vkCmdBeginRenderPass)
 VK_FUNCTION(vkCmdBindPipeline)
 VK_FUNCTION(vkCmdDraw)
 VK_FUNCTION(vkCmdEndRenderPass)
+VK_FUNCTION(vkCmdNextSubpass)
 VK_FUNCTION(vkEndCommandBuffer)
 VK_FUNCTION(vkCreateFramebuffer)
 VK_FUNCTION(vkCreateSemaphore)
@@ -54,4 +61,53 @@ VK_FUNCTION(vkDestroyDevice)
 VK_FUNCTION(vkDestroySurfaceKHR)
 VK_FUNCTION(vkDestroyInstance)
 VK_FUNCTION(vkDestroySemaphore)
-VK_FUNCTION(vkDestroyFramebuffer)
\ No newline at end of file
+VK_FUNCTION(vkDestroyFramebuffer)
+VK_FUNCTION(vkCreateImage)
+VK_FUNCTION(vkGetImageMemoryRequirements)
+VK_FUNCTION(vkBindImageMemory)
+VK_FUNCTION(vkCreateBuffer)
+VK_FUNCTION(vkGetBufferMemoryRequirements)
+VK_FUNCTION(vkBindBufferMemory)
+VK_FUNCTION(vkAllocateMemory)
+VK_FUNCTION(vkMapMemory)
+VK_FUNCTION(vkUnmapMemory)
+VK_FUNCTION(vkCmdPushConstants)
+VK_FUNCTION(vkCmdPipelineBarrier)
+VK_FUNCTION(vkCmdCopyImageToBuffer)
+VK_FUNCTION(vkResetCommandBuffer)
+VK_FUNCTION(vkCreateFence)
+VK_FUNCTION(vkWaitForFences)
+VK_FUNCTION(vkResetFences)
+VK_FUNCTION(vkDestroyFence)
+VK_FUNCTION(vkDestroyBuffer)
+VK_FUNCTION(vkDestroyImage)
+VK_FUNCTION(vkFreeMemory)
+VK_FUNCTION(vkInvalidateMappedMemoryRanges)
+VK_FUNCTION(vkGetPhysicalDeviceFormatProperties)
+VK_FUNCTION(vkCreateQueryPool)
+VK_FUNCTION(vkCmdResetQueryPool)
+VK_FUNCTION(vkCmdWriteTimestamp)
+VK_FUNCTION(vkGetQueryPoolResults)
+VK_FUNCTION(vkDestroyQueryPool)
+VK_FUNCTION(vkGetFenceStatus)
+VK_FUNCTION(vkDestroyDescriptorPool)
+VK_FUNCTION(vkCreateDescriptorSetLayout)
+VK_FUNCTION(vkDestroyDescriptorSetLayout)
+VK_FUNCTION(vkCreateDescriptorPool)
+VK_FUNCTION(vkAllocateDescriptorSets)
+VK_FUNCTION(vkUpdateDescriptorSets)
+VK_FUNCTION(vkCreateComputePipelines)
+VK_FUNCTION(vkCmdBindDescriptorSets)
+VK_FUNCTION(vkCmdDispatch)
+VK_FUNCTION(vkCmdCopyBuffer)
+VK_FUNCTION(vkFlushMappedMemoryRanges)
+VK_FUNCTION(vkCmdBlitImage)
+VK_FUNCTION(vkCmdCopyBufferToImage)
+VK_FUNCTION(vkCmdCopyImage)
+VK_FUNCTION(vkCmdClearColorImage)
+VK_FUNCTION(vkCmdSetViewport)
+VK_FUNCTION(vkCmdSetScissor)
+#ifdef VK_KHR_timeline_semaphore
+    VK_FUNCTION(vkGetSemaphoreCounterValueKHR)
+    VK_FUNCTION(vkWaitSemaphoresKHR)
+#endif
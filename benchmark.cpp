@@ -0,0 +1,29 @@
+#include "Renderer.h"
+
+// Same as the app with --benchmark, renders offscreen unless --target window is given
+int main(int argc, char* argv[])
+{
+    if (!load_vulkan_library()) {
+        return 1;
+    }
+
+    BenchmarkOptions options;
+    parse_benchmark_options(argc, argv, options);
+    if (!options.offscreen) {
+        create_window();
+    }
+    const auto enabledLayerNames = get_enabled_layers();
+
+    auto instance = init_vulkan_instance(enabledLayerNames);
+    auto gpu = find_phisical_device(instance);
+    if (options.offscreen) {
+        run_offscreen_benchmark(instance, gpu, enabledLayerNames, options);
+    } else {
+        run_windowed(instance, gpu, enabledLayerNames, argc, argv, &options);
+    }
+
+    VK_LOAD_INSTANCE_FUNCTION(instance , vkDestroyInstance);
+    vkDestroyInstance( instance, nullptr );
+    unload_vulkan_library();
+    return 0;
+}
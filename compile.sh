@@ -1,6 +1,5 @@
 #!/bin/bash
-#Compile app
-g++ -ldl -lglfw -D USE_GLFW -D ENABLED_DEBUG vulkan.cpp -o vulkan 
-#Compile shaders
-/home/maria/Downloads/VulkanSDK/1.0.54.0/x86_64/bin/glslangValidator -V Shaders/shader.vert 
-/home/maria/Downloads/VulkanSDK/1.0.54.0/x86_64/bin/glslangValidator -V Shaders/shader.frag
+# Usage: ./compile.sh [Release|Debug] [extra cmake options]
+# glslangValidator and vulkan/vulkan.h are looked up in $VULKAN_SDK or the system paths
+BUILD_TYPE=${1:-Release}
+mkdir -p build && cd build && cmake .. -DCMAKE_BUILD_TYPE=$BUILD_TYPE "${@:2}" && cmake --build . -- -j"$(nproc)"
@@ -0,0 +1,93 @@
+#include "Renderer.h"
+
+int main(int argc, char* argv[])
+{
+	printf("\t\t######START######\n");
+    if (!load_vulkan_library()) {
+        return 0;
+    }
+
+    TiledRenderOptions tiledOptions;
+    BenchmarkOptions benchmarkOptions;
+    ComputeBatchOptions computeOptions;
+    TextureStreamingRun streamingOptions;
+    SceneLoadOptions sceneOptions;
+    std::string reloadDirectory;
+    const bool reloadTest = parse_reload_test_option(argc, argv, reloadDirectory);
+    const bool subpassTest = parse_subpass_test_option(argc, argv);
+    const bool graphTest = parse_graph_test_option(argc, argv);
+    const bool sceneLoad = parse_scene_load_options(argc, argv, sceneOptions);
+    const bool streaming = parse_texture_streaming_options(argc, argv, streamingOptions);
+    const bool compute = parse_compute_options(argc, argv, computeOptions);
+    const bool tiled = parse_tiled_options(argc, argv, tiledOptions);
+    const bool benchmark = parse_benchmark_options(argc, argv, benchmarkOptions);
+    const uint32_t windowCount = parse_window_count_option(argc, argv);
+    const bool deviceBaseline = parse_device_baseline_option(argc, argv);
+    const bool offscreen = graphTest || subpassTest || reloadTest || sceneLoad || streaming || compute || tiled || (benchmark && benchmarkOptions.offscreen);
+    const auto enabledLayerNames = get_enabled_layers();
+
+    // The window and the instance don't depend on each other, nor does the informational enumeration
+    StartupGraph startup;
+    VkInstance instance = VK_NULL_HANDLE;
+    VkPhysicalDevice gpu = VK_NULL_HANDLE;
+    if (!offscreen) {
+        add_startup_task(startup, "window", create_window, {}, true);
+    }
+    auto instanceTask = add_startup_task(startup, "instance", [&]() {
+        instance = init_vulkan_instance(enabledLayerNames);
+    });
+    add_startup_task(startup, "physical device", [&]() {
+        gpu = find_phisical_device(instance);
+    }, {instanceTask});
+    // Runs next to the physical device task, its listing is printed once both are done
+    std::string enumeration;
+    if (!parse_skip_enumeration_option(argc, argv)) {
+        add_startup_task(startup, "enumeration", [&]() {
+            enumeration = available_layers_and_extensions();
+        }, {instanceTask});
+    }
+
+    bool succeeded = true;
+    try {
+        run_startup_graph(startup);
+        printf("%s", enumeration.c_str());
+        print_startup_graph(startup);
+        // Printed before the mode's own device, whose creation time is reported as it is created
+        if (deviceBaseline) {
+            time_device_creation_baseline(instance, gpu, enabledLayerNames);
+        }
+        if (graphTest) {
+            succeeded = run_render_graph_test(instance, gpu, enabledLayerNames);
+        } else if (subpassTest) {
+            succeeded = run_subpass_test(instance, gpu, enabledLayerNames);
+        } else if (reloadTest) {
+            succeeded = run_hot_reload_test(instance, gpu, enabledLayerNames, reloadDirectory);
+        } else if (sceneLoad) {
+            succeeded = run_scene_load(instance, gpu, enabledLayerNames, sceneOptions);
+        } else if (streaming) {
+            succeeded = run_texture_streaming(instance, gpu, enabledLayerNames, streamingOptions);
+        } else if (compute) {
+            succeeded = run_compute_batch(instance, gpu, enabledLayerNames, computeOptions);
+        } else if (tiled) {
+            render_tiled(instance, gpu, enabledLayerNames, tiledOptions);
+        } else if (offscreen) {
+            run_offscreen_benchmark(instance, gpu, enabledLayerNames, benchmarkOptions);
+        } else if (!benchmark && windowCount > 1) {
+            run_multi_window(instance, gpu, enabledLayerNames, argc, argv, windowCount);
+        } else {
+            run_windowed(instance, gpu, enabledLayerNames, argc, argv, benchmark ? &benchmarkOptions : nullptr);
+        }
+    } catch (const std::runtime_error& e) {
+        // Device objects are gone with the process, the instance and library are still released
+        printf("Rendering stopped: %s\n", e.what());
+        succeeded = false;
+    }
+
+    if( instance != VK_NULL_HANDLE ) {
+	  VK_LOAD_INSTANCE_FUNCTION(instance , vkDestroyInstance);
+      vkDestroyInstance( instance, nullptr );
+    }
+    unload_vulkan_library();
+	printf("\t\t######FINISH######\n");
+    return succeeded ? 0 : 1;
+}
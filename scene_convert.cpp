@@ -0,0 +1,33 @@
+#include "Renderer.h"
+
+// Writes the binary scene format read by --scene, from an OBJ file or generated grids
+int main(int argc, char* argv[])
+{
+    std::vector<const char*> files;
+    uint64_t generateMegabytes = 0;
+    uint32_t instances = 1;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--generate") && i + 1 < argc) {
+            generateMegabytes = strtoull(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "--instances") && i + 1 < argc) {
+            instances = std::max(1ul, strtoul(argv[++i], nullptr, 10));
+        } else {
+            files.push_back(argv[i]);
+        }
+    }
+    if (generateMegabytes && files.size() == 1) {
+        return generate_scene_file(files[0], generateMegabytes) ? 0 : 1;
+    }
+    if (generateMegabytes || files.size() != 2) {
+        printf("Usage: %s INPUT.obj OUTPUT.vksc [--instances N]\n"
+               "       %s --generate MB OUTPUT.vksc\n", argv[0], argv[0]);
+        return 1;
+    }
+
+    SceneData scene;
+    if (!convert_obj_scene(files[0], scene)) {
+        return 1;
+    }
+    add_grid_instances(scene, instances);
+    return write_scene_file(files[1], scene) ? 0 : 1;
+}
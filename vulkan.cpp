@@ -1,88 +1,39 @@
-#include <dlfcn.h>
-#include <stdio.h>
-#include <map>
-#include <vector>
-#include <algorithm>
-#include <limits>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <unistd.h>
-
-#define VK_NO_PROTOTYPES
-#ifdef USE_GLFW
-	#define VK_USE_PLATFORM_XLIB_KHR
-	#define GLFW_INCLUDE_VULKAN
-	#define GLFW_EXPOSE_NATIVE_X11
-	#include <GLFW/glfw3.h>
-	#include <GLFW/glfw3native.h>
-#elif defined(USE_XCB)
-	#define VK_USE_PLATFORM_XCB_KHR
-	#include <xcb/xcb.h>
-#elif defined(USE_XLIB)
-	#define VK_USE_PLATFORM_XLIB_KHR
-	#include <X11/Xlib.h>
-#endif
-
-#include <vulkan/vulkan.h>
-#include "VulkanFunctions.h"
+#define VK_DEFINE_FUNCTIONS
+#include "Renderer.h"
 
 void* VULKAN_LIBRARY;
-#if defined(VK_USE_PLATFORM_WIN32_KHR)
-    #define LoadProcAddress GetProcAddress
-#elif defined(VK_USE_PLATFORM_XCB_KHR) || defined(VK_USE_PLATFORM_XLIB_KHR)
-    #define LoadProcAddress dlsym
-#endif
-
-#define VK_EXPORTED_FUNCTION( fun )                                     \
-    if( !(fun = (PFN_##fun)LoadProcAddress( VULKAN_LIBRARY, #fun )) ) { \
-      printf("Could not load exported function: %s!\n", #fun);          \
-      return false;                                                     \
-    }
-
-//use only AFTER VK_EXPORTED_FUNCTION( vkGetInstanceProcAddr )
-#define VK_LOAD_INSTANCE_FUNCTION( source, fun ) \
-	if (!(fun = (PFN_##fun)vkGetInstanceProcAddr( source, #fun ))) {  \
-		printf("Could not load function: %s!\n", #fun);               \
-		throw VulkanException("Loading func error");		          \
-	}
-
-//use only AFTER VK_LOAD_INSTANCE_FUNCTION( vkGetDeviceProcAddr )
-#define VK_LOAD_DEVICE_FUNCTION( source, fun ) \
-	if (!(fun = (PFN_##fun)vkGetDeviceProcAddr( source, #fun ))) {	 \
-		printf("Could not load function: %s!\n", #fun);              \
-		throw VulkanException("Loading func error");			     \
-	}
-
-#define VK_DESTROY_INSTANCE_FUNCTION ( source, obj, fun ) \
-    if ( obj != VK_NULL_HANDLE) {                         \
-        VK_LOAD_INSTANCE_FUNCTION(instance , fun);        \
-        fun(source, obj, nullptr);                        \
-    }
-
-#define VK_DESTROY_DEVICE_FUNCTION ( source, obj, fun ) \
-    if ( obj != VK_NULL_HANDLE) {                       \
-        VK_LOAD_DEVICE_FUNCTION(instance , fun);        \
-        fun(source, obj, nullptr);                      \
-    }
+// Static initialization runs before main, so startup timings include the whole process
+const std::chrono::steady_clock::time_point startupTime = std::chrono::steady_clock::now();
 
+const int WIDTH = 800;
+const int HEIGHT = 600;
 #ifdef USE_GLFW
 	GLFWwindow* window;
-	const int WIDTH = 800;
-	const int HEIGHT = 600;
 #elif defined(USE_XCB)
 	xcb_connection_t *c;
 	xcb_screen_t *screen;
-	xcb_drawable_t window;
-	xcb_gcontext_t foreground;
-	xcb_gcontext_t background;
-	xcb_generic_event_t *e;
-	uint32_t mask = 0;
-	uint32_t values[2];
+	xcb_window_t window;
+	xcb_atom_t wmProtocolsAtom;
+	xcb_atom_t deleteWindowAtom;
+	// Key presses close the window, the rest only invalidates what is shown
+	const uint32_t windowEventMask = XCB_EVENT_MASK_EXPOSURE | XCB_EVENT_MASK_KEY_PRESS |
+		XCB_EVENT_MASK_STRUCTURE_NOTIFY | XCB_EVENT_MASK_FOCUS_CHANGE;
 #elif defined(USE_XLIB)
 	Display *display;
 	Window window;
-	XEvent e;
+	Atom deleteWindowAtom;
 	int s;
+	const long windowEventMask = ExposureMask | KeyPressMask | StructureNotifyMask | FocusChangeMask;
+#endif
+
+#ifdef USE_XCB
+xcb_atom_t intern_atom(const char* name)
+{
+    auto reply = xcb_intern_atom_reply(c, xcb_intern_atom(c, 0, strlen(name), name), nullptr);
+    const xcb_atom_t atom = reply ? reply->atom : XCB_ATOM_NONE;
+    free(reply);
+    return atom;
+}
 #endif
 
 void create_window()
@@ -93,25 +44,20 @@ void create_window()
     glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
     window = glfwCreateWindow(WIDTH, HEIGHT, "Vulkan", nullptr, nullptr);
 #elif defined(USE_XCB)
-	c = xcb_connect (NULL, NULL);
-    screen = xcb_setup_roots_iterator (xcb_get_setup (c)).data;
-    window = screen->root;
-    window = xcb_generate_id(c);
-    mask = XCB_CW_BACK_PIXEL | XCB_CW_EVENT_MASK;
-    values[0] = screen->white_pixel;
-    values[1] = XCB_EVENT_MASK_EXPOSURE | XCB_EVENT_MASK_KEY_PRESS;
-    xcb_create_window (c,                              /* connection    */
-                    //  XCB_COPY_FROM_PARENT,          /* depth         */
-                    //  window,                        /* window Id     */
-                    //  screen->root,                  /* parent window */
-                    //  0, 0,                          /* x, y          */
-                    //  150, 150,                      /* width, height */
-                    //  10,                            /* border_width  */
-                    //  XCB_WINDOW_CLASS_INPUT_OUTPUT, /* class         */
-                    //  screen->root_visual,           /* visual        */
-                    //  mask, values);                 /* masks         */
-    xcb_map_window(c, window);
-    xcb_flush(c);
+    int screenNumber = 0;
+	c = xcb_connect(NULL, &screenNumber);
+    if (xcb_connection_has_error(c)) {
+        fprintf(stderr, "Cannot open display\n");
+        exit(1);
+    }
+    auto roots = xcb_setup_roots_iterator(xcb_get_setup(c));
+    for (int i = 0; i < screenNumber; ++i) {
+        xcb_screen_next(&roots);
+    }
+    screen = roots.data;
+    wmProtocolsAtom = intern_atom("WM_PROTOCOLS");
+    deleteWindowAtom = intern_atom("WM_DELETE_WINDOW");
+    window = create_output_window("Vulkan", WIDTH, HEIGHT);
 #elif defined(USE_XLIB)
     display = XOpenDisplay(NULL);
     if (display == NULL) {
@@ -119,123 +65,434 @@ void create_window()
         exit(1);
     }
     s = DefaultScreen(display);
-    window = XCreateSimpleWindow(display, RootWindow(display, s), 10, 10, 100, 100, 1,
-                           BlackPixel(display, s), WhitePixel(display, s));
-    XSelectInput(display, window, ExposureMask | KeyPressMask);
-    XMapWindow(display, window);
+    deleteWindowAtom = XInternAtom(display, "WM_DELETE_WINDOW", False);
+    window = create_output_window("Vulkan", WIDTH, HEIGHT);
 #endif
 }
 
-static
-std::map<char, std::string> vk_return_codes =
-{
-    {0, "VK_SUCCESS"},
-    {1, "VK_NOT_READY"},
-    {2, "VK_TIMEOUT"},
-    {3, "VK_EVENT_SET"},
-    {4, "VK_EVENT_RESET"},
-    {5, "VK_INCOMPLETE"},
-    {-1, "VK_ERROR_OUT_OF_HOST_MEMORY"},
-    {-2, "VK_ERROR_OUT_OF_DEVICE_MEMORY"},
-    {-3, "VK_ERROR_INITIALIZATION_FAILED"},
-    {-4, "VK_ERROR_DEVICE_LOST"},
-    {-5, "VK_ERROR_MEMORY_MAP_FAILED"},
-    {-6, "VK_ERROR_LAYER_NOT_PRESENT"},
-    {-7, "VK_ERROR_EXTENSION_NOT_PRESENT"},
-    {-8, "VK_ERROR_FEATURE_NOT_PRESENT"},
-    {-9, "VK_ERROR_INCOMPATIBLE_DRIVER"},
-    {-10, "VK_ERROR_TOO_MANY_OBJECTS"},
-    {-11, "VK_ERROR_FORMAT_NOT_SUPPORTED"},
-    {-12, "VK_ERROR_FRAGMENTED_POOL"}
-};
+void destroy_window()
+{
+#ifdef USE_GLFW
+	/*GLFW Window main termination*/
+    glfwDestroyWindow(window);
+    glfwTerminate();
+#elif defined(USE_XCB)
+    xcb_destroy_window(c, window);
+    xcb_disconnect(c);
+#elif defined(USE_XLIB)
+    XDestroyWindow(display, window);
+    XCloseDisplay(display);
+#endif
+}
 
-class VulkanException : std::runtime_error
+NativeWindow create_output_window(const char* title, uint32_t width, uint32_t height)
 {
-public:
-	template <typename T>
-	explicit VulkanException(const T arg) : std::runtime_error(arg)
-	{}
-};
+#ifdef USE_GLFW
+    glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
+    glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
+    return glfwCreateWindow(width, height, title, nullptr, nullptr);
+#elif defined(USE_XCB)
+    xcb_window_t output = xcb_generate_id(c);
+    const uint32_t outputValues[2] = {screen->white_pixel, windowEventMask};
+    xcb_create_window(c, XCB_COPY_FROM_PARENT, output, screen->root, 0, 0, width, height, 0,
+        XCB_WINDOW_CLASS_INPUT_OUTPUT, screen->root_visual, XCB_CW_BACK_PIXEL | XCB_CW_EVENT_MASK, outputValues);
+    xcb_change_property(c, XCB_PROP_MODE_REPLACE, output, XCB_ATOM_WM_NAME, XCB_ATOM_STRING, 8, strlen(title), title);
+    // The window manager's close button sends a client message instead of killing the connection
+    xcb_change_property(c, XCB_PROP_MODE_REPLACE, output, wmProtocolsAtom, XCB_ATOM_ATOM, 32, 1, &deleteWindowAtom);
+    xcb_map_window(c, output);
+    xcb_flush(c);
+    return output;
+#elif defined(USE_XLIB)
+    Window output = XCreateSimpleWindow(display, RootWindow(display, s), 0, 0, width, height, 1,
+        BlackPixel(display, s), WhitePixel(display, s));
+    XStoreName(display, output, title);
+    XSelectInput(display, output, windowEventMask);
+    XSetWMProtocols(display, output, &deleteWindowAtom, 1);
+    XMapWindow(display, output);
+    XFlush(display);
+    return output;
+#endif
+}
 
-void vkCheckResult(const char code)
+void destroy_output_window(NativeWindow output)
 {
-	if (code) {
-		const char* const code_str = vk_return_codes[code].c_str();
-		printf("Return code: %d - %s\n", code, code_str);
-		throw(VulkanException(code_str));
-	}
+#ifdef USE_GLFW
+    glfwDestroyWindow(output);
+#elif defined(USE_XCB)
+    xcb_destroy_window(c, output);
+    xcb_flush(c);
+#elif defined(USE_XLIB)
+    XDestroyWindow(display, output);
+    XFlush(display);
+#endif
+}
+
+#if defined(USE_XCB) || defined(USE_XLIB)
+/*Takes one queued event without blocking. close is set for key presses and
+the window manager's close request, dirty for anything that invalidates the
+presented image*/
+bool next_window_event(NativeWindow& target, bool& close, bool& dirty)
+{
+#ifdef USE_XCB
+    xcb_generic_event_t* event = xcb_poll_for_event(c);
+    if (!event) {
+        return false;
+    }
+    target = XCB_WINDOW_NONE;
+    close = false;
+    dirty = false;
+    switch (event->response_type & ~0x80) {
+        case XCB_EXPOSE:
+            target = reinterpret_cast<xcb_expose_event_t*>(event)->window;
+            dirty = true;
+            break;
+        case XCB_CONFIGURE_NOTIFY:
+            target = reinterpret_cast<xcb_configure_notify_event_t*>(event)->window;
+            dirty = true;
+            break;
+        case XCB_FOCUS_IN:
+            target = reinterpret_cast<xcb_focus_in_event_t*>(event)->event;
+            dirty = true;
+            break;
+        case XCB_KEY_PRESS:
+            target = reinterpret_cast<xcb_key_press_event_t*>(event)->event;
+            close = true;
+            break;
+        case XCB_CLIENT_MESSAGE: {
+            auto message = reinterpret_cast<xcb_client_message_event_t*>(event);
+            target = message->window;
+            close = message->data.data32[0] == deleteWindowAtom;
+            break;
+        }
+    }
+    free(event);
+    return true;
+#else
+    // XPending flushes and reads without blocking, XNextEvent then only takes from the queue
+    if (!XPending(display)) {
+        return false;
+    }
+    XEvent event;
+    XNextEvent(display, &event);
+    target = event.xany.window;
+    dirty = event.type == Expose || event.type == ConfigureNotify || event.type == FocusIn;
+    close = event.type == KeyPress ||
+        (event.type == ClientMessage && static_cast<Atom>(event.xclient.data.l[0]) == deleteWindowAtom);
+    return true;
+#endif
+}
+
+// Sleeps until the connection has input or timeoutMs passed, the event queue has to be drained first
+void wait_for_window_events(double timeoutMs)
+{
+#ifdef USE_XCB
+    xcb_flush(c);
+    pollfd connection = {xcb_get_file_descriptor(c), POLLIN, 0};
+#else
+    XFlush(display);
+    pollfd connection = {ConnectionNumber(display), POLLIN, 0};
+#endif
+    poll(&connection, 1, static_cast<int>(std::ceil(timeoutMs)));
+}
+#endif
+
+// Dispatches queued events, waiting up to timeoutMs when there are none. False once the window should close
+bool pump_window_events(FramePacer& pacer, double timeoutMs)
+{
+#ifdef USE_GLFW
+    if (timeoutMs > 0.0) {
+        glfwWaitEventsTimeout(timeoutMs / 1000.0);
+    } else {
+        glfwPollEvents();
+    }
+    return !glfwWindowShouldClose(window);
+#else
+    bool open = true;
+    auto dispatch = [&]() {
+        NativeWindow target;
+        bool close;
+        bool dirty;
+        bool received = false;
+        while (next_window_event(target, close, dirty)) {
+            received = true;
+            open = open && !close;
+            if (dirty) {
+                pacer_mark_dirty(pacer);
+            }
+        }
+        return received;
+    };
+    if (!dispatch() && timeoutMs > 0.0) {
+        wait_for_window_events(timeoutMs);
+        dispatch();
+    }
+#ifdef USE_XCB
+    // A lost connection is never reported as an event
+    open = open && !xcb_connection_has_error(c);
+#endif
+    return open;
+#endif
+}
+
+void vkThrowResult(VkResult result)
+{
+    char message[96];
+    snprintf(message, sizeof(message), "%s (%d)", vk_result_string(result), static_cast<int>(result));
+    printf("Return code: %s\n", message);
+    throw VulkanException(message, result);
+}
+
+void parse_pacing_options(int argc, char* argv[], FramePacingOptions& options)
+{
+    options.targetFps = 0.0;
+    options.idle = false;
+    options.idleTimeoutMs = 100.0;
+    options.frameLimit = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--fps") && i + 1 < argc) {
+            options.targetFps = std::max(0.0, atof(argv[++i]));
+        } else if (!strcmp(argv[i], "--idle")) {
+            options.idle = true;
+        } else if (!strcmp(argv[i], "--frames") && i + 1 < argc) {
+            options.frameLimit = strtoull(argv[++i], nullptr, 10);
+        }
+    }
+}
+
+FramePacer create_frame_pacer(const FramePacingOptions& options)
+{
+    FramePacer pacer;
+    pacer.options = options;
+    pacer.period = std::chrono::steady_clock::duration::zero();
+    if (options.targetFps > 0.0) {
+        pacer.period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(1.0 / options.targetFps));
+    }
+    pacer.deadline = std::chrono::steady_clock::now() + pacer.period;
+    pacer.frameStart = pacer.deadline;
+    pacer.cpuMs = 0.0;
+    pacer.gpuMs = 0.0;
+    pacer.oversleepMs = 0.5;
+    // The first frame has to be drawn even when idle
+    pacer.dirty = true;
+    pacer.frames = 0;
+    pacer.idleSkips = 0;
+    pacer.missed = 0;
+    return pacer;
+}
+
+void pacer_mark_dirty(FramePacer& pacer)
+{
+    pacer.dirty = true;
+}
+
+bool pacer_should_render(FramePacer& pacer)
+{
+    if (!pacer.options.idle || pacer.dirty) {
+        pacer.dirty = false;
+        return true;
+    }
+    ++pacer.idleSkips;
+    return false;
+}
+
+void pacer_begin_frame(FramePacer& pacer)
+{
+    using namespace std::chrono;
+    if (pacer.period == steady_clock::duration::zero()) {
+        pacer.frameStart = steady_clock::now();
+        return;
+    }
+    // After a long idle stretch the old deadline is meaningless, restart from now
+    auto now = steady_clock::now();
+    if (pacer.deadline < now) {
+        pacer.deadline = now + pacer.period;
+    }
+    const double workMs = std::min(pacer.cpuMs + pacer.gpuMs,
+        duration<double, std::milli>(pacer.period).count());
+    const auto wake = pacer.deadline - duration_cast<steady_clock::duration>(duration<double, std::milli>(workMs));
+    // Sleep is cheap but coarse, only the last stretch is spun
+    const auto sleepUntil = wake - duration_cast<steady_clock::duration>(
+        duration<double, std::milli>(2.0 * pacer.oversleepMs));
+    if (sleepUntil > now) {
+        std::this_thread::sleep_until(sleepUntil);
+        const double oversleep = duration<double, std::milli>(steady_clock::now() - sleepUntil).count();
+        pacer.oversleepMs += 0.1 * (std::max(0.0, oversleep) - pacer.oversleepMs);
+    }
+    while (steady_clock::now() < wake) {
+        std::this_thread::yield();
+    }
+    pacer.frameStart = steady_clock::now();
+}
+
+void pacer_end_frame(FramePacer& pacer, double gpuWaitMs)
+{
+    using namespace std::chrono;
+    const auto now = steady_clock::now();
+    const double frameMs = duration<double, std::milli>(now - pacer.frameStart).count();
+    pacer.cpuMs += 0.1 * (std::max(0.0, frameMs - gpuWaitMs) - pacer.cpuMs);
+    pacer.gpuMs += 0.1 * (gpuWaitMs - pacer.gpuMs);
+    ++pacer.frames;
+    if (pacer.period == steady_clock::duration::zero()) {
+        return;
+    }
+    if (now > pacer.deadline) {
+        ++pacer.missed;
+    }
+    pacer.deadline += pacer.period;
+    // Resynchronize rather than rendering a burst of frames to catch up
+    if (pacer.deadline < now) {
+        pacer.deadline = now + pacer.period;
+    }
+}
+
+void print_pacing_statistics(const FramePacer& pacer)
+{
+    printf("---Frame pacing: %llu frames, %llu idle skips, %llu missed deadlines\n",
+        static_cast<unsigned long long>(pacer.frames), static_cast<unsigned long long>(pacer.idleSkips),
+        static_cast<unsigned long long>(pacer.missed));
+    printf("\tCPU %.2f ms, GPU wait %.2f ms, oversleep %.2f ms per frame\n", pacer.cpuMs, pacer.gpuMs, pacer.oversleepMs);
 }
 
 void window_main_loop(VkDevice& logical_device, VkSwapchainKHR& swapChain,
-    VkSemaphore& imageAvailableSemaphore,
-    VkSemaphore& renderFinishedSemaphore,
+    FrameScheduler& scheduler,
+    DeletionQueue& deletionQueue,
     std::vector<VkCommandBuffer>& commandBuffers,
-    VkQueue& graphicsQueue,
-    VkQueue& presentQueue)
+    VkQueue& presentQueue,
+    FramePacer& pacer,
+    const WindowLoopHooks& hooks)
 {
     VK_LOAD_DEVICE_FUNCTION(logical_device, vkAcquireNextImageKHR)
-    VK_LOAD_DEVICE_FUNCTION(logical_device, vkQueueSubmit)
     VK_LOAD_DEVICE_FUNCTION(logical_device, vkQueuePresentKHR)
-    VK_LOAD_DEVICE_FUNCTION(logical_device, vkDeviceWaitIdle)
-    VK_LOAD_DEVICE_FUNCTION(logical_device, vkQueueWaitIdle)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkCreateSemaphore)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkDestroySemaphore)
+    // Acquire and present only take binary semaphores, one pair per frame in flight
+    struct FrameSync
+    {
+        VkSemaphore imageAvailable;
+        VkSemaphore renderFinished;
+        uint64_t submitted;
+    };
+    const uint32_t framesInFlight = 2;
+    std::vector<FrameSync> frames(framesInFlight);
+    VkSemaphoreCreateInfo semaphoreInfo = {};
+    semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    for (auto& sync : frames) {
+        vkCheckResult(vkCreateSemaphore(logical_device, &semaphoreInfo, nullptr, &sync.imageAvailable));
+        vkCheckResult(vkCreateSemaphore(logical_device, &semaphoreInfo, nullptr, &sync.renderFinished));
+        sync.submitted = 0;
+    }
+    // Frames in flight and swapchain images are independent counts, an image can come back
+    // from acquire while the submission that last recorded into its command buffer still runs
+    std::vector<uint64_t> imageSubmitted(commandBuffers.size(), 0);
+    ScheduledSubmit submit;
+    submit.commandBuffers.resize(1);
+    submit.binaryWaits.resize(1);
+    submit.binaryWaitStages = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
+    submit.binarySignals.resize(1);
 #ifdef USE_GLFW
-    while (!glfwWindowShouldClose(window)) {
-        glfwPollEvents();
-        vkQueueWaitIdle(presentQueue);
+    // Anything that invalidates the presented image ends idling
+    glfwSetWindowUserPointer(window, &pacer);
+    glfwSetWindowRefreshCallback(window, [](GLFWwindow* w) {
+        pacer_mark_dirty(*static_cast<FramePacer*>(glfwGetWindowUserPointer(w)));
+    });
+    glfwSetWindowFocusCallback(window, [](GLFWwindow* w, int) {
+        pacer_mark_dirty(*static_cast<FramePacer*>(glfwGetWindowUserPointer(w)));
+    });
+    glfwSetWindowIconifyCallback(window, [](GLFWwindow* w, int) {
+        pacer_mark_dirty(*static_cast<FramePacer*>(glfwGetWindowUserPointer(w)));
+    });
+#endif
+    uint32_t frame = 0;
+    bool deviceLost = false;
+    while (pump_window_events(pacer, pacer.options.idle && !pacer.dirty ? pacer.options.idleTimeoutMs : 0.0)) {
+        if (pacer.options.frameLimit && pacer.frames >= pacer.options.frameLimit) {
+            break;
+        }
+        if (hooks.frameBoundary && hooks.frameBoundary()) {
+            pacer_mark_dirty(pacer);
+        }
+        collect_deletion_queue(deletionQueue);
+        if (!pacer_should_render(pacer)) {
+            continue;
+        }
+        pacer_begin_frame(pacer);
+        auto& sync = frames[frame % framesInFlight];
+        // Only the submission that last used these semaphores has to be done, not the whole queue
+        auto waitStart = std::chrono::steady_clock::now();
+        scheduler_wait(scheduler, SCHEDULER_GRAPHICS, sync.submitted);
+        double gpuWaitMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - waitStart).count();
         uint32_t imageIndex;
-        vkAcquireNextImageKHR(logical_device, swapChain, std::numeric_limits<uint64_t>::max(), imageAvailableSemaphore, VK_NULL_HANDLE, &imageIndex);
+        auto acquired = vkCheckRecoverable(vkAcquireNextImageKHR(logical_device, swapChain,
+            std::numeric_limits<uint64_t>::max(), sync.imageAvailable, VK_NULL_HANDLE, &imageIndex));
+        // Nothing was acquired and imageAvailable stays unsignaled, so the frame can simply be dropped
+        if (acquired == RESULT_RETRY) {
+            pacer_mark_dirty(pacer);
+            continue;
+        }
+        if (acquired == RESULT_RECREATE_SWAPCHAIN) {
+            scheduler_wait_idle(scheduler);
+            hooks.recreateSwapchain();
+            pacer_mark_dirty(pacer);
+            continue;
+        }
+        if (acquired == RESULT_DEVICE_LOST) {
+            deviceLost = true;
+            break;
+        }
+        // Recreation waits for the queue to go idle, so nothing recorded before it is pending
+        if (imageSubmitted.size() != commandBuffers.size()) {
+            imageSubmitted.assign(commandBuffers.size(), 0);
+        }
+        waitStart = std::chrono::steady_clock::now();
+        scheduler_wait(scheduler, SCHEDULER_GRAPHICS, imageSubmitted[imageIndex]);
+        gpuWaitMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - waitStart).count();
 
-        VkSubmitInfo submitInfo = {};
-        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-        VkSemaphore waitSemaphores[] = {imageAvailableSemaphore};
-        VkPipelineStageFlags waitStages[] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
-        submitInfo.waitSemaphoreCount = 1;
-        submitInfo.pWaitSemaphores = waitSemaphores;
-        submitInfo.pWaitDstStageMask = waitStages;
-        submitInfo.commandBufferCount = 1;
-        submitInfo.pCommandBuffers = &commandBuffers[imageIndex];
-        VkSemaphore signalSemaphores[] = {renderFinishedSemaphore};
-        submitInfo.signalSemaphoreCount = 1;
-        submitInfo.pSignalSemaphores = signalSemaphores;
-        vkCheckResult(vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE));
+        submit.commandBuffers[0] = commandBuffers[imageIndex];
+        submit.binaryWaits[0] = sync.imageAvailable;
+        submit.binarySignals[0] = sync.renderFinished;
+        sync.submitted = scheduler_submit(scheduler, SCHEDULER_GRAPHICS, submit);
+        imageSubmitted[imageIndex] = sync.submitted;
 
         VkPresentInfoKHR presentInfo = {};
         presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
         presentInfo.waitSemaphoreCount = 1;
-        presentInfo.pWaitSemaphores = signalSemaphores;
+        presentInfo.pWaitSemaphores = &sync.renderFinished;
         VkSwapchainKHR swapChains[] = {swapChain};
         presentInfo.swapchainCount = 1;
         presentInfo.pSwapchains = swapChains;
         presentInfo.pImageIndices = &imageIndex;
         presentInfo.pResults = nullptr; // Optional
-        vkCheckResult(vkQueuePresentKHR(presentQueue, &presentInfo));
+        auto presented = vkCheckRecoverable(vkQueuePresentKHR(presentQueue, &presentInfo));
+        pacer_end_frame(pacer, gpuWaitMs);
+        if (presented == RESULT_DEVICE_LOST) {
+            deviceLost = true;
+            break;
+        }
+        if (presented == RESULT_RECREATE_SWAPCHAIN) {
+            scheduler_wait_idle(scheduler);
+            hooks.recreateSwapchain();
+            pacer_mark_dirty(pacer);
+        }
+        if (++frame == 1) {
+            printf("---Time to first frame: %.2f ms\n", startup_elapsed_ms());
+        }
+    }
+    // Waiting would only report the loss again
+    if (!deviceLost) {
+        scheduler_wait_idle(scheduler);
+    }
+    print_pacing_statistics(pacer);
+    for (auto& sync : frames) {
+        vkDestroySemaphore(logical_device, sync.imageAvailable, nullptr);
+        vkDestroySemaphore(logical_device, sync.renderFinished, nullptr);
+    }
+    if (deviceLost) {
+        throw VulkanException("Device lost in the window loop", VK_ERROR_DEVICE_LOST);
     }
-    vkDeviceWaitIdle(logical_device);
-	/*GLFW Window main termination*/
-    glfwDestroyWindow(window);
-    glfwTerminate();
-#elif USE_XCB
-	while ((e = xcb_wait_for_event (c))) {
-		switch (e->response_type & ~0x80) {
-			case XCB_EXPOSE:
-				xcb_flush (c);
-				break;
-			case XCB_KEY_PRESS:
-				return;
-		}
-    free (e);
-  }
-#elif defined(USE_XLIB)
-   while (1) {
-      XNextEvent(d, &e);
-      if (e.type == KeyPress)
-         break;
-   }
-   XCloseDisplay(d);
-#endif
 }
 
-VkShaderModule create_vertex_module(PFN_vkCreateShaderModule vkCreateShaderModule, VkDevice& logical_device, const std::vector<char>& shader)
+VkShaderModule create_shader_module(PFN_vkCreateShaderModule vkCreateShaderModule, VkDevice& logical_device, const std::vector<char>& shader)
 {
     VkShaderModuleCreateInfo createInfo = {};
     createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
@@ -248,6 +505,30 @@ VkShaderModule create_vertex_module(PFN_vkCreateShaderModule vkCreateShaderModul
     return shaderModule;
 }
 
+// SPIR-V booleans are 32-bit wide
+void set_specialization_constant(ShaderVariant& variant, uint32_t constantID, const bool value)
+{
+    set_specialization_constant<VkBool32>(variant, constantID, value ? VK_TRUE : VK_FALSE);
+}
+
+VkPipelineShaderStageCreateInfo create_shader_stage(VkShaderStageFlagBits stage, VkShaderModule module, ShaderVariant& variant)
+{
+    VkPipelineShaderStageCreateInfo shaderStageInfo = {};
+    shaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    shaderStageInfo.stage = stage;
+    shaderStageInfo.module = module;
+    shaderStageInfo.pName = "main";
+    shaderStageInfo.pSpecializationInfo = nullptr;
+    if (!variant.entries.empty()) {
+        variant.info.mapEntryCount = static_cast<uint32_t>(variant.entries.size());
+        variant.info.pMapEntries = variant.entries.data();
+        variant.info.dataSize = variant.data.size();
+        variant.info.pData = variant.data.data();
+        shaderStageInfo.pSpecializationInfo = &variant.info;
+    }
+    return shaderStageInfo;
+}
+
 std::vector<char> load_shader(const std::string& filename)
 {
     FILE* shader_file = fopen(filename.c_str(), "rb");
@@ -265,9 +546,9 @@ std::vector<char> load_shader(const std::string& filename)
     }
 }
 
-void available_layers_and_extensions()
+std::string available_layers_and_extensions()
 {
-    printf("---Checking Vulkan-driver Layers and Extensions\n");
+    std::string report = "---Checking Vulkan-driver Layers and Extensions\n";
 	VK_LOAD_INSTANCE_FUNCTION(nullptr , vkEnumerateInstanceLayerProperties)
 	VK_LOAD_INSTANCE_FUNCTION(nullptr , vkEnumerateInstanceExtensionProperties)
 
@@ -275,28 +556,50 @@ void available_layers_and_extensions()
     vkCheckResult(vkEnumerateInstanceLayerProperties(&instanceLayerCount, nullptr));
     VkLayerProperties* layerProperty = new VkLayerProperties[instanceLayerCount];
     vkCheckResult(vkEnumerateInstanceLayerProperties(&instanceLayerCount, layerProperty));
-    printf("Number of instance layers: %d\n", instanceLayerCount);
+    report += "Number of instance layers: " + std::to_string(instanceLayerCount) + "\n";
     for (uint32_t i = 0; i < instanceLayerCount; ++i) {
-		printf("\tDetected layer: %s\n", layerProperty[i].layerName);
+        report += std::string("\tDetected layer: ") + layerProperty[i].layerName + "\n";
         uint32_t layersExtensionCount;
         vkCheckResult(vkEnumerateInstanceExtensionProperties(layerProperty[i].layerName, &layersExtensionCount, nullptr));
         VkExtensionProperties *layerExtensions = new VkExtensionProperties[layersExtensionCount];
         vkCheckResult(vkEnumerateInstanceExtensionProperties(layerProperty[i].layerName,
                 &layersExtensionCount, layerExtensions));
         for (uint32_t j = 0; j < layersExtensionCount; ++j) {
-            printf("\t\tExtensions: %s\n", layerExtensions[j].extensionName);
+            report += std::string("\t\tExtensions: ") + layerExtensions[j].extensionName + "\n";
         }
     }
 
     uint32_t instanceExtensionsCount;
     vkEnumerateInstanceExtensionProperties(nullptr, &instanceExtensionsCount, nullptr);
-	printf("Number of instance extensions: %d\n", instanceExtensionsCount);
+    report += "Number of instance extensions: " + std::to_string(instanceExtensionsCount) + "\n";
     VkExtensionProperties *instanceExtensions = new VkExtensionProperties[instanceExtensionsCount];
     vkCheckResult(vkEnumerateInstanceExtensionProperties(nullptr, &instanceExtensionsCount, instanceExtensions));
     for (uint32_t i = 0; i < instanceExtensionsCount; ++i) {
-        printf("\tDetected instance extension: %s\n", instanceExtensions[i].extensionName);
+        report += std::string("\tDetected instance extension: ") + instanceExtensions[i].extensionName + "\n";
     }
-    printf("\n");
+    return report + "\n";
+}
+
+std::vector<std::string> enabledInstanceExtensions;
+
+bool instance_extension_supported(const char* name)
+{
+	VK_LOAD_INSTANCE_FUNCTION(nullptr , vkEnumerateInstanceExtensionProperties)
+    uint32_t instanceExtensionsCount = 0;
+    vkCheckResult(vkEnumerateInstanceExtensionProperties(nullptr, &instanceExtensionsCount, nullptr));
+    std::vector<VkExtensionProperties> instanceExtensions(instanceExtensionsCount);
+    vkCheckResult(vkEnumerateInstanceExtensionProperties(nullptr, &instanceExtensionsCount, instanceExtensions.data()));
+    for (const auto& extension : instanceExtensions) {
+        if (!strcmp(extension.extensionName, name)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool has_instance_extension(const char* name)
+{
+    return std::find(enabledInstanceExtensions.begin(), enabledInstanceExtensions.end(), name) != enabledInstanceExtensions.end();
 }
 
 VkInstance init_vulkan_instance(const std::vector<const char *> enabledLayerNames)
@@ -326,18 +629,22 @@ VkInstance init_vulkan_instance(const std::vector<const char *> enabledLayerName
     // }
     // instanceInfo.enabledExtensionCount = glfwExtensionCount;
     // instanceInfo.ppEnabledExtensionNames = glfwExtensions;
+    std::vector<const char*> enabledExtensionNames;
 #if defined(VK_USE_PLATFORM_XLIB_KHR) || defined(VK_USE_PLATFORM_XCB_KHR)
-    instanceInfo.enabledExtensionCount = 2;
-    const char * const enabledExtensionNames[] =  {
-        VK_KHR_SURFACE_EXTENSION_NAME,
+    enabledExtensionNames.push_back(VK_KHR_SURFACE_EXTENSION_NAME);
 	#if defined(VK_USE_PLATFORM_XLIB_KHR)
-        VK_KHR_XLIB_SURFACE_EXTENSION_NAME
+    enabledExtensionNames.push_back(VK_KHR_XLIB_SURFACE_EXTENSION_NAME);
 	#elif defined(VK_USE_PLATFORM_XCB_KHR)
-		VK_KHR_XCB_SURFACE_EXTENSION_NAME
+    enabledExtensionNames.push_back(VK_KHR_XCB_SURFACE_EXTENSION_NAME);
 	#endif
-	};
-	instanceInfo.ppEnabledExtensionNames = enabledExtensionNames;
 #endif
+    // Device extensions such as VK_KHR_timeline_semaphore depend on it under Vulkan 1.0
+    if (instance_extension_supported(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME)) {
+        enabledExtensionNames.push_back(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
+    }
+    enabledInstanceExtensions.assign(enabledExtensionNames.begin(), enabledExtensionNames.end());
+    instanceInfo.enabledExtensionCount = enabledExtensionNames.size();
+    instanceInfo.ppEnabledExtensionNames = enabledExtensionNames.data();
 
     instanceInfo.enabledLayerCount = enabledLayerNames.size();
     instanceInfo.ppEnabledLayerNames = enabledLayerNames.data();
@@ -358,6 +665,7 @@ VkPhysicalDevice find_phisical_device(VkInstance& instance)
 	VK_LOAD_INSTANCE_FUNCTION(instance , vkGetPhysicalDeviceFeatures)
 	VK_LOAD_INSTANCE_FUNCTION(instance , vkGetPhysicalDeviceQueueFamilyProperties)
 	VK_LOAD_INSTANCE_FUNCTION(instance , vkEnumerateDeviceExtensionProperties)
+	VK_LOAD_INSTANCE_FUNCTION(instance , vkGetPhysicalDeviceFormatProperties)
     VkPhysicalDevice gpu; 				   // Physical device
     uint32_t gpuCount; 					   // Pysical device count
     std::vector<VkPhysicalDevice> gpuList; // List of physical devices
@@ -445,10 +753,98 @@ const std::vector<uint32_t> find_queue_families(VkInstance& instance, VkPhysical
     return std::vector<uint32_t>{graphicalQueueFamilies[0], supportPresentationQueueFamilies[0]};
 }
 
+uint32_t find_graphics_queue_family(VkPhysicalDevice& gpuDevice)
+{
+    uint32_t queueFamilyCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(gpuDevice, &queueFamilyCount, nullptr);
+    std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+    vkGetPhysicalDeviceQueueFamilyProperties(gpuDevice, &queueFamilyCount, queueFamilies.data());
+    for (uint32_t i = 0; i < queueFamilyCount; ++i) {
+        if (queueFamilies[i].queueCount > 0 && (queueFamilies[i].queueFlags & VK_QUEUE_GRAPHICS_BIT)) {
+            printf("\tFound graphical queue family with index: %d\n", i);
+            return i;
+        }
+    }
+    printf("\tCouldn't find graphical QueueFamily");
+    throw VulkanException("No graphical family\n");
+}
+
+// Prefers a compute-only family, which usually maps to asynchronous compute hardware
+uint32_t find_compute_queue_family(VkPhysicalDevice& gpuDevice)
+{
+    uint32_t queueFamilyCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(gpuDevice, &queueFamilyCount, nullptr);
+    std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+    vkGetPhysicalDeviceQueueFamilyProperties(gpuDevice, &queueFamilyCount, queueFamilies.data());
+    int32_t computeFamily = -1;
+    for (uint32_t i = 0; i < queueFamilyCount; ++i) {
+        if (queueFamilies[i].queueCount == 0 || !(queueFamilies[i].queueFlags & VK_QUEUE_COMPUTE_BIT)) {
+            continue;
+        }
+        if (!(queueFamilies[i].queueFlags & VK_QUEUE_GRAPHICS_BIT)) {
+            printf("\tFound dedicated compute queue family with index: %d\n", i);
+            return i;
+        }
+        if (computeFamily < 0) {
+            computeFamily = i;
+        }
+    }
+    if (computeFamily < 0) {
+        printf("\tCouldn't find compute QueueFamily\n");
+        throw VulkanException("No compute family");
+    }
+    printf("\tFound compute queue family with index: %d\n", computeFamily);
+    return computeFamily;
+}
+
+void require_device_extension(DeviceRequirements& requirements, const char* name, bool optional)
+{
+    auto& extensions = optional ? requirements.optionalExtensions : requirements.requiredExtensions;
+    for (const auto& extension : extensions) {
+        if (!strcmp(extension, name)) {
+            return;
+        }
+    }
+    extensions.push_back(name);
+}
+
+void require_device_feature(DeviceRequirements& requirements, VkBool32 VkPhysicalDeviceFeatures::* feature, bool optional)
+{
+    (optional ? requirements.optionalFeatures : requirements.requiredFeatures).*feature = VK_TRUE;
+}
+
+bool has_device_extension(const DeviceCapabilities& capabilities, const char* name)
+{
+    return std::find(capabilities.extensions.begin(), capabilities.extensions.end(), name) != capabilities.extensions.end();
+}
+
+// VkPhysicalDeviceFeatures is nothing but VkBool32 members
+const uint32_t deviceFeatureCount = sizeof(VkPhysicalDeviceFeatures) / sizeof(VkBool32);
+
+VkPhysicalDeviceFeatures negotiate_device_features(const VkPhysicalDeviceFeatures& supported,
+const DeviceRequirements& requirements)
+{
+    VkPhysicalDeviceFeatures enabled = {};
+    auto supportedBits = reinterpret_cast<const VkBool32*>(&supported);
+    auto requiredBits = reinterpret_cast<const VkBool32*>(&requirements.requiredFeatures);
+    auto optionalBits = reinterpret_cast<const VkBool32*>(&requirements.optionalFeatures);
+    auto enabledBits = reinterpret_cast<VkBool32*>(&enabled);
+    for (uint32_t i = 0; i < deviceFeatureCount; ++i) {
+        if (requiredBits[i] && !supportedBits[i]) {
+            printf("\tRequired device feature #%d is not supported\n", i);
+            throw VulkanException("Missing device feature");
+        }
+        enabledBits[i] = requiredBits[i] || (optionalBits[i] && supportedBits[i]) ? VK_TRUE : VK_FALSE;
+    }
+    return enabled;
+}
+
 VkDevice create_logical_device(VkInstance& instance, 
     VkPhysicalDevice& gpuDevice, 
     const std::vector<uint32_t>& neccessary_queues,
-    const std::vector<const char*> enabled_layers)
+    const std::vector<const char*> enabled_layers,
+    const DeviceRequirements& requirements,
+    DeviceCapabilities& capabilities)
 {
 	printf("---Creating logical device\n");
 
@@ -458,15 +854,41 @@ VkDevice create_logical_device(VkInstance& instance,
     // Available extensions and layers names
 	uint32_t deviceExtensionCount = 0;
 	std::vector<VkExtensionProperties> deviceExtensionProps;
-	std::vector<const char *> deviceExtensionNames;
-    const char* const* _ppExtensionNames = nullptr;
 	vkEnumerateDeviceExtensionProperties(gpuDevice, nullptr, &deviceExtensionCount, nullptr);
     deviceExtensionProps.resize(deviceExtensionCount);
     vkEnumerateDeviceExtensionProperties(gpuDevice, nullptr, &deviceExtensionCount, deviceExtensionProps.data());
-    for (uint32_t i = 0; i < deviceExtensionCount; ++i) {
-        deviceExtensionNames.push_back(deviceExtensionProps[i].extensionName);
-        printf("\tDetected device extension:%s\n",deviceExtensionProps[i].extensionName);
+    auto supported = [&](const char* name) {
+        for (const auto& extension : deviceExtensionProps) {
+            if (!strcmp(extension.extensionName, name)) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    // Only what subsystems asked for, every enabled extension costs creation time and may slow the driver down
+    std::vector<const char*> deviceExtensionNames;
+    for (const auto& name : requirements.requiredExtensions) {
+        if (!supported(name)) {
+            printf("\tRequired device extension is not supported: %s\n", name);
+            throw VulkanException("Missing device extension");
+        }
+        deviceExtensionNames.push_back(name);
+    }
+    for (const auto& name : requirements.optionalExtensions) {
+        if (supported(name)) {
+            deviceExtensionNames.push_back(name);
+        } else {
+            printf("\tOptional device extension is not supported: %s\n", name);
+        }
     }
+    for (const auto& name : deviceExtensionNames) {
+        printf("\tEnabled device extension: %s\n", name);
+    }
+
+    VkPhysicalDeviceFeatures supportedFeatures;
+    vkGetPhysicalDeviceFeatures(gpuDevice, &supportedFeatures);
+    VkPhysicalDeviceFeatures enabledFeatures = negotiate_device_features(supportedFeatures, requirements);
 
     float queuePriority = 1.0f;
     std::vector<VkDeviceQueueCreateInfo> VkDeviceQueueCreateInfos;
@@ -486,61 +908,395 @@ VkDevice create_logical_device(VkInstance& instance,
     deviceInfo.flags = 0;
     deviceInfo.enabledLayerCount = enabled_layers.size();
     deviceInfo.ppEnabledLayerNames = enabled_layers.data();
-    deviceInfo.enabledExtensionCount = deviceExtensionCount;
+    deviceInfo.enabledExtensionCount = deviceExtensionNames.size();
     deviceInfo.ppEnabledExtensionNames = deviceExtensionNames.data();
+    deviceInfo.pEnabledFeatures = &enabledFeatures;
+#ifdef VK_KHR_timeline_semaphore
+    // Enabling the extension doesn't enable the feature, drivers exposing it must support it
+    VkPhysicalDeviceTimelineSemaphoreFeaturesKHR timelineFeatures = {};
+    timelineFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR;
+    timelineFeatures.timelineSemaphore = VK_TRUE;
+    for (const auto& name : deviceExtensionNames) {
+        if (!strcmp(name, VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME)) {
+            deviceInfo.pNext = &timelineFeatures;
+        }
+    }
+#endif
     deviceInfo.queueCreateInfoCount = VkDeviceQueueCreateInfos.size();
     deviceInfo.pQueueCreateInfos = VkDeviceQueueCreateInfos.data();
 
     VkDevice logical_device;
+    auto start = std::chrono::steady_clock::now();
     vkCheckResult(vkCreateDevice(gpuDevice, &deviceInfo, nullptr, &logical_device));
+    capabilities.creationTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    capabilities.extensions.assign(deviceExtensionNames.begin(), deviceExtensionNames.end());
+    capabilities.features = enabledFeatures;
+    printf("\tDevice created in %.3f ms with %d of %d available extensions\n",
+        capabilities.creationTime, static_cast<int>(deviceExtensionNames.size()), deviceExtensionCount);
     return logical_device;
 }
 
-VkSurfaceKHR create_swapchain_surface(VkInstance& instance)
+bool parse_device_baseline_option(int argc, char* argv[])
 {
-	printf("---Creating window surface\n");
-#ifdef VK_USE_PLATFORM_XLIB_KHR
-    VkXlibSurfaceCreateInfoKHR
-#elif defined(VK_USE_PLATFORM_XCB_KHR)
-	VkXcbSurfaceCreateInfoKHR
-#endif 
-    surfaceCreateInfo = {};
-
-#ifdef USE_GLFW
-    surfaceCreateInfo.sType = VK_STRUCTURE_TYPE_XLIB_SURFACE_CREATE_INFO_KHR;
-    surfaceCreateInfo.window = glfwGetX11Window(window);
-    surfaceCreateInfo.dpy = glfwGetX11Display();
-#elif defined(USE_XCB)
-    surfaceCreateInfo.sType = VK_STRUCTURE_TYPE_XCB_SURFACE_CREATE_INFO_KHR;
-    surfaceCreateInfo.window = window;
-    surfaceCreateInfo.connection = c;
-#elif defined(USE_XLIB)
-    surfaceCreateInfo.sType = VK_STRUCTURE_TYPE_XLIB_SURFACE_CREATE_INFO_KHR;
-    surfaceCreateInfo.window = window;
-    surfaceCreateInfo.dpy = display;
-#endif
-    surfaceCreateInfo.pNext = NULL;
-    surfaceCreateInfo.flags = 0;
-
-    VkSurfaceKHR surface;
-#if defined(USE_XLIB) || defined(USE_GLFW)
-	VK_LOAD_INSTANCE_FUNCTION(instance , vkCreateXlibSurfaceKHR)
-	vkCheckResult(vkCreateXlibSurfaceKHR(instance, &surfaceCreateInfo, nullptr, &surface));
-#elif defined(USE_XCB)
-	VK_LOAD_INSTANCE_FUNCTION(instance , vkCreateXcbSurfaceKHR)
-	vkCheckResult(vkCreateXcbSurfaceKHR(instance, &surfaceCreateInfo, nullptr, &surface));
-#endif
-    return surface;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--device-baseline")) {
+            return true;
+        }
+    }
+    return false;
 }
 
-VkExtent2D getSwapchainExtent(const VkSurfaceCapabilitiesKHR& capabilities)
+double time_device_creation_baseline(VkInstance& instance,
+VkPhysicalDevice& gpuDevice,
+const std::vector<const char*>& enabled_layers)
 {
-    VkExtent2D swapChainExtent;
-    if (capabilities.currentExtent.width != std::numeric_limits<uint32_t>::max()) {
-        swapChainExtent = capabilities.currentExtent; 
-        printf("\tCurrent extent: width - %d; height - %d\n", capabilities.currentExtent.width, capabilities.currentExtent.height);
-    } else {
-        int width, height;
+    printf("---Timing baseline device creation\n");
+    VK_LOAD_INSTANCE_FUNCTION(instance, vkCreateDevice)
+    VK_LOAD_INSTANCE_FUNCTION(instance, vkGetDeviceProcAddr)
+    uint32_t deviceExtensionCount = 0;
+    vkEnumerateDeviceExtensionProperties(gpuDevice, nullptr, &deviceExtensionCount, nullptr);
+    std::vector<VkExtensionProperties> deviceExtensionProps(deviceExtensionCount);
+    vkEnumerateDeviceExtensionProperties(gpuDevice, nullptr, &deviceExtensionCount, deviceExtensionProps.data());
+    std::vector<const char*> deviceExtensionNames;
+    for (const auto& extension : deviceExtensionProps) {
+        deviceExtensionNames.push_back(extension.extensionName);
+    }
+
+    float queuePriority = 1.0f;
+    VkDeviceQueueCreateInfo queueCreateInfo = {};
+    queueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+    queueCreateInfo.queueFamilyIndex = find_graphics_queue_family(gpuDevice);
+    queueCreateInfo.queueCount = 1;
+    queueCreateInfo.pQueuePriorities = &queuePriority;
+    VkDeviceCreateInfo deviceInfo = {};
+    deviceInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+    deviceInfo.enabledLayerCount = enabled_layers.size();
+    deviceInfo.ppEnabledLayerNames = enabled_layers.data();
+    deviceInfo.queueCreateInfoCount = 1;
+    deviceInfo.pQueueCreateInfos = &queueCreateInfo;
+
+    // The first device pays for loading the driver, neither timed creation should
+    VkDevice logical_device;
+    vkCheckResult(vkCreateDevice(gpuDevice, &deviceInfo, nullptr, &logical_device));
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkDestroyDevice)
+    vkDestroyDevice(logical_device, nullptr);
+
+    // What create_logical_device did before extensions were negotiated
+    deviceInfo.enabledExtensionCount = deviceExtensionNames.size();
+    deviceInfo.ppEnabledExtensionNames = deviceExtensionNames.data();
+    auto start = std::chrono::steady_clock::now();
+    const VkResult result = vkCreateDevice(gpuDevice, &deviceInfo, nullptr, &logical_device);
+    const double creationTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    if (result != VK_SUCCESS) {
+        // Some extensions exclude each other, such a driver never allowed enabling everything
+        printf("\tDevice with all %d extensions couldn't be created: %s\n", deviceExtensionCount, vk_result_string(result));
+        return -1.0;
+    }
+    vkDestroyDevice(logical_device, nullptr);
+    printf("\tBaseline device created in %.3f ms with all %d available extensions\n", creationTime, deviceExtensionCount);
+    return creationTime;
+}
+
+void register_scheduler_requirements(DeviceRequirements& requirements)
+{
+#ifdef VK_KHR_timeline_semaphore
+    if (has_instance_extension(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME)) {
+        require_device_extension(requirements, VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME, true);
+    }
+#endif
+}
+
+FrameScheduler create_frame_scheduler(VkDevice& logical_device,
+const DeviceCapabilities& capabilities,
+VkQueue graphicsQueue,
+VkQueue transferQueue,
+VkQueue computeQueue)
+{
+    // Everything the scheduler calls later on
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkCreateSemaphore)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkDestroySemaphore)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkQueueSubmit)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkCreateFence)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkGetFenceStatus)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkWaitForFences)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkResetFences)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkDestroyFence)
+    FrameScheduler scheduler;
+    scheduler.device = logical_device;
+    scheduler.timeline = false;
+#ifdef VK_KHR_timeline_semaphore
+    scheduler.timeline = has_device_extension(capabilities, VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME);
+    if (scheduler.timeline) {
+        VK_LOAD_DEVICE_FUNCTION(logical_device, vkGetSemaphoreCounterValueKHR)
+        VK_LOAD_DEVICE_FUNCTION(logical_device, vkWaitSemaphoresKHR)
+    }
+#endif
+    printf("\tFrame scheduler uses %s\n", scheduler.timeline ? "timeline semaphores" : "fences (binary fallback)");
+
+    const VkQueue queues[SCHEDULER_QUEUE_COUNT] = {graphicsQueue, transferQueue, computeQueue};
+    for (uint32_t i = 0; i < SCHEDULER_QUEUE_COUNT; ++i) {
+        auto& timeline = scheduler.timelines[i];
+        timeline.queue = queues[i];
+        timeline.owner = i;
+        timeline.semaphore = VK_NULL_HANDLE;
+        timeline.submitted = 0;
+        timeline.completed = 0;
+        // A queue shared by several roles must have a single timeline, values are ordered per VkQueue
+        for (uint32_t j = 0; j < i; ++j) {
+            if (queues[j] == queues[i]) {
+                timeline.owner = scheduler.timelines[j].owner;
+                break;
+            }
+        }
+        if (timeline.owner != i || !scheduler.timeline) {
+            continue;
+        }
+#ifdef VK_KHR_timeline_semaphore
+        VkSemaphoreTypeCreateInfoKHR typeInfo = {};
+        typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO_KHR;
+        typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE_KHR;
+        typeInfo.initialValue = 0;
+        VkSemaphoreCreateInfo semaphoreInfo = {};
+        semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        semaphoreInfo.pNext = &typeInfo;
+        vkCheckResult(vkCreateSemaphore(logical_device, &semaphoreInfo, nullptr, &timeline.semaphore));
+#endif
+    }
+    return scheduler;
+}
+
+SchedulerTimeline& scheduler_timeline(FrameScheduler& scheduler, SchedulerQueue queue)
+{
+    return scheduler.timelines[scheduler.timelines[queue].owner];
+}
+
+// Fallback: retires finished fences in submission order, waiting for them up to value
+void retire_scheduler_fences(FrameScheduler& scheduler, SchedulerTimeline& timeline, uint64_t waitValue)
+{
+    while (!timeline.pendingFences.empty()) {
+        auto& pending = timeline.pendingFences.front();
+        if (pending.first <= waitValue) {
+            vkCheckResult(vkWaitForFences(scheduler.device, 1, &pending.second, VK_TRUE, std::numeric_limits<uint64_t>::max()));
+        } else if (vkGetFenceStatus(scheduler.device, pending.second) != VK_SUCCESS) {
+            break;
+        }
+        vkCheckResult(vkResetFences(scheduler.device, 1, &pending.second));
+        timeline.freeFences.push_back(pending.second);
+        timeline.completed = pending.first;
+        timeline.pendingFences.pop_front();
+    }
+}
+
+uint64_t scheduler_completed(FrameScheduler& scheduler, SchedulerQueue queue)
+{
+    auto& timeline = scheduler_timeline(scheduler, queue);
+#ifdef VK_KHR_timeline_semaphore
+    if (scheduler.timeline) {
+        vkCheckResult(vkGetSemaphoreCounterValueKHR(scheduler.device, timeline.semaphore, &timeline.completed));
+        return timeline.completed;
+    }
+#endif
+    retire_scheduler_fences(scheduler, timeline, 0);
+    return timeline.completed;
+}
+
+bool scheduler_is_complete(FrameScheduler& scheduler, SchedulerQueue queue, uint64_t value)
+{
+    return scheduler_timeline(scheduler, queue).completed >= value || scheduler_completed(scheduler, queue) >= value;
+}
+
+void scheduler_wait(FrameScheduler& scheduler, SchedulerQueue queue, uint64_t value)
+{
+    auto& timeline = scheduler_timeline(scheduler, queue);
+    if (timeline.completed >= value) {
+        return;
+    }
+#ifdef VK_KHR_timeline_semaphore
+    if (scheduler.timeline) {
+        VkSemaphoreWaitInfoKHR waitInfo = {};
+        waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO_KHR;
+        waitInfo.semaphoreCount = 1;
+        waitInfo.pSemaphores = &timeline.semaphore;
+        waitInfo.pValues = &value;
+        vkCheckResult(vkWaitSemaphoresKHR(scheduler.device, &waitInfo, std::numeric_limits<uint64_t>::max()));
+        timeline.completed = value;
+        return;
+    }
+#endif
+    retire_scheduler_fences(scheduler, timeline, value);
+}
+
+uint64_t scheduler_submitted(FrameScheduler& scheduler, SchedulerQueue queue)
+{
+    return scheduler_timeline(scheduler, queue).submitted;
+}
+
+void scheduler_wait_idle(FrameScheduler& scheduler)
+{
+    for (uint32_t i = 0; i < SCHEDULER_QUEUE_COUNT; ++i) {
+        auto queue = static_cast<SchedulerQueue>(i);
+        scheduler_wait(scheduler, queue, scheduler_timeline(scheduler, queue).submitted);
+    }
+}
+
+uint64_t scheduler_submit(FrameScheduler& scheduler, SchedulerQueue queue, const ScheduledSubmit& submit)
+{
+    auto& timeline = scheduler_timeline(scheduler, queue);
+    const uint64_t value = timeline.submitted + 1;
+
+    std::vector<VkSemaphore> waitSemaphores(submit.binaryWaits);
+    std::vector<VkPipelineStageFlags> waitStages(submit.binaryWaitStages);
+    std::vector<uint64_t> waitValues(submit.binaryWaits.size(), 0);
+    std::vector<VkSemaphore> signalSemaphores(submit.binarySignals);
+    std::vector<uint64_t> signalValues(submit.binarySignals.size(), 0);
+    for (const auto& wait : submit.waits) {
+        auto& other = scheduler_timeline(scheduler, wait.queue);
+        if (&other == &timeline || other.completed >= wait.value) {
+            continue; // Same queue: the caller's barriers order it, done: nothing to wait for
+        }
+        if (scheduler.timeline) {
+            waitSemaphores.push_back(other.semaphore);
+            waitStages.push_back(wait.stage);
+            waitValues.push_back(wait.value);
+        } else {
+            // Binary semaphores can't be waited by value, resolve on the CPU
+            scheduler_wait(scheduler, wait.queue, wait.value);
+        }
+    }
+
+    VkSubmitInfo submitInfo = {};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    VkFence fence = VK_NULL_HANDLE;
+#ifdef VK_KHR_timeline_semaphore
+    VkTimelineSemaphoreSubmitInfoKHR timelineInfo = {};
+    if (scheduler.timeline) {
+        signalSemaphores.push_back(timeline.semaphore);
+        signalValues.push_back(value);
+        timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR;
+        timelineInfo.waitSemaphoreValueCount = static_cast<uint32_t>(waitValues.size());
+        timelineInfo.pWaitSemaphoreValues = waitValues.data();
+        timelineInfo.signalSemaphoreValueCount = static_cast<uint32_t>(signalValues.size());
+        timelineInfo.pSignalSemaphoreValues = signalValues.data();
+        submitInfo.pNext = &timelineInfo;
+    }
+#endif
+    if (!scheduler.timeline) {
+        if (timeline.freeFences.empty()) {
+            VkFenceCreateInfo fenceInfo = {};
+            fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+            vkCheckResult(vkCreateFence(scheduler.device, &fenceInfo, nullptr, &fence));
+        } else {
+            fence = timeline.freeFences.back();
+            timeline.freeFences.pop_back();
+        }
+    }
+    submitInfo.waitSemaphoreCount = static_cast<uint32_t>(waitSemaphores.size());
+    submitInfo.pWaitSemaphores = waitSemaphores.data();
+    submitInfo.pWaitDstStageMask = waitStages.data();
+    submitInfo.commandBufferCount = static_cast<uint32_t>(submit.commandBuffers.size());
+    submitInfo.pCommandBuffers = submit.commandBuffers.data();
+    submitInfo.signalSemaphoreCount = static_cast<uint32_t>(signalSemaphores.size());
+    submitInfo.pSignalSemaphores = signalSemaphores.data();
+    vkCheckResult(vkQueueSubmit(timeline.queue, 1, &submitInfo, fence));
+    if (fence != VK_NULL_HANDLE) {
+        timeline.pendingFences.push_back(std::make_pair(value, fence));
+    }
+    timeline.submitted = value;
+    return value;
+}
+
+void destroy_frame_scheduler(FrameScheduler& scheduler)
+{
+    scheduler_wait_idle(scheduler);
+    for (auto& timeline : scheduler.timelines) {
+        if (timeline.semaphore != VK_NULL_HANDLE) {
+            vkDestroySemaphore(scheduler.device, timeline.semaphore, nullptr);
+        }
+        for (auto& fence : timeline.freeFences) {
+            vkDestroyFence(scheduler.device, fence, nullptr);
+        }
+        timeline.freeFences.clear();
+    }
+}
+
+OffscreenContext create_offscreen_context(VkInstance& instance,
+VkPhysicalDevice& gpuDevice,
+const std::vector<const char*>& enabledLayerNames,
+bool compute)
+{
+    OffscreenContext context;
+    context.queueFamily = compute ? find_compute_queue_family(gpuDevice) : find_graphics_queue_family(gpuDevice);
+    DeviceRequirements requirements = {};
+    register_scheduler_requirements(requirements);
+    context.device = create_logical_device(instance, gpuDevice, {context.queueFamily}, enabledLayerNames,
+        requirements, context.capabilities);
+    VK_LOAD_INSTANCE_FUNCTION(instance, vkGetDeviceQueue)
+    vkGetDeviceQueue(context.device, context.queueFamily, 0, &context.queue);
+    context.scheduler = create_frame_scheduler(context.device, context.capabilities,
+        context.queue, context.queue, context.queue);
+    return context;
+}
+
+void destroy_offscreen_context(OffscreenContext& context)
+{
+    VK_LOAD_DEVICE_FUNCTION(context.device, vkDestroyDevice)
+    destroy_frame_scheduler(context.scheduler);
+    vkDestroyDevice(context.device, nullptr);
+    context.device = VK_NULL_HANDLE;
+}
+
+VkSurfaceKHR create_swapchain_surface(VkInstance& instance)
+{
+    return create_window_surface(instance, window);
+}
+
+VkSurfaceKHR create_window_surface(VkInstance& instance, NativeWindow window)
+{
+	printf("---Creating window surface\n");
+#ifdef VK_USE_PLATFORM_XLIB_KHR
+    VkXlibSurfaceCreateInfoKHR
+#elif defined(VK_USE_PLATFORM_XCB_KHR)
+	VkXcbSurfaceCreateInfoKHR
+#endif 
+    surfaceCreateInfo = {};
+
+#ifdef USE_GLFW
+    surfaceCreateInfo.sType = VK_STRUCTURE_TYPE_XLIB_SURFACE_CREATE_INFO_KHR;
+    surfaceCreateInfo.window = glfwGetX11Window(window);
+    surfaceCreateInfo.dpy = glfwGetX11Display();
+#elif defined(USE_XCB)
+    surfaceCreateInfo.sType = VK_STRUCTURE_TYPE_XCB_SURFACE_CREATE_INFO_KHR;
+    surfaceCreateInfo.window = window;
+    surfaceCreateInfo.connection = c;
+#elif defined(USE_XLIB)
+    surfaceCreateInfo.sType = VK_STRUCTURE_TYPE_XLIB_SURFACE_CREATE_INFO_KHR;
+    surfaceCreateInfo.window = window;
+    surfaceCreateInfo.dpy = display;
+#endif
+    surfaceCreateInfo.pNext = NULL;
+    surfaceCreateInfo.flags = 0;
+
+    VkSurfaceKHR surface;
+#if defined(USE_XLIB) || defined(USE_GLFW)
+	VK_LOAD_INSTANCE_FUNCTION(instance , vkCreateXlibSurfaceKHR)
+	vkCheckResult(vkCreateXlibSurfaceKHR(instance, &surfaceCreateInfo, nullptr, &surface));
+#elif defined(USE_XCB)
+	VK_LOAD_INSTANCE_FUNCTION(instance , vkCreateXcbSurfaceKHR)
+	vkCheckResult(vkCreateXcbSurfaceKHR(instance, &surfaceCreateInfo, nullptr, &surface));
+#endif
+    return surface;
+}
+
+VkExtent2D getSwapchainExtent(const VkSurfaceCapabilitiesKHR& capabilities)
+{
+    VkExtent2D swapChainExtent;
+    if (capabilities.currentExtent.width != std::numeric_limits<uint32_t>::max()) {
+        swapChainExtent = capabilities.currentExtent; 
+        printf("\tCurrent extent: width - %d; height - %d\n", capabilities.currentExtent.width, capabilities.currentExtent.height);
+    } else {
+        // Windows are created at this size, the native backends don't track resizes
+        int width = WIDTH;
+        int height = HEIGHT;
 #ifdef USE_GLFW
         glfwGetWindowSize(window, &width, &height);
 #endif
@@ -564,47 +1320,58 @@ uint32_t getImageCount(const VkSurfaceCapabilitiesKHR& capabilities)
         imageCount = capabilities.maxImageCount;
     }
     printf("\tImage count of swapchain: %d\n", imageCount);
+    return imageCount;
 }
 
-struct VkSwapchain
+void register_swapchain_requirements(DeviceRequirements& requirements)
 {
-    VkSwapchainKHR swapchain;
-    uint32_t imageCount;
-    VkExtent2D extent;
-    VkSurfaceFormatKHR format;
-};
+    require_device_extension(requirements, VK_KHR_SWAPCHAIN_EXTENSION_NAME, false);
+}
 
-VkSwapchain create_swapchain(VkInstance& instance, 
-VkPhysicalDevice& gpuDevice,
-VkDevice& logical_device, 
-VkSurfaceKHR& surface)
+VkSurfaceFormatKHR find_surface_format(VkInstance& instance, VkPhysicalDevice& gpuDevice, VkSurfaceKHR& surface)
 {
-    printf("---Creating swapchain\n");
     VK_LOAD_INSTANCE_FUNCTION(instance, vkGetPhysicalDeviceSurfaceFormatsKHR)
-    VK_LOAD_INSTANCE_FUNCTION(instance, vkGetPhysicalDeviceSurfacePresentModesKHR)
-    VK_LOAD_INSTANCE_FUNCTION(instance, vkGetPhysicalDeviceSurfaceCapabilitiesKHR)
-    VK_LOAD_DEVICE_FUNCTION(logical_device, vkCreateSwapchainKHR)
-
     uint32_t formatCount = 0;	
 	vkGetPhysicalDeviceSurfaceFormatsKHR(gpuDevice, surface, &formatCount, nullptr);	
 	std::vector<VkSurfaceFormatKHR> surfaceFormats(formatCount);
     if (formatCount) printf("\tAvailable surface formats:%d\n", formatCount);
     vkGetPhysicalDeviceSurfaceFormatsKHR(gpuDevice, surface, &formatCount, surfaceFormats.data());
-    VkSurfaceFormatKHR surfaceFormat;
+    if (surfaceFormats.empty()) {
+        throw VulkanException("Surface offers no formats");
+    }
+    // A single undefined entry means any format can be used
+    if (surfaceFormats.size() == 1 && surfaceFormats[0].format == VK_FORMAT_UNDEFINED) {
+        return {VK_FORMAT_B8G8R8A8_UNORM, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR};
+    }
     for (const auto& format : surfaceFormats) {
         if (format.format == VK_FORMAT_B8G8R8A8_UNORM && format.colorSpace == VK_COLOR_SPACE_SRGB_NONLINEAR_KHR) {
             printf("\t\tFound exactly good format\n");
-            surfaceFormat = format;
-            break;
+            return format;
         }
     }
+    return surfaceFormats[0];
+}
+
+VkSwapchain create_swapchain(VkInstance& instance, 
+VkPhysicalDevice& gpuDevice,
+VkDevice& logical_device, 
+VkSurfaceKHR& surface,
+VkSwapchainKHR oldSwapchain)
+{
+    printf("---Creating swapchain\n");
+    VK_LOAD_INSTANCE_FUNCTION(instance, vkGetPhysicalDeviceSurfacePresentModesKHR)
+    VK_LOAD_INSTANCE_FUNCTION(instance, vkGetPhysicalDeviceSurfaceCapabilitiesKHR)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkCreateSwapchainKHR)
+
+    auto surfaceFormat = find_surface_format(instance, gpuDevice, surface);
 
     uint32_t modeCount = 0;
     vkGetPhysicalDeviceSurfacePresentModesKHR(gpuDevice, surface, &modeCount, nullptr);
     std::vector<VkPresentModeKHR> surfaceModes(modeCount);
     if (modeCount) printf("\tAvailable surface modes:%d\n", modeCount);
     vkGetPhysicalDeviceSurfacePresentModesKHR(gpuDevice, surface, &modeCount, surfaceModes.data());
-    VkPresentModeKHR presentMode;
+    // FIFO is the only mode every surface supports
+    VkPresentModeKHR presentMode = VK_PRESENT_MODE_FIFO_KHR;
     for (const auto& mode : surfaceModes) {
         if (mode == VK_PRESENT_MODE_MAILBOX_KHR) {
             printf("\t\tFound exactly good mode\n");
@@ -631,9 +1398,9 @@ VkSurfaceKHR& surface)
     createInfo.pQueueFamilyIndices = nullptr; // Optional
     createInfo.preTransform = capabilities.currentTransform;
     createInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
-    createInfo.presentMode = VK_PRESENT_MODE_MAILBOX_KHR;
+    createInfo.presentMode = presentMode;
     createInfo.clipped = VK_TRUE;
-    createInfo.oldSwapchain = VK_NULL_HANDLE;
+    createInfo.oldSwapchain = oldSwapchain;
     VkSwapchainKHR swapChain;
     vkCheckResult(vkCreateSwapchainKHR(logical_device, &createInfo, nullptr, &swapChain));
 
@@ -679,140 +1446,1585 @@ std::vector<VkImageView> create_image_views(VkDevice& logical_device, VkSwapchai
     return swapChainImageViews;
 }
 
-VkRenderPass create_render_pass(VkDevice& logical_device, VkSwapchain swapchain)
+// Returns -1 if no memory type matches
+int32_t find_memory_type_index(VkPhysicalDevice& gpuDevice, uint32_t typeFilter, VkMemoryPropertyFlags properties)
 {
-    VK_LOAD_DEVICE_FUNCTION(logical_device, vkCreateRenderPass)
-
-    VkSubpassDependency dependency = {};
-    dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
-    dependency.dstSubpass = 0;
-    dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-    dependency.srcAccessMask = 0;
-    dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-    dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
-
-    VkRenderPass renderPass;
-    VkRenderPassCreateInfo renderPassInfo = {};
-    renderPassInfo.dependencyCount = 1;
-    renderPassInfo.pDependencies = &dependency;
-    renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+    VkPhysicalDeviceMemoryProperties memoryProperties;
+    vkGetPhysicalDeviceMemoryProperties(gpuDevice, &memoryProperties);
+    for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; ++i) {
+        if ((typeFilter & (1 << i)) && (memoryProperties.memoryTypes[i].propertyFlags & properties) == properties) {
+            return static_cast<int32_t>(i);
+        }
+    }
+    return -1;
+}
 
-    VkAttachmentDescription colorAttachment = {};
-    colorAttachment.format = swapchain.format.format;
-    colorAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
-    colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-    colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-    colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-    colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-
-    VkAttachmentReference colorAttachmentRef = {};
-    colorAttachmentRef.attachment = 0;
-    colorAttachmentRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-    VkSubpassDescription subpass = {};
-    subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-    subpass.colorAttachmentCount = 1;
-    subpass.pColorAttachments = &colorAttachmentRef;
-
-    renderPassInfo.attachmentCount = 1;
-    renderPassInfo.pAttachments = &colorAttachment;
-    renderPassInfo.subpassCount = 1;
-    renderPassInfo.pSubpasses = &subpass;
-    vkCheckResult(vkCreateRenderPass(logical_device, &renderPassInfo, nullptr, &renderPass));
-    return renderPass;
+uint32_t find_memory_type(VkPhysicalDevice& gpuDevice, uint32_t typeFilter, VkMemoryPropertyFlags properties)
+{
+    const int32_t index = find_memory_type_index(gpuDevice, typeFilter, properties);
+    if (index < 0) {
+        printf("\tCouldn't find memory type with properties: %d\n", properties);
+        throw VulkanException("No suitable memory type");
+    }
+    return static_cast<uint32_t>(index);
 }
 
-VkPipelineLayout create_pipeline_layout(VkDevice& logical_device)
+VkImageCreateInfo make_image_info(VkExtent2D extent,
+VkFormat format,
+VkImageUsageFlags usage,
+VkSampleCountFlagBits samples,
+uint32_t mipLevels)
 {
-    printf("---Creating pipeline layout\n");
-    VkPipelineLayout pipelineLayout;
-    VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
-    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-    pipelineLayoutInfo.setLayoutCount = 0; // Optional
-    pipelineLayoutInfo.pSetLayouts = nullptr; // Optional
-    pipelineLayoutInfo.pushConstantRangeCount = 0; // Optional
-    pipelineLayoutInfo.pPushConstantRanges = 0; // Optional
-    VK_LOAD_DEVICE_FUNCTION(logical_device, vkCreatePipelineLayout)
-    vkCheckResult(vkCreatePipelineLayout(logical_device, &pipelineLayoutInfo, nullptr, &pipelineLayout));
-    return pipelineLayout;
+    VkImageCreateInfo imageInfo = {};
+    imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    imageInfo.imageType = VK_IMAGE_TYPE_2D;
+    imageInfo.format = format;
+    imageInfo.extent = {extent.width, extent.height, 1};
+    imageInfo.mipLevels = mipLevels;
+    imageInfo.arrayLayers = 1;
+    imageInfo.samples = samples;
+    imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+    imageInfo.usage = usage;
+    imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    return imageInfo;
 }
 
-VkPipeline create_pipeline(VkDevice& logical_device, 
-VkPipelineShaderStageCreateInfo shaderStages[], 
-VkExtent2D& swapchainExtent,
-VkRenderPass& renderPass,
-VkPipelineLayout& pipelineLayout
-)
+AllocatedImage create_image(VkPhysicalDevice& gpuDevice,
+VkDevice& logical_device,
+VkExtent2D extent,
+VkFormat format,
+VkImageUsageFlags usage,
+VkImageAspectFlags aspect,
+VkSampleCountFlagBits samples,
+uint32_t mipLevels)
 {
-    printf("---Creating pipeline\n");
-    VkPipelineVertexInputStateCreateInfo vertexInputInfo = {};
-    vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-    vertexInputInfo.vertexBindingDescriptionCount = 0;
-    vertexInputInfo.pVertexBindingDescriptions = nullptr; // Optional
-    vertexInputInfo.vertexAttributeDescriptionCount = 0;
-    vertexInputInfo.pVertexAttributeDescriptions = nullptr; // Optional
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkCreateImage)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkGetImageMemoryRequirements)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkAllocateMemory)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkBindImageMemory)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkCreateImageView)
 
-    VkPipelineInputAssemblyStateCreateInfo inputAssembly = {};
-    inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-    inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
-    inputAssembly.primitiveRestartEnable = VK_FALSE;
+    AllocatedImage image;
+    image.extent = extent;
+    image.format = format;
+    image.mipLevels = mipLevels;
 
-    VkViewport viewport = {};
-    viewport.x = 0.0f;
-    viewport.y = 0.0f;
-    viewport.width = (float) swapchainExtent.width;
-    viewport.height = (float) swapchainExtent.height;
-    viewport.minDepth = 0.0f;
-    viewport.maxDepth = 1.0f;
+    auto imageInfo = make_image_info(extent, format, usage, samples, mipLevels);
+    vkCheckResult(vkCreateImage(logical_device, &imageInfo, nullptr, &image.image));
 
-    VkRect2D scissor = {};
-    scissor.offset = {0, 0};
-    scissor.extent = swapchainExtent;
+    VkMemoryRequirements memoryRequirements;
+    vkGetImageMemoryRequirements(logical_device, image.image, &memoryRequirements);
+    VkMemoryAllocateInfo allocInfo = {};
+    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocInfo.allocationSize = memoryRequirements.size;
+    // Transient attachments may never get backing memory on tilers
+    int32_t memoryType = -1;
+    if (usage & VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT) {
+        memoryType = find_memory_type_index(gpuDevice, memoryRequirements.memoryTypeBits,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT);
+    }
+    if (memoryType < 0) {
+        memoryType = find_memory_type(gpuDevice, memoryRequirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    }
+    allocInfo.memoryTypeIndex = memoryType;
+    vkCheckResult(vkAllocateMemory(logical_device, &allocInfo, nullptr, &image.memory));
+    vkCheckResult(vkBindImageMemory(logical_device, image.image, image.memory, 0));
 
-    VkPipelineViewportStateCreateInfo viewportState = {};
-    viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
-    viewportState.viewportCount = 1;
-    viewportState.pViewports = &viewport;
-    viewportState.scissorCount = 1;
-    viewportState.pScissors = &scissor;
+    VkImageViewCreateInfo viewInfo = {};
+    viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    viewInfo.image = image.image;
+    viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    viewInfo.format = format;
+    viewInfo.subresourceRange.aspectMask = aspect;
+    viewInfo.subresourceRange.baseMipLevel = 0;
+    viewInfo.subresourceRange.levelCount = mipLevels;
+    viewInfo.subresourceRange.baseArrayLayer = 0;
+    viewInfo.subresourceRange.layerCount = 1;
+    vkCheckResult(vkCreateImageView(logical_device, &viewInfo, nullptr, &image.view));
+    return image;
+}
 
-    VkPipelineRasterizationStateCreateInfo rasterizer = {};
-    rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
-    rasterizer.depthClampEnable = VK_FALSE;
-    rasterizer.rasterizerDiscardEnable = VK_FALSE;
-    rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
-    rasterizer.lineWidth = 1.0f;
-    rasterizer.cullMode = VK_CULL_MODE_BACK_BIT;
-    rasterizer.frontFace = VK_FRONT_FACE_CLOCKWISE;
-    rasterizer.depthBiasEnable = VK_FALSE;
-    rasterizer.depthBiasConstantFactor = 0.0f; // Optional
-    rasterizer.depthBiasClamp = 0.0f; // Optional
-    rasterizer.depthBiasSlopeFactor = 0.0f; // Optional
+AllocatedBuffer create_buffer(VkPhysicalDevice& gpuDevice,
+VkDevice& logical_device,
+VkDeviceSize size,
+VkBufferUsageFlags usage,
+VkMemoryPropertyFlags properties,
+VkMemoryPropertyFlags preferredProperties)
+{
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkCreateBuffer)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkGetBufferMemoryRequirements)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkAllocateMemory)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkBindBufferMemory)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkMapMemory)
 
-    VkPipelineMultisampleStateCreateInfo multisampling = {};
-    multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
-    multisampling.sampleShadingEnable = VK_FALSE;
-    multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
-    multisampling.minSampleShading = 1.0f; // Optional
-    multisampling.pSampleMask = nullptr; // Optional
-    multisampling.alphaToCoverageEnable = VK_FALSE; // Optional
-    multisampling.alphaToOneEnable = VK_FALSE; // Optional
+    AllocatedBuffer buffer;
+    buffer.size = size;
+    buffer.mapped = nullptr;
 
-    VkPipelineColorBlendAttachmentState colorBlendAttachment = {};
-    colorBlendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
-    colorBlendAttachment.blendEnable = VK_FALSE;
-    colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_ONE; // Optional
-    colorBlendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ZERO; // Optional
-    colorBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD; // Optional
-    colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE; // Optional
-    colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO; // Optional
-    colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD; // Optional
+    VkBufferCreateInfo bufferInfo = {};
+    bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferInfo.size = size;
+    bufferInfo.usage = usage;
+    bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    vkCheckResult(vkCreateBuffer(logical_device, &bufferInfo, nullptr, &buffer.buffer));
 
-    VkPipelineColorBlendStateCreateInfo colorBlending = {};
-    colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
-    colorBlending.logicOpEnable = VK_FALSE;
-    colorBlending.logicOp = VK_LOGIC_OP_COPY; // Optional
+    VkMemoryRequirements memoryRequirements;
+    vkGetBufferMemoryRequirements(logical_device, buffer.buffer, &memoryRequirements);
+    VkMemoryAllocateInfo allocInfo = {};
+    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocInfo.allocationSize = memoryRequirements.size;
+    // Preferred properties (e.g. HOST_CACHED for readback) are used when available
+    int32_t memoryType = find_memory_type_index(gpuDevice, memoryRequirements.memoryTypeBits, properties | preferredProperties);
+    if (memoryType < 0) {
+        memoryType = find_memory_type(gpuDevice, memoryRequirements.memoryTypeBits, properties);
+    }
+    allocInfo.memoryTypeIndex = memoryType;
+    VkPhysicalDeviceMemoryProperties memoryProperties;
+    vkGetPhysicalDeviceMemoryProperties(gpuDevice, &memoryProperties);
+    buffer.properties = memoryProperties.memoryTypes[memoryType].propertyFlags;
+    vkCheckResult(vkAllocateMemory(logical_device, &allocInfo, nullptr, &buffer.memory));
+    vkCheckResult(vkBindBufferMemory(logical_device, buffer.buffer, buffer.memory, 0));
+
+    // Also when host visibility only came with the preferred properties
+    if (buffer.properties & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+        vkCheckResult(vkMapMemory(logical_device, buffer.memory, 0, size, 0, &buffer.mapped));
+    }
+    return buffer;
+}
+
+VkDeviceSize image_memory_size(VkDevice& logical_device,
+VkExtent2D extent,
+VkFormat format,
+VkImageUsageFlags usage,
+VkSampleCountFlagBits samples,
+uint32_t mipLevels)
+{
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkCreateImage)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkGetImageMemoryRequirements)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkDestroyImage)
+    auto imageInfo = make_image_info(extent, format, usage, samples, mipLevels);
+    VkImage image;
+    vkCheckResult(vkCreateImage(logical_device, &imageInfo, nullptr, &image));
+    VkMemoryRequirements memoryRequirements;
+    vkGetImageMemoryRequirements(logical_device, image, &memoryRequirements);
+    vkDestroyImage(logical_device, image, nullptr);
+    return memoryRequirements.size;
+}
+
+void destroy_image(VkDevice& logical_device, AllocatedImage& image)
+{
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkDestroyImageView)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkDestroyImage)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkFreeMemory)
+    vkDestroyImageView(logical_device, image.view, nullptr);
+    vkDestroyImage(logical_device, image.image, nullptr);
+    vkFreeMemory(logical_device, image.memory, nullptr);
+}
+
+void destroy_buffer(VkDevice& logical_device, AllocatedBuffer& buffer)
+{
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkUnmapMemory)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkDestroyBuffer)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkFreeMemory)
+    if (buffer.mapped) {
+        vkUnmapMemory(logical_device, buffer.memory);
+    }
+    vkDestroyBuffer(logical_device, buffer.buffer, nullptr);
+    vkFreeMemory(logical_device, buffer.memory, nullptr);
+}
+
+VkMappedMemoryRange whole_mapping(const AllocatedBuffer& buffer)
+{
+    VkMappedMemoryRange range = {};
+    range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+    range.memory = buffer.memory;
+    range.offset = 0;
+    range.size = VK_WHOLE_SIZE;
+    return range;
+}
+
+void flush_mapped(VkDevice& logical_device, const AllocatedBuffer& buffer)
+{
+    if (!(buffer.properties & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)) {
+        const auto range = whole_mapping(buffer);
+        vkCheckResult(vkFlushMappedMemoryRanges(logical_device, 1, &range));
+    }
+}
+
+void invalidate_mapped(VkDevice& logical_device, const AllocatedBuffer& buffer)
+{
+    if (!(buffer.properties & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)) {
+        const auto range = whole_mapping(buffer);
+        vkCheckResult(vkInvalidateMappedMemoryRanges(logical_device, 1, &range));
+    }
+}
+
+void defer_deletion(DeletionQueue& queue, SchedulerQueue role, uint64_t value, std::function<void(VkDevice)> destroy)
+{
+    auto owner = queue.scheduler->timelines[role].owner;
+    PendingDeletion deletion;
+    deletion.value = value;
+    deletion.destroy = std::move(destroy);
+    // Kept sorted so collection can stop at the first pending value, callers usually append
+    auto& pending = queue.pending[owner];
+    auto position = std::upper_bound(pending.begin(), pending.end(), value,
+        [](uint64_t v, const PendingDeletion& entry) { return v < entry.value; });
+    pending.insert(position, std::move(deletion));
+}
+
+void defer_destroy_buffer(DeletionQueue& queue, SchedulerQueue role, uint64_t value, AllocatedBuffer buffer)
+{
+    defer_deletion(queue, role, value, [buffer](VkDevice device) mutable { destroy_buffer(device, buffer); });
+}
+
+void defer_destroy_image(DeletionQueue& queue, SchedulerQueue role, uint64_t value, AllocatedImage image)
+{
+    defer_deletion(queue, role, value, [image](VkDevice device) mutable { destroy_image(device, image); });
+}
+
+void defer_destroy_pipeline(DeletionQueue& queue, SchedulerQueue role, uint64_t value, VkPipeline pipeline)
+{
+    defer_deletion(queue, role, value, [pipeline](VkDevice device) { vkDestroyPipeline(device, pipeline, nullptr); });
+}
+
+void defer_destroy_framebuffer(DeletionQueue& queue, SchedulerQueue role, uint64_t value, VkFramebuffer framebuffer)
+{
+    defer_deletion(queue, role, value, [framebuffer](VkDevice device) { vkDestroyFramebuffer(device, framebuffer, nullptr); });
+}
+
+void defer_destroy_descriptor_pool(DeletionQueue& queue, SchedulerQueue role, uint64_t value, VkDescriptorPool pool)
+{
+    defer_deletion(queue, role, value, [pool](VkDevice device) { vkDestroyDescriptorPool(device, pool, nullptr); });
+}
+
+DeletionQueue create_deletion_queue(FrameScheduler& scheduler)
+{
+    // Loaded once here so destruction callbacks can run anywhere
+    VK_LOAD_DEVICE_FUNCTION(scheduler.device, vkDestroyBuffer)
+    VK_LOAD_DEVICE_FUNCTION(scheduler.device, vkDestroyImage)
+    VK_LOAD_DEVICE_FUNCTION(scheduler.device, vkDestroyImageView)
+    VK_LOAD_DEVICE_FUNCTION(scheduler.device, vkFreeMemory)
+    VK_LOAD_DEVICE_FUNCTION(scheduler.device, vkUnmapMemory)
+    VK_LOAD_DEVICE_FUNCTION(scheduler.device, vkDestroyPipeline)
+    VK_LOAD_DEVICE_FUNCTION(scheduler.device, vkDestroyFramebuffer)
+    VK_LOAD_DEVICE_FUNCTION(scheduler.device, vkDestroyDescriptorPool)
+    DeletionQueue queue;
+    queue.scheduler = &scheduler;
+    return queue;
+}
+
+// Destroys whatever the GPU is done with without blocking, returns how many resources were freed
+size_t collect_deletion_queue(DeletionQueue& queue)
+{
+    size_t destroyed = 0;
+    for (uint32_t i = 0; i < SCHEDULER_QUEUE_COUNT; ++i) {
+        auto& pending = queue.pending[i];
+        if (pending.empty()) {
+            continue;
+        }
+        // One completion query per timeline, entries are sorted by value
+        const uint64_t completed = scheduler_completed(*queue.scheduler, static_cast<SchedulerQueue>(i));
+        while (!pending.empty() && pending.front().value <= completed) {
+            pending.front().destroy(queue.scheduler->device);
+            pending.pop_front();
+            ++destroyed;
+        }
+    }
+    return destroyed;
+}
+
+void flush_deletion_queue(DeletionQueue& queue)
+{
+    for (uint32_t i = 0; i < SCHEDULER_QUEUE_COUNT; ++i) {
+        auto& pending = queue.pending[i];
+        if (!pending.empty()) {
+            scheduler_wait(*queue.scheduler, static_cast<SchedulerQueue>(i), pending.back().value);
+        }
+    }
+    collect_deletion_queue(queue);
+}
+
+bool has_stencil(VkFormat format)
+{
+    return format == VK_FORMAT_S8_UINT || format == VK_FORMAT_D16_UNORM_S8_UINT ||
+        format == VK_FORMAT_D24_UNORM_S8_UINT || format == VK_FORMAT_D32_SFLOAT_S8_UINT;
+}
+
+bool is_depth_format(VkFormat format)
+{
+    return format == VK_FORMAT_D16_UNORM || format == VK_FORMAT_X8_D24_UNORM_PACK32 ||
+        format == VK_FORMAT_D32_SFLOAT || has_stencil(format);
+}
+
+uint32_t add_color_attachment(RenderPassBuilder& builder,
+VkFormat format,
+VkSampleCountFlagBits samples,
+bool transient,
+VkImageLayout finalLayout)
+{
+    VkAttachmentDescription attachment = {};
+    attachment.format = format;
+    attachment.samples = samples;
+    attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    attachment.storeOp = transient ? VK_ATTACHMENT_STORE_OP_DONT_CARE : VK_ATTACHMENT_STORE_OP_STORE;
+    attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    attachment.finalLayout = finalLayout;
+    builder.attachments.push_back(attachment);
+    return static_cast<uint32_t>(builder.attachments.size() - 1);
+}
+
+// Single-sampled target of a multisampled color attachment, fully overwritten by the resolve
+uint32_t add_resolve_attachment(RenderPassBuilder& builder, VkFormat format, VkImageLayout finalLayout)
+{
+    const uint32_t index = add_color_attachment(builder, format, VK_SAMPLE_COUNT_1_BIT, false, finalLayout);
+    builder.attachments[index].loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    return index;
+}
+
+uint32_t add_depth_attachment(RenderPassBuilder& builder, VkFormat format, VkSampleCountFlagBits samples, bool transient)
+{
+    VkAttachmentDescription attachment = {};
+    attachment.format = format;
+    attachment.samples = samples;
+    attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    attachment.storeOp = transient ? VK_ATTACHMENT_STORE_OP_DONT_CARE : VK_ATTACHMENT_STORE_OP_STORE;
+    attachment.stencilLoadOp = has_stencil(format) ? VK_ATTACHMENT_LOAD_OP_CLEAR : VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    attachment.stencilStoreOp = has_stencil(format) ? attachment.storeOp : VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    attachment.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    builder.attachments.push_back(attachment);
+    return static_cast<uint32_t>(builder.attachments.size() - 1);
+}
+
+/*resolves is either empty or has one entry per color attachment, depth < 0
+means no depth. Reading an attachment written by an earlier subpass adds
+the by-region dependency between the two*/
+uint32_t add_subpass(RenderPassBuilder& builder,
+const std::vector<uint32_t>& colors,
+const std::vector<uint32_t>& resolves,
+const std::vector<uint32_t>& inputs,
+int32_t depth)
+{
+    const uint32_t subpassIndex = static_cast<uint32_t>(builder.subpasses.size());
+    SubpassAttachments subpass;
+    for (const auto& color : colors) {
+        subpass.colors.push_back({color, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL});
+    }
+    for (const auto& resolve : resolves) {
+        subpass.resolves.push_back({resolve, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL});
+    }
+    subpass.hasDepth = depth >= 0;
+    subpass.depth = {subpass.hasDepth ? static_cast<uint32_t>(depth) : VK_ATTACHMENT_UNUSED,
+        VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL};
+
+    for (const auto& input : inputs) {
+        const bool depthInput = is_depth_format(builder.attachments[input].format);
+        subpass.inputs.push_back({input, depthInput ?
+            VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL : VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL});
+        for (uint32_t src = subpassIndex; src-- > 0;) {
+            const auto& previous = builder.subpasses[src];
+            bool written = previous.hasDepth && previous.depth.attachment == input;
+            for (const auto& color : previous.colors) {
+                written = written || color.attachment == input;
+            }
+            if (!written) {
+                continue;
+            }
+            VkSubpassDependency dependency = {};
+            dependency.srcSubpass = src;
+            dependency.dstSubpass = subpassIndex;
+            dependency.srcStageMask = depthInput ? VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT : VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+            dependency.srcAccessMask = depthInput ? VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT : VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+            dependency.dstStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+            dependency.dstAccessMask = VK_ACCESS_INPUT_ATTACHMENT_READ_BIT;
+            dependency.dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+            builder.dependencies.push_back(dependency);
+            break;
+        }
+    }
+    builder.subpasses.push_back(subpass);
+    return subpassIndex;
+}
+
+VkRenderPass build_render_pass(VkDevice& logical_device, RenderPassBuilder& builder)
+{
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkCreateRenderPass)
+
+    std::vector<VkSubpassDescription> subpasses;
+    for (auto& attachments : builder.subpasses) {
+        VkSubpassDescription subpass = {};
+        subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+        subpass.colorAttachmentCount = static_cast<uint32_t>(attachments.colors.size());
+        subpass.pColorAttachments = attachments.colors.data();
+        subpass.pResolveAttachments = attachments.resolves.empty() ? nullptr : attachments.resolves.data();
+        subpass.inputAttachmentCount = static_cast<uint32_t>(attachments.inputs.size());
+        subpass.pInputAttachments = attachments.inputs.data();
+        subpass.pDepthStencilAttachment = attachments.hasDepth ? &attachments.depth : nullptr;
+        subpasses.push_back(subpass);
+    }
+
+    VkRenderPass renderPass;
+    VkRenderPassCreateInfo renderPassInfo = {};
+    renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+    renderPassInfo.attachmentCount = static_cast<uint32_t>(builder.attachments.size());
+    renderPassInfo.pAttachments = builder.attachments.data();
+    renderPassInfo.subpassCount = static_cast<uint32_t>(subpasses.size());
+    renderPassInfo.pSubpasses = subpasses.data();
+    renderPassInfo.dependencyCount = static_cast<uint32_t>(builder.dependencies.size());
+    renderPassInfo.pDependencies = builder.dependencies.data();
+    vkCheckResult(vkCreateRenderPass(logical_device, &renderPassInfo, nullptr, &renderPass));
+    return renderPass;
+}
+
+VkFormat find_depth_format(VkPhysicalDevice& gpuDevice)
+{
+    const VkFormat candidates[] = {VK_FORMAT_D32_SFLOAT, VK_FORMAT_D24_UNORM_S8_UINT, VK_FORMAT_D16_UNORM};
+    for (const auto& format : candidates) {
+        VkFormatProperties properties;
+        vkGetPhysicalDeviceFormatProperties(gpuDevice, format, &properties);
+        if (properties.optimalTilingFeatures & VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT) {
+            return format;
+        }
+    }
+    return VK_FORMAT_UNDEFINED;
+}
+
+RenderPassConfig make_render_pass_config(VkPhysicalDevice& gpuDevice,
+VkFormat colorFormat,
+VkImageLayout finalLayout,
+uint32_t requestedSamples)
+{
+    RenderPassConfig config;
+    config.colorFormat = colorFormat;
+    config.finalLayout = finalLayout;
+    config.depthFormat = find_depth_format(gpuDevice);
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(gpuDevice, &properties);
+    VkSampleCountFlags supported = properties.limits.framebufferColorSampleCounts;
+    if (config.depthFormat != VK_FORMAT_UNDEFINED) {
+        supported &= properties.limits.framebufferDepthSampleCounts;
+    }
+    config.samples = VK_SAMPLE_COUNT_1_BIT;
+    for (uint32_t samples = VK_SAMPLE_COUNT_64_BIT; samples > VK_SAMPLE_COUNT_1_BIT; samples >>= 1) {
+        if (samples <= requestedSamples && (supported & samples)) {
+            config.samples = static_cast<VkSampleCountFlagBits>(samples);
+            break;
+        }
+    }
+    printf("\tRender pass: %d sample(s), depth format %d\n", config.samples, config.depthFormat);
+    return config;
+}
+
+VkRenderPass create_render_pass(VkDevice& logical_device, const RenderPassConfig& config)
+{
+    RenderPassBuilder builder;
+    const bool multisampled = config.samples != VK_SAMPLE_COUNT_1_BIT;
+    std::vector<uint32_t> colors;
+    std::vector<uint32_t> resolves;
+    if (multisampled) {
+        colors.push_back(add_color_attachment(builder, config.colorFormat, config.samples, true,
+            VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL));
+        resolves.push_back(add_resolve_attachment(builder, config.colorFormat, config.finalLayout));
+    } else {
+        colors.push_back(add_color_attachment(builder, config.colorFormat, VK_SAMPLE_COUNT_1_BIT, false,
+            config.finalLayout));
+    }
+    int32_t depth = -1;
+    if (config.depthFormat != VK_FORMAT_UNDEFINED) {
+        depth = add_depth_attachment(builder, config.depthFormat, config.samples, true);
+    }
+    add_subpass(builder, colors, resolves, {}, depth);
+
+    // Transient attachments are shared by all framebuffers, so also order against the previous pass
+    VkSubpassDependency dependency = {};
+    dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
+    dependency.dstSubpass = 0;
+    dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+        VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    dependency.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+    dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+        VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    builder.dependencies.push_back(dependency);
+    return build_render_pass(logical_device, builder);
+}
+
+std::vector<VkClearValue> make_clear_values(const RenderPassConfig& config)
+{
+    std::vector<VkClearValue> clearValues;
+    VkClearValue clearColor = {0.0f, 0.0f, 0.0f, 1.0f};
+    clearValues.push_back(clearColor);
+    if (config.samples != VK_SAMPLE_COUNT_1_BIT) {
+        clearValues.push_back(clearColor);
+    }
+    if (config.depthFormat != VK_FORMAT_UNDEFINED) {
+        VkClearValue clearDepth = {};
+        clearDepth.depthStencil = {1.0f, 0};
+        clearValues.push_back(clearDepth);
+    }
+    return clearValues;
+}
+
+TransientAttachments create_transient_attachments(VkPhysicalDevice& gpuDevice,
+VkDevice& logical_device,
+const RenderPassConfig& config,
+VkExtent2D extent)
+{
+    TransientAttachments transient;
+    transient.hasColor = config.samples != VK_SAMPLE_COUNT_1_BIT;
+    transient.hasDepth = config.depthFormat != VK_FORMAT_UNDEFINED;
+    if (transient.hasColor) {
+        transient.color = create_image(gpuDevice, logical_device, extent, config.colorFormat,
+            VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT,
+            VK_IMAGE_ASPECT_COLOR_BIT, config.samples);
+    }
+    if (transient.hasDepth) {
+        transient.depth = create_image(gpuDevice, logical_device, extent, config.depthFormat,
+            VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT,
+            VK_IMAGE_ASPECT_DEPTH_BIT | (has_stencil(config.depthFormat) ? VK_IMAGE_ASPECT_STENCIL_BIT : 0),
+            config.samples);
+    }
+    return transient;
+}
+
+std::vector<VkImageView> make_framebuffer_attachments(const TransientAttachments& transient, VkImageView target)
+{
+    std::vector<VkImageView> attachments;
+    if (transient.hasColor) {
+        attachments.push_back(transient.color.view);
+    }
+    attachments.push_back(target);
+    if (transient.hasDepth) {
+        attachments.push_back(transient.depth.view);
+    }
+    return attachments;
+}
+
+void destroy_transient_attachments(VkDevice& logical_device, TransientAttachments& transient)
+{
+    if (transient.hasColor) {
+        destroy_image(logical_device, transient.color);
+    }
+    if (transient.hasDepth) {
+        destroy_image(logical_device, transient.depth);
+    }
+}
+
+bool parse_subpass_test_option(int argc, char* argv[])
+{
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--subpass-test")) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool run_subpass_test(VkInstance& instance, VkPhysicalDevice& gpu, const std::vector<const char*>& enabledLayerNames)
+{
+    printf("---Testing input attachments between subpasses\n");
+    auto context = create_offscreen_context(instance, gpu, enabledLayerNames);
+    auto& device = context.device;
+    auto& scheduler = context.scheduler;
+    VK_LOAD_DEVICE_FUNCTION(device, vkCreateFramebuffer)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCreateCommandPool)
+    VK_LOAD_DEVICE_FUNCTION(device, vkAllocateCommandBuffers)
+    VK_LOAD_DEVICE_FUNCTION(device, vkBeginCommandBuffer)
+    VK_LOAD_DEVICE_FUNCTION(device, vkEndCommandBuffer)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdBeginRenderPass)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdNextSubpass)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdEndRenderPass)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCreateShaderModule)
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyShaderModule)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCreateDescriptorSetLayout)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCreatePipelineLayout)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCreateDescriptorPool)
+    VK_LOAD_DEVICE_FUNCTION(device, vkAllocateDescriptorSets)
+    VK_LOAD_DEVICE_FUNCTION(device, vkUpdateDescriptorSets)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdBindPipeline)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdBindDescriptorSets)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdDraw)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdPipelineBarrier)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdCopyImageToBuffer)
+    VK_LOAD_DEVICE_FUNCTION(device, vkInvalidateMappedMemoryRanges)
+
+    bool succeeded = true;
+    auto check = [&](bool condition, const char* what) {
+        printf("\t%s: %s\n", what, condition ? "ok" : "FAILED");
+        succeeded = succeeded && condition;
+    };
+    // Subpass 0 fills a transient color and depth buffer, subpass 1 reads both and writes the target
+    const VkFormat format = VK_FORMAT_R8G8B8A8_UNORM;
+    VkFormat depthFormat = find_depth_format(gpu);
+    if (has_stencil(depthFormat)) {
+        // Input attachment views have a single aspect, a combined format would need separate views
+        depthFormat = VK_FORMAT_UNDEFINED;
+    }
+    RenderPassBuilder builder;
+    const uint32_t gbuffer = add_color_attachment(builder, format, VK_SAMPLE_COUNT_1_BIT, true,
+        VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+    const int32_t depth = depthFormat == VK_FORMAT_UNDEFINED ? -1 :
+        static_cast<int32_t>(add_depth_attachment(builder, depthFormat, VK_SAMPLE_COUNT_1_BIT, true));
+    const uint32_t target = add_color_attachment(builder, format, VK_SAMPLE_COUNT_1_BIT, false,
+        VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+    std::vector<uint32_t> inputs = {gbuffer};
+    if (depth >= 0) {
+        inputs.push_back(depth);
+    }
+    add_subpass(builder, {gbuffer}, {}, {}, depth);
+    add_subpass(builder, {target}, {}, inputs, -1);
+
+    const auto& reading = builder.subpasses[1];
+    check(reading.inputs.size() == inputs.size() &&
+        reading.inputs[0].layout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL &&
+        (depth < 0 || reading.inputs[1].layout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL),
+        "input attachment layouts");
+    bool dependencies = builder.dependencies.size() == inputs.size();
+    for (size_t i = 0; dependencies && i < builder.dependencies.size(); ++i) {
+        const auto& dependency = builder.dependencies[i];
+        const bool depthInput = depth >= 0 && inputs[i] == static_cast<uint32_t>(depth);
+        dependencies = dependency.srcSubpass == 0 && dependency.dstSubpass == 1 &&
+            dependency.dependencyFlags == VK_DEPENDENCY_BY_REGION_BIT &&
+            dependency.srcAccessMask == (depthInput ? VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT :
+                VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT) &&
+            dependency.dstAccessMask == VK_ACCESS_INPUT_ATTACHMENT_READ_BIT;
+    }
+    check(dependencies, "by-region dependency per input attachment");
+    auto renderPass = build_render_pass(device, builder);
+
+    // Lazily allocated where the device can, the attachments never leave tile memory.
+    // At most 256 wide and high, so pixel coordinates fit the 8 bit channels exactly
+    VkExtent2D extent = {64, 64};
+    std::vector<AllocatedImage> images;
+    images.push_back(create_image(gpu, device, extent, format, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+        VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT, VK_IMAGE_ASPECT_COLOR_BIT));
+    if (depth >= 0) {
+        images.push_back(create_image(gpu, device, extent, depthFormat, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT |
+            VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT, VK_IMAGE_ASPECT_DEPTH_BIT));
+    }
+    images.push_back(create_image(gpu, device, extent, format, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+        VK_IMAGE_USAGE_TRANSFER_SRC_BIT, VK_IMAGE_ASPECT_COLOR_BIT));
+    std::vector<VkImageView> attachments;
+    std::vector<VkClearValue> clearValues;
+    for (const auto& image : images) {
+        attachments.push_back(image.view);
+        VkClearValue clearValue = {};
+        if (is_depth_format(image.format)) {
+            clearValue.depthStencil = {1.0f, 0};
+        } else {
+            clearValue.color = {{0.0f, 0.0f, 0.0f, 1.0f}};
+        }
+        clearValues.push_back(clearValue);
+    }
+    VkFramebuffer framebuffer;
+    VkFramebufferCreateInfo framebufferInfo = {};
+    framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+    framebufferInfo.renderPass = renderPass;
+    framebufferInfo.attachmentCount = static_cast<uint32_t>(attachments.size());
+    framebufferInfo.pAttachments = attachments.data();
+    framebufferInfo.width = extent.width;
+    framebufferInfo.height = extent.height;
+    framebufferInfo.layers = 1;
+    vkCheckResult(vkCreateFramebuffer(device, &framebufferInfo, nullptr, &framebuffer));
+
+    // Subpass 1 reads the color of subpass 0, depth stays an input of the subpass the shader ignores
+    VkDescriptorSetLayoutBinding binding = {};
+    binding.binding = 0;
+    binding.descriptorType = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+    binding.descriptorCount = 1;
+    binding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+    VkDescriptorSetLayoutCreateInfo setLayoutInfo = {};
+    setLayoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    setLayoutInfo.bindingCount = 1;
+    setLayoutInfo.pBindings = &binding;
+    VkDescriptorSetLayout setLayout;
+    vkCheckResult(vkCreateDescriptorSetLayout(device, &setLayoutInfo, nullptr, &setLayout));
+    VkPipelineLayoutCreateInfo layoutInfo = {};
+    layoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    layoutInfo.setLayoutCount = 1;
+    layoutInfo.pSetLayouts = &setLayout;
+    VkPipelineLayout pipelineLayout;
+    vkCheckResult(vkCreatePipelineLayout(device, &layoutInfo, nullptr, &pipelineLayout));
+
+    VkDescriptorPoolSize poolSize = {};
+    poolSize.type = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+    poolSize.descriptorCount = 1;
+    VkDescriptorPoolCreateInfo descriptorPoolInfo = {};
+    descriptorPoolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    descriptorPoolInfo.maxSets = 1;
+    descriptorPoolInfo.poolSizeCount = 1;
+    descriptorPoolInfo.pPoolSizes = &poolSize;
+    VkDescriptorPool descriptorPool;
+    vkCheckResult(vkCreateDescriptorPool(device, &descriptorPoolInfo, nullptr, &descriptorPool));
+    VkDescriptorSetAllocateInfo setInfo = {};
+    setInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    setInfo.descriptorPool = descriptorPool;
+    setInfo.descriptorSetCount = 1;
+    setInfo.pSetLayouts = &setLayout;
+    VkDescriptorSet descriptorSet;
+    vkCheckResult(vkAllocateDescriptorSets(device, &setInfo, &descriptorSet));
+    VkDescriptorImageInfo inputInfo = {};
+    inputInfo.imageView = images[gbuffer].view;
+    inputInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    VkWriteDescriptorSet write = {};
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.dstSet = descriptorSet;
+    write.dstBinding = 0;
+    write.descriptorCount = 1;
+    write.descriptorType = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+    write.pImageInfo = &inputInfo;
+    vkUpdateDescriptorSets(device, 1, &write, 0, nullptr);
+
+    auto vertShader = load_shader("fullscreen.spv");
+    auto writeShader = load_shader("subpass_write.spv");
+    auto readShader = load_shader("subpass_read.spv");
+    VkShaderModule vertModule = create_shader_module(vkCreateShaderModule, device, vertShader);
+    VkShaderModule writeModule = create_shader_module(vkCreateShaderModule, device, writeShader);
+    VkShaderModule readModule = create_shader_module(vkCreateShaderModule, device, readShader);
+    ShaderVariant noConstants;
+    VkPipelineShaderStageCreateInfo writeStages[] = {
+        create_shader_stage(VK_SHADER_STAGE_VERTEX_BIT, vertModule, noConstants),
+        create_shader_stage(VK_SHADER_STAGE_FRAGMENT_BIT, writeModule, noConstants)};
+    VkPipelineShaderStageCreateInfo readStages[] = {
+        create_shader_stage(VK_SHADER_STAGE_VERTEX_BIT, vertModule, noConstants),
+        create_shader_stage(VK_SHADER_STAGE_FRAGMENT_BIT, readModule, noConstants)};
+    const RenderPassConfig writeConfig = {format, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_SAMPLE_COUNT_1_BIT,
+        depthFormat};
+    const RenderPassConfig readConfig = {format, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_SAMPLE_COUNT_1_BIT,
+        VK_FORMAT_UNDEFINED};
+    VkPipeline writePipeline = create_pipeline(device, writeStages, extent, renderPass, writeConfig, pipelineLayout,
+        false, nullptr, 0);
+    VkPipeline readPipeline = create_pipeline(device, readStages, extent, renderPass, readConfig, pipelineLayout,
+        false, nullptr, 1);
+    vkDestroyShaderModule(device, vertModule, nullptr);
+    vkDestroyShaderModule(device, writeModule, nullptr);
+    vkDestroyShaderModule(device, readModule, nullptr);
+
+    const VkDeviceSize imageBytes = static_cast<VkDeviceSize>(extent.width) * extent.height * 4;
+    auto readback = create_buffer(gpu, device, imageBytes, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
+
+    VkCommandPool commandPool;
+    VkCommandPoolCreateInfo poolInfo = {};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.queueFamilyIndex = context.queueFamily;
+    vkCheckResult(vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool));
+    VkCommandBuffer cmd;
+    VkCommandBufferAllocateInfo allocInfo = {};
+    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocInfo.commandPool = commandPool;
+    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    allocInfo.commandBufferCount = 1;
+    vkCheckResult(vkAllocateCommandBuffers(device, &allocInfo, &cmd));
+    VkCommandBufferBeginInfo beginInfo = {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    vkCheckResult(vkBeginCommandBuffer(cmd, &beginInfo));
+    VkRenderPassBeginInfo renderPassInfo = {};
+    renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+    renderPassInfo.renderPass = renderPass;
+    renderPassInfo.framebuffer = framebuffer;
+    renderPassInfo.renderArea.extent = extent;
+    renderPassInfo.clearValueCount = static_cast<uint32_t>(clearValues.size());
+    renderPassInfo.pClearValues = clearValues.data();
+    vkCmdBeginRenderPass(cmd, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, writePipeline);
+    vkCmdDraw(cmd, 3, 1, 0, 0);
+    vkCmdNextSubpass(cmd, VK_SUBPASS_CONTENTS_INLINE);
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, readPipeline);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSet, 0, nullptr);
+    vkCmdDraw(cmd, 3, 1, 0, 0);
+    vkCmdEndRenderPass(cmd);
+    record_image_barrier(cmd, images.back().image, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+        VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT,
+        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1);
+    VkBufferImageCopy region = {};
+    region.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+    region.imageExtent = {extent.width, extent.height, 1};
+    vkCmdCopyImageToBuffer(cmd, images.back().image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, readback.buffer, 1, &region);
+    VkBufferMemoryBarrier hostBarrier = {};
+    hostBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    hostBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    hostBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    hostBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    hostBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    hostBarrier.buffer = readback.buffer;
+    hostBarrier.offset = 0;
+    hostBarrier.size = imageBytes;
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr,
+        1, &hostBarrier, 0, nullptr);
+    vkCheckResult(vkEndCommandBuffer(cmd));
+    ScheduledSubmit submit;
+    submit.commandBuffers.push_back(cmd);
+    scheduler_wait(scheduler, SCHEDULER_GRAPHICS, scheduler_submit(scheduler, SCHEDULER_GRAPHICS, submit));
+    printf("\tTwo subpass render pass executed\n");
+
+    // Subpass 0 wrote (x, y) to the gbuffer, subpass 1 swapped them into the target. The clear color
+    // or an unswapped copy means the input attachment wasn't read
+    invalidate_mapped(device, readback);
+    const uint8_t* texels = static_cast<const uint8_t*>(readback.mapped);
+    bool matches = true;
+    for (uint32_t y = 0; matches && y < extent.height; ++y) {
+        for (uint32_t x = 0; matches && x < extent.width; ++x) {
+            const uint8_t* texel = texels + (static_cast<VkDeviceSize>(y) * extent.width + x) * 4;
+            matches = std::abs(texel[0] - static_cast<int>(y)) <= 1 && std::abs(texel[1] - static_cast<int>(x)) <= 1 &&
+                texel[2] == 255 && texel[3] == 255;
+            if (!matches) {
+                printf("\tPixel (%d, %d) is (%d, %d, %d, %d)\n", x, y, texel[0], texel[1], texel[2], texel[3]);
+            }
+        }
+    }
+    check(matches, "second subpass reads what the first wrote");
+
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyCommandPool)
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyFramebuffer)
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyRenderPass)
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyPipeline)
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyPipelineLayout)
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyDescriptorPool)
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyDescriptorSetLayout)
+    vkDestroyCommandPool(device, commandPool, nullptr);
+    destroy_buffer(device, readback);
+    vkDestroyPipeline(device, writePipeline, nullptr);
+    vkDestroyPipeline(device, readPipeline, nullptr);
+    vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
+    vkDestroyDescriptorPool(device, descriptorPool, nullptr);
+    vkDestroyDescriptorSetLayout(device, setLayout, nullptr);
+    vkDestroyFramebuffer(device, framebuffer, nullptr);
+    for (auto& image : images) {
+        destroy_image(device, image);
+    }
+    vkDestroyRenderPass(device, renderPass, nullptr);
+    destroy_offscreen_context(context);
+    return succeeded;
+}
+
+GraphAccessInfo graph_access_info(GraphAccess access)
+{
+    switch (access) {
+        case GRAPH_ACCESS_COLOR_ATTACHMENT:
+            return {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+                VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, true};
+        case GRAPH_ACCESS_DEPTH_ATTACHMENT:
+            return {VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+                VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+                VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, true};
+        case GRAPH_ACCESS_SHADER_READ:
+            return {VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, false};
+        case GRAPH_ACCESS_STORAGE_READ:
+            return {VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_LAYOUT_GENERAL, false};
+        case GRAPH_ACCESS_STORAGE_WRITE:
+            return {VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+                VK_IMAGE_LAYOUT_GENERAL, true};
+        case GRAPH_ACCESS_TRANSFER_SRC:
+            return {VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, false};
+        case GRAPH_ACCESS_TRANSFER_DST:
+            return {VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, true};
+        case GRAPH_ACCESS_HOST_READ:
+            return {VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT, VK_IMAGE_LAYOUT_GENERAL, false};
+        case GRAPH_ACCESS_PRESENT:
+            return {VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, false};
+    }
+    throw VulkanException("Unknown graph access");
+}
+
+GraphResource make_graph_resource(const std::string& name, bool isImage, bool imported)
+{
+    GraphResource resource = {};
+    resource.name = name;
+    resource.isImage = isImage;
+    resource.imported = imported;
+    resource.image = VK_NULL_HANDLE;
+    resource.view = VK_NULL_HANDLE;
+    resource.buffer = VK_NULL_HANDLE;
+    resource.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    resource.output = false;
+    resource.firstPass = -1;
+    resource.lastPass = -1;
+    resource.aliasOf = -1;
+    return resource;
+}
+
+// Imported images are synchronized externally (fences, semaphores) before the graph runs
+uint32_t graph_import_image(RenderGraph& graph, const std::string& name, VkImageLayout initialLayout, VkImageAspectFlags aspect)
+{
+    auto resource = make_graph_resource(name, true, true);
+    resource.initialLayout = initialLayout;
+    resource.aspect = aspect;
+    graph.resources.push_back(resource);
+    return static_cast<uint32_t>(graph.resources.size() - 1);
+}
+
+uint32_t graph_import_buffer(RenderGraph& graph, const std::string& name)
+{
+    graph.resources.push_back(make_graph_resource(name, false, true));
+    return static_cast<uint32_t>(graph.resources.size() - 1);
+}
+
+// Image owned by the graph, its memory may be aliased with other transient images
+uint32_t graph_create_image(RenderGraph& graph,
+const std::string& name,
+VkExtent2D extent,
+VkFormat format,
+VkImageUsageFlags usage,
+VkImageAspectFlags aspect)
+{
+    auto resource = make_graph_resource(name, true, false);
+    resource.extent = extent;
+    resource.format = format;
+    resource.usage = usage;
+    resource.aspect = aspect;
+    graph.resources.push_back(resource);
+    return static_cast<uint32_t>(graph.resources.size() - 1);
+}
+
+void graph_bind_image(RenderGraph& graph, uint32_t resource, VkImage image, VkImageView view)
+{
+    graph.resources[resource].image = image;
+    graph.resources[resource].view = view;
+}
+
+void graph_bind_buffer(RenderGraph& graph, uint32_t resource, VkBuffer buffer)
+{
+    graph.resources[resource].buffer = buffer;
+}
+
+uint32_t graph_add_pass(RenderGraph& graph, const std::string& name, std::function<void(VkCommandBuffer)> record)
+{
+    GraphPass pass;
+    pass.name = name;
+    pass.record = record;
+    pass.culled = false;
+    graph.passes.push_back(pass);
+    return static_cast<uint32_t>(graph.passes.size() - 1);
+}
+
+void graph_use(RenderGraph& graph, uint32_t pass, uint32_t resource, GraphAccess access)
+{
+    graph.passes[pass].uses.push_back({resource, access});
+}
+
+// Outputs keep their passes alive and end up in the state of finalAccess
+void graph_set_output(RenderGraph& graph, uint32_t resource, GraphAccess finalAccess)
+{
+    graph.resources[resource].output = true;
+    graph.resources[resource].outputAccess = finalAccess;
+}
+
+/*The last write and the reads since. A transition counts as part of the last
+write, it is ordered before the stage of the barrier that did it*/
+struct GraphResourceState
+{
+    VkImageLayout layout;
+    VkPipelineStageFlags writeStage; // TOP_OF_PIPE until something wrote the resource
+    VkAccessFlags writeAccess;
+    VkPipelineStageFlags readStages;
+    VkAccessFlags readAccess;
+};
+
+void add_graph_barrier(GraphBarrierBatch& batch,
+const GraphResource& resource,
+uint32_t resourceIndex,
+GraphResourceState& state,
+const GraphAccessInfo& info)
+{
+    const bool layoutChange = resource.isImage && state.layout != info.layout;
+    const bool written = state.writeStage != VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+    if (layoutChange || info.write) {
+        // Write after read only needs an execution dependency, the last write a memory one too
+        batch.srcStage |= state.writeStage | state.readStages;
+    } else if (written && ((info.stage & ~state.readStages) || (info.access & ~state.readAccess))) {
+        // Every reader has to be made visible to the last write, not just the first one
+        batch.srcStage |= state.writeStage;
+    } else {
+        // Read after read: nothing to wait for, later writers wait on both readers
+        state.readStages |= info.stage;
+        state.readAccess |= info.access;
+        return;
+    }
+    batch.dstStage |= info.stage;
+    if (layoutChange || state.writeAccess) {
+        if (resource.isImage) {
+            VkImageMemoryBarrier barrier = {};
+            barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+            barrier.srcAccessMask = state.writeAccess;
+            barrier.dstAccessMask = info.access;
+            barrier.oldLayout = state.layout;
+            barrier.newLayout = info.layout;
+            barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            barrier.subresourceRange.aspectMask = resource.aspect;
+            barrier.subresourceRange.baseMipLevel = 0;
+            barrier.subresourceRange.levelCount = VK_REMAINING_MIP_LEVELS;
+            barrier.subresourceRange.baseArrayLayer = 0;
+            barrier.subresourceRange.layerCount = VK_REMAINING_ARRAY_LAYERS;
+            batch.images.push_back(barrier);
+            batch.imageResources.push_back(resourceIndex);
+        } else {
+            VkBufferMemoryBarrier barrier = {};
+            barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+            barrier.srcAccessMask = state.writeAccess;
+            barrier.dstAccessMask = info.access;
+            barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            barrier.offset = 0;
+            barrier.size = VK_WHOLE_SIZE;
+            batch.buffers.push_back(barrier);
+            batch.bufferResources.push_back(resourceIndex);
+        }
+    }
+    if (info.write) {
+        state = {info.layout, info.stage, info.access, 0, 0};
+        return;
+    }
+    if (layoutChange) {
+        // Readers of the old layout are done, later readers chain through this one
+        state.writeStage |= info.stage;
+        state.readStages = 0;
+        state.readAccess = 0;
+    }
+    state.layout = info.layout;
+    state.readStages |= info.stage;
+    state.readAccess |= info.access;
+}
+
+void cull_graph_passes(RenderGraph& graph)
+{
+    std::vector<bool> needed(graph.resources.size());
+    for (size_t i = 0; i < graph.resources.size(); ++i) {
+        needed[i] = graph.resources[i].output;
+    }
+    for (size_t p = graph.passes.size(); p-- > 0;) {
+        auto& pass = graph.passes[p];
+        pass.culled = true;
+        for (const auto& use : pass.uses) {
+            if (graph_access_info(use.access).write && needed[use.resource]) {
+                pass.culled = false;
+            }
+        }
+        if (pass.culled) {
+            printf("\tCulled render graph pass: %s\n", pass.name.c_str());
+            continue;
+        }
+        for (const auto& use : pass.uses) {
+            if (!graph_access_info(use.access).write) {
+                needed[use.resource] = true;
+            }
+        }
+    }
+}
+
+/*Greedy first fit: a transient image reuses the block of one whose last pass
+is already over. Images only alias within one allocation per memory type, the
+requirements of different formats and usages don't have to share a type*/
+void alias_graph_memory(VkPhysicalDevice& gpuDevice, VkDevice& logical_device, RenderGraph& graph)
+{
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkCreateImage)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkGetImageMemoryRequirements)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkAllocateMemory)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkBindImageMemory)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkCreateImageView)
+
+    struct MemoryBlock
+    {
+        VkDeviceSize offset;
+        VkDeviceSize size;
+        int32_t lastPass;
+        uint32_t resource;
+    };
+    struct GraphAllocation
+    {
+        uint32_t memoryType;
+        VkDeviceSize size;
+        std::vector<MemoryBlock> blocks;
+    };
+    std::vector<GraphAllocation> allocations;
+    std::vector<uint32_t> order;
+    for (uint32_t i = 0; i < graph.resources.size(); ++i) {
+        if (!graph.resources[i].imported && graph.resources[i].firstPass >= 0) {
+            order.push_back(i);
+        }
+    }
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return graph.resources[a].firstPass < graph.resources[b].firstPass;
+    });
+
+    VkDeviceSize unaliasedSize = 0;
+    for (const auto& index : order) {
+        auto& resource = graph.resources[index];
+        auto imageInfo = make_image_info(resource.extent, resource.format, resource.usage, VK_SAMPLE_COUNT_1_BIT, 1);
+        vkCheckResult(vkCreateImage(logical_device, &imageInfo, nullptr, &resource.image));
+        VkMemoryRequirements requirement;
+        vkGetImageMemoryRequirements(logical_device, resource.image, &requirement);
+        unaliasedSize += requirement.size;
+        const uint32_t memoryType = find_memory_type(gpuDevice, requirement.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        size_t allocationIndex = 0;
+        while (allocationIndex < allocations.size() && allocations[allocationIndex].memoryType != memoryType) {
+            ++allocationIndex;
+        }
+        if (allocationIndex == allocations.size()) {
+            allocations.push_back({memoryType, 0, {}});
+        }
+        auto& allocation = allocations[allocationIndex];
+        resource.memoryIndex = static_cast<uint32_t>(allocationIndex);
+
+        // An output is read after the graph, its block must never be handed on
+        const int32_t lastPass = resource.output ? static_cast<int32_t>(graph.passes.size()) : resource.lastPass;
+        bool placed = false;
+        for (auto& block : allocation.blocks) {
+            const VkDeviceSize offset = (block.offset + requirement.alignment - 1) / requirement.alignment * requirement.alignment;
+            if (block.lastPass < resource.firstPass && offset + requirement.size <= block.offset + block.size) {
+                resource.memoryOffset = offset;
+                resource.aliasOf = block.resource;
+                block.lastPass = lastPass;
+                block.resource = index;
+                placed = true;
+                break;
+            }
+        }
+        if (!placed) {
+            const VkDeviceSize offset = (allocation.size + requirement.alignment - 1) / requirement.alignment * requirement.alignment;
+            resource.memoryOffset = offset;
+            allocation.size = offset + requirement.size;
+            allocation.blocks.push_back({offset, requirement.size, lastPass, index});
+        }
+    }
+    if (order.empty()) {
+        return;
+    }
+
+    for (const auto& allocation : allocations) {
+        VkMemoryAllocateInfo allocInfo = {};
+        allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        allocInfo.allocationSize = allocation.size;
+        allocInfo.memoryTypeIndex = allocation.memoryType;
+        VkDeviceMemory memory;
+        vkCheckResult(vkAllocateMemory(logical_device, &allocInfo, nullptr, &memory));
+        graph.memory.push_back(memory);
+        graph.memorySize += allocation.size;
+    }
+    printf("\tRender graph memory: %llu bytes in %d allocations (%llu without aliasing)\n",
+        static_cast<unsigned long long>(graph.memorySize), static_cast<int>(allocations.size()),
+        static_cast<unsigned long long>(unaliasedSize));
+
+    for (const auto& index : order) {
+        auto& resource = graph.resources[index];
+        vkCheckResult(vkBindImageMemory(logical_device, resource.image, graph.memory[resource.memoryIndex], resource.memoryOffset));
+        VkImageViewCreateInfo viewInfo = {};
+        viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+        viewInfo.image = resource.image;
+        viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+        viewInfo.format = resource.format;
+        viewInfo.subresourceRange.aspectMask = resource.aspect;
+        viewInfo.subresourceRange.baseMipLevel = 0;
+        viewInfo.subresourceRange.levelCount = 1;
+        viewInfo.subresourceRange.baseArrayLayer = 0;
+        viewInfo.subresourceRange.layerCount = 1;
+        vkCheckResult(vkCreateImageView(logical_device, &viewInfo, nullptr, &resource.view));
+    }
+}
+
+void compile_render_graph(VkPhysicalDevice& gpuDevice, VkDevice& logical_device, RenderGraph& graph)
+{
+    printf("---Compiling render graph\n");
+    graph.memory.clear();
+    graph.memorySize = 0;
+    cull_graph_passes(graph);
+
+    for (uint32_t p = 0; p < graph.passes.size(); ++p) {
+        if (graph.passes[p].culled) {
+            continue;
+        }
+        for (const auto& use : graph.passes[p].uses) {
+            auto& resource = graph.resources[use.resource];
+            if (resource.firstPass < 0) {
+                resource.firstPass = p;
+            }
+            resource.lastPass = p;
+        }
+    }
+    alias_graph_memory(gpuDevice, logical_device, graph);
+
+    std::vector<GraphResourceState> states(graph.resources.size());
+    for (size_t i = 0; i < graph.resources.size(); ++i) {
+        states[i] = {graph.resources[i].initialLayout, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, 0, 0, 0};
+    }
+    for (auto& pass : graph.passes) {
+        pass.barriers.srcStage = 0;
+        pass.barriers.dstStage = 0;
+        if (pass.culled) {
+            continue;
+        }
+        for (const auto& use : pass.uses) {
+            auto& resource = graph.resources[use.resource];
+            auto& state = states[use.resource];
+            if (resource.aliasOf >= 0 && state.writeStage == VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT && !state.readStages) {
+                // First use of aliased memory waits for the previous occupant
+                const auto& previous = states[resource.aliasOf];
+                state = {VK_IMAGE_LAYOUT_UNDEFINED, previous.writeStage | previous.readStages, previous.writeAccess, 0, 0};
+            }
+            add_graph_barrier(pass.barriers, resource, use.resource, state, graph_access_info(use.access));
+        }
+    }
+
+    graph.finalBarriers.srcStage = 0;
+    graph.finalBarriers.dstStage = 0;
+    for (uint32_t i = 0; i < graph.resources.size(); ++i) {
+        const auto& resource = graph.resources[i];
+        if (resource.output && resource.lastPass >= 0) {
+            add_graph_barrier(graph.finalBarriers, resource, i, states[i], graph_access_info(resource.outputAccess));
+        }
+    }
+}
+
+void record_graph_barriers(VkCommandBuffer commandBuffer, RenderGraph& graph, GraphBarrierBatch& batch)
+{
+    if (!batch.dstStage) {
+        return;
+    }
+    for (size_t i = 0; i < batch.images.size(); ++i) {
+        batch.images[i].image = graph.resources[batch.imageResources[i]].image;
+    }
+    for (size_t i = 0; i < batch.buffers.size(); ++i) {
+        batch.buffers[i].buffer = graph.resources[batch.bufferResources[i]].buffer;
+    }
+    vkCmdPipelineBarrier(commandBuffer, batch.srcStage, batch.dstStage, 0, 0, nullptr,
+        static_cast<uint32_t>(batch.buffers.size()), batch.buffers.data(),
+        static_cast<uint32_t>(batch.images.size()), batch.images.data());
+}
+
+void execute_render_graph(VkCommandBuffer commandBuffer, RenderGraph& graph)
+{
+    for (auto& pass : graph.passes) {
+        if (pass.culled) {
+            continue;
+        }
+        record_graph_barriers(commandBuffer, graph, pass.barriers);
+        pass.record(commandBuffer);
+    }
+    record_graph_barriers(commandBuffer, graph, graph.finalBarriers);
+}
+
+void destroy_render_graph(VkDevice& logical_device, RenderGraph& graph)
+{
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkDestroyImageView)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkDestroyImage)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkFreeMemory)
+    for (auto& resource : graph.resources) {
+        if (!resource.imported && resource.image != VK_NULL_HANDLE) {
+            vkDestroyImageView(logical_device, resource.view, nullptr);
+            vkDestroyImage(logical_device, resource.image, nullptr);
+        }
+    }
+    for (auto& memory : graph.memory) {
+        vkFreeMemory(logical_device, memory, nullptr);
+    }
+    graph.memory.clear();
+    graph.resources.clear();
+    graph.passes.clear();
+}
+
+bool parse_graph_test_option(int argc, char* argv[])
+{
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--graph-test")) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool run_render_graph_test(VkInstance& instance, VkPhysicalDevice& gpu, const std::vector<const char*>& enabledLayerNames)
+{
+    printf("---Testing render graph culling and aliasing\n");
+    auto context = create_offscreen_context(instance, gpu, enabledLayerNames);
+    auto& device = context.device;
+    auto& scheduler = context.scheduler;
+    VK_LOAD_DEVICE_FUNCTION(device, vkCreateCommandPool)
+    VK_LOAD_DEVICE_FUNCTION(device, vkAllocateCommandBuffers)
+    VK_LOAD_DEVICE_FUNCTION(device, vkBeginCommandBuffer)
+    VK_LOAD_DEVICE_FUNCTION(device, vkEndCommandBuffer)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdPipelineBarrier)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdClearColorImage)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdCopyImage)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdCopyImageToBuffer)
+    VK_LOAD_DEVICE_FUNCTION(device, vkInvalidateMappedMemoryRanges)
+
+    bool succeeded = true;
+    auto check = [&](bool condition, const char* what) {
+        printf("\t%s: %s\n", what, condition ? "ok" : "FAILED");
+        succeeded = succeeded && condition;
+    };
+    /*poster is an output cleared before anything else, nothing may take its
+    memory. first is cleared and copied into second, third is cleared once
+    first is done and can take its memory. All three end up in the output
+    buffer, the last pass writes an image nobody reads*/
+    const VkExtent2D extent = {64, 64};
+    const VkFormat format = VK_FORMAT_R8G8B8A8_UNORM;
+    const VkImageUsageFlags usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+    const VkDeviceSize imageBytes = extent.width * extent.height * 4;
+    auto output = create_buffer(gpu, device, 3 * imageBytes, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
+    RenderGraph graph;
+    const uint32_t poster = graph_create_image(graph, "poster", extent, format, usage, VK_IMAGE_ASPECT_COLOR_BIT);
+    graph_set_output(graph, poster, GRAPH_ACCESS_TRANSFER_SRC);
+    const uint32_t first = graph_create_image(graph, "first", extent, format, usage, VK_IMAGE_ASPECT_COLOR_BIT);
+    const uint32_t second = graph_create_image(graph, "second", extent, format, usage, VK_IMAGE_ASPECT_COLOR_BIT);
+    const uint32_t third = graph_create_image(graph, "third", extent, format, usage, VK_IMAGE_ASPECT_COLOR_BIT);
+    const uint32_t unused = graph_create_image(graph, "unused", extent, format, usage, VK_IMAGE_ASPECT_COLOR_BIT);
+    const uint32_t result = graph_import_buffer(graph, "result");
+    graph_bind_buffer(graph, result, output.buffer);
+    graph_set_output(graph, result, GRAPH_ACCESS_HOST_READ);
+
+    VkImageSubresourceRange range = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+    VkImageCopy imageCopy = {};
+    imageCopy.srcSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+    imageCopy.dstSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+    imageCopy.extent = {extent.width, extent.height, 1};
+    auto clear = [&graph, range](uint32_t image, VkClearColorValue color) {
+        return [&graph, range, image, color](VkCommandBuffer commandBuffer) {
+            vkCmdClearColorImage(commandBuffer, graph.resources[image].image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                &color, 1, &range);
+        };
+    };
+    auto copy = [&graph, imageCopy](uint32_t src, uint32_t dst) {
+        return [&graph, imageCopy, src, dst](VkCommandBuffer commandBuffer) {
+            vkCmdCopyImage(commandBuffer, graph.resources[src].image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                graph.resources[dst].image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &imageCopy);
+        };
+    };
+    const VkClearColorValue red = {{1.0f, 0.0f, 0.0f, 1.0f}};
+    const VkClearColorValue blue = {{0.0f, 0.0f, 1.0f, 1.0f}};
+    const VkClearColorValue green = {{0.0f, 1.0f, 0.0f, 1.0f}};
+    uint32_t pass = graph_add_pass(graph, "clear poster", clear(poster, green));
+    graph_use(graph, pass, poster, GRAPH_ACCESS_TRANSFER_DST);
+    pass = graph_add_pass(graph, "clear first", clear(first, red));
+    graph_use(graph, pass, first, GRAPH_ACCESS_TRANSFER_DST);
+    pass = graph_add_pass(graph, "copy first", copy(first, second));
+    graph_use(graph, pass, first, GRAPH_ACCESS_TRANSFER_SRC);
+    graph_use(graph, pass, second, GRAPH_ACCESS_TRANSFER_DST);
+    pass = graph_add_pass(graph, "clear third", clear(third, blue));
+    graph_use(graph, pass, third, GRAPH_ACCESS_TRANSFER_DST);
+    pass = graph_add_pass(graph, "read back", [&graph, second, third, extent, imageBytes, result](VkCommandBuffer commandBuffer) {
+        VkBufferImageCopy region = {};
+        region.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+        region.imageExtent = {extent.width, extent.height, 1};
+        vkCmdCopyImageToBuffer(commandBuffer, graph.resources[second].image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+            graph.resources[result].buffer, 1, &region);
+        region.bufferOffset = imageBytes;
+        vkCmdCopyImageToBuffer(commandBuffer, graph.resources[third].image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+            graph.resources[result].buffer, 1, &region);
+    });
+    graph_use(graph, pass, second, GRAPH_ACCESS_TRANSFER_SRC);
+    graph_use(graph, pass, third, GRAPH_ACCESS_TRANSFER_SRC);
+    graph_use(graph, pass, result, GRAPH_ACCESS_TRANSFER_DST);
+    const uint32_t unusedPass = graph_add_pass(graph, "unused copy", copy(second, unused));
+    graph_use(graph, unusedPass, second, GRAPH_ACCESS_TRANSFER_SRC);
+    graph_use(graph, unusedPass, unused, GRAPH_ACCESS_TRANSFER_DST);
+    compile_render_graph(gpu, device, graph);
+
+    uint32_t culled = 0;
+    for (const auto& graphPass : graph.passes) {
+        culled += graphPass.culled ? 1 : 0;
+    }
+    check(graph.passes[unusedPass].culled && culled == 1, "only the pass without readers is culled");
+    check(graph.resources[unused].image == VK_NULL_HANDLE, "images of culled passes are not created");
+    check(graph.resources[third].aliasOf == static_cast<int32_t>(first) &&
+        graph.resources[third].memoryOffset == graph.resources[first].memoryOffset, "third aliases first");
+    check(graph.resources[second].aliasOf < 0, "second overlaps both and keeps its memory");
+    bool posterKept = graph.resources[poster].aliasOf < 0;
+    for (const auto& resource : graph.resources) {
+        posterKept = posterKept && resource.aliasOf != static_cast<int32_t>(poster);
+    }
+    check(posterKept, "outputs keep their memory after their last pass");
+    const VkDeviceSize unaliased = 4 * image_memory_size(device, extent, format, usage);
+    check(graph.memorySize < unaliased, "aliasing shrinks the graph memory");
+
+    // The host reads after a shader did, it still has to wait for the storage write before both
+    RenderGraph readers;
+    const uint32_t storage = graph_import_buffer(readers, "storage");
+    graph_set_output(readers, storage, GRAPH_ACCESS_HOST_READ);
+    pass = graph_add_pass(readers, "write storage", [](VkCommandBuffer) {});
+    graph_use(readers, pass, storage, GRAPH_ACCESS_STORAGE_WRITE);
+    pass = graph_add_pass(readers, "read storage", [](VkCommandBuffer) {});
+    graph_use(readers, pass, storage, GRAPH_ACCESS_SHADER_READ);
+    compile_render_graph(gpu, device, readers);
+    check(readers.finalBarriers.buffers.size() == 1 &&
+        (readers.finalBarriers.buffers[0].srcAccessMask & VK_ACCESS_SHADER_WRITE_BIT) &&
+        (readers.finalBarriers.srcStage & VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT),
+        "a second reader waits for the last write");
+    destroy_render_graph(device, readers);
+
+    VkCommandPool commandPool;
+    VkCommandPoolCreateInfo poolInfo = {};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.queueFamilyIndex = context.queueFamily;
+    vkCheckResult(vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool));
+    VkCommandBuffer cmd;
+    VkCommandBufferAllocateInfo allocInfo = {};
+    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocInfo.commandPool = commandPool;
+    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    allocInfo.commandBufferCount = 1;
+    vkCheckResult(vkAllocateCommandBuffers(device, &allocInfo, &cmd));
+    VkCommandBufferBeginInfo beginInfo = {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    vkCheckResult(vkBeginCommandBuffer(cmd, &beginInfo));
+    execute_render_graph(cmd, graph);
+    // The output is read once the graph is done, the final barriers left it in TRANSFER_SRC
+    VkBufferImageCopy posterRegion = {};
+    posterRegion.bufferOffset = 2 * imageBytes;
+    posterRegion.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+    posterRegion.imageExtent = {extent.width, extent.height, 1};
+    vkCmdCopyImageToBuffer(cmd, graph.resources[poster].image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+        output.buffer, 1, &posterRegion);
+    VkBufferMemoryBarrier hostBarrier = {};
+    hostBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    hostBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    hostBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    hostBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    hostBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    hostBarrier.buffer = output.buffer;
+    hostBarrier.offset = 2 * imageBytes;
+    hostBarrier.size = imageBytes;
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr,
+        1, &hostBarrier, 0, nullptr);
+    vkCheckResult(vkEndCommandBuffer(cmd));
+    ScheduledSubmit submit;
+    submit.commandBuffers.push_back(cmd);
+    scheduler_wait(scheduler, SCHEDULER_GRAPHICS, scheduler_submit(scheduler, SCHEDULER_GRAPHICS, submit));
+    invalidate_mapped(device, output);
+    // A missing barrier on the shared memory shows up as blue in the copy of first
+    const uint8_t* texels = static_cast<const uint8_t*>(output.mapped);
+    bool intact = true;
+    for (VkDeviceSize i = 0; i < 2 * imageBytes; i += 4) {
+        const uint8_t expected[4] = {static_cast<uint8_t>(i < imageBytes ? 255 : 0), 0,
+            static_cast<uint8_t>(i < imageBytes ? 0 : 255), 255};
+        intact = intact && !memcmp(texels + i, expected, 4);
+    }
+    check(intact, "aliased images keep their contents while in use");
+    // A transient taking the poster's memory would have painted over the green
+    bool posterIntact = true;
+    for (VkDeviceSize i = 2 * imageBytes; i < 3 * imageBytes; i += 4) {
+        const uint8_t expected[4] = {0, 255, 0, 255};
+        posterIntact = posterIntact && !memcmp(texels + i, expected, 4);
+    }
+    check(posterIntact, "outputs keep their contents after the graph");
+
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyCommandPool)
+    vkDestroyCommandPool(device, commandPool, nullptr);
+    destroy_render_graph(device, graph);
+    destroy_buffer(device, output);
+    destroy_offscreen_context(context);
+    return succeeded;
+}
+
+VkPipelineLayout create_pipeline_layout(VkDevice& logical_device)
+{
+    printf("---Creating pipeline layout\n");
+    VkPushConstantRange pushConstantRange = {};
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = sizeof(TileTransform);
+
+    VkPipelineLayout pipelineLayout;
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
+    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount = 0; // Optional
+    pipelineLayoutInfo.pSetLayouts = nullptr; // Optional
+    pipelineLayoutInfo.pushConstantRangeCount = 1;
+    pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkCreatePipelineLayout)
+    vkCheckResult(vkCreatePipelineLayout(logical_device, &pipelineLayoutInfo, nullptr, &pipelineLayout));
+    return pipelineLayout;
+}
+
+VkPipeline create_pipeline(VkDevice& logical_device, 
+VkPipelineShaderStageCreateInfo shaderStages[], 
+VkExtent2D& swapchainExtent,
+VkRenderPass& renderPass,
+const RenderPassConfig& renderPassConfig,
+VkPipelineLayout& pipelineLayout,
+bool dynamicViewport,
+PFN_vkCreateGraphicsPipelines createGraphicsPipelines,
+uint32_t subpass
+)
+{
+    printf("---Creating pipeline\n");
+    VkPipelineVertexInputStateCreateInfo vertexInputInfo = {};
+    vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+    vertexInputInfo.vertexBindingDescriptionCount = 0;
+    vertexInputInfo.pVertexBindingDescriptions = nullptr; // Optional
+    vertexInputInfo.vertexAttributeDescriptionCount = 0;
+    vertexInputInfo.pVertexAttributeDescriptions = nullptr; // Optional
+
+    VkPipelineInputAssemblyStateCreateInfo inputAssembly = {};
+    inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+    inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+    inputAssembly.primitiveRestartEnable = VK_FALSE;
+
+    VkViewport viewport = {};
+    viewport.x = 0.0f;
+    viewport.y = 0.0f;
+    viewport.width = (float) swapchainExtent.width;
+    viewport.height = (float) swapchainExtent.height;
+    viewport.minDepth = 0.0f;
+    viewport.maxDepth = 1.0f;
+
+    VkRect2D scissor = {};
+    scissor.offset = {0, 0};
+    scissor.extent = swapchainExtent;
+
+    VkPipelineViewportStateCreateInfo viewportState = {};
+    viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+    viewportState.viewportCount = 1;
+    viewportState.pViewports = &viewport;
+    viewportState.scissorCount = 1;
+    viewportState.pScissors = &scissor;
+
+    VkPipelineRasterizationStateCreateInfo rasterizer = {};
+    rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+    rasterizer.depthClampEnable = VK_FALSE;
+    rasterizer.rasterizerDiscardEnable = VK_FALSE;
+    rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
+    rasterizer.lineWidth = 1.0f;
+    rasterizer.cullMode = VK_CULL_MODE_BACK_BIT;
+    rasterizer.frontFace = VK_FRONT_FACE_CLOCKWISE;
+    rasterizer.depthBiasEnable = VK_FALSE;
+    rasterizer.depthBiasConstantFactor = 0.0f; // Optional
+    rasterizer.depthBiasClamp = 0.0f; // Optional
+    rasterizer.depthBiasSlopeFactor = 0.0f; // Optional
+
+    VkPipelineMultisampleStateCreateInfo multisampling = {};
+    multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+    multisampling.sampleShadingEnable = VK_FALSE;
+    multisampling.rasterizationSamples = renderPassConfig.samples;
+    multisampling.minSampleShading = 1.0f; // Optional
+    multisampling.pSampleMask = nullptr; // Optional
+    multisampling.alphaToCoverageEnable = VK_FALSE; // Optional
+    multisampling.alphaToOneEnable = VK_FALSE; // Optional
+
+    VkPipelineColorBlendAttachmentState colorBlendAttachment = {};
+    colorBlendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+    colorBlendAttachment.blendEnable = VK_FALSE;
+    colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_ONE; // Optional
+    colorBlendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ZERO; // Optional
+    colorBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD; // Optional
+    colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE; // Optional
+    colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO; // Optional
+    colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD; // Optional
+
+    VkPipelineColorBlendStateCreateInfo colorBlending = {};
+    colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+    colorBlending.logicOpEnable = VK_FALSE;
+    colorBlending.logicOp = VK_LOGIC_OP_COPY; // Optional
     colorBlending.attachmentCount = 1;
     colorBlending.pAttachments = &colorBlendAttachment;
     colorBlending.blendConstants[0] = 0.0f; // Optional
@@ -820,237 +3032,4054 @@ VkPipelineLayout& pipelineLayout
     colorBlending.blendConstants[2] = 0.0f; // Optional
     colorBlending.blendConstants[3] = 0.0f; // Optional
 
-    VK_LOAD_DEVICE_FUNCTION(logical_device, vkCreateGraphicsPipelines)
-    VkGraphicsPipelineCreateInfo pipelineInfo = {};
-    pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-    pipelineInfo.stageCount = 2;
-    pipelineInfo.pStages = shaderStages;
-    pipelineInfo.pVertexInputState = &vertexInputInfo;
-    pipelineInfo.pInputAssemblyState = &inputAssembly;
-    pipelineInfo.pViewportState = &viewportState;
-    pipelineInfo.pRasterizationState = &rasterizer;
-    pipelineInfo.pMultisampleState = &multisampling;
-    pipelineInfo.pDepthStencilState = nullptr; // Optional
-    pipelineInfo.pColorBlendState = &colorBlending;
-    pipelineInfo.pDynamicState = nullptr; // Optional
-    pipelineInfo.layout = pipelineLayout;
-    pipelineInfo.renderPass = renderPass;
-    pipelineInfo.subpass = 0;
-    pipelineInfo.basePipelineHandle = VK_NULL_HANDLE; // Optional
-    pipelineInfo.basePipelineIndex = -1; // Optional
-    VkPipeline graphicsPipeline;
-    vkCheckResult(vkCreateGraphicsPipelines(logical_device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &graphicsPipeline));
-    printf("---Pipeline created\n");
-    return graphicsPipeline;
+    VkPipelineDepthStencilStateCreateInfo depthStencil = {};
+    depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+    depthStencil.depthTestEnable = VK_TRUE;
+    depthStencil.depthWriteEnable = VK_TRUE;
+    depthStencil.depthCompareOp = VK_COMPARE_OP_LESS;
+    depthStencil.depthBoundsTestEnable = VK_FALSE;
+    depthStencil.stencilTestEnable = VK_FALSE;
+
+    if (!createGraphicsPipelines) {
+        VK_LOAD_DEVICE_FUNCTION(logical_device, vkCreateGraphicsPipelines)
+        createGraphicsPipelines = vkCreateGraphicsPipelines;
+    }
+    VkGraphicsPipelineCreateInfo pipelineInfo = {};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+    pipelineInfo.stageCount = 2;
+    pipelineInfo.pStages = shaderStages;
+    pipelineInfo.pVertexInputState = &vertexInputInfo;
+    pipelineInfo.pInputAssemblyState = &inputAssembly;
+    pipelineInfo.pViewportState = &viewportState;
+    pipelineInfo.pRasterizationState = &rasterizer;
+    pipelineInfo.pMultisampleState = &multisampling;
+    pipelineInfo.pDepthStencilState = renderPassConfig.depthFormat != VK_FORMAT_UNDEFINED ? &depthStencil : nullptr;
+    pipelineInfo.pColorBlendState = &colorBlending;
+    const VkDynamicState dynamicStates[] = {VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR};
+    VkPipelineDynamicStateCreateInfo dynamicState = {};
+    dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+    dynamicState.dynamicStateCount = 2;
+    dynamicState.pDynamicStates = dynamicStates;
+    pipelineInfo.pDynamicState = dynamicViewport ? &dynamicState : nullptr;
+    pipelineInfo.layout = pipelineLayout;
+    pipelineInfo.renderPass = renderPass;
+    pipelineInfo.subpass = subpass;
+    pipelineInfo.basePipelineHandle = VK_NULL_HANDLE; // Optional
+    pipelineInfo.basePipelineIndex = -1; // Optional
+    VkPipeline graphicsPipeline;
+    vkCheckResult(createGraphicsPipelines(logical_device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &graphicsPipeline));
+    printf("---Pipeline created\n");
+    return graphicsPipeline;
+}
+
+PipelineVariant make_pipeline_variant(const char* name, float scale, bool flipY, bool grayscale, int32_t posterizeLevels)
+{
+    PipelineVariant variant;
+    variant.name = name;
+    set_specialization_constant(variant.vertex, SHADER_CONSTANT_SCALE, scale);
+    set_specialization_constant(variant.vertex, SHADER_CONSTANT_FLIP_Y, flipY);
+    set_specialization_constant(variant.fragment, SHADER_CONSTANT_GRAYSCALE, grayscale);
+    set_specialization_constant(variant.fragment, SHADER_CONSTANT_POSTERIZE_LEVELS, posterizeLevels);
+    return variant;
+}
+
+std::vector<VkPipeline> create_pipeline_variants(VkDevice& logical_device,
+VkShaderModule vertModule,
+VkShaderModule fragModule,
+std::vector<PipelineVariant>& variants,
+VkExtent2D& swapchainExtent,
+VkRenderPass& renderPass,
+const RenderPassConfig& renderPassConfig,
+VkPipelineLayout& pipelineLayout,
+bool dynamicViewport,
+PFN_vkCreateGraphicsPipelines createGraphicsPipelines
+)
+{
+    std::vector<VkPipeline> pipelines;
+    for (auto& variant : variants) {
+        printf("---Creating shader stage for variant: %s\n", variant.name);
+        VkPipelineShaderStageCreateInfo shaderStages[] = {
+            create_shader_stage(VK_SHADER_STAGE_VERTEX_BIT, vertModule, variant.vertex),
+            create_shader_stage(VK_SHADER_STAGE_FRAGMENT_BIT, fragModule, variant.fragment)
+        };
+        pipelines.push_back(create_pipeline(logical_device, shaderStages, swapchainExtent, renderPass, renderPassConfig,
+            pipelineLayout, dynamicViewport, createGraphicsPipelines));
+    }
+    return pipelines;
+}
+
+uint32_t parse_msaa_option(int argc, char* argv[])
+{
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (!strcmp(argv[i], "--msaa")) {
+            return std::max(1ul, strtoul(argv[i + 1], nullptr, 10));
+        }
+    }
+    return 1;
+}
+
+bool parse_tiled_options(int argc, char* argv[], TiledRenderOptions& options)
+{
+    bool tiled = false;
+    options.width = 0;
+    options.height = 0;
+    options.tileSize = 2048;
+    options.frames = 1;
+    options.readbackSlots = 3;
+    options.msaa = parse_msaa_option(argc, argv);
+    options.sink = "ppm";
+    options.output = "render.ppm";
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--tiled") && i + 1 < argc) {
+            tiled = sscanf(argv[++i], "%ux%u", &options.width, &options.height) == 2;
+        } else if (!strcmp(argv[i], "--tile-size") && i + 1 < argc) {
+            options.tileSize = std::max(1ul, strtoul(argv[++i], nullptr, 10));
+        } else if (!strcmp(argv[i], "--frames") && i + 1 < argc) {
+            options.frames = std::max(1ul, strtoul(argv[++i], nullptr, 10));
+        } else if (!strcmp(argv[i], "--readback-slots") && i + 1 < argc) {
+            options.readbackSlots = std::max(1ul, strtoul(argv[++i], nullptr, 10));
+        } else if (!strcmp(argv[i], "--sink") && i + 1 < argc) {
+            options.sink = argv[++i];
+        } else if (!strcmp(argv[i], "--output") && i + 1 < argc) {
+            options.output = argv[++i];
+        }
+    }
+    return tiled && options.width && options.height;
+}
+
+/*Every tile is rendered into a tileSize x tileSize target, the transform
+scales the full image up and shifts it so the tile lands on the target*/
+TileTransform make_tile_transform(const TiledRenderOptions& options, uint32_t x, uint32_t y)
+{
+    const float tile = static_cast<float>(options.tileSize);
+    TileTransform transform;
+    transform.scale[0] = options.width / tile;
+    transform.scale[1] = options.height / tile;
+    transform.offset[0] = (static_cast<float>(options.width) - 2.0f * x - tile) / tile;
+    transform.offset[1] = (static_cast<float>(options.height) - 2.0f * y - tile) / tile;
+    return transform;
+}
+
+void write_all(int fd, const uint8_t* data, size_t size)
+{
+    while (size) {
+        ssize_t written = ::write(fd, data, size);
+        if (written < 0) {
+            printf("\tCouldn't write frame data\n");
+            throw std::runtime_error("Couldn't write frame data");
+        }
+        data += written;
+        size -= written;
+    }
+}
+
+void pwrite_all(int fd, const uint8_t* data, size_t size, off_t offset)
+{
+    while (size) {
+        ssize_t written = ::pwrite(fd, data, size, offset);
+        if (written < 0) {
+            printf("\tCouldn't write frame data\n");
+            throw std::runtime_error("Couldn't write frame data");
+        }
+        data += written;
+        offset += written;
+        size -= written;
+    }
+}
+
+/*The first %d or %0Nd in the pattern becomes the frame number, any other
+character is copied as it is. The pattern comes from the command line and is
+never handed to printf*/
+std::string frame_filename(const std::string& pattern, uint32_t frame)
+{
+    std::string name;
+    bool substituted = false;
+    for (size_t i = 0; i < pattern.size(); ++i) {
+        if (pattern[i] != '%' || substituted) {
+            name += pattern[i];
+            continue;
+        }
+        size_t end = i + 1;
+        int width = 0;
+        if (end < pattern.size() && pattern[end] == '0') {
+            ++end;
+            while (end < pattern.size() && end < i + 4 &&
+                pattern[end] >= '0' && pattern[end] <= '9') {
+                width = width * 10 + (pattern[end] - '0');
+                ++end;
+            }
+        }
+        if (end >= pattern.size() || pattern[end] != 'd' || (end > i + 1 && !width)) {
+            name += pattern[i];
+            continue;
+        }
+        char number[32];
+        snprintf(number, sizeof(number), "%0*u", width, frame);
+        name += number;
+        substituted = true;
+        i = end;
+    }
+    return name;
+}
+
+// Binary PPM per frame, regions are written in place so the image never lives in memory
+class PpmSink : public FrameSink
+{
+public:
+    PpmSink(const std::string& pattern, uint32_t width, uint32_t height)
+        : pattern(pattern), width(width), height(height), file(nullptr), headerSize(0), currentFrame(0)
+    {}
+
+    ~PpmSink()
+    {
+        if (file) {
+            fclose(file);
+        }
+    }
+
+    void write(const ReadbackFrame& frame) override
+    {
+        if (!file || frame.frame != currentFrame) {
+            open(frame.frame);
+        }
+        // PPM has no alpha, so this sink is the only one repacking pixels
+        const uint32_t regionWidth = frame.region.extent.width;
+        row.resize(regionWidth * 3);
+        for (uint32_t j = 0; j < frame.region.extent.height; ++j) {
+            const uint8_t* src = frame.data + static_cast<size_t>(j) * regionWidth * 4;
+            for (uint32_t i = 0; i < regionWidth; ++i) {
+                row[i * 3 + 0] = src[i * 4 + 0];
+                row[i * 3 + 1] = src[i * 4 + 1];
+                row[i * 3 + 2] = src[i * 4 + 2];
+            }
+            const off_t offset = headerSize +
+                (static_cast<off_t>(frame.region.offset.y + j) * width + frame.region.offset.x) * 3;
+            if (fseeko(file, offset, SEEK_SET) != 0 || fwrite(row.data(), 1, row.size(), file) != row.size()) {
+                printf("\tCouldn't write frame data\n");
+                throw std::runtime_error("Couldn't write frame data");
+            }
+        }
+        // Buffered errors such as a full disk only show up when the stream is flushed
+        if (fflush(file) != 0) {
+            printf("\tCouldn't write frame data\n");
+            throw std::runtime_error("Couldn't write frame data");
+        }
+    }
+
+private:
+    void open(uint32_t frame)
+    {
+        if (file) {
+            fclose(file);
+        }
+        const std::string filename = frame_filename(pattern, frame);
+        file = fopen(filename.c_str(), "wb");
+        if (!file) {
+            printf("\tCouldn't open output file: %s\n", filename.c_str());
+            throw std::runtime_error("Couldn't open file");
+        }
+        const int written = fprintf(file, "P6\n%u %u\n255\n", width, height);
+        if (written < 0) {
+            printf("\tCouldn't write frame data\n");
+            throw std::runtime_error("Couldn't write frame data");
+        }
+        headerSize = written;
+        currentFrame = frame;
+    }
+
+    std::string pattern;
+    uint32_t width;
+    uint32_t height;
+    FILE* file;
+    off_t headerSize;
+    uint32_t currentFrame;
+    std::vector<uint8_t> row;
+};
+
+// Headerless RGBA8 frames back to back, written straight from the mapped memory
+class RawSink : public FrameSink
+{
+public:
+    RawSink(const std::string& filename, uint32_t width, uint32_t height)
+        : width(width), height(height)
+    {
+        fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            printf("\tCouldn't open output file: %s\n", filename.c_str());
+            throw std::runtime_error("Couldn't open file");
+        }
+    }
+
+    ~RawSink()
+    {
+        ::close(fd);
+    }
+
+    void write(const ReadbackFrame& frame) override
+    {
+        const size_t rowSize = static_cast<size_t>(frame.region.extent.width) * 4;
+        const off_t frameOffset = static_cast<off_t>(frame.frame) * width * height * 4;
+        off_t offset = frameOffset + (static_cast<off_t>(frame.region.offset.y) * width + frame.region.offset.x) * 4;
+        if (frame.region.extent.width == width) {
+            pwrite_all(fd, frame.data, rowSize * frame.region.extent.height, offset);
+            return;
+        }
+        for (uint32_t j = 0; j < frame.region.extent.height; ++j) {
+            pwrite_all(fd, frame.data + j * rowSize, rowSize, offset);
+            offset += static_cast<off_t>(width) * 4;
+        }
+    }
+
+private:
+    uint32_t width;
+    uint32_t height;
+    int fd;
+};
+
+/*Raw RGBA8 stream into a local encoder process, e.g.
+ffmpeg -f rawvideo -pix_fmt rgba -s 1920x1080 -i - out.mp4
+A pipe can't seek, so tiles must cover whole rows of the image*/
+class PipeSink : public FrameSink
+{
+public:
+    PipeSink(const std::string& command, uint32_t width)
+        : width(width)
+    {
+        pipe = popen(command.c_str(), "w");
+        if (!pipe) {
+            printf("\tCouldn't start encoder: %s\n", command.c_str());
+            throw std::runtime_error("Couldn't start encoder");
+        }
+    }
+
+    ~PipeSink()
+    {
+        pclose(pipe);
+    }
+
+    void write(const ReadbackFrame& frame) override
+    {
+        if (frame.region.offset.x != 0 || frame.region.extent.width != width) {
+            printf("\tPipe sink needs full-width tiles\n");
+            throw std::runtime_error("Pipe sink needs full-width tiles");
+        }
+        write_all(fileno(pipe), frame.data, static_cast<size_t>(width) * frame.region.extent.height * 4);
+    }
+
+private:
+    uint32_t width;
+    FILE* pipe;
+};
+
+std::unique_ptr<FrameSink> create_frame_sink(const TiledRenderOptions& options)
+{
+    printf("\tFrame sink: %s -> %s\n", options.sink.c_str(), options.output.c_str());
+    if (options.sink == "raw") {
+        return std::unique_ptr<FrameSink>(new RawSink(options.output, options.width, options.height));
+    } else if (options.sink == "pipe") {
+        return std::unique_ptr<FrameSink>(new PipeSink(options.output, options.width));
+    } else if (options.sink == "ppm") {
+        return std::unique_ptr<FrameSink>(new PpmSink(options.output, options.width, options.height));
+    }
+    printf("\tUnknown frame sink: %s\n", options.sink.c_str());
+    throw std::runtime_error("Unknown frame sink");
+}
+
+ReadbackRing create_readback_ring(VkPhysicalDevice& gpuDevice, VkDevice& logical_device, uint32_t slotCount, VkDeviceSize slotSize)
+{
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkCreateFence)
+    printf("---Creating readback ring: %d x %llu bytes\n", slotCount, static_cast<unsigned long long>(slotSize));
+    ReadbackRing ring;
+    ring.slots.resize(slotCount);
+    ring.next = 0;
+    for (auto& slot : ring.slots) {
+        // Cached memory makes reads from the mapping much faster on most drivers
+        slot.buffer = create_buffer(gpuDevice, logical_device, slotSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
+        VkFenceCreateInfo fenceInfo = {};
+        fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+        vkCheckResult(vkCreateFence(logical_device, &fenceInfo, nullptr, &slot.fence));
+        slot.pending = false;
+        slot.frame.data = static_cast<const uint8_t*>(slot.buffer.mapped);
+    }
+    return ring;
+}
+
+void retire_readback_slot(VkDevice& logical_device, ReadbackSlot& slot, FrameSink& sink)
+{
+    if (!slot.pending) {
+        return;
+    }
+    vkCheckResult(vkWaitForFences(logical_device, 1, &slot.fence, VK_TRUE, std::numeric_limits<uint64_t>::max()));
+    vkCheckResult(vkResetFences(logical_device, 1, &slot.fence));
+    invalidate_mapped(logical_device, slot.buffer);
+    sink.write(slot.frame);
+    slot.pending = false;
+}
+
+// Waits for the oldest slot and returns its index, ready to be recorded into
+uint32_t acquire_readback_slot(VkDevice& logical_device, ReadbackRing& ring, FrameSink& sink)
+{
+    const uint32_t index = ring.next;
+    ring.next = (ring.next + 1) % ring.slots.size();
+    retire_readback_slot(logical_device, ring.slots[index], sink);
+    return index;
+}
+
+void drain_readback_ring(VkDevice& logical_device, ReadbackRing& ring, FrameSink& sink)
+{
+    for (size_t i = 0; i < ring.slots.size(); ++i) {
+        retire_readback_slot(logical_device, ring.slots[(ring.next + i) % ring.slots.size()], sink);
+    }
+}
+
+void destroy_readback_ring(VkDevice& logical_device, ReadbackRing& ring)
+{
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkDestroyFence)
+    for (auto& slot : ring.slots) {
+        vkDestroyFence(logical_device, slot.fence, nullptr);
+        destroy_buffer(logical_device, slot.buffer);
+    }
+    ring.slots.clear();
+}
+
+// Copies slot.frame.region extent from the top-left of image into the slot buffer
+void record_readback_copy(VkCommandBuffer commandBuffer, VkImage image, ReadbackSlot& slot)
+{
+    VkBufferImageCopy copyRegion = {};
+    copyRegion.bufferOffset = 0;
+    copyRegion.bufferRowLength = 0;
+    copyRegion.bufferImageHeight = 0;
+    copyRegion.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    copyRegion.imageSubresource.mipLevel = 0;
+    copyRegion.imageSubresource.baseArrayLayer = 0;
+    copyRegion.imageSubresource.layerCount = 1;
+    copyRegion.imageOffset = {0, 0, 0};
+    copyRegion.imageExtent = {slot.frame.region.extent.width, slot.frame.region.extent.height, 1};
+    vkCmdCopyImageToBuffer(commandBuffer, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+        slot.buffer.buffer, 1, &copyRegion);
+}
+
+void build_tile_graph(TileGraph& tile,
+VkRenderPass renderPass,
+std::vector<VkClearValue> clearValues,
+VkPipeline pipeline,
+VkPipelineLayout pipelineLayout)
+{
+    auto& graph = tile.graph;
+    TileGraph* state = &tile;
+    tile.tileImage = graph_import_image(graph, "tile", VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_ASPECT_COLOR_BIT);
+    tile.readbackBuffer = graph_import_buffer(graph, "readback");
+
+    const uint32_t scene = graph_add_pass(graph, "scene", [=](VkCommandBuffer commandBuffer) {
+        VkRenderPassBeginInfo renderPassInfo = {};
+        renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+        renderPassInfo.renderPass = renderPass;
+        renderPassInfo.framebuffer = state->target->framebuffer;
+        renderPassInfo.renderArea.offset = {0, 0};
+        renderPassInfo.renderArea.extent = state->target->image.extent;
+        renderPassInfo.clearValueCount = static_cast<uint32_t>(clearValues.size());
+        renderPassInfo.pClearValues = clearValues.data();
+        vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+        vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(TileTransform), &state->transform);
+        vkCmdDraw(commandBuffer, 3, 1, 0, 0);
+        vkCmdEndRenderPass(commandBuffer);
+    });
+    graph_use(graph, scene, tile.tileImage, GRAPH_ACCESS_COLOR_ATTACHMENT);
+
+    // Edge tiles copy out only the part that is inside the image
+    const uint32_t readback = graph_add_pass(graph, "readback", [=](VkCommandBuffer commandBuffer) {
+        record_readback_copy(commandBuffer, state->target->image.image, *state->slot);
+    });
+    graph_use(graph, readback, tile.tileImage, GRAPH_ACCESS_TRANSFER_SRC);
+    graph_use(graph, readback, tile.readbackBuffer, GRAPH_ACCESS_TRANSFER_DST);
+    graph_set_output(graph, tile.readbackBuffer, GRAPH_ACCESS_HOST_READ);
+}
+
+void render_tiled(VkInstance& instance,
+VkPhysicalDevice& gpu,
+const std::vector<const char*>& enabledLayerNames,
+TiledRenderOptions& options)
+{
+    printf("---Rendering %d frame(s) of %dx%d offscreen\n", options.frames, options.width, options.height);
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(gpu, &properties);
+    if (options.sink == "pipe") {
+        options.tileSize = std::max(options.tileSize, options.width);
+    }
+    if (options.tileSize > properties.limits.maxImageDimension2D) {
+        options.tileSize = properties.limits.maxImageDimension2D;
+    }
+    printf("\tTile size: %d\n", options.tileSize);
+    auto sink = create_frame_sink(options);
+
+    auto queueFamily = find_graphics_queue_family(gpu);
+    DeviceRequirements requirements = {};
+    DeviceCapabilities capabilities;
+    auto device = create_logical_device(instance, gpu, {queueFamily}, enabledLayerNames, requirements, capabilities);
+    VK_LOAD_INSTANCE_FUNCTION(instance, vkGetDeviceQueue)
+    VkQueue queue;
+    vkGetDeviceQueue(device, queueFamily, 0, &queue);
+
+    printf("---Loading shaders\n");
+    auto vertexShader = load_shader("vert.spv");
+    auto fragmentShader = load_shader("frag.spv");
+    VK_LOAD_DEVICE_FUNCTION(device, vkCreateShaderModule)
+    VkShaderModule vertModule = create_shader_module(vkCreateShaderModule, device, vertexShader);
+    VkShaderModule fragModule = create_shader_module(vkCreateShaderModule, device, fragmentShader);
+
+    const VkFormat format = VK_FORMAT_R8G8B8A8_UNORM;
+    VkExtent2D tileExtent = {options.tileSize, options.tileSize};
+    std::vector<PipelineVariant> pipelineVariants = {
+        make_pipeline_variant("tiled", 1.0f, false, false, 0)
+    };
+    auto renderPassConfig = make_render_pass_config(gpu, format, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, options.msaa);
+    auto renderPass = create_render_pass(device, renderPassConfig);
+    auto clearValues = make_clear_values(renderPassConfig);
+    auto pipelineLayout = create_pipeline_layout(device);
+    auto pipelines = create_pipeline_variants(device, vertModule, fragModule,
+        pipelineVariants, tileExtent, renderPass, renderPassConfig, pipelineLayout);
+    auto transient = create_transient_attachments(gpu, device, renderPassConfig, tileExtent);
+
+    VK_LOAD_DEVICE_FUNCTION(device, vkCreateCommandPool)
+    VK_LOAD_DEVICE_FUNCTION(device, vkAllocateCommandBuffers)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCreateFramebuffer)
+    VK_LOAD_DEVICE_FUNCTION(device, vkWaitForFences)
+    VK_LOAD_DEVICE_FUNCTION(device, vkResetFences)
+    VK_LOAD_DEVICE_FUNCTION(device, vkInvalidateMappedMemoryRanges)
+    VK_LOAD_DEVICE_FUNCTION(device, vkResetCommandBuffer)
+    VK_LOAD_DEVICE_FUNCTION(device, vkBeginCommandBuffer)
+    VK_LOAD_DEVICE_FUNCTION(device, vkEndCommandBuffer)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdBeginRenderPass)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdBindPipeline)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdPushConstants)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdDraw)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdEndRenderPass)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdCopyImageToBuffer)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdPipelineBarrier)
+    VK_LOAD_DEVICE_FUNCTION(device, vkQueueSubmit)
+
+    VkCommandPool commandPool;
+    VkCommandPoolCreateInfo poolInfo = {};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.queueFamilyIndex = queueFamily;
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    vkCheckResult(vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool));
+
+    auto ring = create_readback_ring(gpu, device, options.readbackSlots,
+        static_cast<VkDeviceSize>(options.tileSize) * options.tileSize * 4);
+    std::vector<TileTarget> targets(ring.slots.size());
+    for (auto& target : targets) {
+        target.image = create_image(gpu, device, tileExtent, format,
+            VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, VK_IMAGE_ASPECT_COLOR_BIT);
+
+        auto attachments = make_framebuffer_attachments(transient, target.image.view);
+        VkFramebufferCreateInfo framebufferInfo = {};
+        framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+        framebufferInfo.renderPass = renderPass;
+        framebufferInfo.attachmentCount = static_cast<uint32_t>(attachments.size());
+        framebufferInfo.pAttachments = attachments.data();
+        framebufferInfo.width = tileExtent.width;
+        framebufferInfo.height = tileExtent.height;
+        framebufferInfo.layers = 1;
+        vkCheckResult(vkCreateFramebuffer(device, &framebufferInfo, nullptr, &target.framebuffer));
+
+        VkCommandBufferAllocateInfo allocInfo = {};
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.commandPool = commandPool;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocInfo.commandBufferCount = 1;
+        vkCheckResult(vkAllocateCommandBuffers(device, &allocInfo, &target.commandBuffer));
+    }
+
+    TileGraph tileGraph;
+    build_tile_graph(tileGraph, renderPass, clearValues, pipelines[0], pipelineLayout);
+    compile_render_graph(gpu, device, tileGraph.graph);
+
+    const uint32_t tilesX = (options.width + options.tileSize - 1) / options.tileSize;
+    const uint32_t tilesY = (options.height + options.tileSize - 1) / options.tileSize;
+    printf("---Rendering %d tiles per frame\n", tilesX * tilesY);
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t frame = 0; frame < options.frames; ++frame) {
+        for (uint32_t ty = 0; ty < tilesY; ++ty) {
+            for (uint32_t tx = 0; tx < tilesX; ++tx) {
+                const uint32_t index = acquire_readback_slot(device, ring, *sink);
+                auto& slot = ring.slots[index];
+                auto& target = targets[index];
+
+                const uint32_t x = tx * options.tileSize;
+                const uint32_t y = ty * options.tileSize;
+                slot.frame.frame = frame;
+                slot.frame.region.offset = {static_cast<int32_t>(x), static_cast<int32_t>(y)};
+                slot.frame.region.extent = {std::min(options.tileSize, options.width - x), std::min(options.tileSize, options.height - y)};
+                tileGraph.target = &target;
+                tileGraph.slot = &slot;
+                tileGraph.transform = make_tile_transform(options, x, y);
+                graph_bind_image(tileGraph.graph, tileGraph.tileImage, target.image.image, target.image.view);
+                graph_bind_buffer(tileGraph.graph, tileGraph.readbackBuffer, slot.buffer.buffer);
+
+                vkCheckResult(vkResetCommandBuffer(target.commandBuffer, 0));
+                VkCommandBufferBeginInfo beginInfo = {};
+                beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+                beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+                vkCheckResult(vkBeginCommandBuffer(target.commandBuffer, &beginInfo));
+                execute_render_graph(target.commandBuffer, tileGraph.graph);
+                vkCheckResult(vkEndCommandBuffer(target.commandBuffer));
+
+                VkSubmitInfo submitInfo = {};
+                submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+                submitInfo.commandBufferCount = 1;
+                submitInfo.pCommandBuffers = &target.commandBuffer;
+                vkCheckResult(vkQueueSubmit(queue, 1, &submitInfo, slot.fence));
+                slot.pending = true;
+            }
+        }
+    }
+    drain_readback_ring(device, ring, *sink);
+    sink.reset();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("\tWritten %d frame(s) in %.3f s (%.1f MPix/s)\n", options.frames, seconds,
+        static_cast<double>(options.width) * options.height * options.frames / seconds / 1e6);
+
+    VK_LOAD_DEVICE_FUNCTION(device, vkDeviceWaitIdle)
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyFramebuffer)
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyCommandPool)
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyPipeline)
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyPipelineLayout)
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyRenderPass)
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyShaderModule)
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyDevice)
+    vkDeviceWaitIdle(device);
+    for (auto& target : targets) {
+        vkDestroyFramebuffer(device, target.framebuffer, nullptr);
+        destroy_image(device, target.image);
+    }
+    destroy_render_graph(device, tileGraph.graph);
+    destroy_readback_ring(device, ring);
+    destroy_transient_attachments(device, transient);
+    vkDestroyCommandPool(device, commandPool, nullptr);
+    for (auto& pipeline : pipelines) {
+        vkDestroyPipeline(device, pipeline, nullptr);
+    }
+    vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
+    vkDestroyRenderPass(device, renderPass, nullptr);
+    vkDestroyShaderModule(device, fragModule, nullptr);
+    vkDestroyShaderModule(device, vertModule, nullptr);
+    vkDestroyDevice(device, nullptr);
+}
+
+bool parse_benchmark_options(int argc, char* argv[], BenchmarkOptions& options)
+{
+    bool benchmark = false;
+    options.warmupFrames = 60;
+    options.measuredFrames = 600;
+    options.trianglesPerDraw = 1;
+    options.drawCount = 1;
+    options.overdraw = 1.0f;
+    options.offscreen = true;
+    options.width = 1920;
+    options.height = 1080;
+    options.msaa = parse_msaa_option(argc, argv);
+    options.json = "benchmark.json";
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--benchmark")) {
+            benchmark = true;
+        } else if (!strcmp(argv[i], "--warmup") && i + 1 < argc) {
+            options.warmupFrames = strtoul(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "--measure") && i + 1 < argc) {
+            options.measuredFrames = std::max(1ul, strtoul(argv[++i], nullptr, 10));
+        } else if (!strcmp(argv[i], "--triangles") && i + 1 < argc) {
+            options.trianglesPerDraw = std::max(1ul, strtoul(argv[++i], nullptr, 10));
+        } else if (!strcmp(argv[i], "--draws") && i + 1 < argc) {
+            options.drawCount = std::max(1ul, strtoul(argv[++i], nullptr, 10));
+        } else if (!strcmp(argv[i], "--overdraw") && i + 1 < argc) {
+            options.overdraw = std::max(0.01f, strtof(argv[++i], nullptr));
+        } else if (!strcmp(argv[i], "--target") && i + 1 < argc) {
+            options.offscreen = strcmp(argv[++i], "window") != 0;
+        } else if (!strcmp(argv[i], "--size") && i + 1 < argc) {
+            sscanf(argv[++i], "%ux%u", &options.width, &options.height);
+        } else if (!strcmp(argv[i], "--json") && i + 1 < argc) {
+            options.json = argv[++i];
+        }
+    }
+    return benchmark;
+}
+
+// Nearest-rank percentiles
+FrameStats compute_frame_stats(std::vector<double> samples)
+{
+    FrameStats stats = {};
+    if (samples.empty()) {
+        return stats;
+    }
+    std::sort(samples.begin(), samples.end());
+    double sum = 0.0;
+    for (const auto& sample : samples) {
+        sum += sample;
+    }
+    auto percentile = [&](double p) {
+        size_t rank = static_cast<size_t>(std::ceil(p * samples.size()));
+        return samples[std::min(samples.size() - 1, rank ? rank - 1 : 0)];
+    };
+    stats.mean = sum / samples.size();
+    stats.median = percentile(0.5);
+    stats.p95 = percentile(0.95);
+    stats.p99 = percentile(0.99);
+    stats.min = samples.front();
+    stats.max = samples.back();
+    return stats;
+}
+
+void write_frame_stats_json(FILE* file, const char* name, const FrameStats& stats, bool last)
+{
+    fprintf(file, "    \"%s\": {\"mean\": %.6f, \"median\": %.6f, \"p95\": %.6f, \"p99\": %.6f, \"min\": %.6f, \"max\": %.6f}%s\n",
+        name, stats.mean, stats.median, stats.p95, stats.p99, stats.min, stats.max, last ? "" : ",");
+}
+
+/*Runs warmup + measured frames with one frame in flight and writes the
+JSON report. CPU time covers recording, submission, presentation and the
+wait for the frame, GPU time comes from timestamps around the commands*/
+void run_benchmark(VkPhysicalDevice& gpu, BenchmarkTarget& target, const BenchmarkOptions& options)
+{
+    printf("---Running benchmark: %d warmup + %d measured frames, %d draw(s) x %d triangle(s), overdraw %.2f\n",
+        options.warmupFrames, options.measuredFrames, options.drawCount, options.trianglesPerDraw, options.overdraw);
+    auto& device = target.device;
+    VK_LOAD_DEVICE_FUNCTION(device, vkCreateCommandPool)
+    VK_LOAD_DEVICE_FUNCTION(device, vkAllocateCommandBuffers)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCreateFence)
+    VK_LOAD_DEVICE_FUNCTION(device, vkWaitForFences)
+    VK_LOAD_DEVICE_FUNCTION(device, vkResetFences)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCreateSemaphore)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCreateQueryPool)
+    VK_LOAD_DEVICE_FUNCTION(device, vkGetQueryPoolResults)
+    VK_LOAD_DEVICE_FUNCTION(device, vkResetCommandBuffer)
+    VK_LOAD_DEVICE_FUNCTION(device, vkBeginCommandBuffer)
+    VK_LOAD_DEVICE_FUNCTION(device, vkEndCommandBuffer)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdResetQueryPool)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdWriteTimestamp)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdBeginRenderPass)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdBindPipeline)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdPushConstants)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdDraw)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdEndRenderPass)
+    VK_LOAD_DEVICE_FUNCTION(device, vkQueueSubmit)
+    VK_LOAD_DEVICE_FUNCTION(device, vkAcquireNextImageKHR)
+    VK_LOAD_DEVICE_FUNCTION(device, vkQueuePresentKHR)
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(gpu, &properties);
+    uint32_t queueFamilyCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(gpu, &queueFamilyCount, nullptr);
+    std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+    vkGetPhysicalDeviceQueueFamilyProperties(gpu, &queueFamilyCount, queueFamilies.data());
+    const bool timestamps = queueFamilies[target.queueFamily].timestampValidBits > 0;
+    if (!timestamps) {
+        printf("\tQueue family has no timestamp support, GPU time is not measured\n");
+    }
+
+    VkCommandPool commandPool;
+    VkCommandPoolCreateInfo poolInfo = {};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.queueFamilyIndex = target.queueFamily;
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    vkCheckResult(vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool));
+    VkCommandBuffer commandBuffer;
+    VkCommandBufferAllocateInfo allocInfo = {};
+    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocInfo.commandPool = commandPool;
+    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    allocInfo.commandBufferCount = 1;
+    vkCheckResult(vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer));
+
+    VkFence fence;
+    VkFenceCreateInfo fenceInfo = {};
+    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    vkCheckResult(vkCreateFence(device, &fenceInfo, nullptr, &fence));
+    VkSemaphore imageAvailableSemaphore;
+    VkSemaphore renderFinishedSemaphore;
+    VkSemaphoreCreateInfo semaphoreInfo = {};
+    semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    vkCheckResult(vkCreateSemaphore(device, &semaphoreInfo, nullptr, &imageAvailableSemaphore));
+    vkCheckResult(vkCreateSemaphore(device, &semaphoreInfo, nullptr, &renderFinishedSemaphore));
+    VkQueryPool queryPool;
+    VkQueryPoolCreateInfo queryInfo = {};
+    queryInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    queryInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    queryInfo.queryCount = 2;
+    vkCheckResult(vkCreateQueryPool(device, &queryInfo, nullptr, &queryPool));
+
+    BenchmarkScene scene;
+    scene.trianglesPerDraw = options.trianglesPerDraw;
+    scene.drawCount = options.drawCount;
+    // A triangle covers half of its scaled grid cell
+    scene.triangleScale = std::sqrt(2.0f * options.overdraw);
+
+    std::vector<double> cpuTimes;
+    std::vector<double> gpuTimes;
+    const uint32_t totalFrames = options.warmupFrames + options.measuredFrames;
+    auto measureStart = std::chrono::steady_clock::now();
+    for (uint32_t frame = 0; frame < totalFrames; ++frame) {
+        if (frame == options.warmupFrames) {
+            measureStart = std::chrono::steady_clock::now();
+        }
+        auto frameStart = std::chrono::steady_clock::now();
+        uint32_t imageIndex = 0;
+        if (target.swapchain != VK_NULL_HANDLE) {
+            vkCheckResult(vkAcquireNextImageKHR(device, target.swapchain, std::numeric_limits<uint64_t>::max(),
+                imageAvailableSemaphore, VK_NULL_HANDLE, &imageIndex));
+        }
+
+        vkCheckResult(vkResetCommandBuffer(commandBuffer, 0));
+        VkCommandBufferBeginInfo beginInfo = {};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        vkCheckResult(vkBeginCommandBuffer(commandBuffer, &beginInfo));
+        vkCmdResetQueryPool(commandBuffer, queryPool, 0, 2);
+        vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, queryPool, 0);
+        VkRenderPassBeginInfo renderPassInfo = {};
+        renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+        renderPassInfo.renderPass = target.renderPass;
+        renderPassInfo.framebuffer = target.framebuffers[imageIndex];
+        renderPassInfo.renderArea.offset = {0, 0};
+        renderPassInfo.renderArea.extent = target.extent;
+        renderPassInfo.clearValueCount = static_cast<uint32_t>(target.clearValues.size());
+        renderPassInfo.pClearValues = target.clearValues.data();
+        vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, target.pipeline);
+        for (uint32_t draw = 0; draw < options.drawCount; ++draw) {
+            scene.drawIndex = draw;
+            vkCmdPushConstants(commandBuffer, target.pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(BenchmarkScene), &scene);
+            vkCmdDraw(commandBuffer, 3 * options.trianglesPerDraw, 1, 0, 0);
+        }
+        vkCmdEndRenderPass(commandBuffer);
+        vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, queryPool, 1);
+        vkCheckResult(vkEndCommandBuffer(commandBuffer));
+
+        VkSubmitInfo submitInfo = {};
+        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+        if (target.swapchain != VK_NULL_HANDLE) {
+            submitInfo.waitSemaphoreCount = 1;
+            submitInfo.pWaitSemaphores = &imageAvailableSemaphore;
+            submitInfo.pWaitDstStageMask = &waitStage;
+            submitInfo.signalSemaphoreCount = 1;
+            submitInfo.pSignalSemaphores = &renderFinishedSemaphore;
+        }
+        submitInfo.commandBufferCount = 1;
+        submitInfo.pCommandBuffers = &commandBuffer;
+        vkCheckResult(vkQueueSubmit(target.queue, 1, &submitInfo, fence));
+        if (target.swapchain != VK_NULL_HANDLE) {
+            VkPresentInfoKHR presentInfo = {};
+            presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+            presentInfo.waitSemaphoreCount = 1;
+            presentInfo.pWaitSemaphores = &renderFinishedSemaphore;
+            presentInfo.swapchainCount = 1;
+            presentInfo.pSwapchains = &target.swapchain;
+            presentInfo.pImageIndices = &imageIndex;
+            vkCheckResult(vkQueuePresentKHR(target.presentQueue, &presentInfo));
+        }
+        vkCheckResult(vkWaitForFences(device, 1, &fence, VK_TRUE, std::numeric_limits<uint64_t>::max()));
+        vkCheckResult(vkResetFences(device, 1, &fence));
+        auto frameEnd = std::chrono::steady_clock::now();
+        if (frame < options.warmupFrames) {
+            continue;
+        }
+
+        cpuTimes.push_back(std::chrono::duration<double, std::milli>(frameEnd - frameStart).count());
+        if (timestamps) {
+            uint64_t queries[2];
+            vkCheckResult(vkGetQueryPoolResults(device, queryPool, 0, 2, sizeof(queries), queries, sizeof(uint64_t),
+                VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+            gpuTimes.push_back((queries[1] - queries[0]) * properties.limits.timestampPeriod / 1e6);
+        }
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - measureStart).count();
+
+    auto cpuStats = compute_frame_stats(cpuTimes);
+    auto gpuStats = compute_frame_stats(gpuTimes);
+    const double trianglesPerFrame = static_cast<double>(options.trianglesPerDraw) * options.drawCount;
+    const double fps = options.measuredFrames / seconds;
+    printf("\tCPU frame time ms: mean %.3f, median %.3f, p95 %.3f, p99 %.3f\n", cpuStats.mean, cpuStats.median, cpuStats.p95, cpuStats.p99);
+    if (timestamps) {
+        printf("\tGPU frame time ms: mean %.3f, median %.3f, p95 %.3f, p99 %.3f\n", gpuStats.mean, gpuStats.median, gpuStats.p95, gpuStats.p99);
+    }
+    printf("\t%.1f frames/s, %.3f Mtriangles/s\n", fps, trianglesPerFrame * fps / 1e6);
+
+    FILE* json = fopen(options.json.c_str(), "w");
+    if (json) {
+        fprintf(json, "{\n");
+        fprintf(json, "  \"device\": \"%s\",\n", properties.deviceName);
+        fprintf(json, "  \"target\": \"%s\",\n", target.swapchain != VK_NULL_HANDLE ? "window" : "offscreen");
+        fprintf(json, "  \"width\": %u,\n  \"height\": %u,\n", target.extent.width, target.extent.height);
+        fprintf(json, "  \"scene\": {\"triangles_per_draw\": %u, \"draws\": %u, \"overdraw\": %.3f},\n",
+            options.trianglesPerDraw, options.drawCount, options.overdraw);
+        fprintf(json, "  \"warmup_frames\": %u,\n  \"measured_frames\": %u,\n", options.warmupFrames, options.measuredFrames);
+        fprintf(json, "  \"frame_time_ms\": {\n");
+        write_frame_stats_json(json, "cpu", cpuStats, !timestamps);
+        if (timestamps) {
+            write_frame_stats_json(json, "gpu", gpuStats, true);
+        }
+        fprintf(json, "  },\n");
+        fprintf(json, "  \"throughput\": {\"frames_per_second\": %.3f, \"triangles_per_second\": %.1f, \"pixels_per_second\": %.1f}\n",
+            fps, trianglesPerFrame * fps, static_cast<double>(target.extent.width) * target.extent.height * fps);
+        fprintf(json, "}\n");
+        fclose(json);
+        printf("\tBenchmark report written to %s\n", options.json.c_str());
+    } else {
+        printf("\tCouldn't open benchmark report: %s\n", options.json.c_str());
+    }
+
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyQueryPool)
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroySemaphore)
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyFence)
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyCommandPool)
+    VK_LOAD_DEVICE_FUNCTION(device, vkDeviceWaitIdle)
+    vkDeviceWaitIdle(device);
+    vkDestroyQueryPool(device, queryPool, nullptr);
+    vkDestroySemaphore(device, renderFinishedSemaphore, nullptr);
+    vkDestroySemaphore(device, imageAvailableSemaphore, nullptr);
+    vkDestroyFence(device, fence, nullptr);
+    vkDestroyCommandPool(device, commandPool, nullptr);
+}
+
+VkPipeline create_benchmark_pipeline(VkDevice& logical_device,
+VkShaderModule fragModule,
+VkExtent2D extent,
+VkRenderPass& renderPass,
+const RenderPassConfig& renderPassConfig,
+VkPipelineLayout& pipelineLayout)
+{
+    auto benchShader = load_shader("bench.spv");
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkCreateShaderModule)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkDestroyShaderModule)
+    VkShaderModule benchModule = create_shader_module(vkCreateShaderModule, logical_device, benchShader);
+    std::vector<PipelineVariant> variants = {
+        make_pipeline_variant("benchmark", 1.0f, false, false, 0)
+    };
+    // bench.vert has no specialization constants, the entries are ignored
+    auto pipelines = create_pipeline_variants(logical_device, benchModule, fragModule,
+        variants, extent, renderPass, renderPassConfig, pipelineLayout);
+    vkDestroyShaderModule(logical_device, benchModule, nullptr);
+    return pipelines[0];
+}
+
+void run_offscreen_benchmark(VkInstance& instance,
+VkPhysicalDevice& gpu,
+const std::vector<const char*>& enabledLayerNames,
+const BenchmarkOptions& options)
+{
+    auto queueFamily = find_graphics_queue_family(gpu);
+    DeviceRequirements requirements = {};
+    DeviceCapabilities capabilities;
+    auto device = create_logical_device(instance, gpu, {queueFamily}, enabledLayerNames, requirements, capabilities);
+    VK_LOAD_INSTANCE_FUNCTION(instance, vkGetDeviceQueue)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCreateShaderModule)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCreateFramebuffer)
+
+    BenchmarkTarget target;
+    target.device = device;
+    vkGetDeviceQueue(device, queueFamily, 0, &target.queue);
+    target.presentQueue = target.queue;
+    target.queueFamily = queueFamily;
+    target.swapchain = VK_NULL_HANDLE;
+    target.extent = {options.width, options.height};
+
+    auto fragmentShader = load_shader("frag.spv");
+    VkShaderModule fragModule = create_shader_module(vkCreateShaderModule, device, fragmentShader);
+    const VkFormat format = VK_FORMAT_R8G8B8A8_UNORM;
+    auto renderPassConfig = make_render_pass_config(gpu, format, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, options.msaa);
+    target.renderPass = create_render_pass(device, renderPassConfig);
+    target.clearValues = make_clear_values(renderPassConfig);
+    target.pipelineLayout = create_pipeline_layout(device);
+    target.pipeline = create_benchmark_pipeline(device, fragModule, target.extent, target.renderPass,
+        renderPassConfig, target.pipelineLayout);
+
+    auto image = create_image(gpu, device, target.extent, format, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT, VK_IMAGE_ASPECT_COLOR_BIT);
+    auto transient = create_transient_attachments(gpu, device, renderPassConfig, target.extent);
+    auto attachments = make_framebuffer_attachments(transient, image.view);
+    VkFramebuffer framebuffer;
+    VkFramebufferCreateInfo framebufferInfo = {};
+    framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+    framebufferInfo.renderPass = target.renderPass;
+    framebufferInfo.attachmentCount = static_cast<uint32_t>(attachments.size());
+    framebufferInfo.pAttachments = attachments.data();
+    framebufferInfo.width = target.extent.width;
+    framebufferInfo.height = target.extent.height;
+    framebufferInfo.layers = 1;
+    vkCheckResult(vkCreateFramebuffer(device, &framebufferInfo, nullptr, &framebuffer));
+    target.framebuffers.push_back(framebuffer);
+
+    run_benchmark(gpu, target, options);
+
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyFramebuffer)
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyPipeline)
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyPipelineLayout)
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyRenderPass)
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyShaderModule)
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyDevice)
+    vkDestroyFramebuffer(device, framebuffer, nullptr);
+    destroy_transient_attachments(device, transient);
+    destroy_image(device, image);
+    vkDestroyPipeline(device, target.pipeline, nullptr);
+    vkDestroyPipelineLayout(device, target.pipelineLayout, nullptr);
+    vkDestroyRenderPass(device, target.renderPass, nullptr);
+    vkDestroyShaderModule(device, fragModule, nullptr);
+    vkDestroyDevice(device, nullptr);
+}
+
+ComputePipeline create_compute_pipeline(VkPhysicalDevice& gpuDevice,
+VkDevice& logical_device,
+VkShaderModule module,
+uint32_t storageBuffers,
+uint32_t pushConstantSize)
+{
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkCreateDescriptorSetLayout)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkCreatePipelineLayout)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkCreateComputePipelines)
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(gpuDevice, &properties);
+
+    ComputePipeline pipeline;
+    pipeline.localSize = std::min(256u, std::min(properties.limits.maxComputeWorkGroupSize[0],
+        properties.limits.maxComputeWorkGroupInvocations));
+    pipeline.maxGroups = properties.limits.maxComputeWorkGroupCount[0];
+
+    std::vector<VkDescriptorSetLayoutBinding> bindings(storageBuffers);
+    for (uint32_t i = 0; i < storageBuffers; ++i) {
+        bindings[i] = {};
+        bindings[i].binding = i;
+        bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        bindings[i].descriptorCount = 1;
+        bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    }
+    VkDescriptorSetLayoutCreateInfo setLayoutInfo = {};
+    setLayoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    setLayoutInfo.bindingCount = storageBuffers;
+    setLayoutInfo.pBindings = bindings.data();
+    vkCheckResult(vkCreateDescriptorSetLayout(logical_device, &setLayoutInfo, nullptr, &pipeline.setLayout));
+
+    VkPushConstantRange pushConstantRange = {};
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = pushConstantSize;
+    VkPipelineLayoutCreateInfo layoutInfo = {};
+    layoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    layoutInfo.setLayoutCount = 1;
+    layoutInfo.pSetLayouts = &pipeline.setLayout;
+    layoutInfo.pushConstantRangeCount = pushConstantSize ? 1 : 0;
+    layoutInfo.pPushConstantRanges = &pushConstantRange;
+    vkCheckResult(vkCreatePipelineLayout(logical_device, &layoutInfo, nullptr, &pipeline.layout));
+
+    ShaderVariant variant;
+    set_specialization_constant<uint32_t>(variant, COMPUTE_CONSTANT_LOCAL_SIZE_X, pipeline.localSize);
+    VkComputePipelineCreateInfo pipelineInfo = {};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineInfo.stage = create_shader_stage(VK_SHADER_STAGE_COMPUTE_BIT, module, variant);
+    pipelineInfo.layout = pipeline.layout;
+    vkCheckResult(vkCreateComputePipelines(logical_device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &pipeline.pipeline));
+    printf("\tCompute pipeline: %d invocations per workgroup, up to %d workgroups per dispatch\n",
+        pipeline.localSize, pipeline.maxGroups);
+    return pipeline;
+}
+
+uint32_t compute_group_count(const ComputePipeline& pipeline, uint32_t elements)
+{
+    return (elements + pipeline.localSize - 1) / pipeline.localSize;
+}
+
+uint32_t max_dispatch_elements(const ComputePipeline& pipeline)
+{
+    return static_cast<uint32_t>(std::min<uint64_t>(std::numeric_limits<uint32_t>::max(),
+        static_cast<uint64_t>(pipeline.localSize) * pipeline.maxGroups));
+}
+
+void destroy_compute_pipeline(VkDevice& logical_device, ComputePipeline& pipeline)
+{
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkDestroyPipeline)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkDestroyPipelineLayout)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkDestroyDescriptorSetLayout)
+    vkDestroyPipeline(logical_device, pipeline.pipeline, nullptr);
+    vkDestroyPipelineLayout(logical_device, pipeline.layout, nullptr);
+    vkDestroyDescriptorSetLayout(logical_device, pipeline.setLayout, nullptr);
+}
+
+bool parse_compute_options(int argc, char* argv[], ComputeBatchOptions& options)
+{
+    bool compute = false;
+    options.elements = 0;
+    options.batchElements = 1 << 20;
+    options.scale = 2.0f;
+    options.bias = 0.5f;
+    options.verify = false;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--compute") && i + 1 < argc) {
+            options.elements = strtoull(argv[++i], nullptr, 10);
+            compute = true;
+        } else if (!strcmp(argv[i], "--batch") && i + 1 < argc) {
+            // Clamped before narrowing, a larger value would wrap around
+            options.batchElements = static_cast<uint32_t>(std::min<unsigned long long>(
+                std::max(1ull, strtoull(argv[++i], nullptr, 10)), std::numeric_limits<uint32_t>::max()));
+        } else if (!strcmp(argv[i], "--verify")) {
+            options.verify = true;
+        }
+    }
+    return compute && options.elements;
+}
+
+// Deterministic input, so batches can be checked without keeping the dataset around
+float batch_input_value(uint64_t index)
+{
+    return static_cast<float>(index % 4093) * 0.25f - 511.0f;
+}
+
+bool run_compute_batch(VkInstance& instance,
+VkPhysicalDevice& gpu,
+const std::vector<const char*>& enabledLayerNames,
+ComputeBatchOptions& options)
+{
+    printf("---Running compute batch: %llu elements\n", static_cast<unsigned long long>(options.elements));
+    auto context = create_offscreen_context(instance, gpu, enabledLayerNames, true);
+    auto& device = context.device;
+    auto& scheduler = context.scheduler;
+    VK_LOAD_DEVICE_FUNCTION(device, vkCreateShaderModule)
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyShaderModule)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCreateDescriptorPool)
+    VK_LOAD_DEVICE_FUNCTION(device, vkAllocateDescriptorSets)
+    VK_LOAD_DEVICE_FUNCTION(device, vkUpdateDescriptorSets)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCreateCommandPool)
+    VK_LOAD_DEVICE_FUNCTION(device, vkAllocateCommandBuffers)
+    VK_LOAD_DEVICE_FUNCTION(device, vkResetCommandBuffer)
+    VK_LOAD_DEVICE_FUNCTION(device, vkBeginCommandBuffer)
+    VK_LOAD_DEVICE_FUNCTION(device, vkEndCommandBuffer)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdCopyBuffer)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdPipelineBarrier)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdBindPipeline)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdBindDescriptorSets)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdPushConstants)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdDispatch)
+    VK_LOAD_DEVICE_FUNCTION(device, vkFlushMappedMemoryRanges)
+    VK_LOAD_DEVICE_FUNCTION(device, vkInvalidateMappedMemoryRanges)
+
+    auto computeShader = load_shader("batch.spv");
+    VkShaderModule computeModule = create_shader_module(vkCreateShaderModule, device, computeShader);
+    auto pipeline = create_compute_pipeline(gpu, device, computeModule, 2, sizeof(BatchConstants));
+    vkDestroyShaderModule(device, computeModule, nullptr);
+    options.batchElements = static_cast<uint32_t>(std::min<uint64_t>(options.elements,
+        std::min(options.batchElements, max_dispatch_elements(pipeline))));
+    const VkDeviceSize batchSize = static_cast<VkDeviceSize>(options.batchElements) * sizeof(float);
+
+    VkDescriptorPoolSize poolSize = {};
+    poolSize.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    poolSize.descriptorCount = 2 * 2;
+    VkDescriptorPoolCreateInfo descriptorPoolInfo = {};
+    descriptorPoolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    descriptorPoolInfo.maxSets = 2;
+    descriptorPoolInfo.poolSizeCount = 1;
+    descriptorPoolInfo.pPoolSizes = &poolSize;
+    VkDescriptorPool descriptorPool;
+    vkCheckResult(vkCreateDescriptorPool(device, &descriptorPoolInfo, nullptr, &descriptorPool));
+
+    VkCommandPool commandPool;
+    VkCommandPoolCreateInfo poolInfo = {};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.queueFamilyIndex = context.queueFamily;
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    vkCheckResult(vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool));
+
+    std::vector<ComputeBatchSlot> slots(2);
+    for (auto& slot : slots) {
+        // Host visible device memory (integrated GPUs, lavapipe) is written and read in place, otherwise through copies
+        slot.input = create_buffer(gpu, device, batchSize,
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+        slot.output = create_buffer(gpu, device, batchSize,
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
+        slot.hasStaging = slot.input.mapped == nullptr;
+        slot.hasReadback = slot.output.mapped == nullptr;
+        if (slot.hasStaging) {
+            slot.staging = create_buffer(gpu, device, batchSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+        }
+        if (slot.hasReadback) {
+            slot.readback = create_buffer(gpu, device, batchSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
+        }
+        slot.submitted = 0;
+        slot.first = 0;
+        slot.count = 0;
+
+        VkDescriptorSetAllocateInfo setInfo = {};
+        setInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+        setInfo.descriptorPool = descriptorPool;
+        setInfo.descriptorSetCount = 1;
+        setInfo.pSetLayouts = &pipeline.setLayout;
+        vkCheckResult(vkAllocateDescriptorSets(device, &setInfo, &slot.descriptorSet));
+        VkDescriptorBufferInfo bufferInfos[2] = {
+            {slot.input.buffer, 0, VK_WHOLE_SIZE},
+            {slot.output.buffer, 0, VK_WHOLE_SIZE}
+        };
+        VkWriteDescriptorSet writes[2] = {};
+        for (uint32_t i = 0; i < 2; ++i) {
+            writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            writes[i].dstSet = slot.descriptorSet;
+            writes[i].dstBinding = i;
+            writes[i].descriptorCount = 1;
+            writes[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            writes[i].pBufferInfo = &bufferInfos[i];
+        }
+        vkUpdateDescriptorSets(device, 2, writes, 0, nullptr);
+
+        VkCommandBufferAllocateInfo allocInfo = {};
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.commandPool = commandPool;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocInfo.commandBufferCount = 1;
+        vkCheckResult(vkAllocateCommandBuffers(device, &allocInfo, &slot.commandBuffer));
+    }
+    printf("\tBatches of %d elements, %s input, %s output\n", options.batchElements,
+        slots[0].hasStaging ? "staged" : "mapped", slots[0].hasReadback ? "staged" : "mapped");
+
+    uint64_t mismatches = 0;
+    double checksum = 0.0;
+    auto consume = [&](ComputeBatchSlot& slot) {
+        scheduler_wait(scheduler, SCHEDULER_COMPUTE, slot.submitted);
+        auto& result = slot.hasReadback ? slot.readback : slot.output;
+        invalidate_mapped(device, result);
+        auto values = static_cast<const float*>(result.mapped);
+        for (uint32_t i = 0; i < slot.count; ++i) {
+            checksum += values[i];
+            if (options.verify) {
+                // The GPU may fuse the multiply-add, allow for the rounding difference
+                const float expected = batch_input_value(slot.first + i) * options.scale + options.bias;
+                if (std::fabs(values[i] - expected) > 1e-5f * std::max(1.0f, std::fabs(expected))) {
+                    if (!mismatches) {
+                        printf("\tMismatch at element %llu: %f, expected %f\n",
+                            static_cast<unsigned long long>(slot.first + i), values[i], expected);
+                    }
+                    ++mismatches;
+                }
+            }
+        }
+        slot.count = 0;
+    };
+
+    ScheduledSubmit submit;
+    submit.commandBuffers.resize(1);
+    auto start = std::chrono::steady_clock::now();
+    uint64_t next = 0;
+    uint32_t current = 0;
+    // The CPU fills and checks one slot while the GPU works on the other
+    while (next < options.elements || slots[0].count || slots[1].count) {
+        auto& slot = slots[current];
+        current ^= 1;
+        if (slot.count) {
+            consume(slot);
+        }
+        if (next >= options.elements) {
+            continue;
+        }
+        slot.first = next;
+        slot.count = static_cast<uint32_t>(std::min<uint64_t>(options.batchElements, options.elements - next));
+        next += slot.count;
+
+        auto& source = slot.hasStaging ? slot.staging : slot.input;
+        auto values = static_cast<float*>(source.mapped);
+        for (uint32_t i = 0; i < slot.count; ++i) {
+            values[i] = batch_input_value(slot.first + i);
+        }
+        flush_mapped(device, source);
+
+        const VkDeviceSize size = static_cast<VkDeviceSize>(slot.count) * sizeof(float);
+        auto cmd = slot.commandBuffer;
+        vkCheckResult(vkResetCommandBuffer(cmd, 0));
+        VkCommandBufferBeginInfo beginInfo = {};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        vkCheckResult(vkBeginCommandBuffer(cmd, &beginInfo));
+        VkBufferMemoryBarrier barrier = {};
+        barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.offset = 0;
+        barrier.size = size;
+        if (slot.hasStaging) {
+            VkBufferCopy region = {0, 0, size};
+            vkCmdCopyBuffer(cmd, slot.staging.buffer, slot.input.buffer, 1, &region);
+            barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+            barrier.buffer = slot.input.buffer;
+            vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                0, 0, nullptr, 1, &barrier, 0, nullptr);
+        }
+        BatchConstants constants = {slot.count, options.scale, options.bias};
+        vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline.pipeline);
+        vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline.layout, 0, 1, &slot.descriptorSet, 0, nullptr);
+        vkCmdPushConstants(cmd, pipeline.layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(BatchConstants), &constants);
+        vkCmdDispatch(cmd, compute_group_count(pipeline, slot.count), 1, 1);
+        barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        barrier.buffer = slot.output.buffer;
+        if (slot.hasReadback) {
+            barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+            vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                0, 0, nullptr, 1, &barrier, 0, nullptr);
+            VkBufferCopy region = {0, 0, size};
+            vkCmdCopyBuffer(cmd, slot.output.buffer, slot.readback.buffer, 1, &region);
+            barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+            barrier.buffer = slot.readback.buffer;
+            vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT,
+                0, 0, nullptr, 1, &barrier, 0, nullptr);
+        } else {
+            barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+            vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_HOST_BIT,
+                0, 0, nullptr, 1, &barrier, 0, nullptr);
+        }
+        vkCheckResult(vkEndCommandBuffer(cmd));
+        submit.commandBuffers[0] = cmd;
+        slot.submitted = scheduler_submit(scheduler, SCHEDULER_COMPUTE, submit);
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("\t%.3f s, %.1f Melements/s, %.3f GB/s in+out, checksum %f\n", seconds,
+        options.elements / seconds / 1e6, options.elements * 2.0 * sizeof(float) / seconds / 1e9, checksum);
+    if (options.verify) {
+        printf("\tCPU reference check: %llu mismatches\n", static_cast<unsigned long long>(mismatches));
+    }
+
+    scheduler_wait_idle(scheduler);
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyCommandPool)
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyDescriptorPool)
+    for (auto& slot : slots) {
+        destroy_buffer(device, slot.input);
+        destroy_buffer(device, slot.output);
+        if (slot.hasStaging) {
+            destroy_buffer(device, slot.staging);
+        }
+        if (slot.hasReadback) {
+            destroy_buffer(device, slot.readback);
+        }
+    }
+    vkDestroyCommandPool(device, commandPool, nullptr);
+    vkDestroyDescriptorPool(device, descriptorPool, nullptr);
+    destroy_compute_pipeline(device, pipeline);
+    destroy_offscreen_context(context);
+    return mismatches == 0;
+}
+
+bool load_vulkan_library()
+{
+#if defined(VK_USE_PLATFORM_WIN32_KHR)
+	VULKAN_LIBRARY = LoadLibrary( "vulkan-1.dll" );
+#elif defined(VK_USE_PLATFORM_XCB_KHR) || defined(VK_USE_PLATFORM_XLIB_KHR)
+	VULKAN_LIBRARY = dlopen( "libvulkan.so", RTLD_NOW );
+#endif
+    if( VULKAN_LIBRARY == nullptr ) {
+        printf("Couldn't load Vulkan Library\n");
+        return false;
+    }
+    VK_EXPORTED_FUNCTION( vkGetInstanceProcAddr )
+    return true;
+}
+
+void unload_vulkan_library()
+{
+	if( VULKAN_LIBRARY ) {
+#if defined(VK_USE_PLATFORM_WIN32_KHR)
+      FreeLibrary( VULKAN_LIBRARY );
+#elif defined(VK_USE_PLATFORM_XCB_KHR) || defined(VK_USE_PLATFORM_XLIB_KHR)
+      dlclose( VULKAN_LIBRARY );
+#endif
+      VULKAN_LIBRARY = nullptr;
+    }
+}
+
+std::vector<const char*> get_enabled_layers()
+{
+#ifdef ENABLED_DEBUG
+    return {
+        "VK_LAYER_LUNARG_standard_validation",
+        "VK_LAYER_LUNARG_object_tracker" };
+#else
+    return {};
+#endif
+}
+
+uint32_t add_startup_task(StartupGraph& graph,
+const char* name,
+std::function<void()> run,
+std::vector<uint32_t> dependencies,
+bool mainThread)
+{
+    const uint32_t index = static_cast<uint32_t>(graph.tasks.size());
+    for (auto dependency : dependencies) {
+        if (dependency >= index) {
+            throw std::invalid_argument("Startup tasks can only depend on earlier tasks");
+        }
+    }
+    StartupTask task;
+    task.name = name;
+    task.run = run;
+    task.dependencies = dependencies;
+    task.mainThread = mainThread;
+    task.start = 0.0;
+    task.duration = 0.0;
+    graph.tasks.push_back(task);
+    return index;
+}
+
+void run_startup_graph(StartupGraph& graph)
+{
+    std::vector<std::shared_future<void>> done(graph.tasks.size());
+    std::vector<std::promise<void>> mainThreadDone(graph.tasks.size());
+    auto runTask = [&graph, &done](uint32_t index) {
+        auto& task = graph.tasks[index];
+        for (auto dependency : task.dependencies) {
+            done[dependency].get();
+        }
+        task.start = startup_elapsed_ms();
+        task.run();
+        task.duration = startup_elapsed_ms() - task.start;
+    };
+    // Dependencies always come first, so every future a task waits on exists when it starts
+    for (uint32_t i = 0; i < graph.tasks.size(); ++i) {
+        if (graph.tasks[i].mainThread) {
+            done[i] = mainThreadDone[i].get_future().share();
+        } else {
+            done[i] = std::async(std::launch::async, runTask, i).share();
+        }
+    }
+    for (uint32_t i = 0; i < graph.tasks.size(); ++i) {
+        if (graph.tasks[i].mainThread) {
+            try {
+                runTask(i);
+                mainThreadDone[i].set_value();
+            } catch (...) {
+                mainThreadDone[i].set_exception(std::current_exception());
+            }
+        }
+    }
+    std::exception_ptr failure;
+    for (auto& task : done) {
+        try {
+            task.get();
+        } catch (...) {
+            if (!failure) {
+                failure = std::current_exception();
+            }
+        }
+    }
+    if (failure) {
+        std::rethrow_exception(failure);
+    }
+}
+
+void print_startup_graph(const StartupGraph& graph)
+{
+    printf("---Startup tasks\n");
+    for (auto& task : graph.tasks) {
+        printf("\t%-16s %8.2f ms at %8.2f ms%s\n", task.name, task.duration, task.start,
+            task.mainThread ? " (main thread)" : "");
+    }
+}
+
+double startup_elapsed_ms()
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startupTime).count();
+}
+
+bool parse_skip_enumeration_option(int argc, char* argv[])
+{
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--skip-enumeration")) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool parse_hot_reload_option(int argc, char* argv[], std::string& directory)
+{
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (!strcmp(argv[i], "--hot-reload")) {
+            directory = argv[i + 1];
+            return true;
+        }
+    }
+    return false;
+}
+
+std::string shader_path(const std::string& directory, const std::string& file)
+{
+    return directory.empty() ? file : directory + "/" + file;
+}
+
+// A compiler may still be writing, so check the SPIR-V header before handing it to the driver
+bool is_spirv(const std::vector<char>& shader)
+{
+    if (shader.size() < 20 || shader.size() % 4) {
+        return false;
+    }
+    uint32_t magic;
+    memcpy(&magic, shader.data(), sizeof(magic));
+    return magic == 0x07230203;
+}
+
+void rebuild_reloaded_pipelines(ShaderReloader& reloader)
+{
+    std::vector<VkShaderModule> modules;
+    try {
+        for (auto& file : reloader.files) {
+            auto shader = load_shader(shader_path(reloader.directory, file));
+            if (!is_spirv(shader)) {
+                printf("\tHot reload: %s is not valid SPIR-V, keeping the current pipelines\n", file.c_str());
+                break;
+            }
+            modules.push_back(create_shader_module(reloader.createShaderModule, reloader.device, shader));
+        }
+        if (modules.size() == reloader.files.size()) {
+            auto start = std::chrono::steady_clock::now();
+            auto pipelines = reloader.build(modules, reloader.createGraphicsPipelines);
+            std::lock_guard<std::mutex> lock(reloader.mutex);
+            // The frame loop didn't take the previous rebuild yet, it is superseded
+            if (reloader.hasReady) {
+                for (auto& pipeline : reloader.ready) {
+                    reloader.destroyPipeline(reloader.device, pipeline, nullptr);
+                }
+            }
+            reloader.ready = pipelines;
+            reloader.hasReady = true;
+            ++reloader.generation;
+            printf("\tHot reload: %zu pipelines rebuilt in %.2f ms\n", pipelines.size(),
+                std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+        }
+    } catch (const std::exception& e) {
+        printf("\tHot reload failed (%s), keeping the current pipelines\n", e.what());
+    }
+    for (auto& module : modules) {
+        reloader.destroyShaderModule(reloader.device, module, nullptr);
+    }
+}
+
+#ifdef __linux__
+void shader_reloader_worker(ShaderReloader& reloader)
+{
+    alignas(inotify_event) char events[4096];
+    while (reloader.running) {
+        // Wakes up regularly to notice stop_shader_reloader
+        pollfd descriptor = {reloader.inotifyFd, POLLIN, 0};
+        if (poll(&descriptor, 1, 100) <= 0) {
+            continue;
+        }
+        // Drain everything pending so a burst of writes leads to a single rebuild
+        bool changed = false;
+        ssize_t length;
+        while ((length = read(reloader.inotifyFd, events, sizeof(events))) > 0) {
+            for (char* ptr = events; ptr < events + length; ) {
+                auto event = reinterpret_cast<const inotify_event*>(ptr);
+                if (event->len && std::find(reloader.files.begin(), reloader.files.end(),
+                        std::string(event->name)) != reloader.files.end()) {
+                    printf("\tHot reload: %s changed\n", event->name);
+                    changed = true;
+                }
+                ptr += sizeof(inotify_event) + event->len;
+            }
+        }
+        if (changed) {
+            rebuild_reloaded_pipelines(reloader);
+        }
+    }
+}
+#endif
+
+bool start_shader_reloader(ShaderReloader& reloader,
+VkDevice device,
+const std::string& directory,
+const std::vector<std::string>& files,
+ReloadBuilder build)
+{
+    VK_LOAD_DEVICE_FUNCTION(device, vkCreateShaderModule)
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyShaderModule)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCreateGraphicsPipelines)
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyPipeline)
+    reloader.createShaderModule = vkCreateShaderModule;
+    reloader.destroyShaderModule = vkDestroyShaderModule;
+    reloader.createGraphicsPipelines = vkCreateGraphicsPipelines;
+    reloader.destroyPipeline = vkDestroyPipeline;
+    reloader.device = device;
+    reloader.directory = directory.empty() ? "." : directory;
+    reloader.files = files;
+    reloader.build = build;
+    reloader.hasReady = false;
+    reloader.generation = 0;
+    reloader.running = false;
+#ifdef __linux__
+    reloader.inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (reloader.inotifyFd < 0) {
+        printf("\tHot reload: couldn't initialize inotify\n");
+        return false;
+    }
+    // Compilers either rewrite the file in place or move a finished one over it
+    if (inotify_add_watch(reloader.inotifyFd, reloader.directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        printf("\tHot reload: couldn't watch %s\n", reloader.directory.c_str());
+        close(reloader.inotifyFd);
+        reloader.inotifyFd = -1;
+        return false;
+    }
+    reloader.running = true;
+    reloader.worker = std::thread(shader_reloader_worker, std::ref(reloader));
+    printf("---Watching %s for shader changes\n", reloader.directory.c_str());
+    return true;
+#else
+    reloader.inotifyFd = -1;
+    printf("\tHot reload is only supported on Linux\n");
+    return false;
+#endif
+}
+
+bool take_reloaded_pipelines(ShaderReloader& reloader, std::vector<VkPipeline>& pipelines)
+{
+    std::unique_lock<std::mutex> lock(reloader.mutex, std::try_to_lock);
+    if (!lock.owns_lock() || !reloader.hasReady) {
+        return false;
+    }
+    pipelines.swap(reloader.ready);
+    reloader.ready.clear();
+    reloader.hasReady = false;
+    return true;
+}
+
+void stop_shader_reloader(ShaderReloader& reloader)
+{
+    if (reloader.running) {
+        reloader.running = false;
+        reloader.worker.join();
+    }
+    if (reloader.inotifyFd >= 0) {
+        close(reloader.inotifyFd);
+        reloader.inotifyFd = -1;
+    }
+    if (reloader.hasReady) {
+        for (auto& pipeline : reloader.ready) {
+            reloader.destroyPipeline(reloader.device, pipeline, nullptr);
+        }
+        reloader.ready.clear();
+        reloader.hasReady = false;
+    }
+}
+
+bool parse_reload_test_option(int argc, char* argv[], std::string& directory)
+{
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (!strcmp(argv[i], "--reload-test")) {
+            directory = argv[i + 1];
+            return true;
+        }
+    }
+    return false;
+}
+
+// Written next to the target and moved over it, the way a shader compiler finishes
+bool replace_shader_file(const std::string& path, const std::vector<char>& shader)
+{
+    const std::string temporary = path + ".tmp";
+    FILE* file = fopen(temporary.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+    const bool written = fwrite(shader.data(), 1, shader.size(), file) == shader.size();
+    fclose(file);
+    return written && rename(temporary.c_str(), path.c_str()) == 0;
+}
+
+// Polls like the frame loop does, returns false when nothing arrived within timeoutMs
+bool wait_for_reloaded_pipelines(ShaderReloader& reloader, std::vector<VkPipeline>& pipelines, double timeoutMs)
+{
+    auto start = std::chrono::steady_clock::now();
+    while (std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() < timeoutMs) {
+        if (take_reloaded_pipelines(reloader, pipelines)) {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return false;
+}
+
+bool run_hot_reload_test(VkInstance& instance,
+VkPhysicalDevice& gpu,
+const std::vector<const char*>& enabledLayerNames,
+const std::string& directory)
+{
+    printf("---Testing shader hot reload in %s\n", directory.c_str());
+    auto vertexShader = load_shader("vert.spv");
+    auto fragmentShader = load_shader("frag.spv");
+    // A different vertex shader with the same push constant size, so it fits the pipeline layout
+    auto replacementShader = load_shader("bench.spv");
+    mkdir(directory.c_str(), 0755);
+    if (!replace_shader_file(shader_path(directory, "vert.spv"), vertexShader) ||
+        !replace_shader_file(shader_path(directory, "frag.spv"), fragmentShader)) {
+        printf("\tCouldn't write the shaders to %s\n", directory.c_str());
+        return false;
+    }
+
+    auto queueFamily = find_graphics_queue_family(gpu);
+    DeviceRequirements requirements = {};
+    DeviceCapabilities capabilities;
+    auto device = create_logical_device(instance, gpu, {queueFamily}, enabledLayerNames, requirements, capabilities);
+    VK_LOAD_DEVICE_FUNCTION(device, vkCreateShaderModule)
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyShaderModule)
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyPipeline)
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyPipelineLayout)
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyRenderPass)
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyDevice)
+    auto renderPassConfig = make_render_pass_config(gpu, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, 1);
+    auto renderPass = create_render_pass(device, renderPassConfig);
+    auto pipelineLayout = create_pipeline_layout(device);
+    std::vector<PipelineVariant> pipelineVariants = {
+        make_pipeline_variant("default", 1.0f, false, false, 0)
+    };
+    VkExtent2D ignoredExtent = {64, 64};
+    auto build = [=](const std::vector<VkShaderModule>& modules,
+            PFN_vkCreateGraphicsPipelines createGraphicsPipelines) mutable {
+        return create_pipeline_variants(device, modules[0], modules[1], pipelineVariants, ignoredExtent,
+            renderPass, renderPassConfig, pipelineLayout, true, createGraphicsPipelines);
+    };
+    VkShaderModule vertModule = create_shader_module(vkCreateShaderModule, device, vertexShader);
+    VkShaderModule fragModule = create_shader_module(vkCreateShaderModule, device, fragmentShader);
+    auto pipelines = create_pipeline_variants(device, vertModule, fragModule, pipelineVariants, ignoredExtent,
+        renderPass, renderPassConfig, pipelineLayout, true);
+    vkDestroyShaderModule(device, fragModule, nullptr);
+    vkDestroyShaderModule(device, vertModule, nullptr);
+
+    bool succeeded = true;
+    auto check = [&](bool condition, const char* what) {
+        printf("\t%s: %s\n", what, condition ? "ok" : "FAILED");
+        succeeded = succeeded && condition;
+    };
+    ShaderReloader reloader;
+    const bool watching = start_shader_reloader(reloader, device, directory, {"vert.spv", "frag.spv"}, build);
+    check(watching, "watching the shader directory");
+    if (watching) {
+        std::vector<VkPipeline> reloaded;
+        // Truncated SPIR-V is what a reader sees while a compiler is still writing
+        check(replace_shader_file(shader_path(directory, "frag.spv"), std::vector<char>(fragmentShader.begin(),
+            fragmentShader.begin() + 8)), "writing invalid SPIR-V");
+        const bool rebuiltInvalid = wait_for_reloaded_pipelines(reloader, reloaded, 500.0);
+        check(!rebuiltInvalid, "invalid SPIR-V keeps the pipelines");
+        for (auto& pipeline : reloaded) {
+            vkDestroyPipeline(device, pipeline, nullptr);
+        }
+        reloaded.clear();
+
+        const char* steps[] = {"restored fragment shader", "replaced vertex shader"};
+        const std::vector<char>* contents[] = {&fragmentShader, &replacementShader};
+        const char* files[] = {"frag.spv", "vert.spv"};
+        for (int step = 0; step < 2; ++step) {
+            check(replace_shader_file(shader_path(directory, files[step]), *contents[step]), steps[step]);
+            const bool rebuilt = wait_for_reloaded_pipelines(reloader, reloaded, 5000.0);
+            check(rebuilt && reloaded.size() == pipelines.size() && reloaded[0] != pipelines[0],
+                "pipelines rebuilt from the new shader");
+            if (rebuilt) {
+                for (auto& pipeline : pipelines) {
+                    vkDestroyPipeline(device, pipeline, nullptr);
+                }
+                pipelines = reloaded;
+            }
+        }
+        stop_shader_reloader(reloader);
+        check(reloader.generation >= 2, "rebuild count");
+    }
+
+    for (auto& pipeline : pipelines) {
+        vkDestroyPipeline(device, pipeline, nullptr);
+    }
+    vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
+    vkDestroyRenderPass(device, renderPass, nullptr);
+    vkDestroyDevice(device, nullptr);
+    printf("---Hot reload test %s\n", succeeded ? "passed" : "failed");
+    return succeeded;
+}
+
+// Records the window's single draw into one command buffer per framebuffer
+void record_window_commands(std::vector<VkCommandBuffer>& commandBuffers,
+std::vector<VkFramebuffer>& framebuffers,
+VkRenderPass renderPass,
+VkExtent2D extent,
+const std::vector<VkClearValue>& clearValues,
+VkPipeline pipeline,
+VkPipelineLayout pipelineLayout,
+bool dynamicViewport)
+{
+    const VkViewport viewport = {0.0f, 0.0f, static_cast<float>(extent.width), static_cast<float>(extent.height), 0.0f, 1.0f};
+    const VkRect2D scissor = {{0, 0}, extent};
+    for (size_t i = 0; i < commandBuffers.size(); ++i) {
+        VkCommandBufferBeginInfo beginInfo = {};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
+        beginInfo.pInheritanceInfo = nullptr; // Optional
+
+        vkCheckResult(vkBeginCommandBuffer(commandBuffers[i], &beginInfo));
+        VkRenderPassBeginInfo renderPassInfo = {};
+        renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+        renderPassInfo.renderPass = renderPass;
+        renderPassInfo.framebuffer = framebuffers[i];
+        renderPassInfo.renderArea.offset =  {0, 0};
+        renderPassInfo.renderArea.extent = extent;
+        renderPassInfo.clearValueCount = static_cast<uint32_t>(clearValues.size());
+        renderPassInfo.pClearValues = clearValues.data();
+        vkCmdBeginRenderPass(commandBuffers[i], &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+        vkCmdBindPipeline(commandBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+        if (dynamicViewport) {
+            vkCmdSetViewport(commandBuffers[i], 0, 1, &viewport);
+            vkCmdSetScissor(commandBuffers[i], 0, 1, &scissor);
+        }
+        vkCmdPushConstants(commandBuffers[i], pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(TileTransform), &identityTileTransform);
+        vkCmdDraw(commandBuffers[i], 3, 1, 0, 0);
+        vkCmdEndRenderPass(commandBuffers[i]);
+        vkCheckResult(vkEndCommandBuffer(commandBuffers[i]));
+    }
+}
+
+// One framebuffer per swapchain image, sharing the transient attachments
+std::vector<VkFramebuffer> create_window_framebuffers(VkDevice& device,
+VkRenderPass renderPass,
+std::vector<VkImageView>& imageViews,
+const TransientAttachments& transientAttachments,
+VkExtent2D extent)
+{
+    printf("---Creating framebuffer\n");
+    VK_LOAD_DEVICE_FUNCTION(device, vkCreateFramebuffer)
+    std::vector<VkFramebuffer> framebuffers(imageViews.size());
+    for (size_t i = 0; i < imageViews.size(); ++i) {
+        auto attachments = make_framebuffer_attachments(transientAttachments, imageViews[i]);
+
+        VkFramebufferCreateInfo framebufferInfo = {};
+        framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+        framebufferInfo.renderPass = renderPass;
+        framebufferInfo.attachmentCount = static_cast<uint32_t>(attachments.size());
+        framebufferInfo.pAttachments = attachments.data();
+        framebufferInfo.width = extent.width;
+        framebufferInfo.height = extent.height;
+        framebufferInfo.layers = 1;
+
+        vkCheckResult(vkCreateFramebuffer(device, &framebufferInfo, nullptr, &framebuffers[i]));
+    }
+    return framebuffers;
+}
+
+void run_windowed(VkInstance& instance,
+VkPhysicalDevice& gpu,
+const std::vector<const char*>& enabledLayerNames,
+int argc,
+char* argv[],
+const BenchmarkOptions* benchmark)
+{
+    std::string shaderDirectory;
+    const bool hotReload = !benchmark && parse_hot_reload_option(argc, argv, shaderDirectory);
+    StartupGraph startup;
+
+    std::vector<char> vertexShader;
+    std::vector<char> fragmentShader;
+    auto shaderFiles = add_startup_task(startup, "shader files", [&]() {
+        printf("---Loading shaders\n");
+        vertexShader = load_shader(shader_path(shaderDirectory, "vert.spv"));
+        fragmentShader = load_shader(shader_path(shaderDirectory, "frag.spv"));
+    });
+
+    VkSurfaceKHR swapchain_surface;
+    std::vector<uint32_t> queueFamilies;
+    VkDevice device;
+    VkSwapchain swapchain;
+    uint32_t graphicsQueueFamilyIndex;
+    VkQueue graphicsQueue;
+    VkQueue presentQueue;
+    FrameScheduler scheduler;
+    DeletionQueue deletionQueue;
+    RenderPassConfig renderPassConfig;
+    VkRenderPass renderPass;
+    std::vector<VkClearValue> clearValues;
+    VkPipelineLayout pipelineLayout;
+    auto deviceTask = add_startup_task(startup, "device", [&]() {
+        swapchain_surface = create_swapchain_surface(instance);
+        queueFamilies = find_queue_families(instance, gpu, swapchain_surface);
+        DeviceRequirements requirements = {};
+        register_swapchain_requirements(requirements);
+        register_scheduler_requirements(requirements);
+        DeviceCapabilities capabilities;
+        device = create_logical_device(instance, gpu, queueFamilies, enabledLayerNames, requirements, capabilities);
+        swapchain = create_swapchain(instance, gpu, device, swapchain_surface);
+        graphicsQueueFamilyIndex = queueFamilies[0];
+
+        VK_LOAD_INSTANCE_FUNCTION(instance, vkGetDeviceQueue)
+        if (queueFamilies.size() > 1) {
+            vkGetDeviceQueue(device, queueFamilies[0], 0, &graphicsQueue);
+            vkGetDeviceQueue(device, queueFamilies[1], 0, &presentQueue);
+        } else {
+            vkGetDeviceQueue(device, queueFamilies[0], 0, &graphicsQueue);
+            vkGetDeviceQueue(device, queueFamilies[0], 0, &presentQueue);
+        }
+        // Only a graphics queue is created, transfer and compute work share its timeline
+        scheduler = create_frame_scheduler(device, capabilities, graphicsQueue, graphicsQueue, graphicsQueue);
+        deletionQueue = create_deletion_queue(scheduler);
+
+        renderPassConfig = make_render_pass_config(gpu, swapchain.format.format, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+            parse_msaa_option(argc, argv));
+        renderPass = create_render_pass(device, renderPassConfig);
+        clearValues = make_clear_values(renderPassConfig);
+        pipelineLayout = create_pipeline_layout(device);
+    }, {}, true);
+
+    std::vector<PipelineVariant> pipelineVariants = {
+        make_pipeline_variant("default", 1.0f, false, false, 0)
+    };
+    VkShaderModule vertModule;
+    VkShaderModule fragModule;
+    std::vector<VkPipeline> graphicalPipelines;
+    /*Pipeline compilation is usually the longest step, it overlaps with the
+    framebuffers. Viewport and scissor are dynamic, so neither swapchain
+    recreation nor hot reload depends on the extent the pipelines were built with*/
+    add_startup_task(startup, "pipelines", [&]() {
+        VK_LOAD_DEVICE_FUNCTION(device , vkCreateShaderModule)
+        vertModule = create_shader_module(vkCreateShaderModule, device, vertexShader);
+        fragModule = create_shader_module(vkCreateShaderModule, device, fragmentShader);
+        graphicalPipelines = create_pipeline_variants(device, vertModule, fragModule,
+            pipelineVariants, swapchain.extent, renderPass, renderPassConfig, pipelineLayout, true);
+    }, {shaderFiles, deviceTask});
+
+    std::vector<VkImageView> swapChainImageViews;
+    TransientAttachments transientAttachments;
+    std::vector<VkFramebuffer> swapChainFramebuffers;
+    VkCommandPool commandPool;
+    std::vector<VkCommandBuffer> commandBuffers;
+    VkCommandBufferAllocateInfo allocInfo = {};
+    add_startup_task(startup, "framebuffers", [&]() {
+        swapChainImageViews = create_image_views(device, swapchain);
+        transientAttachments = create_transient_attachments(gpu, device, renderPassConfig, swapchain.extent);
+        swapChainFramebuffers = create_window_framebuffers(device, renderPass, swapChainImageViews, transientAttachments,
+            swapchain.extent);
+        printf("---Creating command pool\n");
+        VK_LOAD_DEVICE_FUNCTION(device, vkCreateCommandPool)
+        VK_LOAD_DEVICE_FUNCTION(device, vkAllocateCommandBuffers)
+        VkCommandPoolCreateInfo poolInfo = {};
+        poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        poolInfo.queueFamilyIndex = graphicsQueueFamilyIndex;
+        poolInfo.flags = 0; // Optional
+        vkCheckResult(vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool));
+
+        commandBuffers.resize(swapChainFramebuffers.size());
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.commandPool = commandPool;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocInfo.commandBufferCount = (uint32_t) commandBuffers.size();
+        vkCheckResult(vkAllocateCommandBuffers(device, &allocInfo, commandBuffers.data()));
+    }, {deviceTask}, true);
+    run_startup_graph(startup);
+    print_startup_graph(startup);
+
+    VK_LOAD_DEVICE_FUNCTION(device, vkBeginCommandBuffer)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdBeginRenderPass)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdBindPipeline)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdSetViewport)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdSetScissor)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdPushConstants)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdDraw)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdEndRenderPass)
+    VK_LOAD_DEVICE_FUNCTION(device, vkEndCommandBuffer)
+    record_window_commands(commandBuffers, swapChainFramebuffers, renderPass, swapchain.extent, clearValues,
+        graphicalPipelines[0], pipelineLayout, true);
+
+    if (benchmark) {
+        BenchmarkTarget target;
+        target.device = device;
+        target.queue = graphicsQueue;
+        target.presentQueue = presentQueue;
+        target.queueFamily = graphicsQueueFamilyIndex;
+        target.swapchain = swapchain.swapchain;
+        target.framebuffers = swapChainFramebuffers;
+        target.renderPass = renderPass;
+        target.clearValues = clearValues;
+        target.extent = swapchain.extent;
+        target.pipelineLayout = pipelineLayout;
+        target.pipeline = create_benchmark_pipeline(device, fragModule, swapchain.extent, renderPass,
+            renderPassConfig, pipelineLayout);
+        graphicalPipelines.push_back(target.pipeline);
+        run_benchmark(gpu, target, *benchmark);
+    } else {
+        ShaderReloader reloader;
+        FramePacingOptions pacingOptions;
+        parse_pacing_options(argc, argv, pacingOptions);
+        auto pacer = create_frame_pacer(pacingOptions);
+        WindowLoopHooks hooks;
+        VK_LOAD_DEVICE_FUNCTION(device, vkFreeCommandBuffers)
+        // The worker gets its own copies, create_shader_stage writes into the variants. The extent is ignored
+        VkExtent2D ignoredExtent = swapchain.extent;
+        auto build = [=](const std::vector<VkShaderModule>& modules,
+                PFN_vkCreateGraphicsPipelines createGraphicsPipelines) mutable {
+            return create_pipeline_variants(device, modules[0], modules[1], pipelineVariants, ignoredExtent,
+                renderPass, renderPassConfig, pipelineLayout, true, createGraphicsPipelines);
+        };
+        const bool reloading = hotReload &&
+            start_shader_reloader(reloader, device, shaderDirectory, {"vert.spv", "frag.spv"}, build);
+        if (reloading) {
+            // Frames in flight keep the old pipelines and command buffers, they are retired with them
+            hooks.frameBoundary = [&]() {
+                std::vector<VkPipeline> reloaded;
+                if (!take_reloaded_pipelines(reloader, reloaded)) {
+                    return false;
+                }
+                const uint64_t lastUse = scheduler_submitted(scheduler, SCHEDULER_GRAPHICS);
+                for (auto& pipeline : graphicalPipelines) {
+                    defer_destroy_pipeline(deletionQueue, SCHEDULER_GRAPHICS, lastUse, pipeline);
+                }
+                auto retired = commandBuffers;
+                defer_deletion(deletionQueue, SCHEDULER_GRAPHICS, lastUse, [=](VkDevice logical_device) {
+                    vkFreeCommandBuffers(logical_device, commandPool, static_cast<uint32_t>(retired.size()), retired.data());
+                });
+                graphicalPipelines = reloaded;
+                vkCheckResult(vkAllocateCommandBuffers(device, &allocInfo, commandBuffers.data()));
+                record_window_commands(commandBuffers, swapChainFramebuffers, renderPass, swapchain.extent, clearValues,
+                    graphicalPipelines[0], pipelineLayout, true);
+                return true;
+            };
+        }
+        /*The window can't be resized, but the surface can still change under it.
+        The pipelines, reloaded ones included, are kept: only the recorded
+        viewport follows the new extent*/
+        hooks.recreateSwapchain = [&]() {
+            printf("---Recreating swapchain\n");
+            VK_LOAD_DEVICE_FUNCTION(device, vkDestroyFramebuffer)
+            VK_LOAD_DEVICE_FUNCTION(device, vkDestroyImageView)
+            VK_LOAD_DEVICE_FUNCTION(device, vkDestroySwapchainKHR)
+            for (auto& framebuffer : swapChainFramebuffers) {
+                vkDestroyFramebuffer(device, framebuffer, nullptr);
+            }
+            for (auto& imageView : swapChainImageViews) {
+                vkDestroyImageView(device, imageView, nullptr);
+            }
+            destroy_transient_attachments(device, transientAttachments);
+            // The old swapchain lets the presentation engine hand its resources over, it is retired afterwards
+            const VkSwapchainKHR oldSwapchain = swapchain.swapchain;
+            swapchain = create_swapchain(instance, gpu, device, swapchain_surface, oldSwapchain);
+            vkDestroySwapchainKHR(device, oldSwapchain, nullptr);
+            swapChainImageViews = create_image_views(device, swapchain);
+            transientAttachments = create_transient_attachments(gpu, device, renderPassConfig, swapchain.extent);
+            swapChainFramebuffers = create_window_framebuffers(device, renderPass, swapChainImageViews,
+                transientAttachments, swapchain.extent);
+            vkFreeCommandBuffers(device, commandPool, static_cast<uint32_t>(commandBuffers.size()), commandBuffers.data());
+            commandBuffers.resize(swapChainFramebuffers.size());
+            allocInfo.commandBufferCount = static_cast<uint32_t>(commandBuffers.size());
+            vkCheckResult(vkAllocateCommandBuffers(device, &allocInfo, commandBuffers.data()));
+            record_window_commands(commandBuffers, swapChainFramebuffers, renderPass, swapchain.extent, clearValues,
+                graphicalPipelines[0], pipelineLayout, true);
+        };
+        printf("---Starting main window-loop\n");
+        window_main_loop(device, swapchain.swapchain, scheduler, deletionQueue, commandBuffers, presentQueue, pacer,
+            hooks);
+        if (reloading) {
+            stop_shader_reloader(reloader);
+        }
+    }
+	printf("---Unloading vulkan application\n");
+    const uint64_t lastFrame = scheduler_submitted(scheduler, SCHEDULER_GRAPHICS);
+    for (auto& framebuffer : swapChainFramebuffers) {
+        defer_destroy_framebuffer(deletionQueue, SCHEDULER_GRAPHICS, lastFrame, framebuffer);
+    }
+    for (auto& pipeline : graphicalPipelines) {
+        defer_destroy_pipeline(deletionQueue, SCHEDULER_GRAPHICS, lastFrame, pipeline);
+    }
+    flush_deletion_queue(deletionQueue);
+    destroy_frame_scheduler(scheduler);
+
+	VK_LOAD_DEVICE_FUNCTION(device, vkDestroyCommandPool)
+    vkDestroyCommandPool(device, commandPool, nullptr);
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyPipelineLayout)
+    vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyRenderPass)
+    vkDestroyRenderPass(device, renderPass, nullptr);
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyShaderModule)
+    vkDestroyShaderModule(device, fragModule, nullptr);
+    vkDestroyShaderModule(device, vertModule, nullptr);
+
+    destroy_transient_attachments(device, transientAttachments);
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyImageView)
+    for (size_t i = 0; i < swapChainImageViews.size(); ++i) {
+        if ( swapChainImageViews[i] != VK_NULL_HANDLE )
+            vkDestroyImageView(device, swapChainImageViews[i], nullptr);
+    }
+
+    if ( swapchain.swapchain != VK_NULL_HANDLE) {
+        VK_LOAD_INSTANCE_FUNCTION(instance , vkDestroySwapchainKHR);
+        vkDestroySwapchainKHR(device, swapchain.swapchain, nullptr);
+    }
+
+    if( device != VK_NULL_HANDLE ) {
+	  VK_LOAD_DEVICE_FUNCTION(device , vkDeviceWaitIdle)
+	  VK_LOAD_DEVICE_FUNCTION(device , vkDestroyDevice)
+      vkDeviceWaitIdle( device );
+      vkDestroyDevice( device, nullptr );
+    }
+
+    if ( swapchain_surface != VK_NULL_HANDLE ) {
+        VK_LOAD_INSTANCE_FUNCTION(instance , vkDestroySurfaceKHR);
+        vkDestroySurfaceKHR(instance, swapchain_surface, nullptr);
+    }
+    // The surface refers to the window, so the window goes last
+    destroy_window();
+}
+
+void init_surface_manager(SurfaceManager& manager,
+VkInstance& instance,
+VkPhysicalDevice& gpuDevice,
+VkDevice& logical_device,
+uint32_t graphicsFamily,
+uint32_t presentFamily,
+const RenderPassConfig& renderPassConfig,
+VkRenderPass renderPass,
+VkPipeline pipeline,
+VkPipelineLayout pipelineLayout)
+{
+    manager.instance = instance;
+    manager.gpu = gpuDevice;
+    manager.device = logical_device;
+    manager.presentFamily = presentFamily;
+    manager.framesInFlight = 2;
+    manager.renderPassConfig = renderPassConfig;
+    manager.renderPass = renderPass;
+    manager.clearValues = make_clear_values(renderPassConfig);
+    manager.pipeline = pipeline;
+    manager.pipelineLayout = pipelineLayout;
+
+    printf("---Creating command pool\n");
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkCreateCommandPool)
+    VkCommandPoolCreateInfo poolInfo = {};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.queueFamilyIndex = graphicsFamily;
+    poolInfo.flags = 0;
+    vkCheckResult(vkCreateCommandPool(logical_device, &poolInfo, nullptr, &manager.commandPool));
+
+    // Used by record_window_commands whenever an output is added or recreated
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkBeginCommandBuffer)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkCmdBeginRenderPass)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkCmdBindPipeline)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkCmdSetViewport)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkCmdSetScissor)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkCmdPushConstants)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkCmdDraw)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkCmdEndRenderPass)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkEndCommandBuffer)
+}
+
+// Swapchain and everything sized by it, recorded against the shared pipeline
+void create_output_resources(SurfaceManager& manager, OutputSurface& output, VkSwapchainKHR oldSwapchain)
+{
+    output.swapchain = create_swapchain(manager.instance, manager.gpu, manager.device, output.surface, oldSwapchain);
+    if (output.swapchain.format.format != manager.renderPassConfig.colorFormat) {
+        throw VulkanException("Surface doesn't offer the format of the shared render pass");
+    }
+    output.imageViews = create_image_views(manager.device, output.swapchain);
+    output.transient = create_transient_attachments(manager.gpu, manager.device, manager.renderPassConfig,
+        output.swapchain.extent);
+    output.framebuffers = create_window_framebuffers(manager.device, manager.renderPass, output.imageViews,
+        output.transient, output.swapchain.extent);
+
+    VK_LOAD_DEVICE_FUNCTION(manager.device, vkAllocateCommandBuffers)
+    output.commandBuffers.resize(output.framebuffers.size());
+    VkCommandBufferAllocateInfo allocInfo = {};
+    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocInfo.commandPool = manager.commandPool;
+    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    allocInfo.commandBufferCount = static_cast<uint32_t>(output.commandBuffers.size());
+    vkCheckResult(vkAllocateCommandBuffers(manager.device, &allocInfo, output.commandBuffers.data()));
+    record_window_commands(output.commandBuffers, output.framebuffers, manager.renderPass, output.swapchain.extent,
+        manager.clearValues, manager.pipeline, manager.pipelineLayout, true);
+    // Recreation happens after the queue went idle, the new buffers start out unused
+    output.imageSubmitted.assign(output.commandBuffers.size(), 0);
+    output.outOfDate = false;
+}
+
+// Handles partially created outputs, every handle starts out null
+void destroy_output_resources(SurfaceManager& manager, OutputSurface& output)
+{
+    VK_LOAD_DEVICE_FUNCTION(manager.device, vkFreeCommandBuffers)
+    VK_LOAD_DEVICE_FUNCTION(manager.device, vkDestroyFramebuffer)
+    VK_LOAD_DEVICE_FUNCTION(manager.device, vkDestroyImageView)
+    VK_LOAD_DEVICE_FUNCTION(manager.device, vkDestroySwapchainKHR)
+    if (!output.commandBuffers.empty()) {
+        vkFreeCommandBuffers(manager.device, manager.commandPool, static_cast<uint32_t>(output.commandBuffers.size()),
+            output.commandBuffers.data());
+    }
+    output.commandBuffers.clear();
+    output.imageSubmitted.clear();
+    for (auto& framebuffer : output.framebuffers) {
+        vkDestroyFramebuffer(manager.device, framebuffer, nullptr);
+    }
+    output.framebuffers.clear();
+    for (auto& imageView : output.imageViews) {
+        vkDestroyImageView(manager.device, imageView, nullptr);
+    }
+    output.imageViews.clear();
+    destroy_transient_attachments(manager.device, output.transient);
+    output.transient = TransientAttachments();
+    vkDestroySwapchainKHR(manager.device, output.swapchain.swapchain, nullptr);
+    output.swapchain.swapchain = VK_NULL_HANDLE;
+}
+
+OutputSurface& add_output_surface(SurfaceManager& manager, NativeWindow window, VkSurfaceKHR surface, bool ownsWindow)
+{
+    manager.outputs.push_back(std::unique_ptr<OutputSurface>(new OutputSurface()));
+    auto& output = *manager.outputs.back();
+    output.window = window;
+    output.ownsWindow = ownsWindow;
+    output.surface = surface;
+    try {
+        VK_LOAD_INSTANCE_FUNCTION(manager.instance, vkGetPhysicalDeviceSurfaceSupportKHR)
+        VK_LOAD_DEVICE_FUNCTION(manager.device, vkCreateSemaphore)
+        VkBool32 presentSupport = VK_FALSE;
+        vkCheckResult(vkGetPhysicalDeviceSurfaceSupportKHR(manager.gpu, manager.presentFamily, surface, &presentSupport));
+        if (!presentSupport) {
+            throw VulkanException("Present queue family can't present to the surface");
+        }
+        create_output_resources(manager, output, VK_NULL_HANDLE);
+        VkSemaphoreCreateInfo semaphoreInfo = {};
+        semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        output.imageAvailable.resize(manager.framesInFlight, VK_NULL_HANDLE);
+        for (auto& semaphore : output.imageAvailable) {
+            vkCheckResult(vkCreateSemaphore(manager.device, &semaphoreInfo, nullptr, &semaphore));
+        }
+    } catch (...) {
+        remove_output_surface(manager, manager.outputs.size() - 1);
+        throw;
+    }
+    return output;
+}
+
+void recreate_output_swapchain(SurfaceManager& manager, OutputSurface& output)
+{
+    printf("---Recreating swapchain\n");
+    VK_LOAD_DEVICE_FUNCTION(manager.device, vkDestroySwapchainKHR)
+    // Kept alive for the new swapchain's create info, retired once that exists
+    const VkSwapchainKHR oldSwapchain = output.swapchain.swapchain;
+    output.swapchain.swapchain = VK_NULL_HANDLE;
+    destroy_output_resources(manager, output);
+    create_output_resources(manager, output, oldSwapchain);
+    vkDestroySwapchainKHR(manager.device, oldSwapchain, nullptr);
+}
+
+void remove_output_surface(SurfaceManager& manager, size_t index)
+{
+    auto& output = *manager.outputs[index];
+    VK_LOAD_DEVICE_FUNCTION(manager.device, vkDestroySemaphore)
+    VK_LOAD_INSTANCE_FUNCTION(manager.instance, vkDestroySurfaceKHR)
+    destroy_output_resources(manager, output);
+    for (auto& semaphore : output.imageAvailable) {
+        vkDestroySemaphore(manager.device, semaphore, nullptr);
+    }
+    vkDestroySurfaceKHR(manager.instance, output.surface, nullptr);
+    if (output.ownsWindow) {
+        destroy_output_window(output.window);
+    } else {
+        // destroy_window still needs it, it only disappears from the screen
+#ifdef USE_GLFW
+        glfwHideWindow(output.window);
+#elif defined(USE_XCB)
+        xcb_unmap_window(c, output.window);
+        xcb_flush(c);
+#elif defined(USE_XLIB)
+        XUnmapWindow(display, output.window);
+        XFlush(display);
+#endif
+    }
+    manager.outputs.erase(manager.outputs.begin() + index);
+}
+
+bool poll_output_events(SurfaceManager& manager, double timeoutMs)
+{
+#ifdef USE_GLFW
+    if (timeoutMs > 0.0) {
+        glfwWaitEventsTimeout(timeoutMs / 1000.0);
+    } else {
+        glfwPollEvents();
+    }
+    for (auto& output : manager.outputs) {
+        output->closed = output->closed || glfwWindowShouldClose(output->window);
+    }
+    return false;
+#else
+    bool dirtied = false;
+    auto dispatch = [&]() {
+        NativeWindow target;
+        bool close;
+        bool dirty;
+        bool received = false;
+        while (next_window_event(target, close, dirty)) {
+            received = true;
+            dirtied = dirtied || dirty;
+            for (auto& output : manager.outputs) {
+                output->closed = output->closed || (close && output->window == target);
+            }
+        }
+        return received;
+    };
+    if (!dispatch() && timeoutMs > 0.0) {
+        wait_for_window_events(timeoutMs);
+        dispatch();
+    }
+    return dirtied;
+#endif
+}
+
+void destroy_surface_manager(SurfaceManager& manager)
+{
+    while (!manager.outputs.empty()) {
+        remove_output_surface(manager, manager.outputs.size() - 1);
+    }
+    VK_LOAD_DEVICE_FUNCTION(manager.device, vkDestroyCommandPool)
+    vkDestroyCommandPool(manager.device, manager.commandPool, nullptr);
+    manager.commandPool = VK_NULL_HANDLE;
+}
+
+uint32_t parse_window_count_option(int argc, char* argv[])
+{
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (!strcmp(argv[i], "--windows")) {
+            return std::max(1ul, strtoul(argv[i + 1], nullptr, 10));
+        }
+    }
+    return 1;
+}
+
+void run_multi_window(VkInstance& instance,
+VkPhysicalDevice& gpu,
+const std::vector<const char*>& enabledLayerNames,
+int argc,
+char* argv[],
+uint32_t windowCount)
+{
+    printf("---Loading shaders\n");
+    auto vertexShader = load_shader("vert.spv");
+    auto fragmentShader = load_shader("frag.spv");
+
+    VkSurfaceKHR firstSurface = create_swapchain_surface(instance);
+    auto queueFamilies = find_queue_families(instance, gpu, firstSurface);
+    DeviceRequirements requirements = {};
+    register_swapchain_requirements(requirements);
+    register_scheduler_requirements(requirements);
+    DeviceCapabilities capabilities;
+    VkDevice device = create_logical_device(instance, gpu, queueFamilies, enabledLayerNames, requirements, capabilities);
+    const uint32_t graphicsFamily = queueFamilies[0];
+    const uint32_t presentFamily = queueFamilies.size() > 1 ? queueFamilies[1] : queueFamilies[0];
+    VK_LOAD_INSTANCE_FUNCTION(instance, vkGetDeviceQueue)
+    VkQueue graphicsQueue;
+    VkQueue presentQueue;
+    vkGetDeviceQueue(device, graphicsFamily, 0, &graphicsQueue);
+    vkGetDeviceQueue(device, presentFamily, 0, &presentQueue);
+    auto scheduler = create_frame_scheduler(device, capabilities, graphicsQueue, graphicsQueue, graphicsQueue);
+    auto deletionQueue = create_deletion_queue(scheduler);
+
+    // Every output renders through this render pass, so its format comes from the first surface
+    auto renderPassConfig = make_render_pass_config(gpu, find_surface_format(instance, gpu, firstSurface).format,
+        VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, parse_msaa_option(argc, argv));
+    VkRenderPass renderPass = create_render_pass(device, renderPassConfig);
+    VkPipelineLayout pipelineLayout = create_pipeline_layout(device);
+    VK_LOAD_DEVICE_FUNCTION(device, vkCreateShaderModule)
+    VkShaderModule vertModule = create_shader_module(vkCreateShaderModule, device, vertexShader);
+    VkShaderModule fragModule = create_shader_module(vkCreateShaderModule, device, fragmentShader);
+    std::vector<PipelineVariant> pipelineVariants = {
+        make_pipeline_variant("default", 1.0f, false, false, 0)
+    };
+    // Viewport and scissor are set per output, the extent only fills the unused static state
+    VkExtent2D ignoredExtent = {WIDTH, HEIGHT};
+    auto pipelines = create_pipeline_variants(device, vertModule, fragModule, pipelineVariants, ignoredExtent,
+        renderPass, renderPassConfig, pipelineLayout, true);
+
+    SurfaceManager manager;
+    init_surface_manager(manager, instance, gpu, device, graphicsFamily, presentFamily, renderPassConfig, renderPass,
+        pipelines[0], pipelineLayout);
+    add_output_surface(manager, window, firstSurface, false);
+    for (uint32_t i = 1; i < windowCount; ++i) {
+        const std::string title = "Vulkan " + std::to_string(i + 1);
+        NativeWindow output = create_output_window(title.c_str(), WIDTH, HEIGHT);
+        add_output_surface(manager, output, create_window_surface(instance, output), true);
+    }
+    printf("---Rendering to %d windows\n", windowCount);
+
+    VK_LOAD_DEVICE_FUNCTION(device, vkAcquireNextImageKHR)
+    VK_LOAD_DEVICE_FUNCTION(device, vkQueuePresentKHR)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCreateSemaphore)
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroySemaphore)
+    FramePacingOptions pacingOptions;
+    parse_pacing_options(argc, argv, pacingOptions);
+    auto pacer = create_frame_pacer(pacingOptions);
+    // Acquire semaphores belong to the outputs, one present waits on a single render-finished semaphore
+    std::vector<VkSemaphore> renderFinished(manager.framesInFlight);
+    std::vector<uint64_t> submitted(manager.framesInFlight, 0);
+    VkSemaphoreCreateInfo semaphoreInfo = {};
+    semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    for (auto& semaphore : renderFinished) {
+        vkCheckResult(vkCreateSemaphore(device, &semaphoreInfo, nullptr, &semaphore));
+    }
+
+    std::vector<OutputSurface*> acquired;
+    std::vector<VkSwapchainKHR> swapchains;
+    std::vector<uint32_t> imageIndices;
+    std::vector<VkResult> presentResults;
+    ScheduledSubmit submit;
+    uint32_t frame = 0;
+    bool deviceLost = false;
+    while (!deviceLost) {
+        if (poll_output_events(manager, pacer.options.idle && !pacer.dirty ? pacer.options.idleTimeoutMs : 0.0)) {
+            pacer_mark_dirty(pacer);
+        }
+        if (pacer.options.frameLimit && pacer.frames >= pacer.options.frameLimit) {
+            break;
+        }
+        bool changed = false;
+        for (auto& output : manager.outputs) {
+            changed = changed || output->closed || output->outOfDate;
+        }
+        if (changed) {
+            scheduler_wait_idle(scheduler);
+            for (size_t i = manager.outputs.size(); i-- > 0;) {
+                if (manager.outputs[i]->closed) {
+                    remove_output_surface(manager, i);
+                } else if (manager.outputs[i]->outOfDate) {
+                    recreate_output_swapchain(manager, *manager.outputs[i]);
+                }
+            }
+            pacer_mark_dirty(pacer);
+        }
+        if (manager.outputs.empty()) {
+            break;
+        }
+        collect_deletion_queue(deletionQueue);
+        if (!pacer_should_render(pacer)) {
+            continue;
+        }
+        pacer_begin_frame(pacer);
+        const uint32_t slot = frame % manager.framesInFlight;
+        auto waitStart = std::chrono::steady_clock::now();
+        scheduler_wait(scheduler, SCHEDULER_GRAPHICS, submitted[slot]);
+        double gpuWaitMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - waitStart).count();
+
+        // Outputs that fail to acquire sit this frame out, their semaphore stays unsignaled
+        acquired.clear();
+        swapchains.clear();
+        imageIndices.clear();
+        submit.commandBuffers.clear();
+        submit.binaryWaits.clear();
+        submit.binaryWaitStages.clear();
+        for (auto& output : manager.outputs) {
+            uint32_t imageIndex;
+            auto result = vkCheckRecoverable(vkAcquireNextImageKHR(device, output->swapchain.swapchain,
+                std::numeric_limits<uint64_t>::max(), output->imageAvailable[slot], VK_NULL_HANDLE, &imageIndex));
+            if (result == RESULT_DEVICE_LOST) {
+                deviceLost = true;
+                break;
+            }
+            if (result == RESULT_RECREATE_SWAPCHAIN) {
+                output->outOfDate = true;
+            }
+            if (result != RESULT_CONTINUE) {
+                continue;
+            }
+            waitStart = std::chrono::steady_clock::now();
+            scheduler_wait(scheduler, SCHEDULER_GRAPHICS, output->imageSubmitted[imageIndex]);
+            gpuWaitMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - waitStart).count();
+            acquired.push_back(output.get());
+            swapchains.push_back(output->swapchain.swapchain);
+            imageIndices.push_back(imageIndex);
+            submit.commandBuffers.push_back(output->commandBuffers[imageIndex]);
+            submit.binaryWaits.push_back(output->imageAvailable[slot]);
+            submit.binaryWaitStages.push_back(VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT);
+        }
+        // Semaphores already signaled by acquire are dropped with the device
+        if (deviceLost || acquired.empty()) {
+            pacer_end_frame(pacer, gpuWaitMs);
+            pacer_mark_dirty(pacer);
+            continue;
+        }
+        submit.binarySignals = {renderFinished[slot]};
+        submitted[slot] = scheduler_submit(scheduler, SCHEDULER_GRAPHICS, submit);
+        for (size_t i = 0; i < acquired.size(); ++i) {
+            acquired[i]->imageSubmitted[imageIndices[i]] = submitted[slot];
+        }
+
+        presentResults.assign(acquired.size(), VK_SUCCESS);
+        VkPresentInfoKHR presentInfo = {};
+        presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+        presentInfo.waitSemaphoreCount = 1;
+        presentInfo.pWaitSemaphores = &renderFinished[slot];
+        presentInfo.swapchainCount = static_cast<uint32_t>(swapchains.size());
+        presentInfo.pSwapchains = swapchains.data();
+        presentInfo.pImageIndices = imageIndices.data();
+        presentInfo.pResults = presentResults.data();
+        if (vkCheckRecoverable(vkQueuePresentKHR(presentQueue, &presentInfo)) == RESULT_DEVICE_LOST) {
+            deviceLost = true;
+        }
+        for (size_t i = 0; i < acquired.size(); ++i) {
+            auto result = vkCheckRecoverable(presentResults[i]);
+            if (result == RESULT_DEVICE_LOST) {
+                deviceLost = true;
+            } else if (result == RESULT_RECREATE_SWAPCHAIN) {
+                acquired[i]->outOfDate = true;
+            }
+        }
+        pacer_end_frame(pacer, gpuWaitMs);
+        if (++frame == 1) {
+            printf("---Time to first frame: %.2f ms\n", startup_elapsed_ms());
+        }
+    }
+    // Waiting would only report the loss again
+    if (!deviceLost) {
+        scheduler_wait_idle(scheduler);
+    }
+    print_pacing_statistics(pacer);
+
+	printf("---Unloading vulkan application\n");
+    for (auto& semaphore : renderFinished) {
+        vkDestroySemaphore(device, semaphore, nullptr);
+    }
+    destroy_surface_manager(manager);
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyPipeline)
+    for (auto& pipeline : pipelines) {
+        vkDestroyPipeline(device, pipeline, nullptr);
+    }
+    flush_deletion_queue(deletionQueue);
+    destroy_frame_scheduler(scheduler);
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyPipelineLayout)
+    vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyRenderPass)
+    vkDestroyRenderPass(device, renderPass, nullptr);
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyShaderModule)
+    vkDestroyShaderModule(device, fragModule, nullptr);
+    vkDestroyShaderModule(device, vertModule, nullptr);
+	VK_LOAD_DEVICE_FUNCTION(device, vkDeviceWaitIdle)
+	VK_LOAD_DEVICE_FUNCTION(device, vkDestroyDevice)
+    vkDeviceWaitIdle(device);
+    vkDestroyDevice(device, nullptr);
+    destroy_window();
+    if (deviceLost) {
+        throw VulkanException("Device lost in the window loop", VK_ERROR_DEVICE_LOST);
+    }
+}
+
+uint32_t mip_level_count(VkExtent2D extent)
+{
+    uint32_t levels = 1;
+    for (uint32_t size = std::max(extent.width, extent.height); size > 1; size >>= 1) {
+        ++levels;
+    }
+    return levels;
+}
+
+VkExtent2D mip_extent(VkExtent2D extent, uint32_t level)
+{
+    return {std::max(1u, extent.width >> level), std::max(1u, extent.height >> level)};
+}
+
+bool supports_linear_blit(VkPhysicalDevice& gpuDevice, VkFormat format)
+{
+    VkFormatProperties properties;
+    vkGetPhysicalDeviceFormatProperties(gpuDevice, format, &properties);
+    const VkFormatFeatureFlags required = VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT |
+        VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+    return (properties.optimalTilingFeatures & required) == required;
+}
+
+void record_image_barrier(VkCommandBuffer commandBuffer,
+VkImage image,
+VkImageLayout oldLayout,
+VkImageLayout newLayout,
+VkAccessFlags srcAccess,
+VkAccessFlags dstAccess,
+VkPipelineStageFlags srcStage,
+VkPipelineStageFlags dstStage,
+uint32_t baseLevel,
+uint32_t levelCount)
+{
+    VkImageMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.oldLayout = oldLayout;
+    barrier.newLayout = newLayout;
+    barrier.srcAccessMask = srcAccess;
+    barrier.dstAccessMask = dstAccess;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = image;
+    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    barrier.subresourceRange.baseMipLevel = baseLevel;
+    barrier.subresourceRange.levelCount = levelCount;
+    barrier.subresourceRange.baseArrayLayer = 0;
+    barrier.subresourceRange.layerCount = 1;
+    vkCmdPipelineBarrier(commandBuffer, srcStage, dstStage, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+}
+
+void record_mip_generation(VkCommandBuffer commandBuffer,
+const AllocatedImage& image,
+uint32_t baseLevel,
+VkImageLayout finalLayout)
+{
+    for (uint32_t level = baseLevel + 1; level < image.mipLevels; ++level) {
+        // Each level is read once to produce the next one and then handed over
+        record_image_barrier(commandBuffer, image.image,
+            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+            VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT,
+            VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, level - 1, 1);
+        const VkExtent2D src = mip_extent(image.extent, level - 1);
+        const VkExtent2D dst = mip_extent(image.extent, level);
+        VkImageBlit blit = {};
+        blit.srcSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, level - 1, 0, 1};
+        blit.srcOffsets[1] = {static_cast<int32_t>(src.width), static_cast<int32_t>(src.height), 1};
+        blit.dstSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, level, 0, 1};
+        blit.dstOffsets[1] = {static_cast<int32_t>(dst.width), static_cast<int32_t>(dst.height), 1};
+        vkCmdBlitImage(commandBuffer, image.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+            image.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blit, VK_FILTER_LINEAR);
+        record_image_barrier(commandBuffer, image.image,
+            VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, finalLayout,
+            VK_ACCESS_TRANSFER_READ_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_TRANSFER_READ_BIT,
+            VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, level - 1, 1);
+    }
+    record_image_barrier(commandBuffer, image.image,
+        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, finalLayout,
+        VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_TRANSFER_READ_BIT,
+        VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, image.mipLevels - 1, 1);
+}
+
+AllocatedImage create_mipmapped_texture(VkPhysicalDevice& gpuDevice,
+VkDevice& logical_device,
+VkCommandBuffer commandBuffer,
+const AllocatedBuffer& staging,
+VkExtent2D extent,
+VkFormat format)
+{
+    if (!supports_linear_blit(gpuDevice, format)) {
+        throw VulkanException("Format can't be blitted with linear filtering", VK_ERROR_FORMAT_NOT_SUPPORTED);
+    }
+    auto image = create_image(gpuDevice, logical_device, extent, format,
+        VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+        VK_IMAGE_ASPECT_COLOR_BIT, VK_SAMPLE_COUNT_1_BIT, mip_level_count(extent));
+    record_image_barrier(commandBuffer, image.image,
+        VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        0, VK_ACCESS_TRANSFER_WRITE_BIT,
+        VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, image.mipLevels);
+    VkBufferImageCopy region = {};
+    region.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+    region.imageExtent = {extent.width, extent.height, 1};
+    vkCmdCopyBufferToImage(commandBuffer, staging.buffer, image.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+    record_mip_generation(commandBuffer, image, 0, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    return image;
+}
+
+bool open_texture_container(const std::string& filename, TextureContainer& container)
+{
+    container.fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    container.data = nullptr;
+    if (container.fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(container.fd, &info) || static_cast<size_t>(info.st_size) < sizeof(TextureFileHeader)) {
+        close(container.fd);
+        return false;
+    }
+    container.size = info.st_size;
+    void* mapping = mmap(nullptr, container.size, PROT_READ, MAP_PRIVATE, container.fd, 0);
+    if (mapping == MAP_FAILED) {
+        close(container.fd);
+        return false;
+    }
+    // Levels are fetched on demand by the loader thread, read-ahead of whole files would be wasted
+    madvise(mapping, container.size, MADV_RANDOM);
+    container.data = static_cast<const uint8_t*>(mapping);
+    container.header = reinterpret_cast<const TextureFileHeader*>(container.data);
+    container.entries = reinterpret_cast<const TextureFileEntry*>(container.data + sizeof(TextureFileHeader));
+    bool valid = container.header->magic == textureFileMagic && container.header->version == textureFileVersion &&
+        container.header->textureCount <= (container.size - sizeof(TextureFileHeader)) / sizeof(TextureFileEntry);
+    for (uint32_t i = 0; valid && i < container.header->textureCount; ++i) {
+        const auto& entry = container.entries[i];
+        // Level sizes and staging offsets assume 4 bytes per texel
+        const VkFormat format = static_cast<VkFormat>(entry.format);
+        valid = (format == VK_FORMAT_R8G8B8A8_UNORM || format == VK_FORMAT_R8G8B8A8_SRGB ||
+            format == VK_FORMAT_B8G8R8A8_UNORM || format == VK_FORMAT_B8G8R8A8_SRGB) &&
+            entry.levels > 0 && entry.levels <= maxTextureLevels &&
+            entry.levels <= mip_level_count({entry.width, entry.height});
+        for (uint32_t level = 0; valid && level < entry.levels; ++level) {
+            const auto extent = mip_extent({entry.width, entry.height}, level);
+            valid = entry.level[level].size == static_cast<uint64_t>(extent.width) * extent.height * 4 &&
+                entry.level[level].offset <= container.size &&
+                entry.level[level].size <= container.size - entry.level[level].offset;
+        }
+    }
+    if (!valid) {
+        printf("\t%s is not a texture container\n", filename.c_str());
+        close_texture_container(container);
+        return false;
+    }
+    printf("\tMapped texture container %s: %d textures, %zu bytes\n", filename.c_str(),
+        container.header->textureCount, container.size);
+    return true;
+}
+
+void close_texture_container(TextureContainer& container)
+{
+    if (container.data) {
+        munmap(const_cast<uint8_t*>(container.data), container.size);
+        container.data = nullptr;
+    }
+    if (container.fd >= 0) {
+        close(container.fd);
+        container.fd = -1;
+    }
+}
+
+bool write_texture_container(const std::string& filename,
+const std::vector<VkExtent2D>& extents,
+const std::vector<std::vector<uint8_t>>& pixels)
+{
+    FILE* file = fopen(filename.c_str(), "wb");
+    if (!file) {
+        printf("\tCouldn't create texture container: %s\n", filename.c_str());
+        return false;
+    }
+    TextureFileHeader header = {textureFileMagic, textureFileVersion, static_cast<uint32_t>(extents.size()), 0};
+    std::vector<TextureFileEntry> entries(extents.size());
+    std::vector<std::vector<std::vector<uint8_t>>> chains(extents.size());
+    uint64_t offset = sizeof(header) + entries.size() * sizeof(TextureFileEntry);
+    for (size_t i = 0; i < extents.size(); ++i) {
+        auto& entry = entries[i];
+        entry = {};
+        entry.width = extents[i].width;
+        entry.height = extents[i].height;
+        entry.format = VK_FORMAT_R8G8B8A8_UNORM;
+        entry.levels = std::min(maxTextureLevels, mip_level_count(extents[i]));
+        chains[i].push_back(pixels[i]);
+        for (uint32_t level = 1; level < entry.levels; ++level) {
+            const auto src = mip_extent(extents[i], level - 1);
+            const auto dst = mip_extent(extents[i], level);
+            const auto& source = chains[i][level - 1];
+            std::vector<uint8_t> reduced(dst.width * dst.height * 4);
+            for (uint32_t y = 0; y < dst.height; ++y) {
+                for (uint32_t x = 0; x < dst.width; ++x) {
+                    const uint32_t x0 = std::min(2 * x, src.width - 1), x1 = std::min(2 * x + 1, src.width - 1);
+                    const uint32_t y0 = std::min(2 * y, src.height - 1), y1 = std::min(2 * y + 1, src.height - 1);
+                    for (uint32_t c = 0; c < 4; ++c) {
+                        const uint32_t sum = source[(y0 * src.width + x0) * 4 + c] + source[(y0 * src.width + x1) * 4 + c] +
+                            source[(y1 * src.width + x0) * 4 + c] + source[(y1 * src.width + x1) * 4 + c];
+                        reduced[(y * dst.width + x) * 4 + c] = static_cast<uint8_t>((sum + 2) / 4);
+                    }
+                }
+            }
+            chains[i].push_back(reduced);
+        }
+        for (uint32_t level = 0; level < entry.levels; ++level) {
+            offset = (offset + 15) & ~uint64_t(15);
+            entry.level[level].offset = offset;
+            entry.level[level].size = chains[i][level].size();
+            offset += entry.level[level].size;
+        }
+    }
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+        fwrite(entries.data(), sizeof(TextureFileEntry), entries.size(), file) == entries.size();
+    for (size_t i = 0; written && i < entries.size(); ++i) {
+        for (uint32_t level = 0; written && level < entries[i].levels; ++level) {
+            written = fseek(file, entries[i].level[level].offset, SEEK_SET) == 0 &&
+                fwrite(chains[i][level].data(), 1, chains[i][level].size(), file) == chains[i][level].size();
+        }
+    }
+    written = fclose(file) == 0 && written;
+    if (!written) {
+        printf("\tCouldn't write texture container: %s\n", filename.c_str());
+        return false;
+    }
+    printf("\tWrote texture container %s: %zu textures, %llu bytes\n", filename.c_str(), extents.size(),
+        static_cast<unsigned long long>(offset));
+    return true;
+}
+
+std::vector<uint8_t> make_test_texture(VkExtent2D extent, uint32_t seed)
+{
+    std::vector<uint8_t> pixels(extent.width * extent.height * 4);
+    const uint32_t checker = 4u << (seed % 4);
+    for (uint32_t y = 0; y < extent.height; ++y) {
+        for (uint32_t x = 0; x < extent.width; ++x) {
+            uint8_t* texel = &pixels[(y * extent.width + x) * 4];
+            texel[0] = static_cast<uint8_t>(x * 255 / std::max(1u, extent.width - 1));
+            texel[1] = static_cast<uint8_t>(y * 255 / std::max(1u, extent.height - 1));
+            texel[2] = static_cast<uint8_t>(seed * 37);
+            texel[3] = ((x / checker + y / checker) % 2) ? 255 : 64;
+        }
+    }
+    return pixels;
+}
+
+// Every image a streamer creates, so memory sizes can be queried up front
+const VkImageUsageFlags streamedImageUsage =
+    VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+
+// Staging bytes of one level, 16 byte aligned
+VkDeviceSize staged_level_bytes(const TextureFileEntry& entry, uint32_t level)
+{
+    return (entry.level[level].size + 15) & ~VkDeviceSize(15);
+}
+
+void texture_streamer_loader(TextureStreamer& streamer)
+{
+    std::unique_lock<std::mutex> lock(streamer.mutex);
+    while (true) {
+        streamer.wake.wait(lock, [&]() { return !streamer.running || !streamer.loadQueue.empty(); });
+        if (!streamer.running) {
+            return;
+        }
+        auto& slot = streamer.slots[streamer.loadQueue.front()];
+        streamer.loadQueue.pop_front();
+        lock.unlock();
+        // Page faults on the mapping land here instead of on the frame loop
+        auto staging = static_cast<uint8_t*>(streamer.staging.mapped) + slot.stagingBase;
+        for (const auto& op : slot.ops) {
+            if (op.stagingBytes) {
+                const auto& level = streamer.container->entries[op.texture].level[op.level];
+                memcpy(staging + op.stagingOffset, streamer.container->data + level.offset, level.size);
+            }
+        }
+        lock.lock();
+        slot.state = STREAMING_SLOT_READY;
+    }
+}
+
+void create_texture_streamer(TextureStreamer& streamer,
+VkPhysicalDevice& gpuDevice,
+VkDevice& logical_device,
+uint32_t queueFamily,
+FrameScheduler& scheduler,
+DeletionQueue& deletionQueue,
+const TextureContainer& container,
+const TextureStreamingOptions& options)
+{
+    // Loaded once here, updates run every frame
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkCreateCommandPool)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkAllocateCommandBuffers)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkResetCommandBuffer)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkBeginCommandBuffer)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkEndCommandBuffer)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkCmdPipelineBarrier)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkCmdCopyBufferToImage)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkCmdCopyImage)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkFlushMappedMemoryRanges)
+    streamer.gpu = gpuDevice;
+    streamer.device = logical_device;
+    streamer.scheduler = &scheduler;
+    streamer.deletionQueue = &deletionQueue;
+    streamer.container = &container;
+    streamer.options = options;
+    streamer.updates = 0;
+    streamer.residentBytes = 0;
+    streamer.uploadedBytes = 0;
+    streamer.largestUpdate = 0;
+    streamer.peakResidentBytes = 0;
+    streamer.evictions = 0;
+    streamer.cappedTextures = 0;
+
+    // Staging never holds more than the budget, levels that don't fit it are never streamed
+    const VkDeviceSize slotSize = std::max<VkDeviceSize>(16, options.uploadBudget & ~VkDeviceSize(15));
+    // Containers repeat a few shapes, each is queried once
+    std::map<std::array<uint32_t, 4>, VkDeviceSize> memorySizes;
+    streamer.textures.resize(container.header->textureCount);
+    for (uint32_t i = 0; i < container.header->textureCount; ++i) {
+        const auto& entry = container.entries[i];
+        auto& texture = streamer.textures[i];
+        texture.image = {};
+        texture.image.image = VK_NULL_HANDLE;
+        texture.residentLevel = entry.levels;
+        texture.wantedLevel = entry.levels;
+        texture.lastRequested = 0;
+        texture.busy = false;
+        texture.finestLevel = 0;
+        while (texture.finestLevel < entry.levels && staged_level_bytes(entry, texture.finestLevel) > slotSize) {
+            ++texture.finestLevel;
+        }
+        if (texture.finestLevel) {
+            ++streamer.cappedTextures;
+        }
+        texture.memoryBytes.assign(entry.levels + 1, 0);
+        for (uint32_t level = texture.finestLevel; level < entry.levels; ++level) {
+            const auto extent = mip_extent({entry.width, entry.height}, level);
+            auto& bytes = memorySizes[{extent.width, extent.height, entry.format, entry.levels - level}];
+            if (!bytes) {
+                bytes = image_memory_size(logical_device, extent, static_cast<VkFormat>(entry.format),
+                    streamedImageUsage, VK_SAMPLE_COUNT_1_BIT, entry.levels - level);
+            }
+            texture.memoryBytes[level] = bytes;
+        }
+    }
+    if (streamer.cappedTextures) {
+        printf("\t%d textures capped below their finest level by the %llu KB upload budget\n",
+            streamer.cappedTextures, static_cast<unsigned long long>(options.uploadBudget / 1024));
+    }
+    streamer.staging = create_buffer(gpuDevice, logical_device, 2 * slotSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+
+    VkCommandPoolCreateInfo poolInfo = {};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.queueFamilyIndex = queueFamily;
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT | VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    vkCheckResult(vkCreateCommandPool(logical_device, &poolInfo, nullptr, &streamer.commandPool));
+    for (uint32_t i = 0; i < 2; ++i) {
+        auto& slot = streamer.slots[i];
+        slot.state = STREAMING_SLOT_IDLE;
+        slot.stagingBase = i * slotSize;
+        slot.submitted = 0;
+        VkCommandBufferAllocateInfo allocInfo = {};
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.commandPool = streamer.commandPool;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocInfo.commandBufferCount = 1;
+        vkCheckResult(vkAllocateCommandBuffers(logical_device, &allocInfo, &slot.commandBuffer));
+    }
+    streamer.running = true;
+    streamer.loader = std::thread(texture_streamer_loader, std::ref(streamer));
+}
+
+void request_texture_level(TextureStreamer& streamer, uint32_t texture, uint32_t level)
+{
+    auto& streamed = streamer.textures[texture];
+    streamed.wantedLevel = std::max(std::min(level, streamer.container->entries[texture].levels - 1), streamed.finestLevel);
+    streamed.lastRequested = streamer.updates;
+}
+
+// The old image stays alive until the graphics work submitted so far is done with it
+void retire_streamed_image(TextureStreamer& streamer, uint32_t index, uint32_t level, AllocatedImage image)
+{
+    const auto& entry = streamer.container->entries[index];
+    auto& texture = streamer.textures[index];
+    if (texture.residentLevel < entry.levels) {
+        streamer.residentBytes -= texture.memoryBytes[texture.residentLevel];
+        defer_destroy_image(*streamer.deletionQueue, SCHEDULER_GRAPHICS,
+            scheduler_submitted(*streamer.scheduler, SCHEDULER_GRAPHICS), texture.image);
+    }
+    texture.image = image;
+    texture.residentLevel = level;
+}
+
+void submit_streaming_slot(TextureStreamer& streamer, StreamingSlot& slot)
+{
+    flush_mapped(streamer.device, streamer.staging);
+    auto cmd = slot.commandBuffer;
+    vkCheckResult(vkResetCommandBuffer(cmd, 0));
+    VkCommandBufferBeginInfo beginInfo = {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    vkCheckResult(vkBeginCommandBuffer(cmd, &beginInfo));
+    VkDeviceSize batchBytes = 0;
+    std::vector<VkImageCopy> regions;
+    for (auto& op : slot.ops) {
+        const auto& entry = streamer.container->entries[op.texture];
+        const VkExtent2D extent = {entry.width, entry.height};
+        op.image = create_image(streamer.gpu, streamer.device, mip_extent(extent, op.level),
+            static_cast<VkFormat>(entry.format), streamedImageUsage, VK_IMAGE_ASPECT_COLOR_BIT,
+            VK_SAMPLE_COUNT_1_BIT, entry.levels - op.level);
+        record_image_barrier(cmd, op.image.image,
+            VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            0, VK_ACCESS_TRANSFER_WRITE_BIT,
+            VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, op.image.mipLevels);
+        if (op.stagingBytes) {
+            const auto levelExtent = mip_extent(extent, op.level);
+            VkBufferImageCopy region = {};
+            region.bufferOffset = slot.stagingBase + op.stagingOffset;
+            region.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+            region.imageExtent = {levelExtent.width, levelExtent.height, 1};
+            vkCmdCopyBufferToImage(cmd, streamer.staging.buffer, op.image.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                1, &region);
+            batchBytes += op.stagingBytes;
+        }
+        if (op.source != VK_NULL_HANDLE) {
+            // The old image stays sampled meanwhile, it is only read and goes back to its layout
+            const uint32_t first = std::max(op.level, op.sourceLevel);
+            regions.clear();
+            for (uint32_t level = first; level < entry.levels; ++level) {
+                const auto levelExtent = mip_extent(extent, level);
+                VkImageCopy region = {};
+                region.srcSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, level - op.sourceLevel, 0, 1};
+                region.dstSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, level - op.level, 0, 1};
+                region.extent = {levelExtent.width, levelExtent.height, 1};
+                regions.push_back(region);
+            }
+            record_image_barrier(cmd, op.source,
+                VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                VK_ACCESS_SHADER_READ_BIT, VK_ACCESS_TRANSFER_READ_BIT,
+                VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                first - op.sourceLevel, entry.levels - first);
+            vkCmdCopyImage(cmd, op.source, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                op.image.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                static_cast<uint32_t>(regions.size()), regions.data());
+            record_image_barrier(cmd, op.source,
+                VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                VK_ACCESS_TRANSFER_READ_BIT, VK_ACCESS_SHADER_READ_BIT,
+                VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                first - op.sourceLevel, entry.levels - first);
+        }
+        // Consumers only see the image after this submission completed, on the same queue
+        record_image_barrier(cmd, op.image.image,
+            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+            VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_TRANSFER_READ_BIT,
+            VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, op.image.mipLevels);
+    }
+    vkCheckResult(vkEndCommandBuffer(cmd));
+    ScheduledSubmit submit;
+    submit.commandBuffers.push_back(cmd);
+    slot.submitted = scheduler_submit(*streamer.scheduler, SCHEDULER_TRANSFER, submit);
+    streamer.uploadedBytes += batchBytes;
 }
 
-int main()
+/*Picks the next batch: textures with nothing resident first, then the most
+recently requested, each a level finer. Only the new level counts against
+the upload budget, the rest is copied on the device. When that would exceed the memory
+budget the least recently requested textures are moved a level coarser and
+the finer level is tried again once they completed. Returns how many
+textures were dropped right away*/
+uint32_t plan_streaming_slot(TextureStreamer& streamer, StreamingSlot& slot)
 {
-	printf("\t\t######START######\n");
-#if defined(VK_USE_PLATFORM_WIN32_KHR)
-	VULKAN_LIBRARY = LoadLibrary( "vulkan-1.dll" );
-#elif defined(VK_USE_PLATFORM_XCB_KHR) || defined(VK_USE_PLATFORM_XLIB_KHR)
-	VULKAN_LIBRARY = dlopen( "libvulkan.so", RTLD_NOW );
-#endif
-    if( VULKAN_LIBRARY == nullptr ) {
-        printf("Couldn't load Vulkan Library\n");
-        return 0;
+    const VkDeviceSize slotSize = streamer.staging.size / 2;
+    const auto& options = streamer.options;
+    const auto entries = streamer.container->entries;
+    std::vector<uint32_t> candidates;
+    for (uint32_t i = 0; i < streamer.textures.size(); ++i) {
+        const auto& texture = streamer.textures[i];
+        // Textures nobody asked for lately would be the next ones evicted again
+        if (!texture.busy && texture.wantedLevel < texture.residentLevel &&
+            streamer.updates - texture.lastRequested < options.evictAfter) {
+            candidates.push_back(i);
+        }
     }
+    std::sort(candidates.begin(), candidates.end(), [&](uint32_t a, uint32_t b) {
+        const auto& first = streamer.textures[a];
+        const auto& second = streamer.textures[b];
+        if (first.residentLevel != second.residentLevel) {
+            return first.residentLevel > second.residentLevel;
+        }
+        return first.lastRequested > second.lastRequested;
+    });
 
-    create_window();
-    VK_EXPORTED_FUNCTION( vkGetInstanceProcAddr )
-    available_layers_and_extensions();
-#define ENABLED_DEBUG
-    #ifdef ENABLED_DEBUG
-        const std::vector<const char*> enabledLayerNames =  {
-            "VK_LAYER_LUNARG_standard_validation",
-            "VK_LAYER_LUNARG_object_tracker" };
-    #else
-        const std::vector<const char*> enabledLayerNames = {};
-    #endif
-
-    auto instance = init_vulkan_instance(enabledLayerNames);
-    auto gpu = find_phisical_device(instance);
-    auto swapchain_surface = create_swapchain_surface(instance);
-    auto queueFamilies = find_queue_families(instance, gpu, swapchain_surface);
-    auto device = create_logical_device(instance, gpu, queueFamilies, enabledLayerNames);
-    auto swapchain = create_swapchain(instance, gpu, device, swapchain_surface);
-    auto graphicsQueueFamilyIndex = queueFamilies[0];
+    VkDeviceSize used = 0;
+    VkDeviceSize shortfall = 0;
+    auto add_op = [&](uint32_t index, uint32_t level, VkDeviceSize staged) {
+        auto& texture = streamer.textures[index];
+        TextureStreamOp op = {};
+        op.texture = index;
+        op.level = level;
+        op.sourceLevel = texture.residentLevel;
+        op.source = texture.residentLevel < entries[index].levels ? texture.image.image : VK_NULL_HANDLE;
+        op.stagingOffset = used;
+        op.stagingBytes = staged;
+        slot.ops.push_back(op);
+        texture.busy = true;
+        streamer.residentBytes += texture.memoryBytes[level];
+        used += staged;
+    };
+    for (auto index : candidates) {
+        const auto& texture = streamer.textures[index];
+        const uint32_t level = texture.residentLevel - 1;
+        const VkDeviceSize staged = staged_level_bytes(entries[index], level);
+        const VkDeviceSize bytes = texture.memoryBytes[level];
+        if (used + staged > slotSize) {
+            continue;
+        }
+        if (streamer.residentBytes + bytes > options.memoryBudget) {
+            shortfall = std::max(shortfall, streamer.residentBytes + bytes - options.memoryBudget);
+            continue;
+        }
+        add_op(index, level, staged);
+    }
 
-    VK_LOAD_INSTANCE_FUNCTION(instance, vkGetDeviceQueue)
-    VkQueue graphicsQueue;
-    VkQueue presentQueue; 
-    if (queueFamilies.size() > 1) {
-        vkGetDeviceQueue(device, queueFamilies[0], 0, &graphicsQueue);
-        vkGetDeviceQueue(device, queueFamilies[1], 0, &presentQueue);
-    } else {
-        vkGetDeviceQueue(device, queueFamilies[0], 0, &graphicsQueue);
-        vkGetDeviceQueue(device, queueFamilies[0], 0, &presentQueue);
+    uint32_t dropped = 0;
+    if (shortfall) {
+        std::vector<uint32_t> victims;
+        for (uint32_t i = 0; i < streamer.textures.size(); ++i) {
+            const auto& texture = streamer.textures[i];
+            if (!texture.busy && texture.residentLevel < entries[i].levels &&
+                streamer.updates - texture.lastRequested >= options.evictAfter) {
+                victims.push_back(i);
+            }
+        }
+        std::sort(victims.begin(), victims.end(), [&](uint32_t a, uint32_t b) {
+            return streamer.textures[a].lastRequested < streamer.textures[b].lastRequested;
+        });
+        VkDeviceSize freed = 0;
+        for (auto index : victims) {
+            if (freed >= shortfall) {
+                break;
+            }
+            const auto& texture = streamer.textures[index];
+            const uint32_t level = texture.residentLevel + 1;
+            const VkDeviceSize current = texture.memoryBytes[level - 1];
+            const VkDeviceSize bytes = texture.memoryBytes[level];
+            ++streamer.evictions;
+            // Dropped outright when there is nothing coarser or both copies wouldn't fit meanwhile
+            if (level == entries[index].levels || streamer.residentBytes + bytes > options.memoryBudget) {
+                AllocatedImage none = {};
+                none.image = VK_NULL_HANDLE;
+                retire_streamed_image(streamer, index, entries[index].levels, none);
+                freed += current;
+                ++dropped;
+                continue;
+            }
+            // Coarser levels all come from the old image, nothing is staged
+            add_op(index, level, 0);
+            freed += current - bytes;
+        }
     }
-   
-    printf("---Loading shaders\n");
-    auto vertexShader = load_shader("vert.spv");
-    auto fragmentShader = load_shader("frag.spv");
-    VK_LOAD_DEVICE_FUNCTION(device , vkCreateShaderModule)
-    VkShaderModule vertModule = create_vertex_module(vkCreateShaderModule, device, vertexShader);
-    VkShaderModule fragModule = create_vertex_module(vkCreateShaderModule, device, fragmentShader);
-
-    printf("---Creating shader stage\n");
-    VkPipelineShaderStageCreateInfo vertShaderStageInfo = {};
-    vertShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    vertShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
-    vertShaderStageInfo.module = vertModule;
-    vertShaderStageInfo.pName = "main";
-    vertShaderStageInfo.pSpecializationInfo = nullptr;
-    
-    VkPipelineShaderStageCreateInfo fragShaderStageInfo = {};
-    fragShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    fragShaderStageInfo.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-    fragShaderStageInfo.module = fragModule;
-    fragShaderStageInfo.pName = "main";
-    fragShaderStageInfo.pSpecializationInfo = nullptr;
-    VkPipelineShaderStageCreateInfo shaderStages[] = {vertShaderStageInfo, fragShaderStageInfo};
-
-    auto renderPass = create_render_pass(device, swapchain);
-    auto pipelineLayout = create_pipeline_layout(device);
-    auto graphicalPipeline = create_pipeline(device, shaderStages, swapchain.extent, renderPass, pipelineLayout);
-    auto swapChainImageViews = create_image_views(device, swapchain);
-    printf("---Creating framebuffer\n");
-    VK_LOAD_DEVICE_FUNCTION(device, vkCreateFramebuffer)
-    std::vector<VkFramebuffer> swapChainFramebuffers(swapChainImageViews.size());
-    for (size_t i = 0; i < swapChainImageViews.size(); ++i) {
-        VkImageView attachments[] = {
-            swapChainImageViews[i]
-        };
+    streamer.peakResidentBytes = std::max(streamer.peakResidentBytes, streamer.residentBytes);
+    return dropped;
+}
 
-        VkFramebufferCreateInfo framebufferInfo = {};
-        framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-        framebufferInfo.renderPass = renderPass;
-        framebufferInfo.attachmentCount = 1;
-        framebufferInfo.pAttachments = attachments;
-        framebufferInfo.width = swapchain.extent.width;
-        framebufferInfo.height = swapchain.extent.height;
-        framebufferInfo.layers = 1;
+uint32_t update_texture_streamer(TextureStreamer& streamer)
+{
+    uint32_t swapped = 0;
+    StreamingSlotState observed[2];
+    {
+        std::lock_guard<std::mutex> lock(streamer.mutex);
+        observed[0] = streamer.slots[0].state;
+        observed[1] = streamer.slots[1].state;
+    }
+    // Only the loader leaves LOADING, every other transition is made here
+    StreamingSlotState states[2] = {observed[0], observed[1]};
+    const VkDeviceSize uploadedBefore = streamer.uploadedBytes;
+    bool submitted = false;
+    for (uint32_t i = 0; i < 2; ++i) {
+        auto& slot = streamer.slots[i];
+        if (states[i] == STREAMING_SLOT_SUBMITTED &&
+            scheduler_is_complete(*streamer.scheduler, SCHEDULER_TRANSFER, slot.submitted)) {
+            for (auto& op : slot.ops) {
+                retire_streamed_image(streamer, op.texture, op.level, op.image);
+                streamer.textures[op.texture].busy = false;
+                ++swapped;
+            }
+            slot.ops.clear();
+            states[i] = STREAMING_SLOT_IDLE;
+        } else if (states[i] == STREAMING_SLOT_READY && !submitted) {
+            // Both slots can finish loading between two updates, the budget is per update
+            submit_streaming_slot(streamer, slot);
+            states[i] = STREAMING_SLOT_SUBMITTED;
+            submitted = true;
+        }
+    }
+    streamer.largestUpdate = std::max(streamer.largestUpdate, streamer.uploadedBytes - uploadedBefore);
+    // One batch planned per update, the other slot may still be loading or in flight
+    int32_t planned = -1;
+    for (uint32_t i = 0; i < 2; ++i) {
+        if (states[i] == STREAMING_SLOT_IDLE) {
+            swapped += plan_streaming_slot(streamer, streamer.slots[i]);
+            if (!streamer.slots[i].ops.empty()) {
+                states[i] = STREAMING_SLOT_LOADING;
+                planned = i;
+            }
+            break;
+        }
+    }
+    if (states[0] != observed[0] || states[1] != observed[1]) {
+        std::lock_guard<std::mutex> lock(streamer.mutex);
+        for (uint32_t i = 0; i < 2; ++i) {
+            if (states[i] != observed[i]) {
+                streamer.slots[i].state = states[i];
+            }
+        }
+        if (planned >= 0) {
+            streamer.loadQueue.push_back(planned);
+        }
+    }
+    if (planned >= 0) {
+        streamer.wake.notify_one();
+    }
+    ++streamer.updates;
+    return swapped;
+}
+
+bool texture_streamer_idle(TextureStreamer& streamer)
+{
+    std::lock_guard<std::mutex> lock(streamer.mutex);
+    return streamer.slots[0].state == STREAMING_SLOT_IDLE && streamer.slots[1].state == STREAMING_SLOT_IDLE;
+}
 
-        vkCheckResult(vkCreateFramebuffer(device, &framebufferInfo, nullptr, &swapChainFramebuffers[i]));
+void destroy_texture_streamer(TextureStreamer& streamer)
+{
+    {
+        std::lock_guard<std::mutex> lock(streamer.mutex);
+        streamer.running = false;
     }
-    printf("---Creating command pool\n");
+    streamer.wake.notify_one();
+    streamer.loader.join();
+    VK_LOAD_DEVICE_FUNCTION(streamer.device, vkDestroyCommandPool)
+    for (auto& slot : streamer.slots) {
+        if (slot.state != STREAMING_SLOT_SUBMITTED) {
+            continue;
+        }
+        scheduler_wait(*streamer.scheduler, SCHEDULER_TRANSFER, slot.submitted);
+        for (auto& op : slot.ops) {
+            destroy_image(streamer.device, op.image);
+        }
+    }
+    for (uint32_t i = 0; i < streamer.textures.size(); ++i) {
+        if (streamer.textures[i].residentLevel < streamer.container->entries[i].levels) {
+            destroy_image(streamer.device, streamer.textures[i].image);
+        }
+    }
+    streamer.textures.clear();
+    destroy_buffer(streamer.device, streamer.staging);
+    vkDestroyCommandPool(streamer.device, streamer.commandPool, nullptr);
+}
+
+bool parse_texture_streaming_options(int argc, char* argv[], TextureStreamingRun& options)
+{
+    bool streaming = false;
+    options.textures = 48;
+    options.size = 256;
+    options.frames = 120;
+    options.streaming.uploadBudget = 512 * 1024;
+    options.streaming.memoryBudget = 4096 * 1024;
+    options.streaming.evictAfter = 8;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--texture-stream") && i + 1 < argc) {
+            options.container = argv[++i];
+            streaming = true;
+        } else if (!strcmp(argv[i], "--textures") && i + 1 < argc) {
+            options.textures = std::max(1ul, strtoul(argv[++i], nullptr, 10));
+        } else if (!strcmp(argv[i], "--texture-size") && i + 1 < argc) {
+            options.size = std::max(1ul, strtoul(argv[++i], nullptr, 10));
+        } else if (!strcmp(argv[i], "--upload-budget") && i + 1 < argc) {
+            options.streaming.uploadBudget = std::max(1ul, strtoul(argv[++i], nullptr, 10)) * 1024;
+        } else if (!strcmp(argv[i], "--memory-budget") && i + 1 < argc) {
+            options.streaming.memoryBudget = std::max(1ul, strtoul(argv[++i], nullptr, 10)) * 1024;
+        } else if (!strcmp(argv[i], "--frames") && i + 1 < argc) {
+            options.frames = strtoul(argv[++i], nullptr, 10);
+        }
+    }
+    return streaming;
+}
+
+bool run_texture_streaming(VkInstance& instance,
+VkPhysicalDevice& gpu,
+const std::vector<const char*>& enabledLayerNames,
+TextureStreamingRun& options)
+{
+    printf("---Streaming textures from %s\n", options.container.c_str());
+    TextureContainer container;
+    if (!open_texture_container(options.container, container)) {
+        std::vector<VkExtent2D> extents;
+        std::vector<std::vector<uint8_t>> pixels;
+        for (uint32_t i = 0; i < options.textures; ++i) {
+            // A few sizes so chains of different lengths share the budgets
+            const VkExtent2D extent = {std::max(1u, options.size >> (i % 3)), std::max(1u, options.size >> (i % 3))};
+            extents.push_back(extent);
+            pixels.push_back(make_test_texture(extent, i));
+        }
+        if (!write_texture_container(options.container, extents, pixels) ||
+            !open_texture_container(options.container, container)) {
+            return false;
+        }
+    }
+
+    // Streaming copies and their consumers share the queue, see TextureStreamer
+    auto context = create_offscreen_context(instance, gpu, enabledLayerNames);
+    auto& device = context.device;
+    auto& scheduler = context.scheduler;
     VK_LOAD_DEVICE_FUNCTION(device, vkCreateCommandPool)
     VK_LOAD_DEVICE_FUNCTION(device, vkAllocateCommandBuffers)
+    VK_LOAD_DEVICE_FUNCTION(device, vkResetCommandBuffer)
     VK_LOAD_DEVICE_FUNCTION(device, vkBeginCommandBuffer)
+    VK_LOAD_DEVICE_FUNCTION(device, vkEndCommandBuffer)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdPipelineBarrier)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdCopyBufferToImage)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdCopyImageToBuffer)
+    VK_LOAD_DEVICE_FUNCTION(device, vkCmdBlitImage)
+    VK_LOAD_DEVICE_FUNCTION(device, vkInvalidateMappedMemoryRanges)
+    auto deletionQueue = create_deletion_queue(scheduler);
+
+    TextureStreamer streamer;
+    create_texture_streamer(streamer, gpu, device, context.queueFamily, scheduler, deletionQueue, container, options.streaming);
+    const uint32_t count = container.header->textureCount;
+
+    // The view moves around a ring of textures, nearby ones want finer levels
+    double longestUpdateMs = 0.0;
+    double totalUpdateMs = 0.0;
+    uint32_t swapped = 0;
+    for (uint32_t frame = 0; frame < options.frames; ++frame) {
+        const double view = 2.0 * count * frame / std::max(1u, options.frames);
+        for (uint32_t i = 0; i < count; ++i) {
+            const double distance = std::fabs(std::fmod(i - view + 1.5 * count, static_cast<double>(count)) - 0.5 * count);
+            if (distance < 6.0) {
+                request_texture_level(streamer, i, static_cast<uint32_t>(distance / 2.0));
+            }
+        }
+        auto start = std::chrono::steady_clock::now();
+        swapped += update_texture_streamer(streamer);
+        const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        longestUpdateMs = std::max(longestUpdateMs, ms);
+        totalUpdateMs += ms;
+        collect_deletion_queue(deletionQueue);
+    }
+    // Lets the batches of the last view position land
+    for (uint32_t settle = 0; settle < 100000 && !texture_streamer_idle(streamer); ++settle) {
+        std::this_thread::yield();
+        swapped += update_texture_streamer(streamer);
+        collect_deletion_queue(deletionQueue);
+    }
+
     VkCommandPool commandPool;
     VkCommandPoolCreateInfo poolInfo = {};
     poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-    poolInfo.queueFamilyIndex = graphicsQueueFamilyIndex;
-    poolInfo.flags = 0; // Optional
+    poolInfo.queueFamilyIndex = context.queueFamily;
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
     vkCheckResult(vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool));
-
-    std::vector<VkCommandBuffer> commandBuffers(swapChainFramebuffers.size());
+    VkCommandBuffer cmd;
     VkCommandBufferAllocateInfo allocInfo = {};
     allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
     allocInfo.commandPool = commandPool;
     allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    allocInfo.commandBufferCount = (uint32_t) commandBuffers.size();
-    vkCheckResult(vkAllocateCommandBuffers(device, &allocInfo, commandBuffers.data()));
-
-    VK_LOAD_DEVICE_FUNCTION(device, vkCmdBeginRenderPass)
-    VK_LOAD_DEVICE_FUNCTION(device, vkCmdBindPipeline)
-    VK_LOAD_DEVICE_FUNCTION(device, vkCmdDraw)
-    VK_LOAD_DEVICE_FUNCTION(device, vkCmdEndRenderPass)
-    VK_LOAD_DEVICE_FUNCTION(device, vkEndCommandBuffer)
-    for (size_t i = 0; i < commandBuffers.size(); ++i) {
+    allocInfo.commandBufferCount = 1;
+    vkCheckResult(vkAllocateCommandBuffers(device, &allocInfo, &cmd));
+    auto begin = [&]() {
+        vkCheckResult(vkResetCommandBuffer(cmd, 0));
         VkCommandBufferBeginInfo beginInfo = {};
         beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
-        beginInfo.pInheritanceInfo = nullptr; // Optional
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        vkCheckResult(vkBeginCommandBuffer(cmd, &beginInfo));
+    };
+    auto submit_and_wait = [&]() {
+        vkCheckResult(vkEndCommandBuffer(cmd));
+        ScheduledSubmit submit;
+        submit.commandBuffers.push_back(cmd);
+        scheduler_wait(scheduler, SCHEDULER_GRAPHICS, scheduler_submit(scheduler, SCHEDULER_GRAPHICS, submit));
+    };
+    VkDeviceSize largest = 16;
+    for (uint32_t i = 0; i < count; ++i) {
+        largest = std::max<VkDeviceSize>(largest, container.entries[i].level[0].size);
+    }
+    auto readback = create_buffer(gpu, device, largest,
+        VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
+    // Copies one level of a sampled image into the readback buffer
+    auto read_level = [&](const AllocatedImage& image, uint32_t level) {
+        const auto extent = mip_extent(image.extent, level);
+        begin();
+        record_image_barrier(cmd, image.image,
+            VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+            VK_ACCESS_SHADER_READ_BIT, VK_ACCESS_TRANSFER_READ_BIT,
+            VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, level, 1);
+        VkBufferImageCopy region = {};
+        region.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, level, 0, 1};
+        region.imageExtent = {extent.width, extent.height, 1};
+        vkCmdCopyImageToBuffer(cmd, image.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, readback.buffer, 1, &region);
+        record_image_barrier(cmd, image.image,
+            VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+            VK_ACCESS_TRANSFER_READ_BIT, VK_ACCESS_SHADER_READ_BIT,
+            VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, level, 1);
+        submit_and_wait();
+        invalidate_mapped(device, readback);
+        return static_cast<const uint8_t*>(readback.mapped);
+    };
 
-        vkCheckResult(vkBeginCommandBuffer(commandBuffers[i], &beginInfo));
-        VkRenderPassBeginInfo renderPassInfo = {};
-        renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-        renderPassInfo.renderPass = renderPass;
-        renderPassInfo.framebuffer = swapChainFramebuffers[i];
-        renderPassInfo.renderArea.offset =  {0, 0};
-        renderPassInfo.renderArea.extent = swapchain.extent;
-        VkClearValue clearColor = {0.0f, 0.0f, 0.0f, 1.0f};
-        renderPassInfo.clearValueCount = 1;
-        renderPassInfo.pClearValues = &clearColor;
-        vkCmdBeginRenderPass(commandBuffers[i], &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
-        vkCmdBindPipeline(commandBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, graphicalPipeline);
-        vkCmdDraw(commandBuffers[i], 3, 1, 0, 0);
-        vkCmdEndRenderPass(commandBuffers[i]);
-        vkCheckResult(vkEndCommandBuffer(commandBuffers[i]));
+    bool passed = true;
+    uint32_t resident = 0;
+    int32_t finest = -1;
+    for (uint32_t i = 0; i < count; ++i) {
+        const auto& texture = streamer.textures[i];
+        if (texture.residentLevel < container.entries[i].levels) {
+            ++resident;
+            if (finest < 0 || texture.residentLevel < streamer.textures[finest].residentLevel) {
+                finest = i;
+            }
+        }
+    }
+    if (finest < 0) {
+        printf("\tNo texture became resident\n");
+        passed = false;
+    } else {
+        // Image level 0 holds the finest resident container level, the last one went through every copy
+        const auto& texture = streamer.textures[finest];
+        const auto& entry = container.entries[finest];
+        for (uint32_t imageLevel : {0u, texture.image.mipLevels - 1}) {
+            const auto& level = entry.level[texture.residentLevel + imageLevel];
+            const bool matches = !memcmp(read_level(texture.image, imageLevel), container.data + level.offset, level.size);
+            printf("\tTexture %d level %d streamed %s\n", finest, texture.residentLevel + imageLevel,
+                matches ? "intact" : "CORRUPTED");
+            passed = passed && matches;
+        }
     }
 
-    VK_LOAD_DEVICE_FUNCTION(device, vkCreateSemaphore)
-    VkSemaphoreCreateInfo semaphoreInfo = {};
-    semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-    VkSemaphore imageAvailableSemaphore;
-    VkSemaphore renderFinishedSemaphore;
-    vkCheckResult(vkCreateSemaphore(device, &semaphoreInfo, nullptr, &imageAvailableSemaphore));
-    vkCheckResult(vkCreateSemaphore(device, &semaphoreInfo, nullptr, &renderFinishedSemaphore));
+    // Blit generated chain of texture 0 against the box filtered one in the container
+    const auto& entry = container.entries[0];
+    const VkExtent2D extent = {entry.width, entry.height};
+    auto staging = create_buffer(gpu, device, entry.level[0].size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    memcpy(staging.mapped, container.data + entry.level[0].offset, entry.level[0].size);
+    AllocatedImage generated = {};
+    const bool blit = supports_linear_blit(gpu, static_cast<VkFormat>(entry.format));
+    if (blit) {
+        begin();
+        generated = create_mipmapped_texture(gpu, device, cmd, staging, extent, static_cast<VkFormat>(entry.format));
+        submit_and_wait();
+        const uint32_t last = std::min(generated.mipLevels, entry.levels) - 1;
+        const auto pixels = read_level(generated, last);
+        const auto& level = entry.level[last];
+        uint32_t worst = 0;
+        for (uint64_t i = 0; i < level.size; ++i) {
+            worst = std::max<uint32_t>(worst, std::abs(pixels[i] - container.data[level.offset + i]));
+        }
+        // Linear blits round per level, a box filter does the same with a different bias
+        printf("\tBlit generated level %d differs by at most %d from the container\n", last, worst);
+        passed = passed && worst <= 16;
+    } else {
+        printf("\tFormat can't be blitted, mip generation not checked\n");
+    }
 
-    printf("---Starting main window-loop\n");
-    window_main_loop(device, swapchain.swapchain,
-    imageAvailableSemaphore, renderFinishedSemaphore,
-    commandBuffers, graphicsQueue, presentQueue);
-	printf("---Unloading vulkan application\n");
+    printf("\t%d updates, %d swaps, %d/%d textures resident, %llu evictions\n", options.frames, swapped, resident, count,
+        static_cast<unsigned long long>(streamer.evictions));
+    printf("\tUploaded %.1f MB, at most %llu KB of %llu KB per update, peak resident %llu KB of %llu KB\n",
+        streamer.uploadedBytes / (1024.0 * 1024.0),
+        static_cast<unsigned long long>(streamer.largestUpdate / 1024),
+        static_cast<unsigned long long>(options.streaming.uploadBudget / 1024),
+        static_cast<unsigned long long>(streamer.peakResidentBytes / 1024),
+        static_cast<unsigned long long>(options.streaming.memoryBudget / 1024));
+    printf("\tUpdate %.3f ms average, %.3f ms longest\n", totalUpdateMs / std::max(1u, options.frames), longestUpdateMs);
+    if (streamer.largestUpdate > options.streaming.uploadBudget || streamer.peakResidentBytes > options.streaming.memoryBudget) {
+        printf("\tBudget exceeded\n");
+        passed = false;
+    }
 
-    VK_LOAD_DEVICE_FUNCTION(device, vkDestroySemaphore)
-    vkDestroySemaphore(device, renderFinishedSemaphore, nullptr);
-    vkDestroySemaphore(device, imageAvailableSemaphore, nullptr);
+    scheduler_wait_idle(scheduler);
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyCommandPool)
+    destroy_texture_streamer(streamer);
+    flush_deletion_queue(deletionQueue);
+    if (blit) {
+        destroy_image(device, generated);
+    }
+    destroy_buffer(device, staging);
+    destroy_buffer(device, readback);
+    vkDestroyCommandPool(device, commandPool, nullptr);
+    destroy_offscreen_context(context);
+    close_texture_container(container);
+    return passed;
+}
 
-    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyFramebuffer)
-    for (size_t i = 0; i < swapChainFramebuffers.size(); ++i) {
-        vkDestroyFramebuffer(device, swapChainFramebuffers[i], nullptr);
+uint32_t scene_section_stride(SceneSection section)
+{
+    switch (section) {
+    case SCENE_SECTION_VERTICES: return sizeof(SceneVertex);
+    case SCENE_SECTION_INDICES: return sizeof(uint32_t);
+    case SCENE_SECTION_INSTANCES: return sizeof(SceneInstance);
+    case SCENE_SECTION_MESHES: return sizeof(SceneMesh);
+    default: return 0;
     }
+}
 
-	VK_LOAD_DEVICE_FUNCTION(device, vkDestroyCommandPool)
-    vkDestroyCommandPool(device, commandPool, nullptr);
-	VK_LOAD_DEVICE_FUNCTION(device, vkDestroyPipeline)
-    vkDestroyPipeline(device, graphicalPipeline, nullptr);
-    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyPipelineLayout)
-    vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
-    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyRenderPass)
-    vkDestroyRenderPass(device, renderPass, nullptr);
-    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyShaderModule)
-    vkDestroyShaderModule(device, fragModule, nullptr);
-    vkDestroyShaderModule(device, vertModule, nullptr);
+SceneFileHeader make_scene_header(const uint64_t counts[SCENE_SECTION_COUNT])
+{
+    SceneFileHeader header = {};
+    header.magic = sceneFileMagic;
+    header.version = sceneFileVersion;
+    uint64_t offset = sizeof(SceneFileHeader);
+    for (uint32_t i = 0; i < SCENE_SECTION_COUNT; ++i) {
+        auto& section = header.sections[i];
+        offset = (offset + sceneSectionAlignment - 1) & ~(sceneSectionAlignment - 1);
+        section.offset = offset;
+        section.stride = scene_section_stride(static_cast<SceneSection>(i));
+        section.size = counts[i] * section.stride;
+        offset += section.size;
+    }
+    header.fileSize = offset;
+    return header;
+}
 
-    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyImageView)
-    for (size_t i = 0; i < swapChainImageViews.size(); ++i) {
-        if ( swapChainImageViews[i] != VK_NULL_HANDLE )
-            vkDestroyImageView(device, swapChainImageViews[i], nullptr);
+bool open_scene_file(const std::string& filename, SceneFile& scene)
+{
+    scene.data = nullptr;
+    scene.fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (scene.fd < 0) {
+        printf("\tCouldn't open scene file: %s\n", filename.c_str());
+        return false;
     }
+    struct stat info;
+    if (fstat(scene.fd, &info) || static_cast<size_t>(info.st_size) < sizeof(SceneFileHeader)) {
+        printf("\t%s is not a scene file\n", filename.c_str());
+        close(scene.fd);
+        return false;
+    }
+    scene.size = info.st_size;
+    void* mapping = mmap(nullptr, scene.size, PROT_READ, MAP_PRIVATE, scene.fd, 0);
+    if (mapping == MAP_FAILED) {
+        printf("\tCouldn't map scene file: %s\n", filename.c_str());
+        close(scene.fd);
+        return false;
+    }
+    // Sections are copied front to back, let the kernel read ahead aggressively
+    madvise(mapping, scene.size, MADV_SEQUENTIAL);
+    scene.data = static_cast<const uint8_t*>(mapping);
+    scene.header = reinterpret_cast<const SceneFileHeader*>(scene.data);
+    const auto& header = *scene.header;
+    bool valid = header.magic == sceneFileMagic && header.version == sceneFileVersion && header.fileSize == scene.size;
+    for (uint32_t i = 0; valid && i < SCENE_SECTION_COUNT; ++i) {
+        const auto& section = header.sections[i];
+        valid = section.stride == scene_section_stride(static_cast<SceneSection>(i)) &&
+            section.offset % sceneSectionAlignment == 0 && section.size % section.stride == 0 &&
+            section.offset >= sizeof(SceneFileHeader) &&
+            section.offset <= scene.size && section.size <= scene.size - section.offset;
+    }
+    if (valid) {
+        scene.meshes = reinterpret_cast<const SceneMesh*>(scene_section_data(scene, SCENE_SECTION_MESHES));
+        scene.meshCount = static_cast<uint32_t>(scene_section_count(scene, SCENE_SECTION_MESHES));
+        const uint64_t vertices = scene_section_count(scene, SCENE_SECTION_VERTICES);
+        const uint64_t indices = scene_section_count(scene, SCENE_SECTION_INDICES);
+        const uint64_t instances = scene_section_count(scene, SCENE_SECTION_INSTANCES);
+        for (uint32_t i = 0; valid && i < scene.meshCount; ++i) {
+            const auto& mesh = scene.meshes[i];
+            valid = static_cast<uint64_t>(mesh.firstIndex) + mesh.indexCount <= indices &&
+                static_cast<uint64_t>(mesh.firstInstance) + mesh.instanceCount <= instances &&
+                mesh.vertexOffset >= 0 && (!mesh.indexCount || static_cast<uint64_t>(mesh.vertexOffset) < vertices);
+        }
+    }
+    if (!valid) {
+        printf("\t%s is not a scene file\n", filename.c_str());
+        close_scene_file(scene);
+        return false;
+    }
+    return true;
+}
 
-    if ( swapchain.swapchain != VK_NULL_HANDLE) {
-        VK_LOAD_INSTANCE_FUNCTION(instance , vkDestroySwapchainKHR);
-        vkDestroySwapchainKHR(device, swapchain.swapchain, nullptr);
+bool check_scene_indices(const SceneFile& scene)
+{
+    const uint64_t vertices = scene_section_count(scene, SCENE_SECTION_VERTICES);
+    const auto indices = reinterpret_cast<const uint32_t*>(scene_section_data(scene, SCENE_SECTION_INDICES));
+    for (uint32_t i = 0; i < scene.meshCount; ++i) {
+        const auto& mesh = scene.meshes[i];
+        uint32_t largest = 0;
+        for (uint32_t index = 0; index < mesh.indexCount; ++index) {
+            largest = std::max(largest, indices[mesh.firstIndex + index]);
+        }
+        if (mesh.indexCount && static_cast<uint64_t>(mesh.vertexOffset) + largest >= vertices) {
+            printf("\tMesh %d indexes vertex %llu of %llu\n", i,
+                static_cast<unsigned long long>(mesh.vertexOffset) + largest, static_cast<unsigned long long>(vertices));
+            return false;
+        }
     }
+    return true;
+}
 
-    if( device != VK_NULL_HANDLE ) {
-	  VK_LOAD_DEVICE_FUNCTION(device , vkDeviceWaitIdle)
-	  VK_LOAD_DEVICE_FUNCTION(device , vkDestroyDevice)
-      vkDeviceWaitIdle( device );
-      vkDestroyDevice( device, nullptr );
+void close_scene_file(SceneFile& scene)
+{
+    if (scene.data) {
+        munmap(const_cast<uint8_t*>(scene.data), scene.size);
+        scene.data = nullptr;
     }
+    if (scene.fd >= 0) {
+        close(scene.fd);
+        scene.fd = -1;
+    }
+}
 
-    if ( swapchain_surface != VK_NULL_HANDLE ) {
-        VK_LOAD_INSTANCE_FUNCTION(instance , vkDestroySurfaceKHR);
-        vkDestroySurfaceKHR(instance, swapchain_surface, nullptr);
+const uint8_t* scene_section_data(const SceneFile& scene, SceneSection section)
+{
+    return scene.data + scene.header->sections[section].offset;
+}
+
+uint64_t scene_section_count(const SceneFile& scene, SceneSection section)
+{
+    return scene.header->sections[section].size / scene.header->sections[section].stride;
+}
+
+bool write_scene_file(const std::string& filename, const SceneData& scene)
+{
+    const uint64_t counts[SCENE_SECTION_COUNT] = {scene.vertices.size(), scene.indices.size(),
+        scene.instances.size(), scene.meshes.size()};
+    const auto header = make_scene_header(counts);
+    const void* sections[SCENE_SECTION_COUNT] = {scene.vertices.data(), scene.indices.data(),
+        scene.instances.data(), scene.meshes.data()};
+    FILE* file = fopen(filename.c_str(), "wb");
+    if (!file) {
+        printf("\tCouldn't create scene file: %s\n", filename.c_str());
+        return false;
     }
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (uint32_t i = 0; written && i < SCENE_SECTION_COUNT; ++i) {
+        const auto& section = header.sections[i];
+        written = fseeko(file, section.offset, SEEK_SET) == 0 &&
+            fwrite(sections[i], 1, section.size, file) == section.size;
+    }
+    // The last section may be empty, the file still has to reach fileSize
+    written = written && fflush(file) == 0 && ftruncate(fileno(file), header.fileSize) == 0;
+    written = fclose(file) == 0 && written;
+    if (!written) {
+        printf("\tCouldn't write scene file: %s\n", filename.c_str());
+        return false;
+    }
+    printf("\tWrote scene %s: %zu vertices, %zu indices, %zu instances, %zu meshes\n", filename.c_str(),
+        scene.vertices.size(), scene.indices.size(), scene.instances.size(), scene.meshes.size());
+    return true;
+}
 
-    if( instance != VK_NULL_HANDLE ) {
-	  VK_LOAD_INSTANCE_FUNCTION(instance , vkDestroyInstance);
-      vkDestroyInstance( instance, nullptr );
+// OBJ indices are 1 based, negative ones count back from the latest element
+int32_t resolve_obj_index(const char* text, size_t count)
+{
+    const long index = strtol(text, nullptr, 10);
+    if (index > 0 && static_cast<size_t>(index) <= count) {
+        return static_cast<int32_t>(index - 1);
     }
+    if (index < 0 && static_cast<size_t>(-index) <= count) {
+        return static_cast<int32_t>(count + index);
+    }
+    return -1;
+}
 
-	if( VULKAN_LIBRARY ) {
-#if defined(VK_USE_PLATFORM_WIN32_KHR)
-      FreeLibrary( VULKAN_LIBRARY );
-#elif defined(VK_USE_PLATFORM_XCB_KHR) || defined(VK_USE_PLATFORM_XLIB_KHR)
-      dlclose( VULKAN_LIBRARY );
-#endif
+bool convert_obj_scene(const std::string& filename, SceneData& scene)
+{
+    FILE* file = fopen(filename.c_str(), "r");
+    if (!file) {
+        printf("\tCouldn't open OBJ file: %s\n", filename.c_str());
+        return false;
+    }
+    std::vector<std::array<float, 3>> positions;
+    std::vector<std::array<float, 3>> normals;
+    std::vector<std::array<float, 2>> uvs;
+    std::map<std::array<int32_t, 3>, uint32_t> unique;
+    std::vector<uint32_t> face;
+    bool valid = true;
+    uint32_t line = 0;
+    auto finish_mesh = [&]() {
+        if (scene.meshes.empty() || scene.indices.size() == scene.meshes.back().firstIndex) {
+            return;
+        }
+        scene.meshes.back().indexCount = static_cast<uint32_t>(scene.indices.size() - scene.meshes.back().firstIndex);
+    };
+    auto start_mesh = [&]() {
+        finish_mesh();
+        if (!scene.meshes.empty() && scene.meshes.back().indexCount == 0) {
+            return;
+        }
+        SceneMesh mesh = {};
+        mesh.firstIndex = static_cast<uint32_t>(scene.indices.size());
+        scene.meshes.push_back(mesh);
+    };
+    start_mesh();
+    char buffer[1024];
+    while (valid && fgets(buffer, sizeof(buffer), file)) {
+        ++line;
+        char* token = strtok(buffer, " \t\r\n");
+        if (!token || token[0] == '#') {
+            continue;
+        }
+        if (!strcmp(token, "v") || !strcmp(token, "vn")) {
+            std::array<float, 3> value = {};
+            for (auto& component : value) {
+                const char* number = strtok(nullptr, " \t\r\n");
+                component = number ? strtof(number, nullptr) : 0.0f;
+            }
+            (token[1] ? normals : positions).push_back(value);
+        } else if (!strcmp(token, "vt")) {
+            std::array<float, 2> value = {};
+            for (auto& component : value) {
+                const char* number = strtok(nullptr, " \t\r\n");
+                component = number ? strtof(number, nullptr) : 0.0f;
+            }
+            uvs.push_back(value);
+        } else if (!strcmp(token, "o") || !strcmp(token, "g")) {
+            start_mesh();
+        } else if (!strcmp(token, "f")) {
+            face.clear();
+            while (valid && (token = strtok(nullptr, " \t\r\n"))) {
+                // v, v/vt, v//vn or v/vt/vn
+                std::array<int32_t, 3> key = {resolve_obj_index(token, positions.size()), -1, -1};
+                const char* slash = strchr(token, '/');
+                if (slash && slash[1] != '/') {
+                    key[1] = resolve_obj_index(slash + 1, uvs.size());
+                }
+                slash = slash ? strchr(slash + 1, '/') : nullptr;
+                if (slash) {
+                    key[2] = resolve_obj_index(slash + 1, normals.size());
+                }
+                valid = key[0] >= 0;
+                auto found = unique.find(key);
+                if (valid && found == unique.end()) {
+                    SceneVertex vertex = {};
+                    memcpy(vertex.position, positions[key[0]].data(), sizeof(vertex.position));
+                    if (key[1] >= 0) {
+                        memcpy(vertex.uv, uvs[key[1]].data(), sizeof(vertex.uv));
+                    }
+                    if (key[2] >= 0) {
+                        memcpy(vertex.normal, normals[key[2]].data(), sizeof(vertex.normal));
+                    }
+                    found = unique.emplace(key, static_cast<uint32_t>(scene.vertices.size())).first;
+                    scene.vertices.push_back(vertex);
+                }
+                if (valid) {
+                    face.push_back(found->second);
+                }
+            }
+            for (size_t i = 2; valid && i < face.size(); ++i) {
+                scene.indices.insert(scene.indices.end(), {face[0], face[i - 1], face[i]});
+            }
+        }
+    }
+    fclose(file);
+    finish_mesh();
+    if (!scene.meshes.empty() && scene.meshes.back().indexCount == 0) {
+        scene.meshes.pop_back();
+    }
+    if (!valid) {
+        printf("\t%s:%d: face refers to a missing vertex\n", filename.c_str(), line);
+    }
+    return valid;
+}
+
+void add_grid_instances(SceneData& scene, uint32_t instanceCount)
+{
+    const uint32_t side = static_cast<uint32_t>(std::ceil(std::sqrt(static_cast<double>(instanceCount))));
+    for (uint32_t i = 0; i < instanceCount; ++i) {
+        SceneInstance instance = {};
+        instance.position[0] = 2.0f * (i % side) - side + 1.0f;
+        instance.position[2] = 2.0f * (i / side) - side + 1.0f;
+        instance.scale = 1.0f;
+        scene.instances.push_back(instance);
     }
-	printf("\t\t######FINISH######\n");
-    return 0;
-}
\ No newline at end of file
+    for (auto& mesh : scene.meshes) {
+        mesh.firstInstance = 0;
+        mesh.instanceCount = instanceCount;
+    }
+}
+
+bool generate_scene_file(const std::string& filename, uint64_t megabytes)
+{
+    // Each mesh is a 256x256 vertex grid, about 3.6 MB with its indices
+    const uint32_t side = 256;
+    const uint32_t instancesPerMesh = 16;
+    const uint64_t meshBytes = side * side * sizeof(SceneVertex) + (side - 1) * (side - 1) * 6 * sizeof(uint32_t);
+    const uint32_t meshCount = static_cast<uint32_t>(std::max<uint64_t>(1, (megabytes * 1024 * 1024) / meshBytes));
+    const uint64_t counts[SCENE_SECTION_COUNT] = {static_cast<uint64_t>(meshCount) * side * side,
+        static_cast<uint64_t>(meshCount) * (side - 1) * (side - 1) * 6,
+        static_cast<uint64_t>(meshCount) * instancesPerMesh, meshCount};
+    const auto header = make_scene_header(counts);
+    if (counts[SCENE_SECTION_INDICES] > std::numeric_limits<uint32_t>::max() ||
+        counts[SCENE_SECTION_VERTICES] > static_cast<uint64_t>(std::numeric_limits<int32_t>::max())) {
+        printf("\tScene too large for 32 bit draw arguments\n");
+        return false;
+    }
+
+    // Grids only differ by their vertex offset, so one index list serves all of them
+    std::vector<uint32_t> indices;
+    indices.reserve((side - 1) * (side - 1) * 6);
+    for (uint32_t y = 0; y + 1 < side; ++y) {
+        for (uint32_t x = 0; x + 1 < side; ++x) {
+            const uint32_t corner = y * side + x;
+            indices.insert(indices.end(), {corner, corner + side, corner + 1, corner + 1, corner + side, corner + side + 1});
+        }
+    }
+    std::vector<SceneVertex> vertices(side * side);
+    std::vector<SceneMesh> meshes(meshCount);
+    std::vector<SceneInstance> instances(instancesPerMesh);
+
+    FILE* file = fopen(filename.c_str(), "wb");
+    if (!file) {
+        printf("\tCouldn't create scene file: %s\n", filename.c_str());
+        return false;
+    }
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+    auto write_section_part = [&](SceneSection section, uint64_t first, const void* data, size_t size) {
+        written = written && fseeko(file, header.sections[section].offset + first, SEEK_SET) == 0 &&
+            fwrite(data, 1, size, file) == size;
+    };
+    for (uint32_t mesh = 0; written && mesh < meshCount; ++mesh) {
+        for (uint32_t y = 0; y < side; ++y) {
+            for (uint32_t x = 0; x < side; ++x) {
+                auto& vertex = vertices[y * side + x];
+                const float u = static_cast<float>(x) / (side - 1);
+                const float v = static_cast<float>(y) / (side - 1);
+                const float height = 0.05f * std::sin(6.2831853f * (u + v + 0.1f * mesh));
+                vertex = {{u - 0.5f, height, v - 0.5f}, {0.0f, 1.0f, 0.0f}, {u, v}};
+            }
+        }
+        write_section_part(SCENE_SECTION_VERTICES, static_cast<uint64_t>(mesh) * vertices.size() * sizeof(SceneVertex),
+            vertices.data(), vertices.size() * sizeof(SceneVertex));
+        write_section_part(SCENE_SECTION_INDICES, static_cast<uint64_t>(mesh) * indices.size() * sizeof(uint32_t),
+            indices.data(), indices.size() * sizeof(uint32_t));
+        for (uint32_t i = 0; i < instancesPerMesh; ++i) {
+            instances[i] = {{static_cast<float>(mesh % 64) + (i % 4) * 0.25f, 0.0f,
+                static_cast<float>(mesh / 64) + (i / 4) * 0.25f}, 0.25f};
+        }
+        write_section_part(SCENE_SECTION_INSTANCES, static_cast<uint64_t>(mesh) * instancesPerMesh * sizeof(SceneInstance),
+            instances.data(), instances.size() * sizeof(SceneInstance));
+        meshes[mesh] = {0, static_cast<uint32_t>(indices.size()), static_cast<int32_t>(mesh * side * side),
+            mesh * instancesPerMesh, instancesPerMesh};
+    }
+    write_section_part(SCENE_SECTION_MESHES, 0, meshes.data(), meshes.size() * sizeof(SceneMesh));
+    written = written && fflush(file) == 0 && ftruncate(fileno(file), header.fileSize) == 0;
+    written = fclose(file) == 0 && written;
+    if (!written) {
+        printf("\tCouldn't write scene file: %s\n", filename.c_str());
+        return false;
+    }
+    printf("\tGenerated scene %s: %d meshes, %.1f MB\n", filename.c_str(), meshCount, header.fileSize / (1024.0 * 1024.0));
+    return true;
+}
+
+GpuScene upload_scene(VkPhysicalDevice& gpuDevice,
+VkDevice& logical_device,
+FrameScheduler& scheduler,
+VkCommandPool commandPool,
+const SceneFile& scene,
+VkDeviceSize chunkSize,
+SceneLoadStats& stats)
+{
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkAllocateCommandBuffers)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkFreeCommandBuffers)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkResetCommandBuffer)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkBeginCommandBuffer)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkEndCommandBuffer)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkCmdCopyBuffer)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkCmdPipelineBarrier)
+    VK_LOAD_DEVICE_FUNCTION(logical_device, vkFlushMappedMemoryRanges)
+    const VkBufferUsageFlags usages[SCENE_SECTION_MESHES] = {
+        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT};
+    GpuScene gpuScene = {};
+    bool staged = false;
+    for (uint32_t i = 0; i < SCENE_SECTION_MESHES; ++i) {
+        const auto size = scene.header->sections[i].size;
+        gpuScene.buffers[i].buffer = VK_NULL_HANDLE;
+        if (!size) {
+            continue;
+        }
+        gpuScene.buffers[i] = create_buffer(gpuDevice, logical_device, size,
+            usages[i] | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+        staged = staged || !gpuScene.buffers[i].mapped;
+    }
+
+    AllocatedBuffer staging = {};
+    VkCommandBuffer commandBuffers[2];
+    uint64_t submitted[2] = {0, 0};
+    VkCommandBufferAllocateInfo allocInfo = {};
+    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocInfo.commandPool = commandPool;
+    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    allocInfo.commandBufferCount = 2;
+    vkCheckResult(vkAllocateCommandBuffers(logical_device, &allocInfo, commandBuffers));
+    if (staged) {
+        staging = create_buffer(gpuDevice, logical_device, 2 * chunkSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    }
+    uint32_t slot = 0;
+    auto begin = [&]() {
+        if (submitted[slot]) {
+            const auto waitStart = std::chrono::steady_clock::now();
+            scheduler_wait(scheduler, SCHEDULER_TRANSFER, submitted[slot]);
+            stats.waitMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - waitStart).count();
+        }
+        vkCheckResult(vkResetCommandBuffer(commandBuffers[slot], 0));
+        VkCommandBufferBeginInfo beginInfo = {};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        vkCheckResult(vkBeginCommandBuffer(commandBuffers[slot], &beginInfo));
+        return commandBuffers[slot];
+    };
+    auto submit = [&]() {
+        vkCheckResult(vkEndCommandBuffer(commandBuffers[slot]));
+        ScheduledSubmit transfer;
+        transfer.commandBuffers.push_back(commandBuffers[slot]);
+        submitted[slot] = scheduler_submit(scheduler, SCHEDULER_TRANSFER, transfer);
+        slot ^= 1;
+    };
+
+    stats.copyMs = 0.0;
+    stats.waitMs = 0.0;
+    stats.bytes = 0;
+    rusage usageBefore;
+    getrusage(RUSAGE_SELF, &usageBefore);
+    const auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < SCENE_SECTION_MESHES; ++i) {
+        const auto& section = scene.header->sections[i];
+        auto& buffer = gpuScene.buffers[i];
+        const uint8_t* source = scene_section_data(scene, static_cast<SceneSection>(i));
+        for (VkDeviceSize offset = 0; offset < section.size; offset += chunkSize) {
+            const VkDeviceSize size = std::min(chunkSize, section.size - offset);
+            // Staging is filled while the other slot's copy runs
+            const auto cmd = buffer.mapped ? VK_NULL_HANDLE : begin();
+            auto target = buffer.mapped ? static_cast<uint8_t*>(buffer.mapped) + offset :
+                static_cast<uint8_t*>(staging.mapped) + slot * chunkSize;
+            const auto copyStart = std::chrono::steady_clock::now();
+            memcpy(target, source + offset, size);
+            stats.copyMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - copyStart).count();
+            stats.bytes += size;
+            if (cmd != VK_NULL_HANDLE) {
+                flush_mapped(logical_device, staging);
+                VkBufferCopy region = {slot * chunkSize, offset, size};
+                vkCmdCopyBuffer(cmd, staging.buffer, buffer.buffer, 1, &region);
+                submit();
+            }
+        }
+        if (buffer.mapped) {
+            flush_mapped(logical_device, buffer);
+        }
+    }
+    // Later submissions on the queue read the buffers as vertex input
+    auto cmd = begin();
+    VkMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT;
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+        0, 1, &barrier, 0, nullptr, 0, nullptr);
+    submit();
+    scheduler_wait(scheduler, SCHEDULER_TRANSFER, std::max(submitted[0], submitted[1]));
+    stats.uploadMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    rusage usageAfter;
+    getrusage(RUSAGE_SELF, &usageAfter);
+    stats.majorFaults = usageAfter.ru_majflt - usageBefore.ru_majflt;
+    stats.minorFaults = usageAfter.ru_minflt - usageBefore.ru_minflt;
+
+    vkFreeCommandBuffers(logical_device, commandPool, 2, commandBuffers);
+    if (staged) {
+        destroy_buffer(logical_device, staging);
+    }
+    return gpuScene;
+}
+
+void destroy_gpu_scene(VkDevice& logical_device, GpuScene& scene)
+{
+    for (auto& buffer : scene.buffers) {
+        if (buffer.buffer != VK_NULL_HANDLE) {
+            destroy_buffer(logical_device, buffer);
+            buffer.buffer = VK_NULL_HANDLE;
+        }
+    }
+}
+
+bool parse_scene_load_options(int argc, char* argv[], SceneLoadOptions& options)
+{
+    bool load = false;
+    options.chunkSize = 64 * 1024 * 1024;
+    options.cold = false;
+    options.verify = false;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--scene") && i + 1 < argc) {
+            options.file = argv[++i];
+            load = true;
+        } else if (!strcmp(argv[i], "--scene-chunk") && i + 1 < argc) {
+            options.chunkSize = std::max(1ul, strtoul(argv[++i], nullptr, 10)) * 1024 * 1024;
+        } else if (!strcmp(argv[i], "--cold")) {
+            options.cold = true;
+        } else if (!strcmp(argv[i], "--verify")) {
+            options.verify = true;
+        }
+    }
+    return load;
+}
+
+bool run_scene_load(VkInstance& instance,
+VkPhysicalDevice& gpu,
+const std::vector<const char*>& enabledLayerNames,
+const SceneLoadOptions& options)
+{
+    printf("---Loading scene %s\n", options.file.c_str());
+    SceneLoadStats stats = {};
+    const auto openStart = std::chrono::steady_clock::now();
+    SceneFile scene;
+    if (!open_scene_file(options.file, scene)) {
+        return false;
+    }
+    stats.openMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - openStart).count();
+    // Not part of the open time, it reads the whole index section
+    if (options.verify && !check_scene_indices(scene)) {
+        close_scene_file(scene);
+        return false;
+    }
+    if (options.cold) {
+        // Clean pages only, so this works without privileges
+        posix_fadvise(scene.fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+
+    auto context = create_offscreen_context(instance, gpu, enabledLayerNames);
+    auto& device = context.device;
+    auto& scheduler = context.scheduler;
+    VK_LOAD_DEVICE_FUNCTION(device, vkCreateCommandPool)
+    VkCommandPool commandPool;
+    VkCommandPoolCreateInfo poolInfo = {};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.queueFamilyIndex = context.queueFamily;
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    vkCheckResult(vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool));
+
+    auto gpuScene = upload_scene(gpu, device, scheduler, commandPool, scene, options.chunkSize, stats);
+    uint64_t triangles = 0;
+    for (uint32_t i = 0; i < scene.meshCount; ++i) {
+        triangles += static_cast<uint64_t>(scene.meshes[i].indexCount / 3) * scene.meshes[i].instanceCount;
+    }
+    printf("\t%d meshes, %llu vertices, %llu instances, %llu triangles in scene\n", scene.meshCount,
+        static_cast<unsigned long long>(scene_section_count(scene, SCENE_SECTION_VERTICES)),
+        static_cast<unsigned long long>(scene_section_count(scene, SCENE_SECTION_INSTANCES)),
+        static_cast<unsigned long long>(triangles));
+    printf("\tOpened in %.3f ms, %.1f MB uploaded in %.1f ms (%.2f GB/s)%s\n", stats.openMs,
+        stats.bytes / (1024.0 * 1024.0), stats.uploadMs, stats.bytes / (stats.uploadMs * 1e6),
+        gpuScene.buffers[SCENE_SECTION_VERTICES].mapped ? ", written in place" : "");
+    printf("\tCopying from the mapping %.1f ms, waiting for transfers %.1f ms, %ld major and %ld minor faults\n",
+        stats.copyMs, stats.waitMs, stats.majorFaults, stats.minorFaults);
+
+    bool matches = true;
+    if (options.verify) {
+        VK_LOAD_DEVICE_FUNCTION(device, vkAllocateCommandBuffers)
+        VK_LOAD_DEVICE_FUNCTION(device, vkBeginCommandBuffer)
+        VK_LOAD_DEVICE_FUNCTION(device, vkEndCommandBuffer)
+        VK_LOAD_DEVICE_FUNCTION(device, vkResetCommandBuffer)
+        VK_LOAD_DEVICE_FUNCTION(device, vkCmdCopyBuffer)
+        VK_LOAD_DEVICE_FUNCTION(device, vkInvalidateMappedMemoryRanges)
+        const VkDeviceSize sample = 1024 * 1024;
+        auto readback = create_buffer(gpu, device, sample, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
+        VkCommandBuffer cmd;
+        VkCommandBufferAllocateInfo allocInfo = {};
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.commandPool = commandPool;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocInfo.commandBufferCount = 1;
+        vkCheckResult(vkAllocateCommandBuffers(device, &allocInfo, &cmd));
+        for (uint32_t i = 0; i < SCENE_SECTION_MESHES; ++i) {
+            const auto& section = scene.header->sections[i];
+            auto& buffer = gpuScene.buffers[i];
+            const uint8_t* source = scene_section_data(scene, static_cast<SceneSection>(i));
+            const VkDeviceSize size = std::min(sample, section.size);
+            // Start and end of every section, the chunk boundaries in between are exercised by both
+            const VkDeviceSize offsets[2] = {0, section.size - size};
+            for (uint32_t part = 0; part < 2 && size; ++part) {
+                const uint8_t* uploaded;
+                if (buffer.mapped) {
+                    invalidate_mapped(device, buffer);
+                    uploaded = static_cast<const uint8_t*>(buffer.mapped) + offsets[part];
+                } else {
+                    vkCheckResult(vkResetCommandBuffer(cmd, 0));
+                    VkCommandBufferBeginInfo beginInfo = {};
+                    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+                    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+                    vkCheckResult(vkBeginCommandBuffer(cmd, &beginInfo));
+                    VkBufferCopy region = {offsets[part], 0, size};
+                    vkCmdCopyBuffer(cmd, buffer.buffer, readback.buffer, 1, &region);
+                    vkCheckResult(vkEndCommandBuffer(cmd));
+                    ScheduledSubmit submit;
+                    submit.commandBuffers.push_back(cmd);
+                    scheduler_wait(scheduler, SCHEDULER_GRAPHICS, scheduler_submit(scheduler, SCHEDULER_GRAPHICS, submit));
+                    invalidate_mapped(device, readback);
+                    uploaded = static_cast<const uint8_t*>(readback.mapped);
+                }
+                if (memcmp(uploaded, source + offsets[part], size)) {
+                    printf("\tSection %d differs from the file at offset %llu\n", i,
+                        static_cast<unsigned long long>(offsets[part]));
+                    matches = false;
+                }
+            }
+        }
+        printf("\tUploaded sections %s the file\n", matches ? "match" : "DON'T MATCH");
+        destroy_buffer(device, readback);
+    }
+
+    scheduler_wait_idle(scheduler);
+    VK_LOAD_DEVICE_FUNCTION(device, vkDestroyCommandPool)
+    destroy_gpu_scene(device, gpuScene);
+    vkDestroyCommandPool(device, commandPool, nullptr);
+    destroy_offscreen_context(context);
+    close_scene_file(scene);
+    return matches;
+}